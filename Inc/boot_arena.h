@@ -0,0 +1,25 @@
+#pragma once
+
+/*
+ * Static RAM arena for the bootloader's large buffers.
+ *
+ * Packet buffers, the receive context and the log line used to live on the
+ * stack, which the linker script only sized at 1KB. They are now statically
+ * allocated in the .arena section, placed after .bss, so the map file and
+ * `make stack` see them and the stack only has to hold call frames.
+ *
+ * The startup code does not clear the arena. Every owner initializes its
+ * buffer before use. Buffers used one after the other share memory through
+ * a union at the owner (see bootloader_work_t in bootloader.c).
+ *
+ * The application reuses this RAM, so code reachable from the service
+ * table (boot_services.c) must not touch the arena.
+ *
+ * Owners:
+ *   g_bootloader_log  one BOOTLOADER_LOG line, formatted and sent at once
+ *   s_packet          ymodem.c, the header and then every data packet
+ *   s_work            bootloader.c, receive context, then the copy from the
+ *                     staging flash and the signature check, or a command
+ *                     session (boot_command.c)
+ */
+#define BOOT_ARENA __attribute__((section(".arena")))
@@ -0,0 +1,104 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * One-way broadcast update on the USART1 receive line, for RS-485 or radio
+ * downlinks where the nodes cannot answer. Any number of nodes listen to
+ * the same stream and none of them acknowledges anything.
+ *
+ * Every packet is framed and checked on its own, values MSB first:
+ *
+ *   sync (2)  type  session  generation  mask (2)  payload  CRC16 (2)
+ *
+ *   ANNOUNCE  payload: image size (4), CRC32 (4)
+ *   DATA      payload: BOOT_BROADCAST_SYMBOL_SIZE bytes
+ *
+ * The CRC16 (XMODEM, as Y-modem) covers type to payload. A packet with a
+ * bad CRC is an erasure, nothing more.
+ *
+ * The image is cut into symbols of BOOT_BROADCAST_SYMBOL_SIZE bytes, and
+ * every BOOT_BROADCAST_GENERATION symbols form a generation, one flash
+ * page. A DATA packet carries the XOR of the symbols of its generation
+ * that are set in mask: one bit is a plain symbol, more bits a repair
+ * symbol (a random linear code over GF(2), systematic). The host sends
+ * each generation's symbols, then repair symbols with fresh random masks,
+ * then the next generation, and repeats the whole image as often as it
+ * likes. Symbols past the end of the image are 0xFF, as erased flash.
+ *
+ * A node programs a symbol as soon as it is known and keeps the equations
+ * of one generation in RAM, reduced against each other (Gaussian
+ * elimination, lowest set bit as pivot). Symbols already in flash are
+ * XORed out of every new equation. Once the equations determine every
+ * missing symbol of the generation, they are solved and programmed. Any
+ * set of packets that spans a generation completes it, whichever were
+ * lost. Equations still open when the stream moves on are dropped, a later
+ * pass fills the gap. Decoding needs one generation of rows, about 1 KB.
+ *
+ * The first sync byte a waiting bootloader receives is a stray byte to the
+ * Y-modem receiver and enters the session. The host sends a run of sync
+ * bytes, which the parser skips, in front of the ANNOUNCEs, long enough
+ * for a node to wake from Stop mode on the first one.
+ *
+ * An ANNOUNCE starts a session: the pages the image needs are erased,
+ * which takes up to BOOT_BROADCAST_ERASE_MS per page, and the host waits
+ * that long. A node programs up to BOOT_BROADCAST_SYMBOL_SIZE bytes after
+ * a packet and a generation after its last one, the host leaves the line
+ * quiet meanwhile. Once every symbol is in, the image CRC32 is checked
+ * and the bootloader verifies and starts it like a Y-modem transfer.
+ */
+#define BOOT_BROADCAST_SYNC 0xA5 /* first byte, a command to Y-modem */
+#define BOOT_BROADCAST_SYNC2 0x5A
+#define BOOT_BROADCAST_SYMBOL_SIZE 64
+#define BOOT_BROADCAST_GENERATION 16 /* symbols, bits in the mask */
+#define BOOT_BROADCAST_MAX_SYMBOLS 1024
+#define BOOT_BROADCAST_HEADER_SIZE 7
+#define BOOT_BROADCAST_ANNOUNCE_SIZE 8
+#define BOOT_BROADCAST_PACKET_MAX                                              \
+  (BOOT_BROADCAST_HEADER_SIZE + BOOT_BROADCAST_SYMBOL_SIZE + 2)
+#define BOOT_BROADCAST_TIMEOUT_MS 5000 /* without a good packet */
+#define BOOT_BROADCAST_ERASE_MS 40     /* per page, F103 tERASE max */
+#define BOOT_BROADCAST_NONE 0xFF       /* no generation in RAM */
+
+typedef enum {
+  BOOT_BROADCAST_ANNOUNCE = 0x01,
+  BOOT_BROADCAST_DATA = 0x02
+} boot_broadcast_type_t;
+
+/* What boot_broadcast_feed() asks of the caller */
+typedef enum {
+  BOOT_BROADCAST_CONTINUE = 0,
+  BOOT_BROADCAST_START,    /* ANNOUNCE of a new session */
+  BOOT_BROADCAST_COMPLETE, /* every symbol is in, the CRC32 matches */
+  BOOT_BROADCAST_FAILED    /* the image in flash does not match */
+} boot_broadcast_status_t;
+
+/* Listening to the stream, from the first sync byte on */
+typedef struct {
+  uint32_t deadline; /* HAL_GetTick() when the session ends */
+  uint32_t size;
+  uint32_t crc32;
+  uint16_t symbols;
+  uint16_t missing; /* symbols not in flash yet */
+  uint16_t bad;     /* packets with a bad CRC16 */
+  uint8_t generations;
+  uint8_t session;
+  bool started; /* an ANNOUNCE was accepted */
+  uint8_t result; /* bootloader_result_t, a symbol failed to program */
+  /* Packet parser */
+  uint16_t fill;
+  uint16_t need;
+  uint8_t packet[BOOT_BROADCAST_PACKET_MAX];
+  /* Equations of one generation, row i has its lowest bit at i */
+  uint8_t generation;
+  uint16_t pivots; /* rows in use */
+  uint16_t masks[BOOT_BROADCAST_GENERATION];
+  uint8_t rows[BOOT_BROADCAST_GENERATION][BOOT_BROADCAST_SYMBOL_SIZE];
+  /* Programmed symbols, two bytes per generation */
+  uint8_t have[BOOT_BROADCAST_MAX_SYMBOLS / 8];
+} boot_broadcast_session_t;
+
+void boot_broadcast_listen(boot_broadcast_session_t *session);
+boot_broadcast_status_t boot_broadcast_feed(boot_broadcast_session_t *session,
+                                            uint8_t byte);
+bool boot_broadcast_start(boot_broadcast_session_t *session);
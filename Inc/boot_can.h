@@ -0,0 +1,112 @@
+#pragma once
+#include "can_bus.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Multicast update over CAN (can_bus.h), many nodes from one broadcast.
+ *
+ * Frames carry 29-bit IDs: type (5 bits), a 16-bit field a and an 8-bit
+ * field b. Lower types win arbitration, so the host (0x10-0x17) always
+ * gets through before the nodes (0x18-0x1F). Nodes are addressed by
+ * can_bus_node_id(), BOOT_CAN_ALL addresses every one of them. Values are
+ * sent MSB first.
+ *
+ *   PING      a target          answered with STATUS
+ *   ANNOUNCE  a target b session  size (4) CRC32 (4) > STATUS
+ *   DATA      a frame  b session  8 image bytes, 0xFF behind the end
+ *   QUERY     a target b session  > MISSING..., STATUS
+ *   COMMIT    a target b session  > STATUS once verified, or failed
+ *   ENTER     a target          the application enters the bootloader
+ *
+ *   STATUS    a node   b session  state, result, missing blocks (2),
+ *                                 version of the application (4)
+ *   MISSING   a node   b session  first block (2), 48-bit map, bit i of
+ *                                 byte 2 + i / 8 is block first + i
+ *
+ * An ANNOUNCE starts a session on every node it addresses that waits for
+ * firmware: the pages the image needs are erased, then the node answers
+ * STATUS. The host sends the image once to all of them, BOOT_CAN_BLOCK_SIZE
+ * bytes to a block, frame n of the image carries bytes 8n to 8n + 7. A
+ * node programs a block once all its frames are in, a block that stays
+ * incomplete is dropped. After each block the host leaves the bus quiet
+ * for BOOT_CAN_BLOCK_GAP_MS while the nodes program it, the FIFO only
+ * holds three frames.
+ *
+ * QUERY then has each node list the blocks it is still missing, and the
+ * host sends their union once more, until no node misses one. The update
+ * time grows with the image and the worst link, not with the number of
+ * nodes. COMMIT has each node check the image CRC32, then the bootloader
+ * verifies it like a Y-modem transfer and starts it. A session ends after
+ * BOOT_CAN_TIMEOUT_MS without a frame for it.
+ */
+#define BOOT_CAN_BITRATE 500000
+#define BOOT_CAN_ALL 0xFFFF
+#define BOOT_CAN_FRAME_SIZE 8
+#define BOOT_CAN_BLOCK_SIZE 256
+#define BOOT_CAN_BLOCK_FRAMES (BOOT_CAN_BLOCK_SIZE / BOOT_CAN_FRAME_SIZE)
+#define BOOT_CAN_MAX_BLOCKS 256
+#define BOOT_CAN_MISSING_SPAN 48 /* blocks per MISSING frame */
+#define BOOT_CAN_TIMEOUT_MS 5000
+#define BOOT_CAN_BLOCK_GAP_MS 8 /* 128 halfwords at 70 us max, and margin */
+
+#define BOOT_CAN_ID(type, a, b)                                                \
+  ((uint32_t)(type) << 24 | (uint32_t)(a) << 8 | (uint32_t)(b))
+#define BOOT_CAN_TYPE(id) ((uint8_t)((id) >> 24 & 0x1F))
+#define BOOT_CAN_A(id) ((uint16_t)((id) >> 8))
+#define BOOT_CAN_B(id) ((uint8_t)(id))
+
+/* Frame types, host to node from BOOT_CAN_HOST_FIRST on */
+#define BOOT_CAN_HOST_FIRST 0x10
+#define BOOT_CAN_HOST_MASK 0x18 /* type bits that tell host from node */
+#define BOOT_CAN_NODE_FIRST 0x18
+
+typedef enum {
+  BOOT_CAN_PING = 0x10,
+  BOOT_CAN_ANNOUNCE = 0x11,
+  BOOT_CAN_DATA = 0x12,
+  BOOT_CAN_QUERY = 0x13,
+  BOOT_CAN_COMMIT = 0x14,
+  BOOT_CAN_ENTER = 0x15,
+  BOOT_CAN_STATUS = 0x18,
+  BOOT_CAN_MISSING = 0x19
+} boot_can_type_t;
+
+/* STATUS state byte */
+typedef enum {
+  BOOT_CAN_STATE_IDLE = 0,      /* waiting for firmware */
+  BOOT_CAN_STATE_RECEIVING = 1, /* in the session */
+  BOOT_CAN_STATE_VERIFIED = 2,  /* starting the new image */
+  BOOT_CAN_STATE_FAILED = 3     /* see the result byte */
+} boot_can_state_t;
+
+/* What boot_can_idle() and boot_can_feed() ask of the caller */
+typedef enum {
+  BOOT_CAN_CONTINUE = 0,
+  BOOT_CAN_START,    /* an ANNOUNCE addressed this node */
+  BOOT_CAN_COMPLETE, /* COMMIT, every block is in and the CRC32 matches */
+  BOOT_CAN_FAILED    /* COMMIT, the image in flash does not match */
+} boot_can_status_t;
+
+/* One session, from ANNOUNCE to COMMIT */
+typedef struct {
+  uint32_t deadline; /* HAL_GetTick() when the session ends */
+  uint32_t size;
+  uint32_t crc32;
+  uint16_t blocks;
+  uint16_t missing;
+  uint16_t block;  /* collected in data, BOOT_CAN_MAX_BLOCKS for none */
+  uint32_t frames; /* of that block */
+  uint8_t session;
+  uint8_t result; /* bootloader_result_t, a block failed to program */
+  uint8_t have[BOOT_CAN_MAX_BLOCKS / 8]; /* programmed blocks */
+  uint8_t data[BOOT_CAN_BLOCK_SIZE];
+} boot_can_session_t;
+
+void boot_can_init(void);
+boot_can_status_t boot_can_idle(const can_frame_t *frame);
+bool boot_can_start(boot_can_session_t *session, const can_frame_t *frame);
+boot_can_status_t boot_can_feed(boot_can_session_t *session,
+                                const can_frame_t *frame);
+void boot_can_report(uint8_t result);
+void boot_can_deinit(void);
@@ -0,0 +1,91 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Binary command protocol, modelled on the STM32 system bootloader (AN3155).
+ *
+ * While the bootloader waits for a Y-modem transfer, BOOT_COMMAND_SYNC
+ * starts a command session instead. The device answers BOOT_COMMAND_ACK and
+ * from then on only answers frames, no log text. Every frame is an opcode
+ * and its complement, then argument blocks, each followed by the XOR of its
+ * bytes. Values are sent MSB first. The device answers every part with ACK,
+ * or NACK and waits for the next opcode:
+ *
+ *   GET_INFO  op ~op > ACK, N-1, N info bytes, ACK
+ *   READ      op ~op > ACK, address xor > ACK, length-1 (2) xor > ACK,
+ *             length bytes (up to 64KB in one stream)
+ *   CRC       op ~op > ACK, address xor > ACK, length (4) xor > ACK,
+ *             CRC32 (4) xor
+ *   ERASE     op ~op > ACK, address xor > ACK, pages-1 (2) xor > ACK
+ *   WRITE     op ~op > ACK, address xor > ACK, N-1, N bytes, xor > ACK
+ *   GO        op ~op > ACK, address xor > ACK, then the application starts
+ *   RUN       op ~op > ACK, address xor > ACK, size (4) CRC32 (4) xor > ACK,
+ *             then the RAM image starts
+ *
+ * Addresses must lie in the update region, the metadata page and the
+ * application, so the bootloader and its keys stay out of reach. The first
+ * ERASE or WRITE of the application erases the metadata page as an update
+ * does; the host writes new metadata last. GO only starts the application
+ * at APPLICATION_START_ADDR. A session ends after BOOT_COMMAND_TIMEOUT_MS
+ * without a byte and the bootloader asks for a Y-modem transfer again.
+ *
+ * RAM images: READ, CRC and WRITE also take the SRAM range from
+ * BOOT_COMMAND_RAM_ADDR, which the bootloader leaves unused (asserted in the
+ * linker script). A test image linked to run there is written with WRITE,
+ * and RUN checks its CRC32 and vector table, then starts it like the
+ * application: VTOR and MSP from its vector table, its reset handler. Flash
+ * is not touched. Builds with secure boot or encryption have no RAM images,
+ * they would run unsigned code with the keys in reach.
+ *
+ * GET_INFO, MSB first:
+ *   0  protocol version      1  number of opcodes n    2  opcodes
+ *   2+n  flash size (4), page size (2), application start (4),
+ *        application max size (4), entry reason (1),
+ *        metadata magic, version, size, CRC32 (4 each), verified (1),
+ *        bootloader version string
+ */
+#define BOOT_COMMAND_SYNC 0x7F
+#define BOOT_COMMAND_ACK 0x79
+#define BOOT_COMMAND_NACK 0x1F
+#define BOOT_COMMAND_PROTOCOL 0x10 /* 1.0 */
+#define BOOT_COMMAND_WRITE_MAX 256
+#define BOOT_COMMAND_READ_MAX 0x10000
+#define BOOT_COMMAND_RAM_ADDR 0x20002000 /* vector table aligned */
+#define BOOT_COMMAND_RAM_SIZE 0x2800     /* up to the bootloader's stack */
+#ifndef BOOT_COMMAND_TIMEOUT_MS
+#define BOOT_COMMAND_TIMEOUT_MS 1000
+#endif
+
+typedef enum {
+  BOOT_COMMAND_GET_INFO = 0x00,
+  BOOT_COMMAND_READ = 0x11,
+  BOOT_COMMAND_GO = 0x21,
+  BOOT_COMMAND_RUN = 0x22,
+  BOOT_COMMAND_WRITE = 0x31,
+  BOOT_COMMAND_ERASE = 0x44,
+  BOOT_COMMAND_CRC = 0xA1
+} boot_command_op_t;
+
+/* What boot_command_feed() asks of the caller */
+typedef enum {
+  BOOT_COMMAND_CONTINUE = 0,
+  BOOT_COMMAND_START_APP, /* GO was acknowledged */
+  BOOT_COMMAND_START_RAM  /* RUN was, the RAM image checked out */
+} boot_command_status_t;
+
+/* Parser of one session, fed one byte at a time */
+typedef struct {
+  uint32_t deadline; /* HAL_GetTick() when the session ends */
+  uint8_t phase;
+  uint8_t op;
+  uint16_t fill; /* bytes of the current block */
+  uint16_t need; /* size of the current block, checksum included */
+  uint32_t address;
+  bool metadata_erased;
+  uint8_t block[1 + BOOT_COMMAND_WRITE_MAX + 1];
+} boot_command_session_t;
+
+void boot_command_start(boot_command_session_t *session);
+boot_command_status_t boot_command_feed(boot_command_session_t *session,
+                                        uint8_t byte);
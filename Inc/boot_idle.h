@@ -0,0 +1,42 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Low-power waits of the bootloader loop.
+ *
+ * bootloader_next_event() used to poll the UART at 72 MHz until a byte or
+ * the next deadline. It now calls boot_idle_wait(), which sleeps instead:
+ *
+ *   BOOT_IDLE_SLEEP  Sleep mode (WFE). SysTick and the USART1 RXNE flag,
+ *                    pending but never enabled in the NVIC (SEVONPEND),
+ *                    wake the core, so no byte is missed in any state.
+ *   BOOT_IDLE_STOP   As above, and while the bootloader only waits for a
+ *                    sender, Stop mode: the clocks stop until the RTC alarm
+ *                    at the next deadline or an edge on the RX pin (PB7,
+ *                    EXTI line 7). The PLL is started again after the wake
+ *                    and HAL_GetTick() is advanced by the time stopped.
+ *
+ * The byte whose start bit wakes the core from Stop, and whatever follows
+ * while the clock comes back, is lost. The bootloader only stops once the
+ * line has been quiet for BOOT_IDLE_LISTEN_MS after its last 'C' or byte,
+ * so answers to a 'C' are always received. A host that starts talking on
+ * its own gets the next 'C' on time and retries, the wake opens a new
+ * listen window.
+ *
+ * Stop mode needs the RTC, clocked by the LSI. If the application already
+ * runs the RTC, the bootloader leaves it alone and only uses Sleep mode.
+ */
+#define BOOT_IDLE_RUN 0   /* poll the UART, never sleep */
+#define BOOT_IDLE_SLEEP 1 /* Sleep mode between ticks and bytes */
+#define BOOT_IDLE_STOP 2  /* and Stop mode while no sender talks */
+
+#ifndef BOOT_IDLE_LISTEN_MS
+#define BOOT_IDLE_LISTEN_MS 200 /* awake after a 'C' or a byte */
+#endif
+#ifndef BOOT_IDLE_STOP_MIN_MS
+#define BOOT_IDLE_STOP_MIN_MS 10 /* shorter waits are not worth the restart */
+#endif
+
+bool boot_idle_wait(uint32_t deadline, bool stop);
+void boot_idle_deinit(void);
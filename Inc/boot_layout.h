@@ -0,0 +1,26 @@
+#pragma once
+
+/*
+ * Flash layout shared by the bootloader and the host tools, which have no
+ * HAL to include bootloader.h with. The Makefile passes BOOTLOADER_SIZE to
+ * both, the same value the linker scripts and merge.py -b get.
+ */
+#define BOOTLOADER_START_ADDR 0x08000000
+/* Flash reserved for the bootloader, set by the Makefile (BOOTLOADER_SIZE)
+ * together with the linker scripts. The last page holds the metadata. */
+#ifndef BOOTLOADER_SIZE
+#define BOOTLOADER_SIZE 0x4000 /* 16KB for bootloader */
+#endif
+#define FLASH_END_ADDR 0x0800FFFF /* 64KB Flash end */
+
+/* A bootloader size the flash can be split at, whole 1KB pages */
+#define BOOT_LAYOUT_SIZE_VALID(size)                                           \
+  ((size) != 0 && (size) % 0x400 == 0 &&                                      \
+   (size) < FLASH_END_ADDR + 1 - BOOTLOADER_START_ADDR)
+
+/* Application space behind a bootloader of the given size */
+#define BOOT_LAYOUT_APP_MAX(bootloader_size)                                   \
+  (FLASH_END_ADDR + 1 - BOOTLOADER_START_ADDR - (bootloader_size))
+
+#define APPLICATION_START_ADDR (BOOTLOADER_START_ADDR + BOOTLOADER_SIZE)
+#define APPLICATION_MAX_SIZE BOOT_LAYOUT_APP_MAX(BOOTLOADER_SIZE)
@@ -0,0 +1,104 @@
+#pragma once
+#include "common.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Application -> bootloader mailbox.
+ *
+ * Lives at the start of the shared RAM both linker scripts leave out of
+ * their RAM region (SHARED_RAM, reserved by the .shared_ram section), so it
+ * survives the reset. The mailbox, boot_timing_t and boot_stats_t keep fixed
+ * addresses in it: the two images are linked apart and have to agree. Header only: the application
+ * includes this file as is, no bootloader object has to be linked in.
+ *
+ * The application fills a boot_mailbox_t, calls boot_mailbox_write() and
+ * resets. The bootloader consumes it on the next boot. The legacy
+ * 0xDEADBEEF word at the same address is still honoured as "enter update".
+ */
+#define BOOT_SHARED_RAM_ADDR 0x20000000
+#define BOOT_SHARED_RAM_SIZE 0x100 /* SHARED_RAM in both linker scripts */
+#define BOOT_MAILBOX_ADDR 0x20000000
+#define BOOT_MAILBOX_MAGIC 0x584F424D // MBOX
+#define BOOT_MAILBOX_VERSION 1
+#define BOOT_MAILBOX_LEGACY_MAGIC 0xDEADBEEF
+
+/* Commands */
+#define BOOT_MAILBOX_CMD_NONE 0
+#define BOOT_MAILBOX_CMD_ENTER_UPDATE 1
+
+/* Flags */
+#define BOOT_MAILBOX_FLAG_SKIP_BANNER (1u << 0)
+
+/* Transports */
+#define BOOT_MAILBOX_TRANSPORT_UART1 0
+#define BOOT_MAILBOX_TRANSPORT_CAN1 1 /* BOOTLOADER_CAN builds, boot_can.h */
+
+/* At most 64 bytes, boot_timing_t follows at 0x20000040 */
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size; /* sizeof(boot_mailbox_t) of the writer */
+  uint32_t command;
+  uint32_t flags;
+  uint32_t baudrate;    /* 0 = BOOTLOADER_UART_BAUDRATE */
+  uint32_t transport;   /* BOOT_MAILBOX_TRANSPORT_* */
+  uint32_t image_size;  /* expected update size, 0 = any */
+  uint32_t image_crc32; /* expected update CRC32, 0 = any */
+  uint32_t crc32;       /* over all fields above */
+} boot_mailbox_t;
+
+_Static_assert(sizeof(boot_mailbox_t) <= 64,
+               "boot_mailbox_t runs into boot_timing_t at 0x20000040");
+
+#define BOOT_MAILBOX ((volatile boot_mailbox_t *)BOOT_MAILBOX_ADDR)
+
+/**
+ * @brief CRC32 of the mailbox fields in front of the crc32 member
+ */
+static inline uint32_t boot_mailbox_crc(const boot_mailbox_t *msg) {
+  return crc32_bitwise((const uint8_t *)msg, offsetof(boot_mailbox_t, crc32));
+}
+
+/**
+ * @brief Post a request for the next boot
+ * @param msg: Request, magic, version, size and crc32 are filled in here
+ */
+static inline void boot_mailbox_write(boot_mailbox_t *msg) {
+  msg->magic = BOOT_MAILBOX_MAGIC;
+  msg->version = BOOT_MAILBOX_VERSION;
+  msg->size = sizeof(boot_mailbox_t);
+  msg->crc32 = boot_mailbox_crc(msg);
+  *BOOT_MAILBOX = *msg;
+}
+
+/**
+ * @brief Fetch a valid request
+ * @param msg: Output, the legacy magic word is reported as ENTER_UPDATE
+ * @return true if the mailbox held a request
+ */
+static inline bool boot_mailbox_read(boot_mailbox_t *msg) {
+  const boot_mailbox_t *raw = (const boot_mailbox_t *)BOOT_MAILBOX_ADDR;
+
+  for (uint32_t i = 0; i < sizeof(*msg); i++) {
+    ((uint8_t *)msg)[i] = 0;
+  }
+  if (raw->magic == BOOT_MAILBOX_LEGACY_MAGIC) {
+    msg->command = BOOT_MAILBOX_CMD_ENTER_UPDATE;
+    return true;
+  }
+  if (raw->magic != BOOT_MAILBOX_MAGIC ||
+      raw->version != BOOT_MAILBOX_VERSION ||
+      raw->size != sizeof(boot_mailbox_t) ||
+      raw->crc32 != boot_mailbox_crc(raw)) {
+    return false;
+  }
+  *msg = *raw;
+  return true;
+}
+
+/**
+ * @brief Drop any request so it is acted on only once
+ */
+static inline void boot_mailbox_clear(void) { BOOT_MAILBOX->magic = 0; }
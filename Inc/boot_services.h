@@ -0,0 +1,81 @@
+#pragma once
+#include "boot_mailbox.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Bootloader services, a function table the application can call.
+ *
+ * The table sits at a fixed address in the bootloader flash and gives the
+ * application the bootloader's flash engine, CRC engines, mailbox access and
+ * image metadata, so it does not have to link its own copies. Header only,
+ * like boot_mailbox.h.
+ *
+ * The services keep no state in RAM: the application owns all of it by the
+ * time it calls them. They run on the caller's stack and do not enable or
+ * rely on interrupts.
+ *
+ * Entries are only ever appended. Check the version (or the size) before
+ * using one that a later version added.
+ */
+#define BOOT_SERVICES_ADDR 0x08000200
+#define BOOT_SERVICES_MAGIC 0x56524553 // SERV
+#define BOOT_SERVICES_VERSION 1
+
+typedef enum {
+  BOOT_SERVICE_OK = 0,
+  BOOT_SERVICE_ERROR,       /* flash programming or write protection error */
+  BOOT_SERVICE_RANGE_ERROR, /* address outside the application region */
+  BOOT_SERVICE_NO_IMAGE     /* no image metadata */
+} boot_service_result_t;
+
+/* Copy of the application metadata the bootloader wrote */
+typedef struct {
+  uint32_t address; /* application start */
+  uint32_t version;
+  uint32_t size;
+  uint32_t crc32;
+  uint8_t sha256[32];
+  uint32_t verified; /* 1 if the verified mark is set */
+} boot_image_info_t;
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size; /* sizeof(boot_services_t) of the bootloader */
+  const char *bootloader_version;
+
+  /* Flash, limited to the application region after the metadata page.
+   * Erase works on whole pages, program on halfwords and verifies. Either
+   * one reaching into the image clears its verified mark first. */
+  boot_service_result_t (*flash_erase)(uint32_t address, uint32_t size);
+  boot_service_result_t (*flash_program)(uint32_t address,
+                                         const uint8_t *data, uint32_t size);
+
+  /* CRC32 (start with 0xFFFFFFFF, no final xor) and CRC16-CCITT. CRC32 uses
+   * the CRC unit for word aligned data and leaves its clock disabled. */
+  uint32_t (*crc32_update)(uint32_t crc, const uint8_t *data, uint32_t size);
+  uint16_t (*crc16_update)(uint16_t crc, const uint8_t *data,
+                           uint16_t size);
+
+  /* Mailbox, see boot_mailbox.h */
+  void (*mailbox_write)(boot_mailbox_t *msg);
+  bool (*mailbox_read)(boot_mailbox_t *msg);
+
+  /* Image metadata */
+  boot_service_result_t (*image_info)(boot_image_info_t *info);
+  boot_service_result_t (*image_check)(void); /* full CRC32 of the image */
+} boot_services_t;
+
+/**
+ * @brief Locate the service table
+ * @return The table, or NULL if the bootloader does not provide one
+ */
+static inline const boot_services_t *boot_services(void) {
+  const boot_services_t *services = (const boot_services_t *)BOOT_SERVICES_ADDR;
+
+  if (services->magic != BOOT_SERVICES_MAGIC || services->version == 0) {
+    return 0;
+  }
+  return services;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include "bootloader.h"
+#include "spi_flash.h"
+
+/*
+ * Staging slots in the external SPI flash (spi_flash.h).
+ *
+ * With a chip fitted, a Y-modem transfer no longer goes to the application
+ * flash. It is written to a slot at link rate, and the running application
+ * stays intact until the whole image is in and its header is written. Only
+ * then is it installed: the slot is read back against its CRC32, copied
+ * page by page into the internal flash and checked there like a direct
+ * transfer, signature included.
+ *
+ *   0x000000  update slot, every transfer
+ *   0x010000  golden slot, a file named BOOT_STAGING_GOLDEN_NAME
+ *
+ * Each slot is one 64KB block: the header in the first page, the image
+ * from BOOT_STAGING_IMAGE_OFFSET on. An image that fails its checks after
+ * the install has its slot rejected. When the application is missing or
+ * corrupt at boot, the bootloader installs the update slot, or the golden
+ * image if that one is rejected or empty, without a host.
+ *
+ * Without a chip the bootloader programs the internal flash directly, as
+ * before.
+ */
+#define BOOT_STAGING_MAGIC 0x47415453 // STAG
+#define BOOT_STAGING_SLOT_SIZE SPI_FLASH_BLOCK_SIZE
+#define BOOT_STAGING_IMAGE_OFFSET SPI_FLASH_PAGE_SIZE
+#define BOOT_STAGING_GOLDEN_NAME "golden.bin"
+
+#define BOOT_STAGING_UPDATE 0
+#define BOOT_STAGING_GOLDEN 1
+#define BOOT_STAGING_SLOTS 2
+#define BOOT_STAGING_NONE 0xFF
+
+/* In the first page of a slot, programmed once the image is complete */
+typedef struct {
+  uint32_t magic;
+  uint32_t rejected;    /* 0xFFFFFFFF, 0 once the image failed its checks */
+  firmware_info_t info; /* size, CRC32 and SHA-256 of the image */
+} boot_staging_header_t;
+
+bool boot_staging_init(void);
+bool boot_staging_present(void);
+bool boot_staging_open(uint8_t slot);
+bool boot_staging_prepare(uint8_t slot, uint32_t end);
+bool boot_staging_write(uint8_t slot, uint32_t offset, const uint8_t *data,
+                        uint32_t size);
+bool boot_staging_close(uint8_t slot, const firmware_info_t *info);
+bool boot_staging_find(uint8_t *slot);
+bootloader_result_t boot_staging_install(uint8_t slot,
+                                         uint8_t buffer[SPI_FLASH_PAGE_SIZE],
+                                         firmware_info_t *info);
+void boot_staging_reject(uint8_t slot);
+void boot_staging_deinit(void);
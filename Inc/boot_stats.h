@@ -0,0 +1,113 @@
+#pragma once
+#include "common.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Update statistics, kept across resets.
+ *
+ * Like boot_timing_t the block lives at a fixed address in the RAM both
+ * images keep out of their linker scripts, so the application can read it
+ * with boot_stats_read(). It survives resets but not a power cycle: the
+ * bootloader starts over whenever magic, size or CRC32 do not match. The
+ * bootloader prints it when the host sends BOOT_STATS_COMMAND while it
+ * waits for a Y-modem transfer.
+ *
+ * A session starts when a header is accepted and ends with the verified
+ * image or the first failure. last[] holds the most recent session, total[]
+ * everything since the block was started.
+ */
+#define BOOT_STATS_ADDR 0x20000080
+#define BOOT_STATS_MAGIC 0x54415453 // STAT
+#define BOOT_STATS_VERSION 1
+#define BOOT_STATS_COMMAND 'S'
+
+typedef enum {
+  BOOT_STAT_CRC_ERRORS = 0, /* bad CRC16, packet number or start byte */
+  BOOT_STAT_TIMEOUTS,       /* YMODEM_TIMEOUT_MS without a byte */
+  BOOT_STAT_NAKS,           /* NAKs sent */
+  BOOT_STAT_OVERRUNS,       /* USART overruns, bytes lost */
+  BOOT_STAT_FLASH_RETRIES,  /* page erases repeated */
+  BOOT_STAT_FLASH_ERRORS,   /* erases or writes that failed for good */
+  BOOT_STAT_BYTES,          /* file bytes received */
+  BOOT_STAT_DURATION_MS,    /* header to verified image or failure */
+  BOOT_STAT_COUNT
+} boot_stat_t;
+
+/* 100 bytes, the layout is shared with the application */
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size;        /* sizeof(boot_stats_t) of the bootloader */
+  uint32_t sessions;    /* headers accepted */
+  uint32_t updates;     /* sessions that ended with a verified image */
+  uint32_t failures;    /* sessions that did not */
+  uint32_t last_result; /* bootloader_result_t of the last session */
+  uint32_t last[BOOT_STAT_COUNT];
+  uint32_t total[BOOT_STAT_COUNT];
+  uint32_t crc32; /* over all fields above */
+} boot_stats_t;
+
+#define BOOT_STATS ((volatile boot_stats_t *)BOOT_STATS_ADDR)
+
+/**
+ * @brief CRC32 of the fields in front of the crc32 member
+ */
+static inline uint32_t boot_stats_crc(const volatile boot_stats_t *stats) {
+  return crc32_bitwise((const volatile uint8_t *)stats,
+                       offsetof(boot_stats_t, crc32));
+}
+
+/**
+ * @brief Copy the statistics the bootloader left
+ * @param stats: Output
+ * @return false if there are none or they did not survive
+ */
+static inline bool boot_stats_read(boot_stats_t *stats) {
+  const volatile boot_stats_t *raw = BOOT_STATS;
+
+  if (raw->magic != BOOT_STATS_MAGIC || raw->version != BOOT_STATS_VERSION ||
+      raw->size != sizeof(boot_stats_t) ||
+      raw->crc32 != boot_stats_crc(raw)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < sizeof(*stats); i++) {
+    ((uint8_t *)stats)[i] = ((const volatile uint8_t *)raw)[i];
+  }
+  return true;
+}
+
+/**
+ * @brief Throughput from a byte and a millisecond counter
+ * @return Bytes per second, 0 without a duration
+ */
+static inline uint32_t boot_stats_rate(uint32_t bytes, uint32_t ms) {
+  if (ms == 0) {
+    return 0;
+  }
+  return (bytes < 0xFFFFFFFFu / 1000) ? bytes * 1000 / ms
+                                      : bytes / ms * 1000;
+}
+
+/* Keep the block at all, the 8 KB build leaves it out (make STATS=0) */
+#ifndef BOOTLOADER_STATS
+#define BOOTLOADER_STATS 1
+#endif
+
+#if BOOTLOADER_STATS
+void boot_stats_init(void);
+void boot_stats_begin(void);
+void boot_stats_add(boot_stat_t stat, uint32_t count);
+void boot_stats_end(uint32_t result);
+void boot_stats_report(void);
+#else
+static inline void boot_stats_init(void) {}
+static inline void boot_stats_begin(void) {}
+static inline void boot_stats_add(boot_stat_t stat, uint32_t count) {
+  (void)stat;
+  (void)count;
+}
+static inline void boot_stats_end(uint32_t result) { (void)result; }
+static inline void boot_stats_report(void) {}
+#endif
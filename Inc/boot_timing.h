@@ -0,0 +1,66 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Boot and update phase timestamps from the DWT cycle counter.
+ *
+ * The table lives at a fixed address in the RAM both images keep out of
+ * their linker scripts, so the application can read how its own boot went.
+ * The bootloader prints it when the host sends BOOT_TIMING_COMMAND while
+ * it waits for a Y-modem transfer.
+ */
+#define BOOT_TIMING_ADDR 0x20000040
+#define BOOT_TIMING_MAGIC 0x454D4954 // TIME
+#define BOOT_TIMING_COMMAND 'T'
+
+/* Phases in the order they complete, not every boot goes through all */
+typedef enum {
+  BOOT_PHASE_RESET = 0, /* cycle counter started, first line of main() */
+  BOOT_PHASE_HAL_INIT,
+  BOOT_PHASE_CLOCK_LOCK,
+  BOOT_PHASE_CONDITIONS,
+  BOOT_PHASE_HEADER, /* Y-modem header packet received */
+  BOOT_PHASE_ERASE,  /* transfer started, pages are erased as it goes */
+  BOOT_PHASE_FIRST_PACKET,
+  BOOT_PHASE_LAST_PACKET,
+  BOOT_PHASE_VERIFY,
+  BOOT_PHASE_METADATA,
+  BOOT_PHASE_JUMP,
+  BOOT_PHASE_COUNT
+} boot_phase_t;
+
+/* 64 bytes, the layout is shared with the application */
+typedef struct {
+  uint32_t magic;
+  uint32_t core_clock; /* Hz after BOOT_PHASE_CLOCK_LOCK, HSI before */
+  uint32_t phase[BOOT_PHASE_COUNT]; /* DWT cycles, 0 = phase not reached */
+  uint32_t packet_count;
+  uint32_t packet_max_cycles; /* slowest packet callback */
+  uint32_t packet_total_cycles;
+} boot_timing_t;
+
+_Static_assert(sizeof(boot_timing_t) <= 64,
+               "boot_timing_t runs into boot_stats_t at 0x20000080");
+
+#define BOOT_TIMING ((volatile boot_timing_t *)BOOT_TIMING_ADDR)
+
+/* Fill the table at all, the 8 KB build leaves it out (make TIMING=0) */
+#ifndef BOOTLOADER_TIMING
+#define BOOTLOADER_TIMING 1
+#endif
+
+#if BOOTLOADER_TIMING
+void boot_timing_start(void);
+void boot_timing_mark(boot_phase_t phase);
+uint32_t boot_timing_now(void);
+void boot_timing_packet(uint32_t start_cycles);
+void boot_timing_report(void);
+#else
+static inline void boot_timing_start(void) {}
+static inline void boot_timing_mark(boot_phase_t phase) { (void)phase; }
+static inline uint32_t boot_timing_now(void) { return 0; }
+static inline void boot_timing_packet(uint32_t start_cycles) {
+  (void)start_cycles;
+}
+static inline void boot_timing_report(void) {}
+#endif
@@ -1,7 +1,12 @@
 #ifndef __BOOTLOADER_H__
 #define __BOOTLOADER_H__
 
+#include "boot_idle.h"
+#include "boot_layout.h"
+#include "boot_mailbox.h"
+#include "can_bus.h"
 #include "mini_print.h"
+#include "sha256.h"
 #include "stm32f1xx_hal.h"
 #include "ymodem.h"
 #include <stdbool.h>
@@ -10,39 +15,145 @@
 
 /* Bootloader Configuration */
 #define BOOTLOADER_VERSION "1.0.0"
-#define BOOTLOADER_START_ADDR 0x08000000
-#define VECT_TAB_OFFSET 0x4000 /* Vector table offset */
-#define APPLICATION_START_ADDR                                                 \
-  (BOOTLOADER_START_ADDR + VECT_TAB_OFFSET) /* 16KB offset for bootloader */
-#define FLASH_END_ADDR 0x0800FFFF           /* 64KB Flash end */
+#define VECT_TAB_OFFSET BOOTLOADER_SIZE /* Vector table offset */
 
-#define BOOTLOADER_SIZE 0x4000 /* 16KB for bootloader */
+/* LL drivers instead of the HAL modules, see ll_hal.c */
+#ifndef BOOTLOADER_LL
+#define BOOTLOADER_LL 0
+#endif
 
 /* Bootloader settings */
 #define BOOTLOADER_TIMEOUT_MS 5000
-#define APPLICATION_META_ADDR (APPLICATION_START_ADDR - 0x30)
+#define APPLICATION_META_ADDR (APPLICATION_START_ADDR - 0x40)
 #define APPLICATION_META_MAGIC 0x424F4F54 // BOOT
+#define APPLICATION_META_PAGE_ADDR                                             \
+  (APPLICATION_META_ADDR & ~(FLASH_PAGE_SIZE - 1)) /* erased on every update */
+#define APPLICATION_VERIFIED_MAGIC 0x56524659 // VRFY
+
+/* Boot integrity policy */
+#define BOOT_INTEGRITY_NONE 0       /* vectors and metadata magic only */
+#define BOOT_INTEGRITY_CRC_ALWAYS 1 /* image CRC32 on every boot */
+#define BOOT_INTEGRITY_CRC_ONCE 2   /* image CRC32 once, then verified mark */
+#define BOOT_INTEGRITY_SHA256_ONCE 3 /* image SHA-256 once, then verified mark */
+#define BOOTLOADER_BOOT_INTEGRITY BOOT_INTEGRITY_CRC_ONCE
+
+/* Legacy entry word, superseded by the mailbox in boot_mailbox.h */
+#define BOOTLOADER_MAGIC_ADDR BOOT_MAILBOX_ADDR
+#define BOOTLOADER_ENTER_MAGIC BOOT_MAILBOX_LEGACY_MAGIC
+
+/* Fast boot: decide whether to jump before HAL, clock and UART bring-up */
+#define BOOTLOADER_FAST_BOOT 1
 
-/* Magic numbers for bootloader control */
-#define BOOTLOADER_MAGIC_ADDR 0x20000000 /* RAM address for magic number */
-#define BOOTLOADER_ENTER_MAGIC 0xDEADBEEF
+/* Secure boot: only accept images signed with sign.py (Ed25519) */
+#ifndef BOOTLOADER_SECURE_BOOT
+#define BOOTLOADER_SECURE_BOOT 0
+#endif
+#define FIRMWARE_SIGNATURE_MAGIC 0x4E474953 // SIGN
+
+/* Encrypted updates: only accept images from encrypt.py (ChaCha20) */
+#ifndef BOOTLOADER_ENCRYPTION
+#define BOOTLOADER_ENCRYPTION 0
+#endif
+#define FIRMWARE_ENCRYPTION_MAGIC 0x52434E45 // ENCR
+
+/* Binary command protocol next to Y-modem, see boot_command.h */
+#ifndef BOOTLOADER_COMMANDS
+#define BOOTLOADER_COMMANDS 1
+#endif
+
+/* Sleep or Stop mode while waiting for the host, see boot_idle.h */
+#ifndef BOOTLOADER_IDLE
+#define BOOTLOADER_IDLE BOOT_IDLE_STOP
+#endif
+
+/* Stage transfers in an external SPI flash, see boot_staging.h. The slots
+ * would hold the decrypted image, so not together with encryption. */
+#ifndef BOOTLOADER_STAGING
+#define BOOTLOADER_STAGING 0
+#endif
+#if BOOTLOADER_STAGING && BOOTLOADER_ENCRYPTION
+#error "Staging would store the decrypted image outside the chip"
+#endif
+
+/* Multicast updates over CAN1 next to the UART, see boot_can.h. Nodes
+ * program the image as it is broadcast, there is no decryption step. */
+#ifndef BOOTLOADER_CAN
+#define BOOTLOADER_CAN 0
+#endif
+#if BOOTLOADER_CAN && BOOTLOADER_ENCRYPTION
+#error "CAN updates are not encrypted"
+#endif
+
+/* One-way broadcast updates on the UART receive line, see boot_broadcast.h.
+ * Symbols are programmed as they are decoded, not decrypted. */
+#ifndef BOOTLOADER_BROADCAST
+#define BOOTLOADER_BROADCAST 0
+#endif
+#if BOOTLOADER_BROADCAST && BOOTLOADER_ENCRYPTION
+#error "Broadcast updates are not encrypted"
+#endif
+
+/* Sparse container from merge.py --container: only the populated ranges
+ * of the image are sent, erased and programmed */
+#define FIRMWARE_SPARSE_MAGIC 0x53525053 // SPRS
+
+/* CRC32 on the CRC unit for word aligned data, 0 leaves it to the table
+ * (host simulator) */
+#ifndef BOOTLOADER_HW_CRC
+#define BOOTLOADER_HW_CRC 1
+#endif
 
 /* UART Configuration */
 #define BOOTLOADER_UART_BAUDRATE 115200
 #define BOOTLOADER_UART_TIMEOUT 1000
 
+/* Event loop timing, see bootloader_run(). Like the Y-modem timeouts in
+ * ymodem.h these bound waits for the host, none of them is a sleep. */
+#ifndef BOOTLOADER_TICK_MS
+#define BOOTLOADER_TICK_MS 500 /* LED blink while waiting for a sender */
+#endif
+#ifndef BOOTLOADER_ERROR_BACKOFF_MS
+#define BOOTLOADER_ERROR_BACKOFF_MS 100 /* quiet time after a failed session */
+#endif
+#ifndef BOOTLOADER_MAX_SESSION_ERRORS
+#define BOOTLOADER_MAX_SESSION_ERRORS 5 /* failed sessions before a reset */
+#endif
+#ifndef BOOTLOADER_ERASE_RETRIES
+#define BOOTLOADER_ERASE_RETRIES 1 /* extra erases of a page not read blank */
+#endif
+
 /* Bootloader states */
 typedef enum {
   BOOTLOADER_STATE_INIT,
   BOOTLOADER_STATE_CHECK_CONDITIONS,
   BOOTLOADER_STATE_WAIT_FOR_FIRMWARE,
   BOOTLOADER_STATE_RECEIVING_FIRMWARE,
+  BOOTLOADER_STATE_COMMAND_SESSION,
+  BOOTLOADER_STATE_CAN_SESSION,
+  BOOTLOADER_STATE_BROADCAST_SESSION,
   BOOTLOADER_STATE_PROGRAMMING_FLASH,
   BOOTLOADER_STATE_VERIFYING_FIRMWARE,
   BOOTLOADER_STATE_JUMP_TO_APP,
   BOOTLOADER_STATE_ERROR
 } bootloader_state_t;
 
+/* Events of the bootloader loop, each handled to completion in turn */
+typedef enum {
+  BOOTLOADER_EVENT_ENTER,      /* the state was just entered */
+  BOOTLOADER_EVENT_RX,         /* byte from the host */
+  BOOTLOADER_EVENT_TIMEOUT,    /* deadline of the current state passed */
+  BOOTLOADER_EVENT_TICK,       /* every BOOTLOADER_TICK_MS */
+  BOOTLOADER_EVENT_FLASH_DONE, /* packet programmed, see ok */
+  BOOTLOADER_EVENT_CAN         /* frame from the CAN bus */
+} bootloader_event_type_t;
+
+typedef struct {
+  bootloader_event_type_t type;
+  uint8_t byte;             /* BOOTLOADER_EVENT_RX */
+  bool ok;                  /* BOOTLOADER_EVENT_FLASH_DONE */
+  const can_frame_t *frame; /* BOOTLOADER_EVENT_CAN, until the next event */
+} bootloader_event_t;
+
 /* Bootloader result codes */
 typedef enum {
   BOOTLOADER_OK = 0,
@@ -54,42 +165,94 @@ typedef enum {
   BOOTLOADER_INVALID_APPLICATION
 } bootloader_result_t;
 
+/* Reasons for staying in the bootloader */
+typedef enum {
+  BOOTLOADER_ENTRY_NONE = 0,
+  BOOTLOADER_ENTRY_BUTTON,
+  BOOTLOADER_ENTRY_MAGIC,
+  BOOTLOADER_ENTRY_NO_APPLICATION,
+  BOOTLOADER_ENTRY_CORRUPT_APPLICATION
+} bootloader_entry_reason_t;
+
 /* Firmware information structure */
 typedef struct {
   uint32_t magic;
   uint32_t version;
   uint32_t size;
   uint32_t crc32;
+  uint8_t sha256[SHA256_DIGEST_SIZE]; /* hashed while the image is received */
+  uint32_t verified; /* APPLICATION_VERIFIED_MAGIC once checked at boot,
+                        left erased when the metadata is written */
 } firmware_info_t;
 
+/* Signature block appended to the image by sign.py */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size; /* image size without this block */
+  uint32_t crc32;
+  uint8_t signature[64]; /* over image + firmware_info_t up to verified */
+} firmware_signature_t;
+
+/* Header in front of encrypted images, the rest of the file is ciphertext */
+typedef struct {
+  uint32_t magic;
+  uint8_t nonce[12];
+} firmware_encryption_t;
+
+/* Header of a sparse container, segment_count segments follow */
+typedef struct {
+  uint32_t magic;
+  uint32_t image_size;  /* span from APPLICATION_START_ADDR, holes read 0xFF */
+  uint32_t image_crc32; /* over that span as it ends up in flash */
+  uint32_t segment_count;
+} firmware_sparse_t;
+
+/* One populated range, its data follows the header */
+typedef struct {
+  uint32_t address; /* halfword aligned, ascending */
+  uint32_t size;    /* even */
+  uint32_t crc32;
+} firmware_segment_t;
+
 /* Bootloader context */
 typedef struct {
   bootloader_state_t state;
   firmware_info_t firmware_info;
+  bootloader_entry_reason_t entry_reason;
   bool force_update;
   uint32_t error_count;
 } bootloader_context_t;
 
 /* Main bootloader functions */
+void bootloader_fast_boot(void);
 void bootloader_init(void);
 bootloader_result_t bootloader_run(void);
 void bootloader_jump_to_application(void);
+void bootloader_jump_to_image(uint32_t vectors);
 
 /* Condition checking functions */
 bool bootloader_should_enter(void);
 bool bootloader_is_button_pressed(void);
 bool bootloader_check_magic_number(void);
 bool bootloader_is_application_valid(void);
+bool bootloader_is_application_intact(void);
 
 /* Flash operations */
 bootloader_result_t bootloader_erase_application_flash(void);
+bootloader_result_t bootloader_erase_page(uint32_t page);
 bootloader_result_t
 bootloader_program_flash(uint32_t address, const uint8_t *data, uint32_t size);
 bootloader_result_t
 bootloader_verify_firmware(const firmware_info_t *firmware_info);
+bootloader_result_t
+bootloader_verify_signature(firmware_info_t *firmware_info);
+bootloader_result_t
+bootloader_write_firmware_info(firmware_info_t *firmware_info);
+uint32_t bootloader_crc32_update(uint32_t crc, const uint8_t *data,
+                                 uint32_t size);
 
 /* Communication functions */
-bootloader_result_t bootloader_receive_firmware(void);
 void bootloader_print_banner(void);
 
 void bootloader_delay_ms(uint32_t delay);
@@ -107,13 +270,15 @@ uint32_t bootloader_get_sector_size(uint32_t sector);
 
 #if 1
 /* Debug and logging */
+#define BOOTLOADER_LOG_SIZE 128
 #define BOOTLOADER_LOG(fmt, ...)                                               \
   do {                                                                         \
-    uint8_t buf[128];                                                          \
-    int size = mini_printf((char *)buf, sizeof(buf) - 1, fmt, ##__VA_ARGS__);  \
-    buf[size] = '\n';                                                          \
+    int size = mini_printf((char *)g_bootloader_log, BOOTLOADER_LOG_SIZE - 1,  \
+                           fmt, ##__VA_ARGS__);                                \
+    g_bootloader_log[size] = '\n';                                             \
     size += 1;                                                                 \
-    HAL_UART_Transmit(&huart1, buf, size, BOOTLOADER_UART_TIMEOUT);            \
+    HAL_UART_Transmit(&huart1, g_bootloader_log, size,                         \
+                      BOOTLOADER_UART_TIMEOUT);                                \
   } while (0)
 #else
 #define BOOTLOADER_LOG(fmt, ...)
@@ -131,5 +296,6 @@ uint32_t bootloader_get_sector_size(uint32_t sector);
 /* External variables */
 extern UART_HandleTypeDef huart1;
 extern bootloader_context_t g_bootloader_context;
+extern uint8_t g_bootloader_log[]; /* BOOTLOADER_LOG line, in the arena */
 
 #endif /* __BOOTLOADER_H__ */
@@ -0,0 +1,28 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * bxCAN on CAN1, extended frames only, for the multicast update in
+ * boot_can.h. A transceiver sits on PA11 (RX) and PA12 (TX).
+ *
+ * The receive filter passes the host frames of boot_can.h into FIFO 0. The
+ * FIFO holds three frames; whatever arrives while it is full is lost, so
+ * the bootloader reads it between every step and never logs during a
+ * session. Sends take a free transmit mailbox and return, the frame goes
+ * out while the bootloader works on.
+ */
+#define CAN_BUS_TX_TIMEOUT_MS 10 /* for a free mailbox, the bus may be dead */
+
+typedef struct {
+  uint32_t id; /* 29 bits */
+  uint8_t size;
+  uint8_t data[8];
+} can_frame_t;
+
+void can_bus_init(void);
+bool can_bus_pending(void);
+bool can_bus_receive(can_frame_t *frame);
+bool can_bus_send(const can_frame_t *frame);
+uint16_t can_bus_node_id(void);
+void can_bus_deinit(void);
@@ -0,0 +1,18 @@
+#pragma once
+#include <stdint.h>
+
+#define CHACHA20_KEY_SIZE 32
+#define CHACHA20_NONCE_SIZE 12
+#define CHACHA20_BLOCK_SIZE 64
+
+/* ChaCha20 (RFC 8439) stream cipher context */
+typedef struct {
+  uint32_t state[16];
+  uint32_t keystream[16];
+  uint32_t used; /* keystream bytes already consumed */
+} chacha20_ctx_t;
+
+void chacha20_init(chacha20_ctx_t *ctx, const uint8_t key[CHACHA20_KEY_SIZE],
+                   const uint8_t nonce[CHACHA20_NONCE_SIZE], uint32_t counter);
+void chacha20_crypt(chacha20_ctx_t *ctx, const uint8_t *in, uint8_t *out,
+                    uint32_t size);
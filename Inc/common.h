@@ -4,3 +4,22 @@
 uint16_t crc16_update(uint16_t crc, const uint8_t *data, uint16_t length);
 uint32_t crc32_update(uint32_t crc, const uint8_t *data, uint32_t length);
 uint8_t sum_update(uint8_t checksum, const uint8_t *data, uint16_t length);
+
+/**
+ * @brief crc32_update(0, data, length) without the table
+ * @note  Header only, for the small blocks in the shared RAM: the
+ *        application checks them without linking common.c, and a few dozen
+ *        bytes do not justify a table in both images
+ */
+static inline uint32_t crc32_bitwise(const volatile uint8_t *data,
+                                     uint32_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+
+  for (uint32_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include "sha512.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ED25519_SIGNATURE_SIZE 64
+#define ED25519_PUBLIC_KEY_SIZE 32
+
+/*
+ * Ed25519 (RFC 8032) signature verification.
+ *
+ * The message can be streamed, e.g. straight out of flash:
+ *   ed25519_verify_start(&hash, sig, pk);
+ *   sha512_update(&hash, part, size);   // as many times as needed
+ *   ok = ed25519_verify_finish(&hash, sig, pk);
+ */
+void ed25519_verify_start(sha512_ctx_t *hash,
+                          const uint8_t signature[ED25519_SIGNATURE_SIZE],
+                          const uint8_t public_key[ED25519_PUBLIC_KEY_SIZE]);
+bool ed25519_verify_finish(sha512_ctx_t *hash,
+                           const uint8_t signature[ED25519_SIGNATURE_SIZE],
+                           const uint8_t public_key[ED25519_PUBLIC_KEY_SIZE]);
+bool ed25519_verify(const uint8_t signature[ED25519_SIGNATURE_SIZE],
+                    const uint8_t *message, uint32_t size,
+                    const uint8_t public_key[ED25519_PUBLIC_KEY_SIZE]);
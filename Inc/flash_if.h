@@ -0,0 +1,19 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Register-level flash engine.
+ *
+ * Keeps no state in RAM and does not use the HAL, so it also works before
+ * HAL_Init() and when the application calls it through the service table
+ * after it took over the RAM.
+ */
+typedef enum {
+  FLASH_IF_OK = 0,
+  FLASH_IF_ERROR,       /* programming or write protection error */
+  FLASH_IF_VERIFY_ERROR /* read back differs from what was written */
+} flash_if_result_t;
+
+flash_if_result_t flash_if_erase(uint32_t address, uint32_t size);
+flash_if_result_t flash_if_program(uint32_t address, const uint8_t *data,
+                                   uint32_t size);
@@ -1,4 +1,19 @@
 #pragma once
+#include <stdarg.h>
 #include <stddef.h>
 
+/**
+ * @brief Small snprintf for the bootloader log, no newlib and no division
+ * @note  Supports %d %i %u %x %X %p %s %c %% with the '-' and '0' flags, a
+ *        field width and the 'l' length. Integers are formatted as 32 bits,
+ *        the size of long on the target. Output that does not fit is cut.
+ * @param buffer: Destination, always NUL terminated when max > 0
+ * @param max: Size of buffer
+ * @return Number of characters written, without the terminator
+ */
 int mini_printf(char *buffer, size_t max, const char *fmt, ...);
+
+/**
+ * @brief mini_printf with a va_list
+ */
+int mini_vprintf(char *buffer, size_t max, const char *fmt, va_list args);
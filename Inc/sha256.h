@@ -0,0 +1,16 @@
+#pragma once
+#include <stdint.h>
+
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_DIGEST_SIZE 32
+
+/* Incremental SHA-256 context */
+typedef struct {
+  uint32_t state[8];
+  uint32_t count; /* Bytes hashed so far, images are far below 512MB */
+  uint8_t buffer[SHA256_BLOCK_SIZE];
+} sha256_ctx_t;
+
+void sha256_init(sha256_ctx_t *ctx);
+void sha256_update(sha256_ctx_t *ctx, const uint8_t *data, uint32_t size);
+void sha256_final(sha256_ctx_t *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
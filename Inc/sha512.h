@@ -0,0 +1,16 @@
+#pragma once
+#include <stdint.h>
+
+#define SHA512_BLOCK_SIZE 128
+#define SHA512_DIGEST_SIZE 64
+
+/* Incremental SHA-512 context */
+typedef struct {
+  uint64_t state[8];
+  uint64_t count; /* Bytes hashed so far */
+  uint8_t buffer[SHA512_BLOCK_SIZE];
+} sha512_ctx_t;
+
+void sha512_init(sha512_ctx_t *ctx);
+void sha512_update(sha512_ctx_t *ctx, const uint8_t *data, uint32_t size);
+void sha512_final(sha512_ctx_t *ctx, uint8_t digest[SHA512_DIGEST_SIZE]);
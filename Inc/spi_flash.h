@@ -0,0 +1,41 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * W25Qxx-class SPI NOR flash: 256 byte pages, 4KB sectors, 64KB blocks.
+ *
+ * The commands live in spi_flash.c. The bus below them is spi_bus.c on the
+ * chip (SPI1 on PA4-PA7, both directions by DMA) and a W25Q model in
+ * tools/host_sim/sim_spi.c on the host, so the command layer runs unchanged
+ * against either. Like flash_if.c, programming only clears bits and the
+ * caller erases first.
+ */
+#define SPI_FLASH_PAGE_SIZE 256
+#define SPI_FLASH_SECTOR_SIZE 0x1000
+#define SPI_FLASH_BLOCK_SIZE 0x10000
+
+/* Datasheet maximums of the W25Q16JV, the longest busy times to wait for */
+#define SPI_FLASH_PROGRAM_TIMEOUT_MS 3
+#define SPI_FLASH_SECTOR_TIMEOUT_MS 400
+#define SPI_FLASH_BLOCK_TIMEOUT_MS 2000
+
+typedef enum {
+  SPI_FLASH_OK = 0,
+  SPI_FLASH_ERROR,  /* no chip, or an address outside it */
+  SPI_FLASH_TIMEOUT /* still busy after the datasheet maximum */
+} spi_flash_result_t;
+
+spi_flash_result_t spi_flash_init(uint32_t *size);
+spi_flash_result_t spi_flash_read(uint32_t address, void *data, uint32_t size);
+spi_flash_result_t spi_flash_program(uint32_t address, const void *data,
+                                     uint32_t size);
+spi_flash_result_t spi_flash_erase(uint32_t address, uint32_t size);
+void spi_flash_deinit(void);
+
+/* Bus: one transaction between select(true) and select(false). A NULL tx
+ * sends 0xFF, a NULL rx drops what comes back. */
+void spi_bus_init(void);
+void spi_bus_deinit(void);
+void spi_bus_select(bool select);
+void spi_bus_transfer(const uint8_t *tx, uint8_t *rx, uint32_t size);
@@ -20,9 +20,23 @@
 #define YMODEM_PACKET_TRAILER_SIZE 2
 #define YMODEM_CRC_SIZE 2
 
-#define YMODEM_MAX_ERRORS 10
-#define YMODEM_TIMEOUT_MS 1000
-#define YMODEM_LONG_TIMEOUT_MS 10000
+/* Receiver timing, every one can be overridden with -D. None of them is a
+ * sleep, each only bounds how long the receiver waits for the sender. */
+#ifndef YMODEM_MAX_ERRORS
+#define YMODEM_MAX_ERRORS 10 /* consecutive bad packets before CAN */
+#endif
+#ifndef YMODEM_TIMEOUT_MS
+#define YMODEM_TIMEOUT_MS 1000 /* silence within and between packets */
+#endif
+#ifndef YMODEM_POLL_INTERVAL_MS
+#define YMODEM_POLL_INTERVAL_MS 1000 /* 'C' while waiting for a header */
+#endif
+#ifndef YMODEM_HEADER_TIMEOUT_MS
+#define YMODEM_HEADER_TIMEOUT_MS 10000 /* give up waiting for a sender */
+#endif
+#ifndef YMODEM_PURGE_MS
+#define YMODEM_PURGE_MS 10 /* quiet line that ends a garbled packet */
+#endif
 
 /* Y-modem packet structure */
 typedef struct {
@@ -50,9 +64,39 @@ typedef struct {
   uint32_t received_size;
   uint32_t packet_count;
   ymodem_state_t state;
-  uint8_t error_count;
+  uint8_t error_count; /* in a row, reset by every good packet */
+  uint32_t crc_errors; /* whole transfer, for boot_stats.h */
+  uint32_t timeouts;
+  uint32_t naks;
 } ymodem_file_info_t;
 
+/* What ymodem_receiver_feed() and ymodem_receiver_timeout() report */
+typedef enum {
+  YMODEM_EVENT_NONE = 0, /* nothing for the caller yet */
+  YMODEM_EVENT_COMMAND,  /* stray byte while waiting for the header */
+  YMODEM_EVENT_HEADER,   /* file info parsed, answer with receiver_done() */
+  YMODEM_EVENT_DATA,     /* payload ready, answer with receiver_done() */
+  YMODEM_EVENT_COMPLETE, /* last EOT acknowledged */
+  YMODEM_EVENT_FAILED    /* timeout, cancel or too many errors */
+} ymodem_event_t;
+
+/* Incremental receiver, fed one byte at a time by the caller's event loop */
+typedef struct {
+  ymodem_file_info_t *file_info;
+  uint32_t deadline;     /* HAL_GetTick() when receiver_timeout() is due */
+  uint32_t header_start; /* start of the wait for a header */
+  uint16_t count;        /* bytes of the current packet so far */
+  uint16_t size;         /* data bytes the current packet carries */
+  uint8_t expected_packet_num; /* wraps after 255, as the sender's does */
+  uint8_t eot_count;
+  bool purging;        /* dropping a garbled packet until the line is quiet */
+  bool pending;        /* header or data with the caller, nothing is due */
+  bool header_taken;   /* header acknowledged, packets carry file data */
+  uint8_t command;     /* byte of a YMODEM_EVENT_COMMAND */
+  const uint8_t *data; /* payload of a YMODEM_EVENT_DATA */
+  uint16_t data_size;
+} ymodem_receiver_t;
+
 /* Y-modem result codes */
 typedef enum {
   YMODEM_OK = 0,
@@ -65,20 +109,15 @@ typedef enum {
   YMODEM_FLASH_ERROR
 } ymodem_result_t;
 
-/* Callback function type for packet processing */
-typedef bool (*ymodem_packet_callback_t)(const uint8_t *data,
-                                         uint16_t data_size,
-                                         uint32_t packet_num, void *user_data);
-
 /* Function prototypes */
-ymodem_result_t ymodem_receive_init(void);
-ymodem_result_t ymodem_receive_packet(ymodem_packet_t *packet);
-bool ymodem_wait_receive_header(ymodem_file_info_t *file_info, int times);
-
-ymodem_result_t
-ymodem_receive_file_with_callback(ymodem_file_info_t *file_info,
-                                  ymodem_packet_callback_t callback,
-                                  void *user_data);
+void ymodem_receiver_start(ymodem_receiver_t *rx,
+                           ymodem_file_info_t *file_info);
+ymodem_event_t ymodem_receiver_feed(ymodem_receiver_t *rx, uint8_t byte);
+ymodem_event_t ymodem_receiver_timeout(ymodem_receiver_t *rx);
+bool ymodem_receiver_deadline(const ymodem_receiver_t *rx,
+                              uint32_t *deadline);
+void ymodem_receiver_done(ymodem_receiver_t *rx, bool ok);
+void ymodem_receiver_poll(ymodem_receiver_t *rx);
 ymodem_result_t ymodem_send_response(uint8_t response);
 ymodem_result_t ymodem_parse_header_packet(const ymodem_packet_t *packet,
                                            ymodem_file_info_t *file_info);
@@ -0,0 +1,305 @@
+#include "boot_broadcast.h"
+#include "boot_stats.h"
+#include "bootloader.h"
+#include "common.h"
+#include <string.h>
+
+#if BOOTLOADER_BROADCAST
+
+#define BOOT_BROADCAST_PAGE                                                    \
+  (BOOT_BROADCAST_SYMBOL_SIZE * BOOT_BROADCAST_GENERATION)
+
+_Static_assert(APPLICATION_MAX_SIZE <=
+                   BOOT_BROADCAST_MAX_SYMBOLS * BOOT_BROADCAST_SYMBOL_SIZE,
+               "the application has more symbols than a session tracks");
+_Static_assert(BOOT_BROADCAST_PAGE == FLASH_PAGE_SIZE,
+               "a generation is one flash page");
+_Static_assert(BOOT_BROADCAST_GENERATION == 16, "one mask bit per symbol");
+
+static uint32_t boot_broadcast_get(const uint8_t *p, int size) {
+  uint32_t value = 0;
+
+  while (size-- > 0) {
+    value = value << 8 | *p++;
+  }
+  return value;
+}
+
+static void boot_broadcast_xor(uint8_t *dst, const uint8_t *src) {
+  for (uint32_t i = 0; i < BOOT_BROADCAST_SYMBOL_SIZE; i++) {
+    dst[i] ^= src[i];
+  }
+}
+
+static const uint8_t *boot_broadcast_flash(uint32_t symbol) {
+  return (const uint8_t *)(APPLICATION_START_ADDR +
+                           symbol * BOOT_BROADCAST_SYMBOL_SIZE);
+}
+
+/**
+ * @brief Symbols of a generation that are in flash, bit i for symbol i
+ */
+static uint16_t boot_broadcast_known(const boot_broadcast_session_t *session,
+                                     uint32_t generation) {
+  return (uint16_t)(session->have[generation * 2] |
+                    session->have[generation * 2 + 1] << 8);
+}
+
+/**
+ * @brief Program the rows that are down to a single symbol
+ * @note  A programmed symbol is XORed out of the other rows, which may
+ *        leave another one with a single symbol
+ */
+static void boot_broadcast_settle(boot_broadcast_session_t *session) {
+  uint32_t first = (uint32_t)session->generation * BOOT_BROADCAST_GENERATION;
+
+  for (;;) {
+    uint32_t i = 0;
+    uint16_t bit;
+
+    while (i < BOOT_BROADCAST_GENERATION &&
+           ((session->pivots & (1u << i)) == 0 ||
+            session->masks[i] != (1u << i))) {
+      i++;
+    }
+    if (i == BOOT_BROADCAST_GENERATION) {
+      return;
+    }
+    bit = (uint16_t)(1u << i);
+    if (bootloader_program_flash(
+            APPLICATION_START_ADDR + (first + i) * BOOT_BROADCAST_SYMBOL_SIZE,
+            session->rows[i], BOOT_BROADCAST_SYMBOL_SIZE) != BOOTLOADER_OK) {
+      boot_stats_add(BOOT_STAT_FLASH_ERRORS, 1);
+      session->result = BOOTLOADER_FLASH_ERROR;
+      return;
+    }
+    session->have[(first + i) / 8] |= (uint8_t)(1u << ((first + i) % 8));
+    session->missing--;
+    session->pivots &= (uint16_t)~bit;
+
+    /* Rows below i may hold it, rows above cannot */
+    for (uint32_t j = 0; j < i; j++) {
+      if ((session->pivots & (1u << j)) != 0 &&
+          (session->masks[j] & bit) != 0) {
+        boot_broadcast_xor(session->rows[j], session->rows[i]);
+        session->masks[j] &= (uint16_t)~bit;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Add one equation to its generation
+ * @param mask: Symbols of the generation XORed into data
+ * @param data: BOOT_BROADCAST_SYMBOL_SIZE bytes, reduced in place
+ */
+static void boot_broadcast_decode(boot_broadcast_session_t *session,
+                                  uint8_t generation, uint16_t mask,
+                                  uint8_t *data) {
+  uint32_t first = (uint32_t)generation * BOOT_BROADCAST_GENERATION;
+  uint16_t known = boot_broadcast_known(session, generation);
+  uint32_t pivot = 0;
+
+  if (generation != session->generation) {
+    /* The stream moved on, what is left of the last one is dropped */
+    session->generation = generation;
+    session->pivots = 0;
+  }
+
+  /* Symbols in flash drop out of the equation */
+  for (uint32_t i = 0; i < BOOT_BROADCAST_GENERATION; i++) {
+    if ((mask & known & (1u << i)) != 0) {
+      boot_broadcast_xor(data, boot_broadcast_flash(first + i));
+    }
+  }
+  mask &= (uint16_t)~known;
+
+  /* Eliminate against the rows, lowest pivot first */
+  while (mask != 0) {
+    pivot = (uint32_t)__builtin_ctz(mask);
+    if ((session->pivots & (1u << pivot)) == 0) {
+      break;
+    }
+    boot_broadcast_xor(data, session->rows[pivot]);
+    mask ^= session->masks[pivot];
+  }
+  if (mask == 0) {
+    return; /* nothing new */
+  }
+  memcpy(session->rows[pivot], data, BOOT_BROADCAST_SYMBOL_SIZE);
+  session->masks[pivot] = mask;
+  session->pivots |= (uint16_t)(1u << pivot);
+
+  /* A row for every missing symbol: substitute back, highest first */
+  if (session->pivots == (uint16_t)~known) {
+    for (int i = BOOT_BROADCAST_GENERATION - 1; i >= 0; i--) {
+      if ((session->pivots & (1u << i)) == 0) {
+        continue;
+      }
+      for (int j = i + 1; j < BOOT_BROADCAST_GENERATION; j++) {
+        if ((session->masks[i] & (1u << j)) != 0) {
+          boot_broadcast_xor(session->rows[i], session->rows[j]);
+          session->masks[i] ^= session->masks[j];
+        }
+      }
+    }
+  }
+  boot_broadcast_settle(session);
+}
+
+/**
+ * @brief Check the image against the CRC32 of the ANNOUNCE
+ * @return Bootloader result code
+ */
+static bootloader_result_t
+boot_broadcast_check(const boot_broadcast_session_t *session) {
+  if (session->result != BOOTLOADER_OK) {
+    return (bootloader_result_t)session->result;
+  }
+  if (bootloader_crc32_update(0xFFFFFFFF, (uint8_t *)APPLICATION_START_ADDR,
+                              session->size) != session->crc32) {
+    return BOOTLOADER_VERIFY_ERROR;
+  }
+  return BOOTLOADER_OK;
+}
+
+/**
+ * @brief A packet that passed its CRC16
+ * @return What the caller has to do next
+ */
+static boot_broadcast_status_t
+boot_broadcast_packet(boot_broadcast_session_t *session) {
+  uint8_t *p = session->packet;
+  uint8_t type = p[2];
+  uint8_t generation = p[4];
+
+  session->deadline = HAL_GetTick() + BOOT_BROADCAST_TIMEOUT_MS;
+  if (type == BOOT_BROADCAST_ANNOUNCE) {
+    return !session->started || p[3] != session->session
+               ? BOOT_BROADCAST_START
+               : BOOT_BROADCAST_CONTINUE;
+  }
+  if (!session->started || p[3] != session->session ||
+      generation >= session->generations || session->missing == 0 ||
+      session->result != BOOTLOADER_OK) {
+    return BOOT_BROADCAST_CONTINUE;
+  }
+
+  boot_broadcast_decode(session, generation,
+                        (uint16_t)boot_broadcast_get(p + 5, 2),
+                        p + BOOT_BROADCAST_HEADER_SIZE);
+  if (session->result != BOOTLOADER_OK) {
+    return BOOT_BROADCAST_FAILED;
+  }
+  if (session->missing != 0) {
+    return BOOT_BROADCAST_CONTINUE;
+  }
+  return boot_broadcast_check(session) == BOOTLOADER_OK
+             ? BOOT_BROADCAST_COMPLETE
+             : BOOT_BROADCAST_FAILED;
+}
+
+/**
+ * @brief Listen to the stream, the first sync byte was just received
+ */
+void boot_broadcast_listen(boot_broadcast_session_t *session) {
+  memset(session, 0, sizeof(*session));
+  session->generation = BOOT_BROADCAST_NONE;
+  session->packet[0] = BOOT_BROADCAST_SYNC;
+  session->fill = 1;
+  session->deadline = HAL_GetTick() + BOOT_BROADCAST_TIMEOUT_MS;
+}
+
+/**
+ * @brief Feed one received byte
+ * @note  Bytes outside a packet are skipped until the next sync
+ * @return What the caller has to do next
+ */
+boot_broadcast_status_t boot_broadcast_feed(boot_broadcast_session_t *session,
+                                            uint8_t byte) {
+  uint8_t *p = session->packet;
+
+  switch (session->fill) {
+  case 0:
+    if (byte == BOOT_BROADCAST_SYNC) {
+      p[session->fill++] = byte;
+    }
+    return BOOT_BROADCAST_CONTINUE;
+  case 1:
+    session->fill = byte == BOOT_BROADCAST_SYNC2  ? 2
+                    : byte == BOOT_BROADCAST_SYNC ? 1
+                                                  : 0;
+    return BOOT_BROADCAST_CONTINUE;
+  case 2:
+    if (byte == BOOT_BROADCAST_ANNOUNCE) {
+      session->need =
+          BOOT_BROADCAST_HEADER_SIZE + BOOT_BROADCAST_ANNOUNCE_SIZE + 2;
+    } else if (byte == BOOT_BROADCAST_DATA) {
+      session->need = BOOT_BROADCAST_PACKET_MAX;
+    } else {
+      session->fill = 0;
+      return BOOT_BROADCAST_CONTINUE;
+    }
+    break;
+  default:
+    break;
+  }
+
+  p[session->fill++] = byte;
+  if (session->fill < session->need) {
+    return BOOT_BROADCAST_CONTINUE;
+  }
+  session->fill = 0;
+  if (crc16_update(0, p + 2, (uint16_t)(session->need - 4)) !=
+      boot_broadcast_get(p + session->need - 2, 2)) {
+    session->bad++;
+    return BOOT_BROADCAST_CONTINUE;
+  }
+  return boot_broadcast_packet(session);
+}
+
+/**
+ * @brief Start the session of the ANNOUNCE just received
+ * @note  Erases the metadata page and the pages the image needs, like the
+ *        first writes of a Y-modem transfer. Symbols past the end of the
+ *        image count as received, they stay erased.
+ * @return false if the image does not fit or the erase failed
+ */
+bool boot_broadcast_start(boot_broadcast_session_t *session) {
+  const uint8_t *p = session->packet;
+  uint32_t last;
+
+  session->session = p[3];
+  session->size = boot_broadcast_get(p + BOOT_BROADCAST_HEADER_SIZE, 4);
+  session->crc32 = boot_broadcast_get(p + BOOT_BROADCAST_HEADER_SIZE + 4, 4);
+  session->generation = BOOT_BROADCAST_NONE;
+  session->pivots = 0;
+  session->result = BOOTLOADER_OK;
+  session->started = false;
+  memset(session->have, 0, sizeof(session->have));
+  if (session->size == 0 || session->size > APPLICATION_MAX_SIZE) {
+    return false;
+  }
+  session->symbols = (uint16_t)((session->size + BOOT_BROADCAST_SYMBOL_SIZE -
+                                 1) /
+                                BOOT_BROADCAST_SYMBOL_SIZE);
+  session->missing = session->symbols;
+  session->generations = (uint8_t)((session->size + BOOT_BROADCAST_PAGE - 1) /
+                                   BOOT_BROADCAST_PAGE);
+  last = (uint32_t)session->generations * BOOT_BROADCAST_GENERATION;
+  for (uint32_t i = session->symbols; i < last; i++) {
+    session->have[i / 8] |= (uint8_t)(1u << (i % 8));
+  }
+
+  for (uint32_t page = APPLICATION_META_PAGE_ADDR;
+       page < APPLICATION_START_ADDR + session->size; page += FLASH_PAGE_SIZE) {
+    if (bootloader_erase_page(page) != BOOTLOADER_OK) {
+      return false;
+    }
+  }
+  session->started = true;
+  session->deadline = HAL_GetTick() + BOOT_BROADCAST_TIMEOUT_MS;
+  return true;
+}
+
+#endif
@@ -0,0 +1,300 @@
+#include "boot_can.h"
+#include "boot_stats.h"
+#include "bootloader.h"
+#include <string.h>
+
+#if BOOTLOADER_CAN
+
+_Static_assert(APPLICATION_MAX_SIZE <=
+                   BOOT_CAN_MAX_BLOCKS * BOOT_CAN_BLOCK_SIZE,
+               "the application has more blocks than a session tracks");
+_Static_assert(BOOT_CAN_BLOCK_FRAMES == 32, "one frame bit per block bit");
+
+static uint16_t s_node;
+static bool s_report;       /* COMPLETE was returned, STATUS still owed */
+static uint8_t s_report_session;
+
+static uint32_t boot_can_get(const uint8_t *p, int size) {
+  uint32_t value = 0;
+
+  while (size-- > 0) {
+    value = value << 8 | *p++;
+  }
+  return value;
+}
+
+static uint8_t *boot_can_put(uint8_t *p, uint32_t value, int size) {
+  while (size-- > 0) {
+    *p++ = (uint8_t)(value >> (size * 8));
+  }
+  return p;
+}
+
+static bool boot_can_for_me(uint16_t target) {
+  return target == s_node || target == BOOT_CAN_ALL;
+}
+
+/**
+ * @brief Answer the host with a STATUS frame
+ * @param missing: Blocks the session still needs
+ */
+static void boot_can_status(uint8_t session, boot_can_state_t state,
+                            uint8_t result, uint16_t missing) {
+  const firmware_info_t *info = (const firmware_info_t *)APPLICATION_META_ADDR;
+  can_frame_t frame = {
+      .id = BOOT_CAN_ID(BOOT_CAN_STATUS, s_node, session), .size = 8};
+  uint8_t *p = frame.data;
+
+  *p++ = (uint8_t)state;
+  *p++ = result;
+  p = boot_can_put(p, missing, 2);
+  boot_can_put(p, info->magic == APPLICATION_META_MAGIC ? info->version : 0,
+               4);
+  can_bus_send(&frame);
+}
+
+static bool boot_can_has(const boot_can_session_t *session, uint32_t block) {
+  return (session->have[block / 8] & (1u << (block % 8))) != 0;
+}
+
+/**
+ * @brief Tell the host which blocks are missing, a frame per span with any
+ */
+static void boot_can_list_missing(const boot_can_session_t *session) {
+  for (uint32_t first = 0; first < session->blocks;
+       first += BOOT_CAN_MISSING_SPAN) {
+    can_frame_t frame = {.id = BOOT_CAN_ID(BOOT_CAN_MISSING, s_node,
+                                           session->session),
+                         .size = 8};
+    bool any = false;
+
+    memset(frame.data, 0, sizeof(frame.data));
+    boot_can_put(frame.data, first, 2);
+    for (uint32_t i = 0;
+         i < BOOT_CAN_MISSING_SPAN && first + i < session->blocks; i++) {
+      if (!boot_can_has(session, first + i)) {
+        frame.data[2 + i / 8] |= (uint8_t)(1u << (i % 8));
+        any = true;
+      }
+    }
+    if (any) {
+      can_bus_send(&frame);
+    }
+  }
+}
+
+/**
+ * @brief Collect a DATA frame, program its block once complete
+ * @note  Blocks arrive in order, so a frame of another block means the
+ *        collected one lost a frame. It is dropped and sent again later.
+ * @param index: Frame number in the image
+ */
+static void boot_can_data(boot_can_session_t *session, uint32_t index,
+                          const can_frame_t *frame) {
+  uint32_t block = index / BOOT_CAN_BLOCK_FRAMES;
+  uint32_t offset = block * BOOT_CAN_BLOCK_SIZE;
+  uint32_t length;
+  uint32_t frames;
+  uint32_t all;
+
+  if (block >= session->blocks || boot_can_has(session, block) ||
+      session->result != BOOTLOADER_OK) {
+    return;
+  }
+  if (block != session->block) {
+    session->block = (uint16_t)block;
+    session->frames = 0;
+    memset(session->data, 0xFF, sizeof(session->data));
+  }
+  memcpy(&session->data[(index % BOOT_CAN_BLOCK_FRAMES) * BOOT_CAN_FRAME_SIZE],
+         frame->data, frame->size);
+  session->frames |= 1u << (index % BOOT_CAN_BLOCK_FRAMES);
+
+  length = session->size - offset < BOOT_CAN_BLOCK_SIZE ? session->size - offset
+                                                        : BOOT_CAN_BLOCK_SIZE;
+  frames = (length + BOOT_CAN_FRAME_SIZE - 1) / BOOT_CAN_FRAME_SIZE;
+  all = frames == 32 ? 0xFFFFFFFF : (1u << frames) - 1;
+  if ((session->frames & all) != all) {
+    return;
+  }
+
+  session->block = BOOT_CAN_MAX_BLOCKS;
+  if (bootloader_program_flash(APPLICATION_START_ADDR + offset, session->data,
+                               length) != BOOTLOADER_OK) {
+    boot_stats_add(BOOT_STAT_FLASH_ERRORS, 1);
+    session->result = BOOTLOADER_FLASH_ERROR;
+    return;
+  }
+  session->have[block / 8] |= (uint8_t)(1u << (block % 8));
+  session->missing--;
+}
+
+/**
+ * @brief Check a finished session against the CRC32 of the ANNOUNCE
+ * @return Bootloader result code
+ */
+static bootloader_result_t boot_can_check(boot_can_session_t *session) {
+  if (session->result != BOOTLOADER_OK) {
+    return (bootloader_result_t)session->result;
+  }
+  if (bootloader_crc32_update(0xFFFFFFFF, (uint8_t *)APPLICATION_START_ADDR,
+                              session->size) != session->crc32) {
+    return BOOTLOADER_VERIFY_ERROR;
+  }
+  return BOOTLOADER_OK;
+}
+
+/**
+ * @brief Bring up CAN1 and learn the node address
+ */
+void boot_can_init(void) {
+  s_node = can_bus_node_id();
+  can_bus_init();
+  BOOTLOADER_LOG("CAN node 0x%04X", s_node);
+}
+
+/**
+ * @brief Frame received outside a session
+ * @return BOOT_CAN_START for an ANNOUNCE that addresses this node
+ */
+boot_can_status_t boot_can_idle(const can_frame_t *frame) {
+  if (!boot_can_for_me(BOOT_CAN_A(frame->id))) {
+    return BOOT_CAN_CONTINUE;
+  }
+  switch (BOOT_CAN_TYPE(frame->id)) {
+  case BOOT_CAN_PING:
+    boot_can_status(0, BOOT_CAN_STATE_IDLE, BOOTLOADER_OK, 0);
+    return BOOT_CAN_CONTINUE;
+  case BOOT_CAN_ANNOUNCE:
+    return BOOT_CAN_START;
+  default:
+    return BOOT_CAN_CONTINUE;
+  }
+}
+
+/**
+ * @brief Start a session from its ANNOUNCE
+ * @note  Erases the metadata page and the pages the image needs, like the
+ *        first writes of a Y-modem transfer, then answers STATUS
+ * @return false if the image does not fit or the erase failed, the host
+ *         has been told
+ */
+bool boot_can_start(boot_can_session_t *session, const can_frame_t *frame) {
+  memset(session, 0, sizeof(*session));
+  session->session = BOOT_CAN_B(frame->id);
+  session->block = BOOT_CAN_MAX_BLOCKS;
+  s_report = false;
+
+  if (frame->size < 8) {
+    return false;
+  }
+  session->size = boot_can_get(frame->data, 4);
+  session->crc32 = boot_can_get(frame->data + 4, 4);
+  if (session->size == 0 || session->size > APPLICATION_MAX_SIZE) {
+    boot_can_status(session->session, BOOT_CAN_STATE_FAILED,
+                    BOOTLOADER_INVALID_APPLICATION, 0);
+    return false;
+  }
+  session->blocks = (uint16_t)((session->size + BOOT_CAN_BLOCK_SIZE - 1) /
+                               BOOT_CAN_BLOCK_SIZE);
+  session->missing = session->blocks;
+
+  for (uint32_t page = APPLICATION_META_PAGE_ADDR;
+       page < APPLICATION_START_ADDR + session->size; page += FLASH_PAGE_SIZE) {
+    if (bootloader_erase_page(page) != BOOTLOADER_OK) {
+      boot_can_status(session->session, BOOT_CAN_STATE_FAILED,
+                      BOOTLOADER_FLASH_ERROR, session->missing);
+      return false;
+    }
+  }
+
+  session->deadline = HAL_GetTick() + BOOT_CAN_TIMEOUT_MS;
+  boot_can_status(session->session, BOOT_CAN_STATE_RECEIVING, BOOTLOADER_OK,
+                  session->missing);
+  return true;
+}
+
+/**
+ * @brief Frame received in a session
+ * @note  Frames of other sessions are ignored, the deadline moves with
+ *        every frame of this one
+ * @return What the caller has to do next
+ */
+boot_can_status_t boot_can_feed(boot_can_session_t *session,
+                                const can_frame_t *frame) {
+  uint8_t type = BOOT_CAN_TYPE(frame->id);
+  uint16_t a = BOOT_CAN_A(frame->id);
+  bootloader_result_t result;
+
+  if (type == BOOT_CAN_PING && boot_can_for_me(a)) {
+    boot_can_status(session->session, BOOT_CAN_STATE_RECEIVING,
+                    session->result, session->missing);
+    return BOOT_CAN_CONTINUE;
+  }
+  if (BOOT_CAN_B(frame->id) != session->session) {
+    /* A new session replaces this one */
+    return type == BOOT_CAN_ANNOUNCE && boot_can_for_me(a) ? BOOT_CAN_START
+                                                            : BOOT_CAN_CONTINUE;
+  }
+  if (type != BOOT_CAN_DATA && !boot_can_for_me(a)) {
+    return BOOT_CAN_CONTINUE;
+  }
+  session->deadline = HAL_GetTick() + BOOT_CAN_TIMEOUT_MS;
+
+  switch (type) {
+  case BOOT_CAN_DATA:
+    boot_can_data(session, a, frame);
+    break;
+  case BOOT_CAN_ANNOUNCE:
+    /* Our STATUS got lost, the host asks again */
+    boot_can_status(session->session, BOOT_CAN_STATE_RECEIVING,
+                    session->result, session->missing);
+    break;
+  case BOOT_CAN_QUERY:
+    boot_can_list_missing(session);
+    boot_can_status(session->session, BOOT_CAN_STATE_RECEIVING,
+                    session->result, session->missing);
+    break;
+  case BOOT_CAN_COMMIT:
+    if (session->missing != 0 && session->result == BOOTLOADER_OK) {
+      boot_can_status(session->session, BOOT_CAN_STATE_RECEIVING,
+                      session->result, session->missing);
+      break;
+    }
+    result = boot_can_check(session);
+    if (result != BOOTLOADER_OK) {
+      boot_can_status(session->session, BOOT_CAN_STATE_FAILED, result,
+                      session->missing);
+      return BOOT_CAN_FAILED;
+    }
+    s_report = true;
+    s_report_session = session->session;
+    return BOOT_CAN_COMPLETE;
+  default:
+    break;
+  }
+  return BOOT_CAN_CONTINUE;
+}
+
+/**
+ * @brief Tell the host how the verification of a completed session ended
+ * @note  Does nothing unless boot_can_feed() returned BOOT_CAN_COMPLETE
+ * @param result: Bootloader result code
+ */
+void boot_can_report(uint8_t result) {
+  if (!s_report) {
+    return;
+  }
+  s_report = false;
+  boot_can_status(s_report_session,
+                  result == BOOTLOADER_OK ? BOOT_CAN_STATE_VERIFIED
+                                          : BOOT_CAN_STATE_FAILED,
+                  result, 0);
+}
+
+/**
+ * @brief Release CAN1 before the jump, queued answers go out first
+ */
+void boot_can_deinit(void) { can_bus_deinit(); }
+
+#endif
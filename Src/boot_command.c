@@ -0,0 +1,403 @@
+#include "boot_command.h"
+#include "boot_stats.h"
+#include "bootloader.h"
+#include <string.h>
+
+/* What the next byte of a session is */
+enum {
+  BOOT_COMMAND_PHASE_OPCODE = 0,
+  BOOT_COMMAND_PHASE_COMPLEMENT,
+  BOOT_COMMAND_PHASE_ADDRESS,  /* address and checksum */
+  BOOT_COMMAND_PHASE_ARGUMENT, /* length or page count and checksum */
+  BOOT_COMMAND_PHASE_DATA      /* N-1, N bytes and checksum */
+};
+
+/* Opcodes this build accepts, also reported by GET_INFO. Writes and RAM
+ * images would get around the signature check and the encryption, reads
+ * would give the decrypted image away. */
+static const uint8_t boot_command_ops[] = {
+    BOOT_COMMAND_GET_INFO,
+#if !BOOTLOADER_ENCRYPTION
+    BOOT_COMMAND_READ,
+    BOOT_COMMAND_CRC,
+#endif
+    BOOT_COMMAND_GO,
+#if !BOOTLOADER_SECURE_BOOT && !BOOTLOADER_ENCRYPTION
+    BOOT_COMMAND_WRITE,
+    BOOT_COMMAND_ERASE,
+    BOOT_COMMAND_RUN,
+#endif
+};
+
+/* RAM images need the same build as writes, they run unchecked code */
+#define BOOT_COMMAND_HAS_RAM (!BOOTLOADER_SECURE_BOOT && !BOOTLOADER_ENCRYPTION)
+
+/* Bytes per HAL_UART_Transmit(), BOOTLOADER_UART_TIMEOUT covers the whole
+ * call even at 9600 baud */
+#define BOOT_COMMAND_TX_CHUNK 256
+
+static void boot_command_send(const uint8_t *data, uint32_t size) {
+  while (size > 0) {
+    uint16_t chunk =
+        size < BOOT_COMMAND_TX_CHUNK ? (uint16_t)size : BOOT_COMMAND_TX_CHUNK;
+
+    HAL_UART_Transmit(&huart1, (uint8_t *)data, chunk,
+                      BOOTLOADER_UART_TIMEOUT);
+    data += chunk;
+    size -= chunk;
+  }
+}
+
+static void boot_command_reply(uint8_t byte) { boot_command_send(&byte, 1); }
+
+static uint32_t boot_command_get(const uint8_t *p, int size) {
+  uint32_t value = 0;
+
+  while (size-- > 0) {
+    value = value << 8 | *p++;
+  }
+  return value;
+}
+
+static uint8_t *boot_command_put(uint8_t *p, uint32_t value, int size) {
+  while (size-- > 0) {
+    *p++ = (uint8_t)(value >> (size * 8));
+  }
+  return p;
+}
+
+static uint8_t boot_command_xor(const uint8_t *data, uint32_t size) {
+  uint8_t sum = 0;
+
+  while (size-- > 0) {
+    sum ^= *data++;
+  }
+  return sum;
+}
+
+/**
+ * @brief Check that a range lies in the update region
+ * @note  The metadata page and the application, never the bootloader
+ * @return true if the session may touch the range
+ */
+static bool boot_command_in_region(uint32_t address, uint32_t size) {
+  return address >= APPLICATION_META_PAGE_ADDR && address <= FLASH_END_ADDR &&
+         size <= FLASH_END_ADDR + 1 - address;
+}
+
+/**
+ * @brief Check that a range lies in the RAM image area
+ * @return false in builds without RAM images
+ */
+static bool boot_command_in_ram(uint32_t address, uint32_t size) {
+#if BOOT_COMMAND_HAS_RAM
+  return address >= BOOT_COMMAND_RAM_ADDR &&
+         address < BOOT_COMMAND_RAM_ADDR + BOOT_COMMAND_RAM_SIZE &&
+         size <= BOOT_COMMAND_RAM_ADDR + BOOT_COMMAND_RAM_SIZE - address;
+#else
+  (void)address;
+  (void)size;
+  return false;
+#endif
+}
+
+static bool boot_command_in_range(uint32_t address, uint32_t size) {
+  return boot_command_in_region(address, size) ||
+         boot_command_in_ram(address, size);
+}
+
+/**
+ * @brief Check a RAM image before RUN starts it
+ * @note  Its vector table is at BOOT_COMMAND_RAM_ADDR: the stack pointer in
+ *        SRAM, a Thumb reset handler inside the image
+ * @return true if it is complete and may be started
+ */
+static bool boot_command_check_ram(uint32_t size, uint32_t crc32) {
+  const uint32_t *vectors = (const uint32_t *)BOOT_COMMAND_RAM_ADDR;
+  uint32_t reset = vectors[1] & ~1U;
+
+  return size >= 8 && boot_command_in_ram(BOOT_COMMAND_RAM_ADDR, size) &&
+         (vectors[0] & 0xFFF00000) == 0x20000000 && (vectors[1] & 1) != 0 &&
+         reset >= BOOT_COMMAND_RAM_ADDR &&
+         reset < BOOT_COMMAND_RAM_ADDR + size &&
+         bootloader_crc32_update(0xFFFFFFFF,
+                                 (const uint8_t *)BOOT_COMMAND_RAM_ADDR,
+                                 size) == crc32;
+}
+
+static bool boot_command_is_supported(uint8_t op) {
+  return memchr(boot_command_ops, op, sizeof(boot_command_ops)) != NULL;
+}
+
+/**
+ * @brief Expect a block of size bytes plus its checksum next
+ */
+static void boot_command_expect(boot_command_session_t *session,
+                                uint8_t phase, uint16_t size) {
+  session->phase = phase;
+  session->fill = 0;
+  session->need = size + 1;
+}
+
+/**
+ * @brief Answer GET_INFO, the layout is described in boot_command.h
+ */
+static void boot_command_send_info(boot_command_session_t *session) {
+  const firmware_info_t *meta = (const firmware_info_t *)APPLICATION_META_ADDR;
+  uint8_t *start = &session->block[1];
+  uint8_t *p = start;
+
+  *p++ = BOOT_COMMAND_PROTOCOL;
+  *p++ = sizeof(boot_command_ops);
+  memcpy(p, boot_command_ops, sizeof(boot_command_ops));
+  p += sizeof(boot_command_ops);
+  p = boot_command_put(p, FLASH_END_ADDR + 1 - BOOTLOADER_START_ADDR, 4);
+  p = boot_command_put(p, FLASH_PAGE_SIZE, 2);
+  p = boot_command_put(p, APPLICATION_START_ADDR, 4);
+  p = boot_command_put(p, APPLICATION_MAX_SIZE, 4);
+  *p++ = (uint8_t)g_bootloader_context.entry_reason;
+  p = boot_command_put(p, meta->magic, 4);
+  p = boot_command_put(p, meta->version, 4);
+  p = boot_command_put(p, meta->size, 4);
+  p = boot_command_put(p, meta->crc32, 4);
+  *p++ = meta->verified == APPLICATION_VERIFIED_MAGIC;
+  memcpy(p, BOOTLOADER_VERSION, sizeof(BOOTLOADER_VERSION) - 1);
+  p += sizeof(BOOTLOADER_VERSION) - 1;
+
+  session->block[0] = (uint8_t)(p - start - 1);
+  *p++ = BOOT_COMMAND_ACK;
+  boot_command_send(session->block, (uint32_t)(p - session->block));
+}
+
+/**
+ * @brief Erase the metadata page before the application is first changed
+ * @note  As in an update the image is not bootable until new metadata is
+ *        written, and a stale verified mark cannot vouch for it
+ * @return false if the page could not be erased
+ */
+static bool boot_command_touch(boot_command_session_t *session,
+                               uint32_t address, uint32_t size) {
+  if (session->metadata_erased || address + size <= APPLICATION_START_ADDR) {
+    return true;
+  }
+  session->metadata_erased = true;
+  return bootloader_erase_page(APPLICATION_META_PAGE_ADDR) == BOOTLOADER_OK;
+}
+
+/**
+ * @brief Check the address of a command
+ * @return true if it may be used, the host gets ACK
+ */
+static bool boot_command_accept_address(const boot_command_session_t *session) {
+  uint32_t address = session->address;
+
+  switch (session->op) {
+  case BOOT_COMMAND_GO:
+    return address == APPLICATION_START_ADDR &&
+           bootloader_is_application_valid();
+  case BOOT_COMMAND_ERASE:
+    return (address & (FLASH_PAGE_SIZE - 1)) == 0 &&
+           boot_command_in_region(address, 1);
+  case BOOT_COMMAND_WRITE:
+    return (address & 1) == 0 && boot_command_in_range(address, 1);
+  case BOOT_COMMAND_RUN:
+    return address == BOOT_COMMAND_RAM_ADDR;
+  default:
+    return boot_command_in_range(address, 1);
+  }
+}
+
+/**
+ * @brief Run a command once its last block is in
+ * @return true on success, the host gets ACK or the result
+ */
+static bool boot_command_execute(boot_command_session_t *session) {
+  const uint8_t *arg = session->block;
+  uint32_t address = session->address;
+  uint8_t reply[6];
+  uint32_t size;
+
+  switch (session->op) {
+  case BOOT_COMMAND_READ:
+    size = boot_command_get(arg, 2) + 1;
+    if (!boot_command_in_range(address, size)) {
+      return false;
+    }
+    boot_command_reply(BOOT_COMMAND_ACK);
+    boot_command_send((const uint8_t *)address, size);
+    return true;
+
+  case BOOT_COMMAND_CRC:
+    size = boot_command_get(arg, 4);
+    if (size == 0 || !boot_command_in_range(address, size)) {
+      return false;
+    }
+    reply[0] = BOOT_COMMAND_ACK;
+    boot_command_put(&reply[1],
+                     bootloader_crc32_update(0xFFFFFFFF,
+                                             (const uint8_t *)address, size),
+                     4);
+    reply[5] = boot_command_xor(&reply[1], 4);
+    boot_command_send(reply, sizeof(reply));
+    return true;
+
+  case BOOT_COMMAND_ERASE:
+    size = (boot_command_get(arg, 2) + 1) * FLASH_PAGE_SIZE;
+    if (!boot_command_in_region(address, size) ||
+        !boot_command_touch(session, address, size)) {
+      return false;
+    }
+    for (uint32_t page = address; page < address + size;
+         page += FLASH_PAGE_SIZE) {
+      if (bootloader_erase_page(page) != BOOTLOADER_OK) {
+        return false;
+      }
+    }
+    boot_command_reply(BOOT_COMMAND_ACK);
+    return true;
+
+  case BOOT_COMMAND_WRITE:
+    size = arg[0] + 1U;
+    if (boot_command_in_ram(address, size)) {
+      memcpy((uint8_t *)address, &arg[1], size);
+      boot_command_reply(BOOT_COMMAND_ACK);
+      return true;
+    }
+    if (!boot_command_in_region(address, size) ||
+        !boot_command_touch(session, address, size)) {
+      return false;
+    }
+    if (bootloader_program_flash(address, &arg[1], size) != BOOTLOADER_OK) {
+      boot_stats_add(BOOT_STAT_FLASH_ERRORS, 1);
+      return false;
+    }
+    boot_command_reply(BOOT_COMMAND_ACK);
+    return true;
+
+  case BOOT_COMMAND_RUN:
+    if (!boot_command_check_ram(boot_command_get(arg, 4),
+                                boot_command_get(&arg[4], 4))) {
+      return false;
+    }
+    boot_command_reply(BOOT_COMMAND_ACK);
+    return true;
+
+  default:
+    return false;
+  }
+}
+
+/**
+ * @brief Handle a complete block
+ * @return BOOT_COMMAND_START_APP once GO was acknowledged,
+ *         BOOT_COMMAND_START_RAM once RUN was
+ */
+static boot_command_status_t
+boot_command_block(boot_command_session_t *session) {
+  uint8_t phase = session->phase;
+
+  session->phase = BOOT_COMMAND_PHASE_OPCODE;
+  if (boot_command_xor(session->block, session->need) != 0) {
+    boot_command_reply(BOOT_COMMAND_NACK);
+    return BOOT_COMMAND_CONTINUE;
+  }
+
+  if (phase != BOOT_COMMAND_PHASE_ADDRESS) {
+    if (!boot_command_execute(session)) {
+      boot_command_reply(BOOT_COMMAND_NACK);
+    } else if (session->op == BOOT_COMMAND_RUN) {
+      return BOOT_COMMAND_START_RAM;
+    }
+    return BOOT_COMMAND_CONTINUE;
+  }
+
+  session->address = boot_command_get(session->block, 4);
+  if (!boot_command_accept_address(session)) {
+    boot_command_reply(BOOT_COMMAND_NACK);
+    return BOOT_COMMAND_CONTINUE;
+  }
+  boot_command_reply(BOOT_COMMAND_ACK);
+  switch (session->op) {
+  case BOOT_COMMAND_GO:
+    return BOOT_COMMAND_START_APP;
+  case BOOT_COMMAND_CRC:
+    boot_command_expect(session, BOOT_COMMAND_PHASE_ARGUMENT, 4);
+    break;
+  case BOOT_COMMAND_RUN:
+    boot_command_expect(session, BOOT_COMMAND_PHASE_ARGUMENT, 8);
+    break;
+  case BOOT_COMMAND_WRITE:
+    /* The size follows from the first byte */
+    boot_command_expect(session, BOOT_COMMAND_PHASE_DATA, 1);
+    break;
+  default:
+    boot_command_expect(session, BOOT_COMMAND_PHASE_ARGUMENT, 2);
+    break;
+  }
+  return BOOT_COMMAND_CONTINUE;
+}
+
+/**
+ * @brief Start a session, the host sent BOOT_COMMAND_SYNC
+ * @param session: Session state, in the arena while no transfer runs
+ */
+void boot_command_start(boot_command_session_t *session) {
+  memset(session, 0, sizeof(*session));
+  session->phase = BOOT_COMMAND_PHASE_OPCODE;
+  session->deadline = HAL_GetTick() + BOOT_COMMAND_TIMEOUT_MS;
+  boot_command_reply(BOOT_COMMAND_ACK);
+}
+
+/**
+ * @brief Take the next byte of the session
+ * @note  Flash is erased and programmed right here, the host waits for the
+ *        ACK. The session deadline restarts with every byte.
+ * @param session: Session state
+ * @param byte: Received byte
+ * @return BOOT_COMMAND_START_APP or BOOT_COMMAND_START_RAM once GO or RUN
+ *         was acknowledged
+ */
+boot_command_status_t boot_command_feed(boot_command_session_t *session,
+                                        uint8_t byte) {
+  boot_command_status_t status = BOOT_COMMAND_CONTINUE;
+
+  switch (session->phase) {
+  case BOOT_COMMAND_PHASE_OPCODE:
+    /* A repeated sync only checks that the session is alive */
+    if (byte == BOOT_COMMAND_SYNC) {
+      boot_command_reply(BOOT_COMMAND_ACK);
+    } else {
+      session->op = byte;
+      session->phase = BOOT_COMMAND_PHASE_COMPLEMENT;
+    }
+    break;
+
+  case BOOT_COMMAND_PHASE_COMPLEMENT:
+    session->phase = BOOT_COMMAND_PHASE_OPCODE;
+    if ((uint8_t)(session->op ^ byte) != 0xFF ||
+        !boot_command_is_supported(session->op)) {
+      boot_command_reply(BOOT_COMMAND_NACK);
+      break;
+    }
+    boot_command_reply(BOOT_COMMAND_ACK);
+    if (session->op == BOOT_COMMAND_GET_INFO) {
+      boot_command_send_info(session);
+    } else {
+      boot_command_expect(session, BOOT_COMMAND_PHASE_ADDRESS, 4);
+    }
+    break;
+
+  default:
+    session->block[session->fill++] = byte;
+    if (session->phase == BOOT_COMMAND_PHASE_DATA && session->fill == 1) {
+      session->need = byte + 1U + 2U; /* N-1, N bytes, checksum */
+    }
+    if (session->fill == session->need) {
+      status = boot_command_block(session);
+    }
+    break;
+  }
+
+  session->deadline = HAL_GetTick() + BOOT_COMMAND_TIMEOUT_MS;
+  return status;
+}
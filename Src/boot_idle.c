@@ -0,0 +1,231 @@
+#include "boot_idle.h"
+#include "bootloader.h"
+#include "can_bus.h"
+#include "main.h"
+
+#if BOOTLOADER_IDLE != BOOT_IDLE_RUN
+
+#if BOOTLOADER_IDLE == BOOT_IDLE_STOP
+/* Wake-up lines: USART1 RX after the remap (PB7) and the RTC alarm */
+#define BOOT_IDLE_RX_LINE EXTI_EMR_MR7
+#define BOOT_IDLE_ALARM_LINE EXTI_EMR_MR17
+
+/* RTC counter in ms from the nominal LSI, which is only good to +-50%.
+ * Stopped time is counted in the same ms, so the deadlines stay in step
+ * with HAL_GetTick(), only the 'C' cadence drifts. */
+#define BOOT_IDLE_RTC_PRESCALER (LSI_VALUE / 1000U - 1U)
+
+typedef enum {
+  BOOT_IDLE_RTC_OFF = 0,
+  BOOT_IDLE_RTC_OURS,   /* started by boot_idle_rtc_start() */
+  BOOT_IDLE_RTC_FOREIGN /* running for the application, Sleep mode only */
+} boot_idle_rtc_t;
+
+static boot_idle_rtc_t s_rtc;
+#endif
+
+static bool boot_idle_is_due(uint32_t deadline) {
+  return (int32_t)(HAL_GetTick() - deadline) >= 0;
+}
+
+/**
+ * @brief Sleep mode until a byte is in the data register or the deadline
+ * @note  RXNEIE only makes USART1 pending, which SEVONPEND turns into an
+ *        event for WFE. The IRQ stays disabled in the NVIC, no handler
+ *        runs and the byte is left for HAL_UART_Receive(). A CAN frame in
+ *        FIFO 0 wakes the core the same way (FMPIE0, see can_bus.c).
+ */
+static void boot_idle_sleep(uint32_t deadline) {
+  USART1->CR1 |= USART_CR1_RXNEIE;
+  SCB->SCR |= SCB_SCR_SEVONPEND_Msk;
+  for (;;) {
+    /* Only a new pending edge is an event, clear before the check */
+    NVIC_ClearPendingIRQ(USART1_IRQn);
+#if BOOTLOADER_CAN
+    NVIC_ClearPendingIRQ(USB_LP_CAN1_RX0_IRQn);
+    if (can_bus_pending()) {
+      break;
+    }
+#endif
+    if ((USART1->SR & USART_SR_RXNE) != 0 || boot_idle_is_due(deadline)) {
+      break;
+    }
+    __WFE();
+  }
+  SCB->SCR &= ~SCB_SCR_SEVONPEND_Msk;
+  USART1->CR1 &= ~USART_CR1_RXNEIE;
+  NVIC_ClearPendingIRQ(USART1_IRQn);
+}
+
+#if BOOTLOADER_IDLE == BOOT_IDLE_STOP
+/**
+ * @brief Wait until the RTC registers are read back after an APB1 stop
+ */
+static void boot_idle_rtc_sync(void) {
+  RTC->CRL &= ~RTC_CRL_RSF;
+  while ((RTC->CRL & RTC_CRL_RSF) == 0) {
+  }
+}
+
+/**
+ * @brief Enter the RTC configuration mode
+ */
+static void boot_idle_rtc_unlock(void) {
+  while ((RTC->CRL & RTC_CRL_RTOFF) == 0) {
+  }
+  RTC->CRL |= RTC_CRL_CNF;
+}
+
+/**
+ * @brief Leave the configuration mode and wait for the write to finish
+ */
+static void boot_idle_rtc_lock(void) {
+  RTC->CRL &= ~RTC_CRL_CNF;
+  while ((RTC->CRL & RTC_CRL_RTOFF) == 0) {
+  }
+}
+
+/**
+ * @brief RTC counter, the halves read consistently
+ */
+static uint32_t boot_idle_rtc_count(void) {
+  uint16_t high = RTC->CNTH;
+  uint16_t low = RTC->CNTL;
+
+  if (RTC->CNTH != high) {
+    high = RTC->CNTH;
+    low = RTC->CNTL;
+  }
+  return (uint32_t)high << 16 | low;
+}
+
+/**
+ * @brief Run the RTC from the LSI as a ms counter, once
+ * @note  An RTC the application enabled, or clocked from another source,
+ *        keeps its calendar. Backup domain write access stays on until
+ *        HAL_DeInit() resets the PWR block.
+ * @return false if the RTC belongs to the application
+ */
+static bool boot_idle_rtc_start(void) {
+  uint32_t source;
+
+  if (s_rtc != BOOT_IDLE_RTC_OFF) {
+    return s_rtc == BOOT_IDLE_RTC_OURS;
+  }
+
+  RCC->APB1ENR |= RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN;
+  PWR->CR |= PWR_CR_DBP;
+  source = RCC->BDCR & RCC_BDCR_RTCSEL;
+  if ((RCC->BDCR & RCC_BDCR_RTCEN) != 0 ||
+      (source != 0 && source != RCC_BDCR_RTCSEL_LSI)) {
+    s_rtc = BOOT_IDLE_RTC_FOREIGN;
+    return false;
+  }
+
+  RCC->CSR |= RCC_CSR_LSION;
+  while ((RCC->CSR & RCC_CSR_LSIRDY) == 0) {
+  }
+  RCC->BDCR |= RCC_BDCR_RTCSEL_LSI | RCC_BDCR_RTCEN;
+  boot_idle_rtc_sync();
+  boot_idle_rtc_unlock();
+  RTC->PRLH = 0;
+  RTC->PRLL = BOOT_IDLE_RTC_PRESCALER;
+  RTC->CNTH = 0;
+  RTC->CNTL = 0;
+  boot_idle_rtc_lock();
+  s_rtc = BOOT_IDLE_RTC_OURS;
+  return true;
+}
+
+/**
+ * @brief Stop mode until the RTC alarm at deadline or an edge on RX
+ * @note  The core wakes on the HSI, SystemClock_Config() brings the PLL
+ *        back and SysTick with it. The USART sampled at the wrong rate
+ *        meanwhile, its data register is dropped.
+ * @param deadline: HAL_GetTick() value, BOOT_IDLE_STOP_MIN_MS ahead at least
+ * @return true if the RX line woke the core
+ */
+static bool boot_idle_stop(uint32_t deadline) {
+  const uint32_t lines = BOOT_IDLE_RX_LINE | BOOT_IDLE_ALARM_LINE;
+  uint32_t start = boot_idle_rtc_count();
+  uint32_t alarm = start + (deadline - HAL_GetTick());
+  bool alarmed;
+
+  boot_idle_rtc_unlock();
+  RTC->ALRH = (uint16_t)(alarm >> 16);
+  RTC->ALRL = (uint16_t)alarm;
+  RTC->CRL &= ~RTC_CRL_ALRF;
+  boot_idle_rtc_lock();
+
+  AFIO->EXTICR[1] =
+      (AFIO->EXTICR[1] & ~AFIO_EXTICR2_EXTI7) | AFIO_EXTICR2_EXTI7_PB;
+  EXTI->FTSR |= BOOT_IDLE_RX_LINE;
+  EXTI->RTSR |= BOOT_IDLE_ALARM_LINE;
+  EXTI->PR = lines;
+  EXTI->EMR |= lines;
+
+  /* No tick until the clock is back, a pending one would end the stop */
+  SysTick->CTRL &= ~SysTick_CTRL_TICKINT_Msk;
+  SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+
+  PWR->CR = (PWR->CR & ~PWR_CR_PDDS) | PWR_CR_LPDS | PWR_CR_CWUF;
+  SCB->SCR |= SCB_SCR_SLEEPDEEP_Msk;
+  /* The first WFE takes the event SEV set, the second one stops */
+  __SEV();
+  __WFE();
+  __WFE();
+  SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+
+  EXTI->EMR &= ~lines;
+  EXTI->FTSR &= ~BOOT_IDLE_RX_LINE;
+  EXTI->RTSR &= ~BOOT_IDLE_ALARM_LINE;
+  EXTI->PR = lines;
+
+  SystemClock_Config();
+  boot_idle_rtc_sync();
+  alarmed = (RTC->CRL & RTC_CRL_ALRF) != 0;
+  uwTick += boot_idle_rtc_count() - start;
+  SysTick->CTRL |= SysTick_CTRL_TICKINT_Msk;
+
+  (void)USART1->SR;
+  (void)USART1->DR;
+  return !alarmed;
+}
+#endif
+
+/**
+ * @brief Wait for a byte from the host or the deadline, whichever is first
+ * @note  Returns with the byte still in USART1, or once HAL_GetTick() has
+ *        reached deadline
+ * @param deadline: HAL_GetTick() value
+ * @param stop: Stop mode is allowed, no sender is talking
+ * @return true if the wake from Stop lost a byte of the host
+ */
+bool boot_idle_wait(uint32_t deadline, bool stop) {
+#if BOOTLOADER_IDLE == BOOT_IDLE_STOP
+  if (stop && boot_idle_rtc_start()) {
+    return boot_idle_stop(deadline);
+  }
+#else
+  (void)stop;
+#endif
+  boot_idle_sleep(deadline);
+  return false;
+}
+
+/**
+ * @brief Hand the application the RTC as it was
+ * @note  RTCSEL stays on the LSI until a backup domain reset, the HAL
+ *        does one when the application selects another RTC clock
+ */
+void boot_idle_deinit(void) {
+#if BOOTLOADER_IDLE == BOOT_IDLE_STOP
+  if (s_rtc == BOOT_IDLE_RTC_OURS) {
+    RCC->BDCR &= ~RCC_BDCR_RTCEN;
+    RCC->CSR &= ~RCC_CSR_LSION;
+    s_rtc = BOOT_IDLE_RTC_OFF;
+  }
+#endif
+}
+
+#endif
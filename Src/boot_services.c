@@ -0,0 +1,142 @@
+#include "boot_services.h"
+#include "bootloader.h"
+#include "common.h"
+#include "flash_if.h"
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Everything reachable from the table must stay free of RAM state, HAL
+ * handles and interrupts: by the time the application calls in, the
+ * bootloader's .data and .bss belong to the application.
+ */
+
+/**
+ * @brief Check that a range lies inside the application region
+ * @param address: Start address
+ * @param size: Range size in bytes
+ * @return true if the application may write the range
+ */
+static bool boot_services_in_app(uint32_t address, uint32_t size) {
+  return address >= APPLICATION_START_ADDR && address <= FLASH_END_ADDR &&
+         size <= FLASH_END_ADDR + 1 - address;
+}
+
+static boot_service_result_t boot_services_flash_result(flash_if_result_t r) {
+  return r == FLASH_IF_OK ? BOOT_SERVICE_OK : BOOT_SERVICE_ERROR;
+}
+
+/**
+ * @brief Drop the verified mark before a change to the image it vouches for
+ * @note  Like boot_command_touch(), but the metadata is written back without
+ *        the mark instead of erased: the next boot checks the image again
+ *        and still boots it if it matches. The copy lives on the stack.
+ * @param address: Start of the range about to be erased or programmed
+ * @param size: Range size in bytes
+ * @return false if the metadata page could not be rewritten
+ */
+static bool boot_services_touch(uint32_t address, uint32_t size) {
+  const firmware_info_t *meta = (const firmware_info_t *)APPLICATION_META_ADDR;
+  firmware_info_t copy;
+
+  if (meta->magic != APPLICATION_META_MAGIC ||
+      meta->verified != APPLICATION_VERIFIED_MAGIC ||
+      address >= APPLICATION_START_ADDR + meta->size) {
+    return true; /* no mark, or the range lies past the image */
+  }
+  copy = *meta;
+  copy.verified = 0xFFFFFFFF;
+  return flash_if_erase(APPLICATION_META_PAGE_ADDR, FLASH_PAGE_SIZE) ==
+             FLASH_IF_OK &&
+         flash_if_program(APPLICATION_META_ADDR, (const uint8_t *)&copy,
+                          offsetof(firmware_info_t, verified)) == FLASH_IF_OK;
+}
+
+static boot_service_result_t boot_services_flash_erase(uint32_t address,
+                                                       uint32_t size) {
+  /* Erase rounds down to the page start, that must stay in range too */
+  if (!boot_services_in_app(address & ~(FLASH_PAGE_SIZE - 1), size)) {
+    return BOOT_SERVICE_RANGE_ERROR;
+  }
+  if (size != 0 && !boot_services_touch(address & ~(FLASH_PAGE_SIZE - 1),
+                                        size)) {
+    return BOOT_SERVICE_ERROR;
+  }
+  return boot_services_flash_result(flash_if_erase(address, size));
+}
+
+static boot_service_result_t
+boot_services_flash_program(uint32_t address, const uint8_t *data,
+                            uint32_t size) {
+  if (!boot_services_in_app(address, size)) {
+    return BOOT_SERVICE_RANGE_ERROR;
+  }
+  if (size != 0 && !boot_services_touch(address, size)) {
+    return BOOT_SERVICE_ERROR;
+  }
+  return boot_services_flash_result(flash_if_program(address, data, size));
+}
+
+static void boot_services_mailbox_write(boot_mailbox_t *msg) {
+  boot_mailbox_write(msg);
+}
+
+static bool boot_services_mailbox_read(boot_mailbox_t *msg) {
+  return boot_mailbox_read(msg);
+}
+
+/**
+ * @brief Copy the application metadata
+ * @param info: Output
+ * @return BOOT_SERVICE_OK, or BOOT_SERVICE_NO_IMAGE without metadata
+ */
+static boot_service_result_t boot_services_image_info(boot_image_info_t *info) {
+  const firmware_info_t *meta = (const firmware_info_t *)APPLICATION_META_ADDR;
+
+  if (meta->magic != APPLICATION_META_MAGIC) {
+    return BOOT_SERVICE_NO_IMAGE;
+  }
+  info->address = APPLICATION_START_ADDR;
+  info->version = meta->version;
+  info->size = meta->size;
+  info->crc32 = meta->crc32;
+  memcpy(info->sha256, meta->sha256, sizeof(info->sha256));
+  info->verified = meta->verified == APPLICATION_VERIFIED_MAGIC;
+  return BOOT_SERVICE_OK;
+}
+
+/**
+ * @brief Recompute the image CRC32, ignoring the verified mark
+ * @return BOOT_SERVICE_OK if it matches the metadata
+ */
+static boot_service_result_t boot_services_image_check(void) {
+  const firmware_info_t *meta = (const firmware_info_t *)APPLICATION_META_ADDR;
+
+  if (meta->magic != APPLICATION_META_MAGIC || meta->size == 0 ||
+      meta->size > APPLICATION_MAX_SIZE) {
+    return BOOT_SERVICE_NO_IMAGE;
+  }
+  if (bootloader_crc32_update(0xFFFFFFFF,
+                              (const uint8_t *)APPLICATION_START_ADDR,
+                              meta->size) != meta->crc32) {
+    return BOOT_SERVICE_ERROR;
+  }
+  return BOOT_SERVICE_OK;
+}
+
+/* Placed at BOOT_SERVICES_ADDR by the linker script */
+__attribute__((section(".services"), used))
+const boot_services_t boot_services_table = {
+    .magic = BOOT_SERVICES_MAGIC,
+    .version = BOOT_SERVICES_VERSION,
+    .size = sizeof(boot_services_t),
+    .bootloader_version = BOOTLOADER_VERSION,
+    .flash_erase = boot_services_flash_erase,
+    .flash_program = boot_services_flash_program,
+    .crc32_update = bootloader_crc32_update,
+    .crc16_update = crc16_update,
+    .mailbox_write = boot_services_mailbox_write,
+    .mailbox_read = boot_services_mailbox_read,
+    .image_info = boot_services_image_info,
+    .image_check = boot_services_image_check,
+};
@@ -0,0 +1,218 @@
+#include "boot_staging.h"
+#include "boot_stats.h"
+#include <stddef.h>
+#include <string.h>
+
+#if BOOTLOADER_STAGING
+
+_Static_assert(APPLICATION_MAX_SIZE <=
+                   BOOT_STAGING_SLOT_SIZE - BOOT_STAGING_IMAGE_OFFSET,
+               "the application does not fit in a staging slot");
+
+static bool s_present;   /* a chip large enough for both slots answered */
+static uint32_t s_erased; /* image bytes of the open slot that are erased */
+
+static uint32_t boot_staging_base(uint8_t slot) {
+  return (uint32_t)slot * BOOT_STAGING_SLOT_SIZE;
+}
+
+static uint32_t boot_staging_image(uint8_t slot) {
+  return boot_staging_base(slot) + BOOT_STAGING_IMAGE_OFFSET;
+}
+
+/**
+ * @brief Read the header of a slot that holds an installable image
+ * @return false if the slot is empty, incomplete or rejected
+ */
+static bool boot_staging_read_header(uint8_t slot,
+                                     boot_staging_header_t *header) {
+  return spi_flash_read(boot_staging_base(slot), header, sizeof(*header)) ==
+             SPI_FLASH_OK &&
+         header->magic == BOOT_STAGING_MAGIC &&
+         header->rejected == 0xFFFFFFFF && header->info.size != 0 &&
+         header->info.size <= APPLICATION_MAX_SIZE;
+}
+
+/**
+ * @brief Look for the staging flash
+ * @return true if transfers go through the slots
+ */
+bool boot_staging_init(void) {
+  uint32_t capacity = 0;
+
+  s_present = spi_flash_init(&capacity) == SPI_FLASH_OK &&
+              capacity >= BOOT_STAGING_SLOTS * BOOT_STAGING_SLOT_SIZE;
+  if (s_present) {
+    BOOTLOADER_LOG("Staging flash: %d KB", capacity / 1024);
+  }
+  return s_present;
+}
+
+bool boot_staging_present(void) { return s_present; }
+
+/**
+ * @brief Start writing a slot, its old header goes first
+ * @note  Erases one sector. The rest is erased as the image reaches it,
+ *        like the internal flash in a direct transfer.
+ */
+bool boot_staging_open(uint8_t slot) {
+  s_erased = 0;
+  if (spi_flash_erase(boot_staging_base(slot), SPI_FLASH_SECTOR_SIZE) !=
+      SPI_FLASH_OK) {
+    return false;
+  }
+  s_erased = SPI_FLASH_SECTOR_SIZE - BOOT_STAGING_IMAGE_OFFSET;
+  return true;
+}
+
+/**
+ * @brief Erase the open slot up to an image offset
+ * @param end: Image bytes about to be written or skipped as a hole
+ */
+bool boot_staging_prepare(uint8_t slot, uint32_t end) {
+  if (end <= s_erased) {
+    return true;
+  }
+  if (end > BOOT_STAGING_SLOT_SIZE - BOOT_STAGING_IMAGE_OFFSET ||
+      spi_flash_erase(boot_staging_image(slot) + s_erased, end - s_erased) !=
+          SPI_FLASH_OK) {
+    return false;
+  }
+  /* Whole sectors went, the image offset keeps them unaligned */
+  s_erased = (end + BOOT_STAGING_IMAGE_OFFSET + SPI_FLASH_SECTOR_SIZE - 1) /
+                 SPI_FLASH_SECTOR_SIZE * SPI_FLASH_SECTOR_SIZE -
+             BOOT_STAGING_IMAGE_OFFSET;
+  return true;
+}
+
+/**
+ * @brief Program image bytes into the open slot, prepared up to their end
+ */
+bool boot_staging_write(uint8_t slot, uint32_t offset, const uint8_t *data,
+                        uint32_t size) {
+  if (offset + size > s_erased ||
+      spi_flash_program(boot_staging_image(slot) + offset, data, size) !=
+          SPI_FLASH_OK) {
+    return false;
+  }
+  bootloader_led_toggle();
+  return true;
+}
+
+/**
+ * @brief Commit the slot once the transfer checked out
+ * @param info: Size, CRC32 and digest of the image as received
+ */
+bool boot_staging_close(uint8_t slot, const firmware_info_t *info) {
+  boot_staging_header_t header;
+
+  memset(&header, 0xFF, sizeof(header));
+  header.magic = BOOT_STAGING_MAGIC;
+  header.info = *info;
+  return spi_flash_program(boot_staging_base(slot), &header, sizeof(header)) ==
+         SPI_FLASH_OK;
+}
+
+/**
+ * @brief Find the image to restore the application from
+ * @param slot: Update slot if it is installable, else the golden slot
+ * @return false if neither is
+ */
+bool boot_staging_find(uint8_t *slot) {
+  boot_staging_header_t header;
+
+  if (!s_present) {
+    return false;
+  }
+  for (uint8_t i = 0; i < BOOT_STAGING_SLOTS; i++) {
+    if (boot_staging_read_header(i, &header)) {
+      *slot = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Copy a slot into the application flash
+ * @note  The slot is read back against its CRC32 before the first page is
+ *        erased, a damaged copy leaves the application alone. The caller
+ *        still verifies the result in the internal flash.
+ * @param slot: Slot with a committed header
+ * @param buffer: One SPI flash page of work memory
+ * @param info: Filled in from the slot header
+ * @return Bootloader result code, BOOTLOADER_VERIFY_ERROR for a bad slot
+ */
+bootloader_result_t boot_staging_install(uint8_t slot,
+                                         uint8_t buffer[SPI_FLASH_PAGE_SIZE],
+                                         firmware_info_t *info) {
+  boot_staging_header_t header;
+  uint32_t crc = 0xFFFFFFFF;
+  uint32_t image = boot_staging_image(slot);
+  uint32_t size;
+
+  if (!boot_staging_read_header(slot, &header)) {
+    return BOOTLOADER_NO_APPLICATION;
+  }
+  size = header.info.size;
+
+  for (uint32_t offset = 0; offset < size; offset += SPI_FLASH_PAGE_SIZE) {
+    uint32_t chunk = size - offset < SPI_FLASH_PAGE_SIZE ? size - offset
+                                                         : SPI_FLASH_PAGE_SIZE;
+
+    if (spi_flash_read(image + offset, buffer, chunk) != SPI_FLASH_OK) {
+      return BOOTLOADER_ERROR;
+    }
+    crc = bootloader_crc32_update(crc, buffer, chunk);
+  }
+  if (crc != header.info.crc32) {
+    BOOTLOADER_LOG("Staging slot %d damaged", slot);
+    return BOOTLOADER_VERIFY_ERROR;
+  }
+
+  /* As in a direct transfer, the metadata page goes first */
+  if (bootloader_erase_page(APPLICATION_META_PAGE_ADDR) != BOOTLOADER_OK) {
+    return BOOTLOADER_FLASH_ERROR;
+  }
+  for (uint32_t offset = 0; offset < size; offset += SPI_FLASH_PAGE_SIZE) {
+    uint32_t address = APPLICATION_START_ADDR + offset;
+    uint32_t chunk = size - offset < SPI_FLASH_PAGE_SIZE ? size - offset
+                                                         : SPI_FLASH_PAGE_SIZE;
+
+    if ((address & (FLASH_PAGE_SIZE - 1)) == 0 &&
+        bootloader_erase_page(address) != BOOTLOADER_OK) {
+      return BOOTLOADER_FLASH_ERROR;
+    }
+    if (spi_flash_read(image + offset, buffer, chunk) != SPI_FLASH_OK) {
+      return BOOTLOADER_ERROR;
+    }
+    if (bootloader_program_flash(address, buffer, chunk) != BOOTLOADER_OK) {
+      boot_stats_add(BOOT_STAT_FLASH_ERRORS, 1);
+      return BOOTLOADER_FLASH_ERROR;
+    }
+  }
+
+  *info = header.info;
+  return BOOTLOADER_OK;
+}
+
+/**
+ * @brief Mark a slot whose image failed its checks, find() skips it
+ */
+void boot_staging_reject(uint8_t slot) {
+  uint32_t rejected = 0;
+
+  spi_flash_program(boot_staging_base(slot) +
+                        offsetof(boot_staging_header_t, rejected),
+                    &rejected, sizeof(rejected));
+}
+
+/**
+ * @brief Release the SPI bus before the jump
+ */
+void boot_staging_deinit(void) {
+  spi_flash_deinit();
+  s_present = false;
+}
+
+#endif
@@ -0,0 +1,118 @@
+#include "boot_stats.h"
+#include "bootloader.h"
+
+_Static_assert(BOOT_STATS_ADDR + sizeof(boot_stats_t) <=
+                   BOOT_SHARED_RAM_ADDR + BOOT_SHARED_RAM_SIZE,
+               "mailbox, boot timing and stats overflow the shared RAM");
+
+#if BOOTLOADER_STATS
+
+static const char *const boot_stat_names[BOOT_STAT_COUNT] = {
+    "crc", "timeout", "nak", "overrun", "retry", "flash_err", "bytes", "ms"};
+
+/* Session in progress, started by boot_stats_begin() */
+static bool s_session_open;
+static uint32_t s_session_start;
+
+/**
+ * @brief Recompute the CRC32 after a change
+ */
+static void boot_stats_seal(void) {
+  BOOT_STATS->crc32 = boot_stats_crc(BOOT_STATS);
+}
+
+/**
+ * @brief Keep the statistics of earlier boots, or start over
+ * @note  Power-on leaves noise in the RAM, which fails the CRC32
+ */
+void boot_stats_init(void) {
+  volatile boot_stats_t *s = BOOT_STATS;
+  boot_stats_t check;
+
+  if (boot_stats_read(&check)) {
+    return;
+  }
+  for (uint32_t i = 0; i < sizeof(boot_stats_t) / sizeof(uint32_t); i++) {
+    ((volatile uint32_t *)s)[i] = 0;
+  }
+  s->magic = BOOT_STATS_MAGIC;
+  s->version = BOOT_STATS_VERSION;
+  s->size = sizeof(boot_stats_t);
+  boot_stats_seal();
+}
+
+/**
+ * @brief Start a session, the header of a transfer was accepted
+ */
+void boot_stats_begin(void) {
+  volatile boot_stats_t *s = BOOT_STATS;
+
+  for (int i = 0; i < BOOT_STAT_COUNT; i++) {
+    s->last[i] = 0;
+  }
+  s->sessions++;
+  boot_stats_seal();
+  s_session_open = true;
+  s_session_start = HAL_GetTick();
+}
+
+/**
+ * @brief Add to a counter
+ * @note  Outside a session only the total counts
+ * @param stat: Counter
+ * @param count: Amount to add
+ */
+void boot_stats_add(boot_stat_t stat, uint32_t count) {
+  volatile boot_stats_t *s = BOOT_STATS;
+
+  if (count == 0) {
+    return;
+  }
+  if (s_session_open) {
+    s->last[stat] += count;
+  }
+  s->total[stat] += count;
+  boot_stats_seal();
+}
+
+/**
+ * @brief Close the session with its outcome
+ * @param result: bootloader_result_t, BOOTLOADER_OK for a verified image
+ */
+void boot_stats_end(uint32_t result) {
+  volatile boot_stats_t *s = BOOT_STATS;
+
+  if (!s_session_open) {
+    return;
+  }
+  boot_stats_add(BOOT_STAT_DURATION_MS, HAL_GetTick() - s_session_start);
+  if (result == BOOTLOADER_OK) {
+    s->updates++;
+  } else {
+    s->failures++;
+  }
+  s->last_result = result;
+  boot_stats_seal();
+  s_session_open = false;
+}
+
+/**
+ * @brief Print the statistics, the last session and then the totals
+ */
+void boot_stats_report(void) {
+  volatile boot_stats_t *s = BOOT_STATS;
+
+  BOOTLOADER_LOG("STATS sessions %u updates %u failures %u result %u",
+                 s->sessions, s->updates, s->failures, s->last_result);
+  for (int i = 0; i < BOOT_STAT_COUNT; i++) {
+    BOOTLOADER_LOG("STATS %s last %u total %u", boot_stat_names[i],
+                   s->last[i], s->total[i]);
+  }
+  BOOTLOADER_LOG("STATS rate last %u total %u bytes/s",
+                 boot_stats_rate(s->last[BOOT_STAT_BYTES],
+                                 s->last[BOOT_STAT_DURATION_MS]),
+                 boot_stats_rate(s->total[BOOT_STAT_BYTES],
+                                 s->total[BOOT_STAT_DURATION_MS]));
+}
+
+#endif
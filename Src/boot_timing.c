@@ -0,0 +1,93 @@
+#include "boot_timing.h"
+#include "bootloader.h"
+
+#if BOOTLOADER_TIMING
+
+static const char *const boot_phase_names[BOOT_PHASE_COUNT] = {
+    "reset",  "hal_init",     "clock_lock",  "conditions",
+    "header", "erase",        "first_packet", "last_packet",
+    "verify", "metadata",     "jump"};
+
+/**
+ * @brief Start the cycle counter and clear the table
+ * @note  Called first thing out of reset, before HAL_Init()
+ */
+void boot_timing_start(void) {
+  volatile boot_timing_t *t = BOOT_TIMING;
+
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+  for (uint32_t i = 0; i < sizeof(boot_timing_t) / sizeof(uint32_t); i++) {
+    ((volatile uint32_t *)t)[i] = 0;
+  }
+  t->magic = BOOT_TIMING_MAGIC;
+  t->core_clock = HSI_VALUE;
+}
+
+/**
+ * @brief Current cycle count
+ */
+uint32_t boot_timing_now(void) { return DWT->CYCCNT; }
+
+/**
+ * @brief Timestamp the end of a phase
+ * @param phase: Phase that just completed
+ */
+void boot_timing_mark(boot_phase_t phase) {
+  uint32_t now = DWT->CYCCNT;
+
+  BOOT_TIMING->phase[phase] = now != 0 ? now : 1;
+  if (phase == BOOT_PHASE_CLOCK_LOCK) {
+    BOOT_TIMING->core_clock = SystemCoreClock;
+  }
+}
+
+/**
+ * @brief Account one packet callback
+ * @param start_cycles: boot_timing_now() when the callback was entered
+ */
+void boot_timing_packet(uint32_t start_cycles) {
+  volatile boot_timing_t *t = BOOT_TIMING;
+  uint32_t now = DWT->CYCCNT;
+  uint32_t cycles = now - start_cycles;
+
+  if (t->packet_count++ == 0) {
+    t->phase[BOOT_PHASE_FIRST_PACKET] = now;
+  }
+  t->phase[BOOT_PHASE_LAST_PACKET] = now;
+  t->packet_total_cycles += cycles;
+  if (cycles > t->packet_max_cycles) {
+    t->packet_max_cycles = cycles;
+  }
+}
+
+/**
+ * @brief Print the table, one line per reached phase
+ * @note  Cycles are since the previous reached phase, the time in us is
+ *        since reset. Phases up to the clock lock run on the HSI.
+ */
+void boot_timing_report(void) {
+  volatile boot_timing_t *t = BOOT_TIMING;
+  uint32_t prev = 0;
+  uint32_t us = 0;
+
+  BOOTLOADER_LOG("TIMING clock %u", t->core_clock);
+  for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+    uint32_t mhz;
+
+    if (t->phase[i] == 0 && i != BOOT_PHASE_RESET) {
+      continue;
+    }
+    mhz = (i <= BOOT_PHASE_CLOCK_LOCK ? HSI_VALUE : t->core_clock) / 1000000;
+    us += (t->phase[i] - prev) / mhz;
+    BOOTLOADER_LOG("TIMING %s %u cycles %u us", boot_phase_names[i],
+                   t->phase[i] - prev, us);
+    prev = t->phase[i];
+  }
+  BOOTLOADER_LOG("TIMING packets %u max %u total %u cycles", t->packet_count,
+                 t->packet_max_cycles, t->packet_total_cycles);
+}
+
+#endif
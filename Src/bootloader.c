@@ -1,135 +1,964 @@
 #include "bootloader.h"
+#include "boot_arena.h"
+#include "boot_broadcast.h"
+#include "boot_can.h"
+#include "boot_command.h"
+#include "boot_staging.h"
+#include "boot_stats.h"
+#include "boot_timing.h"
 #include "common.h"
+#include "flash_if.h"
 #include "main.h"
 #include "stm32f1xx_hal.h"
 #include "stm32f1xx_hal_gpio.h"
 #include "ymodem.h"
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
+#if BOOTLOADER_SECURE_BOOT
+#if !__has_include("signing_key.h")
+#error "Secure boot needs Inc/signing_key.h, generate it with ./sign.py keygen"
+#endif
+#include "ed25519.h"
+#include "signing_key.h"
+#endif
+
+#if BOOTLOADER_ENCRYPTION
+#if !__has_include("encryption_key.h")
+#error "Encryption needs Inc/encryption_key.h, generate it with ./encrypt.py keygen"
+#endif
+#include "chacha20.h"
+#include "encryption_key.h"
+#endif
+
+/* Policies that check the image once and then trust the verified mark */
+#define BOOT_INTEGRITY_USES_MARK                                               \
+  (BOOTLOADER_BOOT_INTEGRITY == BOOT_INTEGRITY_CRC_ONCE ||                     \
+   BOOTLOADER_BOOT_INTEGRITY == BOOT_INTEGRITY_SHA256_ONCE)
+
 /* Global bootloader context */
 bootloader_context_t g_bootloader_context;
+uint8_t g_bootloader_log[BOOTLOADER_LOG_SIZE] BOOT_ARENA;
 ymodem_file_info_t g_file_info;
 
 /* UART handle (defined in main.c) */
 extern UART_HandleTypeDef huart1;
 
+/* Entry reason latched by the fast-boot path before HAL_Init() */
+static bootloader_entry_reason_t s_fast_boot_reason = BOOTLOADER_ENTRY_NONE;
+
+/* Application request from the mailbox, read once per boot */
+static boot_mailbox_t s_request;
+static bool s_request_taken;
+
+/* Structure for packet callback context */
+typedef struct {
+  uint32_t image_end;  /* end of the image so far, holes included */
+  uint32_t erased_end; /* pages below are ready for programming */
+  uint32_t file_crc32;
+  sha256_ctx_t sha256;
+  uint32_t hash_size; /* leading bytes that make up the image itself */
+  uint32_t file_size;     /* Y-modem file without the encryption header */
+  uint32_t expected_size; /* from the mailbox request, 0 = any */
+#if BOOTLOADER_ENCRYPTION
+  uint8_t buffer[YMODEM_PACKET_SIZE_1024]; /* decrypted packet */
+  chacha20_ctx_t cipher;
+  firmware_encryption_t header;
+  uint32_t header_size; /* header bytes received so far */
+#endif
+  bool format_known;
+  bool sparse;
+  bool container_ready;
+  firmware_sparse_t container;
+  firmware_segment_t segment;
+  uint32_t fill;          /* bytes of the container or segment header */
+  uint32_t segments_left; /* headers still to come */
+  uint32_t segment_left;  /* data bytes of the current segment */
+  uint32_t segment_crc32;
+#if BOOTLOADER_STAGING
+  uint8_t slot; /* staging slot, BOOT_STAGING_NONE programs directly */
+#endif
+} packet_context_t;
+
+/* Work memory of the update, one step at a time */
+typedef union {
+  packet_context_t receive; /* from the header to the last packet */
+#if BOOTLOADER_SECURE_BOOT
+  struct {
+    firmware_signature_t block;
+    firmware_info_t header;
+    sha512_ctx_t hash;
+  } signature; /* bootloader_verify_signature(), after the receive */
+#endif
+#if BOOTLOADER_COMMANDS
+  boot_command_session_t command; /* instead of a transfer */
+#endif
+#if BOOTLOADER_STAGING
+  uint8_t install[SPI_FLASH_PAGE_SIZE]; /* boot_staging_install() */
+#endif
+#if BOOTLOADER_CAN
+  boot_can_session_t can; /* instead of a transfer */
+#endif
+#if BOOTLOADER_BROADCAST
+  boot_broadcast_session_t broadcast; /* instead of a transfer */
+#endif
+} bootloader_work_t;
+
+static bootloader_work_t s_work BOOT_ARENA;
+
+/* Event loop: Y-modem receiver and the deadlines of bootloader_run() */
+static ymodem_receiver_t s_receiver;
+static uint32_t s_tick_at;  /* next BOOTLOADER_EVENT_TICK */
+static uint32_t s_retry_at; /* end of the backoff in the error state */
+#if BOOTLOADER_IDLE == BOOT_IDLE_STOP
+static uint32_t s_listen_until; /* no Stop mode before, see boot_idle.h */
+#endif
+#if BOOTLOADER_STAGING
+/* Slot bootloader_on_verifying() installs first */
+static uint8_t s_install_slot = BOOT_STAGING_NONE;
+#endif
+#if BOOTLOADER_CAN
+static can_frame_t s_can_frame; /* of the last BOOTLOADER_EVENT_CAN */
+#endif
+
 /* Private function prototypes */
-static void bootloader_set_application_vector_table(void);
-static bool bootloader_packet_callback(const uint8_t *data, uint16_t data_size,
-                                       uint32_t packet_num, void *user_data);
+static bootloader_entry_reason_t bootloader_get_entry_reason(void);
+static void bootloader_start_image(uint32_t vectors);
+static void bootloader_mark_application_verified(void);
+static void bootloader_begin_receive(void);
+static bootloader_result_t bootloader_accept_header(void);
+static bool bootloader_process_packet(const uint8_t *data, uint16_t data_size);
+static bootloader_result_t bootloader_finish_receive(void);
+static bool bootloader_command_handler(uint8_t command);
+static const boot_mailbox_t *bootloader_take_request(void);
 
 #define WAIT_HERE(x)                                                           \
   do {                                                                         \
     bootloader_led_toggle();                                                   \
     HAL_Delay(x);                                                              \
   } while (1)
+/**
+ * @brief Fast-boot path, called straight out of reset before HAL_Init()
+ * @note  Runs on the reset clock (HSI) with raw register reads only: no HAL,
+ *        no PLL and no UART. When nothing asks us to stay, the application
+ *        is started from here and this function does not return.
+ */
+void bootloader_fast_boot(void) {
+  boot_timing_start();
+#if BOOTLOADER_FAST_BOOT
+  bootloader_entry_reason_t reason;
+
+  /* KEY_2 is a floating input out of reset, only its port clock is needed */
+  __HAL_RCC_GPIOC_CLK_ENABLE();
+  reason = bootloader_get_entry_reason();
+  boot_timing_mark(BOOT_PHASE_CONDITIONS);
+
+  if (reason == BOOTLOADER_ENTRY_NONE) {
+    /* Hand the application a reset-state RCC */
+    __HAL_RCC_GPIOC_CLK_DISABLE();
+    bootloader_start_image(APPLICATION_START_ADDR);
+  }
+
+  s_fast_boot_reason = reason;
+#endif
+}
+
 /**
  * @brief Initialize bootloader
  */
 void bootloader_init(void) {
+  const boot_mailbox_t *request;
+
   /* Initialize bootloader context */
   memset(&g_bootloader_context, 0, sizeof(bootloader_context_t));
   g_bootloader_context.state = BOOTLOADER_STATE_INIT;
+  g_bootloader_context.entry_reason = s_fast_boot_reason;
+  boot_stats_init();
+
+  /* Session settings the application asked for */
+  request = bootloader_take_request();
+  if (request->baudrate != 0 && request->baudrate != huart1.Init.BaudRate) {
+    huart1.Init.BaudRate = request->baudrate;
+    HAL_UART_Init(&huart1);
+  }
 
   /* Print banner */
-  bootloader_print_banner();
+  if ((request->flags & BOOT_MAILBOX_FLAG_SKIP_BANNER) == 0) {
+    bootloader_print_banner();
+  }
+  if (request->transport != BOOT_MAILBOX_TRANSPORT_UART1 &&
+      (!BOOTLOADER_CAN || request->transport != BOOT_MAILBOX_TRANSPORT_CAN1)) {
+    BOOTLOADER_LOG("Transport %d not supported, using UART1",
+                   request->transport);
+  }
+#if BOOTLOADER_STAGING
+  boot_staging_init();
+#endif
+#if BOOTLOADER_CAN
+  /* Listens next to the UART, whichever transport the request named */
+  boot_can_init();
+#endif
   BOOTLOADER_LOG("Bootloader initialized");
 }
 
 /**
- * @brief Main bootloader execution loop
- * @return Bootloader result code
+ * @brief Consume the application mailbox
+ * @note  The first call reads and clears it, later calls in the same boot
+ *        see the saved copy. Usable before HAL_Init().
+ * @return Request, all zero when there was none
  */
-bootloader_result_t bootloader_run(void) {
-  bootloader_result_t result = BOOTLOADER_OK;
+static const boot_mailbox_t *bootloader_take_request(void) {
+  if (!s_request_taken) {
+    s_request_taken = true;
+    boot_mailbox_read(&s_request);
+    boot_mailbox_clear();
+  }
+  return &s_request;
+}
 
-  g_bootloader_context.state = BOOTLOADER_STATE_CHECK_CONDITIONS;
+/* Events the loop posts to itself, served before the UART and the timers.
+ * A step posts at most an entry and a flash-done event. */
+#define BOOTLOADER_EVENT_QUEUE_SIZE 4
+static struct {
+  bootloader_event_t events[BOOTLOADER_EVENT_QUEUE_SIZE];
+  uint8_t head;
+  uint8_t tail;
+} s_events;
 
-  while (1) {
-    switch (g_bootloader_context.state) {
-    case BOOTLOADER_STATE_CHECK_CONDITIONS:
-      if (bootloader_should_enter()) {
-        BOOTLOADER_LOG("Entering bootloader mode");
-        g_bootloader_context.state = BOOTLOADER_STATE_WAIT_FOR_FIRMWARE;
-      } else {
-        BOOTLOADER_LOG("Jumping to application");
-        g_bootloader_context.state = BOOTLOADER_STATE_JUMP_TO_APP;
-      }
-      break;
+/**
+ * @brief Queue an event for the loop
+ * @param type: Event type
+ * @param ok: Result carried by BOOTLOADER_EVENT_FLASH_DONE
+ */
+static void bootloader_post(bootloader_event_type_t type, bool ok) {
+  bootloader_event_t *event =
+      &s_events.events[s_events.tail++ % BOOTLOADER_EVENT_QUEUE_SIZE];
 
-    case BOOTLOADER_STATE_WAIT_FOR_FIRMWARE:
-      BOOTLOADER_LOG("Waiting for firmware... Send file using Y-modem");
-      g_bootloader_context.state = BOOTLOADER_STATE_RECEIVING_FIRMWARE;
-      break;
+  event->type = type;
+  event->ok = ok;
+}
+
+/**
+ * @brief Change state, the new state sees BOOTLOADER_EVENT_ENTER next
+ * @param state: New state
+ */
+static void bootloader_transition(bootloader_state_t state) {
+  g_bootloader_context.state = state;
+  bootloader_post(BOOTLOADER_EVENT_ENTER, true);
+}
+
+/**
+ * @brief Check a deadline against the tick, wrap safe
+ * @return true once now has reached deadline
+ */
+static bool bootloader_is_due(uint32_t deadline, uint32_t now) {
+  return (int32_t)(now - deadline) >= 0;
+}
+
+/**
+ * @brief Deadline of the current state
+ * @param deadline: HAL_GetTick() value of the next BOOTLOADER_EVENT_TIMEOUT
+ * @return false when the state has none
+ */
+static bool bootloader_state_deadline(uint32_t *deadline) {
+  switch (g_bootloader_context.state) {
+  case BOOTLOADER_STATE_WAIT_FOR_FIRMWARE:
+  case BOOTLOADER_STATE_RECEIVING_FIRMWARE:
+    return ymodem_receiver_deadline(&s_receiver, deadline);
+#if BOOTLOADER_COMMANDS
+  case BOOTLOADER_STATE_COMMAND_SESSION:
+    *deadline = s_work.command.deadline;
+    return true;
+#endif
+#if BOOTLOADER_CAN
+  case BOOTLOADER_STATE_CAN_SESSION:
+    *deadline = s_work.can.deadline;
+    return true;
+#endif
+#if BOOTLOADER_BROADCAST
+  case BOOTLOADER_STATE_BROADCAST_SESSION:
+    *deadline = s_work.broadcast.deadline;
+    return true;
+#endif
+  case BOOTLOADER_STATE_ERROR:
+    *deadline = s_retry_at;
+    return true;
+  default:
+    return false;
+  }
+}
+
+#if BOOTLOADER_IDLE == BOOT_IDLE_STOP
+/**
+ * @brief Check whether the wait until deadline may run in Stop mode
+ * @note  Only while waiting for a sender, with no packet under way and the
+ *        line quiet since the listen window after the last 'C' or byte.
+ *        Never with CAN, only the UART RX line wakes the core.
+ * @return true if losing the byte that wakes the core is fine
+ */
+static bool bootloader_may_stop(uint32_t deadline, uint32_t now) {
+  return !BOOTLOADER_CAN &&
+         g_bootloader_context.state == BOOTLOADER_STATE_WAIT_FOR_FIRMWARE &&
+         s_receiver.count == 0 && !s_receiver.purging &&
+         bootloader_is_due(s_listen_until, now) &&
+         deadline - now >= BOOT_IDLE_STOP_MIN_MS;
+}
+#endif
+
+/**
+ * @brief Wait for the next event
+ * @note  Posted events come first, then passed deadlines and CAN frames.
+ *        Otherwise the core sleeps (boot_idle.h) until a byte or a frame
+ *        arrives or the nearest deadline.
+ * @param event: Next event
+ */
+static void bootloader_next_event(bootloader_event_t *event) {
+  uint32_t deadline;
+  uint32_t timeout;
+  uint32_t now;
+
+  if (s_events.head != s_events.tail) {
+    *event = s_events.events[s_events.head++ % BOOTLOADER_EVENT_QUEUE_SIZE];
+    return;
+  }
 
-    case BOOTLOADER_STATE_RECEIVING_FIRMWARE:
+  for (;;) {
+    now = HAL_GetTick();
+    if (!bootloader_state_deadline(&deadline)) {
+      deadline = s_tick_at;
+    } else if (bootloader_is_due(deadline, now)) {
+      event->type = BOOTLOADER_EVENT_TIMEOUT;
+      return;
+    }
+    if (bootloader_is_due(s_tick_at, now)) {
+      s_tick_at = now + BOOTLOADER_TICK_MS;
+      event->type = BOOTLOADER_EVENT_TICK;
+      return;
+    }
+    if (!bootloader_is_due(deadline, s_tick_at)) {
+      deadline = s_tick_at;
+    }
+#if BOOTLOADER_CAN
+    if (can_bus_receive(&s_can_frame)) {
+      event->type = BOOTLOADER_EVENT_CAN;
+      event->frame = &s_can_frame;
+      return;
+    }
+#endif
+    /* Cleared by the data register read in the receive */
+    if (__HAL_UART_GET_FLAG(&huart1, UART_FLAG_ORE)) {
+      boot_stats_add(BOOT_STAT_OVERRUNS, 1);
+    }
+#if BOOTLOADER_IDLE == BOOT_IDLE_STOP
+    /* Sleep through the listen window, then decide on Stop again */
+    if (!bootloader_is_due(s_listen_until, now) &&
+        !bootloader_is_due(deadline, s_listen_until)) {
+      deadline = s_listen_until;
+    }
+    if (boot_idle_wait(deadline, bootloader_may_stop(deadline, now))) {
+      /* The host is talking, stay awake for its retry */
+      s_listen_until = HAL_GetTick() + BOOT_IDLE_LISTEN_MS;
+    }
+    timeout = 0;
+#elif BOOTLOADER_IDLE == BOOT_IDLE_SLEEP
+    boot_idle_wait(deadline, false);
+    timeout = 0;
+#elif BOOTLOADER_CAN
+    timeout = 0; /* poll both */
+#else
+    timeout = deadline - now;
+#endif
+    if (HAL_UART_Receive(&huart1, &event->byte, 1, timeout) == HAL_OK) {
+      event->type = BOOTLOADER_EVENT_RX;
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Log the outcome of a transfer and leave the transfer states
+ * @param result: Result of the transfer
+ */
+static void bootloader_end_receive(bootloader_result_t result) {
+  BOOTLOADER_LOG("firmware_info.size: %d, received: %d, packets: %d, ret: %d",
+                 g_file_info.file_size, g_file_info.received_size,
+                 g_file_info.packet_count, result);
+  BOOTLOADER_LOG("file_info: %s, %d, %d", g_file_info.filename,
+                 g_file_info.state, g_file_info.error_count);
+  bootloader_led_toggle();
+  boot_stats_add(BOOT_STAT_CRC_ERRORS, g_file_info.crc_errors);
+  boot_stats_add(BOOT_STAT_TIMEOUTS, g_file_info.timeouts);
+  boot_stats_add(BOOT_STAT_NAKS, g_file_info.naks);
+  boot_stats_add(BOOT_STAT_BYTES, g_file_info.received_size);
+  if (result == BOOTLOADER_OK) {
+    bootloader_transition(BOOTLOADER_STATE_VERIFYING_FIRMWARE);
+  } else {
+    BOOTLOADER_LOG("Firmware reception failed!");
+    boot_stats_end(result);
+    bootloader_transition(BOOTLOADER_STATE_ERROR);
+  }
+}
+
+/**
+ * @brief Waiting for and receiving a Y-modem transfer
+ * @param event: Event to handle
+ */
+static void bootloader_on_transfer(const bootloader_event_t *event) {
+  bool waiting =
+      g_bootloader_context.state == BOOTLOADER_STATE_WAIT_FOR_FIRMWARE;
+  bootloader_result_t result;
+  ymodem_event_t ymodem_event;
+
+  switch (event->type) {
+  case BOOTLOADER_EVENT_ENTER:
+    if (waiting) {
+      BOOTLOADER_LOG("Waiting for firmware... Send file using Y-modem");
       bootloader_led_set(false);
-      result = bootloader_receive_firmware();
-      HAL_Delay(1000);
-      BOOTLOADER_LOG(
-          "firmware_info.size: %d, received: %d, packets: %d, ret: %d",
-          g_file_info.file_size, g_file_info.received_size,
-          g_file_info.packet_count, result);
-      BOOTLOADER_LOG("file_info: %s, %d, %d", g_file_info.filename,
-                     g_file_info.state, g_file_info.error_count);
+      bootloader_begin_receive();
+    }
+    return;
+  case BOOTLOADER_EVENT_RX:
+    ymodem_event = ymodem_receiver_feed(&s_receiver, event->byte);
+    break;
+  case BOOTLOADER_EVENT_TIMEOUT:
+    ymodem_event = ymodem_receiver_timeout(&s_receiver);
+    break;
+  case BOOTLOADER_EVENT_TICK:
+    if (waiting) {
       bootloader_led_toggle();
-      if (result == BOOTLOADER_OK) {
-        g_bootloader_context.firmware_info.magic = APPLICATION_META_MAGIC;
-        bootloader_result_t ret = bootloader_program_flash(
-            APPLICATION_META_ADDR,
-            (uint8_t *)&g_bootloader_context.firmware_info,
-            sizeof(firmware_info_t));
-        g_bootloader_context.state = BOOTLOADER_STATE_VERIFYING_FIRMWARE;
-      } else {
-        BOOTLOADER_LOG("Firmware reception failed!");
-        g_bootloader_context.state = BOOTLOADER_STATE_ERROR;
-      }
+    }
+    return;
+  default:
+    return;
+  }
+
+  switch (ymodem_event) {
+  case YMODEM_EVENT_COMMAND:
+#if BOOTLOADER_COMMANDS
+    if (s_receiver.command == BOOT_COMMAND_SYNC) {
+      bootloader_transition(BOOTLOADER_STATE_COMMAND_SESSION);
       break;
+    }
+#endif
+#if BOOTLOADER_BROADCAST
+    if (s_receiver.command == BOOT_BROADCAST_SYNC) {
+      bootloader_transition(BOOTLOADER_STATE_BROADCAST_SESSION);
+      break;
+    }
+#endif
+    /* Answered, ask for the transfer again right away */
+    if (bootloader_command_handler(s_receiver.command)) {
+      ymodem_receiver_poll(&s_receiver);
+    }
+    break;
+  case YMODEM_EVENT_HEADER:
+    boot_timing_mark(BOOT_PHASE_HEADER);
+    boot_stats_begin();
+    result = bootloader_accept_header();
+    ymodem_receiver_done(&s_receiver, result == BOOTLOADER_OK);
+    /* Pages are erased as the image reaches them, see prepare_flash() */
+    boot_timing_mark(BOOT_PHASE_ERASE);
+    if (result == BOOTLOADER_OK) {
+      bootloader_transition(BOOTLOADER_STATE_RECEIVING_FIRMWARE);
+    } else {
+      bootloader_end_receive(result);
+    }
+    break;
+  case YMODEM_EVENT_DATA:
+    bootloader_transition(BOOTLOADER_STATE_PROGRAMMING_FLASH);
+    break;
+  case YMODEM_EVENT_COMPLETE:
+    bootloader_end_receive(bootloader_finish_receive());
+    break;
+  case YMODEM_EVENT_FAILED:
+    if (waiting) {
+      BOOTLOADER_LOG("Timeout wait file");
+    }
+    bootloader_end_receive(BOOTLOADER_ERROR);
+    break;
+  default:
+    break;
+  }
+}
 
-    case BOOTLOADER_STATE_VERIFYING_FIRMWARE:
-      BOOTLOADER_LOG("Verifying firmware...");
-      result = bootloader_verify_firmware(&g_bootloader_context.firmware_info);
+/**
+ * @brief Programming one packet, the sender waits for its ACK meanwhile
+ * @param event: Event to handle
+ */
+static void bootloader_on_programming(const bootloader_event_t *event) {
+  switch (event->type) {
+  case BOOTLOADER_EVENT_ENTER:
+    bootloader_post(BOOTLOADER_EVENT_FLASH_DONE,
+                    bootloader_process_packet(s_receiver.data,
+                                              s_receiver.data_size));
+    break;
+  case BOOTLOADER_EVENT_FLASH_DONE:
+    ymodem_receiver_done(&s_receiver, event->ok);
+    bootloader_led_toggle();
+    if (event->ok) {
+      bootloader_transition(BOOTLOADER_STATE_RECEIVING_FIRMWARE);
+    } else {
+      bootloader_end_receive(BOOTLOADER_FLASH_ERROR);
+    }
+    break;
+  default:
+    break;
+  }
+}
 
-      if (result == BOOTLOADER_OK) {
-        BOOTLOADER_LOG("Firmware verification successful!");
-        g_bootloader_context.state = BOOTLOADER_STATE_JUMP_TO_APP;
-      } else {
-        BOOTLOADER_LOG("Firmware verification failed!");
-        g_bootloader_context.state = BOOTLOADER_STATE_ERROR;
-      }
+#if BOOTLOADER_COMMANDS
+/**
+ * @brief Binary command session, see boot_command.h
+ * @note  Nothing is logged until it ends, the host reads raw replies
+ * @param event: Event to handle
+ */
+static void bootloader_on_command(const bootloader_event_t *event) {
+  switch (event->type) {
+  case BOOTLOADER_EVENT_ENTER:
+    boot_command_start(&s_work.command);
+    break;
+  case BOOTLOADER_EVENT_RX:
+    switch (boot_command_feed(&s_work.command, event->byte)) {
+    case BOOT_COMMAND_START_APP:
+      bootloader_transition(BOOTLOADER_STATE_JUMP_TO_APP);
+      break;
+    case BOOT_COMMAND_START_RAM:
+      BOOTLOADER_LOG("Starting RAM image...");
+      bootloader_jump_to_image(BOOT_COMMAND_RAM_ADDR);
+      break;
+    default:
       break;
+    }
+    break;
+  case BOOTLOADER_EVENT_TIMEOUT:
+    BOOTLOADER_LOG("Command session closed");
+    bootloader_transition(BOOTLOADER_STATE_WAIT_FOR_FIRMWARE);
+    break;
+  case BOOTLOADER_EVENT_TICK:
+    bootloader_led_toggle();
+    break;
+  default:
+    break;
+  }
+}
+#endif
 
-    case BOOTLOADER_STATE_JUMP_TO_APP:
-      if (bootloader_is_application_valid()) {
-        BOOTLOADER_LOG("Starting application...");
-        bootloader_jump_to_application();
-      } else {
-        BOOTLOADER_LOG("No valid application found!");
-        g_bootloader_context.state = BOOTLOADER_STATE_WAIT_FOR_FIRMWARE;
-      }
+#if BOOTLOADER_CAN || BOOTLOADER_BROADCAST
+/**
+ * @brief Check an image programmed in place and fill in the firmware info
+ * @note  The image is already in flash, its digest is taken from there
+ * @param size: Image size of the session
+ * @param crc32: Image CRC32 of the session, already checked against flash
+ * @return Bootloader result code
+ */
+static bootloader_result_t bootloader_finish_in_place(uint32_t size,
+                                                      uint32_t crc32) {
+  const boot_mailbox_t *request = bootloader_take_request();
+  firmware_info_t *info = &g_bootloader_context.firmware_info;
+  uint32_t hash_size = size;
+  sha256_ctx_t hash;
+
+  if ((request->image_size != 0 && request->image_size != size) ||
+      (request->image_crc32 != 0 && request->image_crc32 != crc32)) {
+    BOOTLOADER_LOG("Expected %d bytes, CRC32 0x%08X", request->image_size,
+                   request->image_crc32);
+    return BOOTLOADER_VERIFY_ERROR;
+  }
+#if BOOTLOADER_SECURE_BOOT
+  if (hash_size >= sizeof(firmware_signature_t)) {
+    hash_size -= sizeof(firmware_signature_t);
+  }
+#endif
+
+  info->size = size;
+  info->crc32 = crc32;
+  sha256_init(&hash);
+  sha256_update(&hash, (const uint8_t *)APPLICATION_START_ADDR, hash_size);
+  sha256_final(&hash, info->sha256);
+  boot_stats_add(BOOT_STAT_BYTES, size);
+  return BOOTLOADER_OK;
+}
+#endif
+
+#if BOOTLOADER_CAN
+/**
+ * @brief Start a CAN session from its ANNOUNCE
+ * @note  Logs before the erase, the host only starts sending once every
+ *        node has answered
+ */
+static void bootloader_begin_can(const can_frame_t *frame) {
+  BOOTLOADER_LOG("CAN session %d", BOOT_CAN_B(frame->id));
+  boot_stats_begin();
+  if (boot_can_start(&s_work.can, frame)) {
+    bootloader_transition(BOOTLOADER_STATE_CAN_SESSION);
+  } else {
+    boot_stats_end(BOOTLOADER_ERROR);
+    bootloader_transition(BOOTLOADER_STATE_ERROR);
+  }
+}
+
+/**
+ * @brief Leave a CAN session, on to the verification or the error state
+ * @param result: Result of the session
+ */
+static void bootloader_end_can(bootloader_result_t result) {
+  if (result == BOOTLOADER_OK) {
+    bootloader_transition(BOOTLOADER_STATE_VERIFYING_FIRMWARE);
+    return;
+  }
+  BOOTLOADER_LOG("CAN update failed: %d", result);
+  boot_stats_end(result);
+  bootloader_transition(BOOTLOADER_STATE_ERROR);
+}
+
+/**
+ * @brief CAN frame outside a session, an ANNOUNCE starts one
+ * @note  Only while waiting for firmware, a Y-modem transfer or command
+ *        session goes on and the host hears nothing from this node
+ */
+static void bootloader_on_can_idle(const can_frame_t *frame) {
+  if (boot_can_idle(frame) == BOOT_CAN_START &&
+      g_bootloader_context.state == BOOTLOADER_STATE_WAIT_FOR_FIRMWARE) {
+    bootloader_begin_can(frame);
+  }
+}
+
+/**
+ * @brief CAN multicast session, see boot_can.h
+ * @note  Nothing is logged until it ends, the three frame FIFO would
+ *        overflow meanwhile. Bytes on the UART are dropped.
+ * @param event: Event to handle
+ */
+static void bootloader_on_can(const bootloader_event_t *event) {
+  switch (event->type) {
+  case BOOTLOADER_EVENT_CAN:
+    switch (boot_can_feed(&s_work.can, event->frame)) {
+    case BOOT_CAN_START:
+      boot_stats_end(BOOTLOADER_ERROR);
+      bootloader_begin_can(event->frame);
+      break;
+    case BOOT_CAN_COMPLETE:
+      bootloader_end_can(
+          bootloader_finish_in_place(s_work.can.size, s_work.can.crc32));
+      break;
+    case BOOT_CAN_FAILED:
+      bootloader_end_can(BOOTLOADER_VERIFY_ERROR);
+      break;
+    default:
       break;
+    }
+    break;
+  case BOOTLOADER_EVENT_TIMEOUT:
+    BOOTLOADER_LOG("CAN session timed out, %d blocks missing",
+                   s_work.can.missing);
+    bootloader_end_can(BOOTLOADER_TIMEOUT);
+    break;
+  case BOOTLOADER_EVENT_TICK:
+    bootloader_led_toggle();
+    break;
+  default:
+    break;
+  }
+}
+#endif
 
-    case BOOTLOADER_STATE_ERROR:
-      BOOTLOADER_LOG("Bootloader error occurred!");
-      bootloader_led_toggle();
-      bootloader_delay_ms(100);
-      /* Reset to wait for firmware after error */
-      g_bootloader_context.state = BOOTLOADER_STATE_WAIT_FOR_FIRMWARE;
-      g_bootloader_context.error_count++;
+#if BOOTLOADER_BROADCAST
+/**
+ * @brief Start a broadcast session from its ANNOUNCE
+ * @note  Logs before the erase, the host leaves the line quiet for both
+ */
+static void bootloader_begin_broadcast(void) {
+  BOOTLOADER_LOG("Broadcast session %d", s_work.broadcast.packet[3]);
+  boot_stats_begin();
+  if (!boot_broadcast_start(&s_work.broadcast)) {
+    boot_stats_end(BOOTLOADER_ERROR);
+    bootloader_transition(BOOTLOADER_STATE_ERROR);
+  }
+}
 
-      if (g_bootloader_context.error_count > 5) {
-        bootloader_system_reset();
+/**
+ * @brief Leave a broadcast session, on to the verification or the error state
+ * @param result: Result of the session
+ */
+static void bootloader_end_broadcast(bootloader_result_t result) {
+  boot_stats_add(BOOT_STAT_CRC_ERRORS, s_work.broadcast.bad);
+  if (result == BOOTLOADER_OK) {
+    bootloader_transition(BOOTLOADER_STATE_VERIFYING_FIRMWARE);
+    return;
+  }
+  BOOTLOADER_LOG("Broadcast update failed: %d", result);
+  boot_stats_end(result);
+  bootloader_transition(BOOTLOADER_STATE_ERROR);
+}
+
+/**
+ * @brief Broadcast session, see boot_broadcast.h
+ * @note  Nothing is logged until it ends, the line does not wait for the
+ *        transmit. Without an ANNOUNCE before the timeout the bootloader
+ *        goes back to waiting for a Y-modem transfer.
+ * @param event: Event to handle
+ */
+static void bootloader_on_broadcast(const bootloader_event_t *event) {
+  boot_broadcast_session_t *session = &s_work.broadcast;
+
+  switch (event->type) {
+  case BOOTLOADER_EVENT_ENTER:
+    boot_broadcast_listen(session);
+    break;
+  case BOOTLOADER_EVENT_RX:
+    switch (boot_broadcast_feed(session, event->byte)) {
+    case BOOT_BROADCAST_START:
+      if (session->started) {
+        boot_stats_end(BOOTLOADER_ERROR);
       }
+      bootloader_begin_broadcast();
+      break;
+    case BOOT_BROADCAST_COMPLETE:
+      bootloader_end_broadcast(
+          bootloader_finish_in_place(session->size, session->crc32));
+      break;
+    case BOOT_BROADCAST_FAILED:
+      bootloader_end_broadcast(BOOTLOADER_VERIFY_ERROR);
       break;
-
     default:
-      g_bootloader_context.state = BOOTLOADER_STATE_ERROR;
       break;
     }
+    break;
+  case BOOTLOADER_EVENT_TIMEOUT:
+    if (!session->started) {
+      BOOTLOADER_LOG("Broadcast closed");
+      bootloader_transition(BOOTLOADER_STATE_WAIT_FOR_FIRMWARE);
+      break;
+    }
+    BOOTLOADER_LOG("Broadcast timed out, %d symbols missing",
+                   session->missing);
+    bootloader_end_broadcast(BOOTLOADER_TIMEOUT);
+    break;
+  case BOOTLOADER_EVENT_TICK:
+    bootloader_led_toggle();
+    break;
+  default:
+    break;
   }
+}
+#endif
 
-  return result;
+/**
+ * @brief Decide between the update and the application
+ */
+static void bootloader_on_check_conditions(void) {
+  bool enter = bootloader_should_enter();
+
+  boot_timing_mark(BOOT_PHASE_CONDITIONS);
+#if BOOTLOADER_STAGING
+  /* A broken application comes back from the staging flash, no host */
+  if ((g_bootloader_context.entry_reason == BOOTLOADER_ENTRY_NO_APPLICATION ||
+       g_bootloader_context.entry_reason ==
+           BOOTLOADER_ENTRY_CORRUPT_APPLICATION) &&
+      boot_staging_find(&s_install_slot)) {
+    BOOTLOADER_LOG("Restoring the application from slot %d", s_install_slot);
+    bootloader_transition(BOOTLOADER_STATE_VERIFYING_FIRMWARE);
+    return;
+  }
+#endif
+  if (enter) {
+    BOOTLOADER_LOG("Entering bootloader mode");
+    bootloader_transition(BOOTLOADER_STATE_WAIT_FOR_FIRMWARE);
+  } else {
+    BOOTLOADER_LOG("Jumping to application");
+    bootloader_transition(BOOTLOADER_STATE_JUMP_TO_APP);
+  }
+}
+
+/**
+ * @brief Verify the received image and commit its metadata
+ */
+static void bootloader_on_verifying(void) {
+  bootloader_result_t result = BOOTLOADER_OK;
+#if BOOTLOADER_STAGING
+  uint8_t slot = s_install_slot;
+
+  s_install_slot = BOOT_STAGING_NONE;
+  if (slot != BOOT_STAGING_NONE) {
+    BOOTLOADER_LOG("Installing from staging slot %d...", slot);
+    result = boot_staging_install(slot, s_work.install,
+                                  &g_bootloader_context.firmware_info);
+  }
+#endif
+
+  if (result == BOOTLOADER_OK) {
+    BOOTLOADER_LOG("Verifying firmware...");
+    result = bootloader_verify_firmware(&g_bootloader_context.firmware_info);
+  }
+  if (result == BOOTLOADER_OK) {
+    result = bootloader_verify_signature(&g_bootloader_context.firmware_info);
+  }
+  boot_timing_mark(BOOT_PHASE_VERIFY);
+  if (result == BOOTLOADER_OK) {
+    /* Metadata is only committed once the image checks out */
+    result =
+        bootloader_write_firmware_info(&g_bootloader_context.firmware_info);
+    boot_timing_mark(BOOT_PHASE_METADATA);
+  }
+  boot_stats_end(result);
+#if BOOTLOADER_CAN
+  boot_can_report(result);
+#endif
+
+  if (result == BOOTLOADER_OK) {
+    BOOTLOADER_LOG("Firmware verification successful!");
+    bootloader_transition(BOOTLOADER_STATE_JUMP_TO_APP);
+    return;
+  }
+
+  BOOTLOADER_LOG("Firmware verification failed!");
+#if BOOTLOADER_STAGING
+  /* A bad image is not installed again. The next slot gets its turn once
+   * the application is gone, a slot that failed its read back left it. */
+  if (slot != BOOT_STAGING_NONE && (result == BOOTLOADER_VERIFY_ERROR ||
+                                    result == BOOTLOADER_INVALID_APPLICATION)) {
+    boot_staging_reject(slot);
+    if ((!bootloader_is_application_valid() ||
+         !bootloader_is_application_intact()) &&
+        boot_staging_find(&s_install_slot)) {
+      bootloader_transition(BOOTLOADER_STATE_VERIFYING_FIRMWARE);
+      return;
+    }
+  }
+#endif
+  bootloader_transition(BOOTLOADER_STATE_ERROR);
+}
+
+/**
+ * @brief Back off after a failed session, then wait for firmware again
+ * @note  Bytes the host still sends meanwhile are dropped
+ * @param event: Event to handle
+ */
+static void bootloader_on_error(const bootloader_event_t *event) {
+  switch (event->type) {
+  case BOOTLOADER_EVENT_ENTER:
+    BOOTLOADER_LOG("Bootloader error occurred!");
+    bootloader_led_toggle();
+    g_bootloader_context.error_count++;
+    if (g_bootloader_context.error_count > BOOTLOADER_MAX_SESSION_ERRORS) {
+      bootloader_system_reset();
+    }
+    s_retry_at = HAL_GetTick() + BOOTLOADER_ERROR_BACKOFF_MS;
+    break;
+  case BOOTLOADER_EVENT_TIMEOUT:
+    bootloader_transition(BOOTLOADER_STATE_WAIT_FOR_FIRMWARE);
+    break;
+  default:
+    break;
+  }
+}
+
+/**
+ * @brief Hand an event to the current state
+ * @param event: Event to handle
+ */
+static void bootloader_dispatch(const bootloader_event_t *event) {
+  bool enter = event->type == BOOTLOADER_EVENT_ENTER;
+
+#if BOOTLOADER_CAN
+  if (event->type == BOOTLOADER_EVENT_CAN &&
+      g_bootloader_context.state != BOOTLOADER_STATE_CAN_SESSION) {
+    bootloader_on_can_idle(event->frame);
+    return;
+  }
+#endif
+
+  switch (g_bootloader_context.state) {
+  case BOOTLOADER_STATE_CHECK_CONDITIONS:
+    if (enter) {
+      bootloader_on_check_conditions();
+    }
+    break;
+
+  case BOOTLOADER_STATE_WAIT_FOR_FIRMWARE:
+  case BOOTLOADER_STATE_RECEIVING_FIRMWARE:
+    bootloader_on_transfer(event);
+    break;
+
+  case BOOTLOADER_STATE_PROGRAMMING_FLASH:
+    bootloader_on_programming(event);
+    break;
+
+#if BOOTLOADER_COMMANDS
+  case BOOTLOADER_STATE_COMMAND_SESSION:
+    bootloader_on_command(event);
+    break;
+#endif
+
+#if BOOTLOADER_CAN
+  case BOOTLOADER_STATE_CAN_SESSION:
+    bootloader_on_can(event);
+    break;
+#endif
+
+#if BOOTLOADER_BROADCAST
+  case BOOTLOADER_STATE_BROADCAST_SESSION:
+    bootloader_on_broadcast(event);
+    break;
+#endif
+
+  case BOOTLOADER_STATE_VERIFYING_FIRMWARE:
+    if (enter) {
+      bootloader_on_verifying();
+    }
+    break;
+
+  case BOOTLOADER_STATE_JUMP_TO_APP:
+    if (!enter) {
+      break;
+    }
+    if (bootloader_is_application_valid()) {
+      BOOTLOADER_LOG("Starting application...");
+      bootloader_jump_to_application();
+    } else {
+      BOOTLOADER_LOG("No valid application found!");
+      bootloader_transition(BOOTLOADER_STATE_WAIT_FOR_FIRMWARE);
+    }
+    break;
+
+  case BOOTLOADER_STATE_ERROR:
+    bootloader_on_error(event);
+    break;
+
+  default:
+    bootloader_transition(BOOTLOADER_STATE_ERROR);
+    break;
+  }
+}
+
+/**
+ * @brief Main bootloader execution loop
+ * @note  Run to completion: each event is handled in full before the next
+ *        one is taken. Between events the core sleeps until a byte or the
+ *        nearest deadline, so the LED tick and the timeouts are served
+ *        while no byte arrives.
+ * @return Bootloader result code, not reached since the loop ends in the
+ *         jump to the application or a reset
+ */
+bootloader_result_t bootloader_run(void) {
+  bootloader_event_t event;
+
+  s_tick_at = HAL_GetTick() + BOOTLOADER_TICK_MS;
+  bootloader_transition(BOOTLOADER_STATE_CHECK_CONDITIONS);
+
+  while (1) {
+    bootloader_next_event(&event);
+    bootloader_dispatch(&event);
+#if BOOTLOADER_IDLE == BOOT_IDLE_STOP
+    /* Whatever the step sent, a 'C' or an answer, the host may reply */
+    if (event.type != BOOTLOADER_EVENT_TICK) {
+      s_listen_until = HAL_GetTick() + BOOT_IDLE_LISTEN_MS;
+    }
+#endif
+  }
+
+  return BOOTLOADER_ERROR;
 }
 
 /**
@@ -137,27 +966,59 @@ bootloader_result_t bootloader_run(void) {
  * @return true if bootloader should enter, false otherwise
  */
 bool bootloader_should_enter(void) {
-  /* Check if button is pressed */
-  if (bootloader_is_button_pressed()) {
+  bootloader_entry_reason_t reason = g_bootloader_context.entry_reason;
+
+  /* Fast boot already decided, otherwise evaluate the conditions now */
+  if (reason == BOOTLOADER_ENTRY_NONE) {
+    reason = bootloader_get_entry_reason();
+    g_bootloader_context.entry_reason = reason;
+  }
+
+  switch (reason) {
+  case BOOTLOADER_ENTRY_BUTTON:
     BOOTLOADER_LOG("Button pressed - entering bootloader");
     return true;
+  case BOOTLOADER_ENTRY_MAGIC:
+    BOOTLOADER_LOG("Magic number detected - entering bootloader");
+    return true;
+  case BOOTLOADER_ENTRY_NO_APPLICATION:
+    BOOTLOADER_LOG("No valid application - entering bootloader");
+    return true;
+  case BOOTLOADER_ENTRY_CORRUPT_APPLICATION:
+    BOOTLOADER_LOG("Application CRC mismatch - entering bootloader");
+    return true;
+  default:
+    return false;
+  }
+}
+
+/**
+ * @brief Evaluate the entry conditions without logging
+ * @note  Safe to call before HAL_Init(), the magic number is consumed here
+ * @return Reason for staying in the bootloader, BOOTLOADER_ENTRY_NONE to jump
+ */
+static bootloader_entry_reason_t bootloader_get_entry_reason(void) {
+  /* Check if button is pressed */
+  if (bootloader_is_button_pressed()) {
+    return BOOTLOADER_ENTRY_BUTTON;
   }
 
-  /* Check magic number in RAM */
+  /* Check the application mailbox */
   if (bootloader_check_magic_number()) {
-    BOOTLOADER_LOG("Magic number detected - entering bootloader");
-    /* Clear magic number */
-    *((uint32_t *)BOOTLOADER_MAGIC_ADDR) = 0;
-    return true;
+    return BOOTLOADER_ENTRY_MAGIC;
   }
 
   /* Check if valid application exists */
   if (!bootloader_is_application_valid()) {
-    BOOTLOADER_LOG("No valid application - entering bootloader");
-    return true;
+    return BOOTLOADER_ENTRY_NO_APPLICATION;
   }
 
-  return false;
+  /* Check image integrity according to the boot policy */
+  if (!bootloader_is_application_intact()) {
+    return BOOTLOADER_ENTRY_CORRUPT_APPLICATION;
+  }
+
+  return BOOTLOADER_ENTRY_NONE;
 }
 
 /**
@@ -173,8 +1034,7 @@ bool bootloader_is_button_pressed(void) {
  * @return true if magic number is present, false otherwise
  */
 bool bootloader_check_magic_number(void) {
-  uint32_t magic = *((uint32_t *)BOOTLOADER_MAGIC_ADDR);
-  return (magic == BOOTLOADER_ENTER_MAGIC);
+  return bootloader_take_request()->command == BOOT_MAILBOX_CMD_ENTER_UPDATE;
 }
 
 /**
@@ -199,178 +1059,523 @@ bool bootloader_is_application_valid(void) {
 
   /* Check if application meta is valid */
   if (app_meta_magic != APPLICATION_META_MAGIC) {
-    BOOTLOADER_LOG("Invalid application meta, %x, %x", app_meta_magic,
-                   APPLICATION_META_MAGIC);
     return false;
   }
 
   return true;
 }
 
-/* Structure for packet callback context */
-typedef struct {
-  uint8_t buffer[FLASH_PAGE_SIZE];
-  uint32_t current_flash_address;
-  uint32_t total_written;
-  uint32_t file_crc32;
-  bool flash_unlocked;
-} packet_context_t;
 /**
- * @brief Packet processing callback for real-time flash writing
- * @param data: Packet data
- * @param data_size: Size of packet data
- * @param packet_num: Packet number
- * @param user_data: User context data
- * @return Y-modem result code
- */
-static bool bootloader_packet_callback(const uint8_t *data, uint16_t data_size,
-                                       uint32_t packet_num, void *user_data) {
-  packet_context_t *ctx = (packet_context_t *)user_data;
-  bootloader_result_t ret = bootloader_program_flash(
-      ctx->current_flash_address, (const char *)data, data_size);
-  if (ret != BOOTLOADER_OK) {
+ * @brief Check the application image against the digest in its metadata
+ * @note  Follows BOOTLOADER_BOOT_INTEGRITY. With the *_ONCE policies the
+ *        first successful check programs the verified mark, later boots only
+ *        read it back. Any update erases the metadata page and the mark.
+ * @return true if the image passes the configured check, false otherwise
+ */
+bool bootloader_is_application_intact(void) {
+#if BOOTLOADER_BOOT_INTEGRITY == BOOT_INTEGRITY_NONE
+  return true;
+#else
+  const firmware_info_t *info = (const firmware_info_t *)APPLICATION_META_ADDR;
+#if BOOTLOADER_BOOT_INTEGRITY == BOOT_INTEGRITY_SHA256_ONCE
+  sha256_ctx_t hash;
+  uint8_t digest[SHA256_DIGEST_SIZE];
+#else
+  uint32_t crc;
+#endif
+
+#if BOOT_INTEGRITY_USES_MARK
+  if (info->verified == APPLICATION_VERIFIED_MAGIC) {
+    return true;
+  }
+#endif
+
+  if (info->size == 0 || info->size > APPLICATION_MAX_SIZE) {
+    return false;
+  }
+
+#if BOOTLOADER_BOOT_INTEGRITY == BOOT_INTEGRITY_SHA256_ONCE
+  sha256_init(&hash);
+  sha256_update(&hash, (uint8_t *)APPLICATION_START_ADDR, info->size);
+  sha256_final(&hash, digest);
+  if (memcmp(digest, info->sha256, sizeof(digest)) != 0) {
+    return false;
+  }
+#else
+  crc = bootloader_crc32_update(0xFFFFFFFF, (uint8_t *)APPLICATION_START_ADDR,
+                                info->size);
+  if (crc != info->crc32) {
     return false;
   }
-  ctx->current_flash_address += data_size;
-  ctx->total_written += data_size;
-  ctx->file_crc32 = crc32_update(ctx->file_crc32, data, data_size);
+#endif
+
+#if BOOT_INTEGRITY_USES_MARK
+  bootloader_mark_application_verified();
+#endif
   return true;
+#endif
 }
 
 /**
- * @brief Receive firmware via Y-modem protocol
- * @return Bootloader result code
+ * @brief Program the verified mark into the application metadata
+ * @note  Works before HAL_Init(), the flash wait only polls BSY
  */
-bootloader_result_t bootloader_receive_firmware(void) {
-  ymodem_result_t ymodem_result;
-  bootloader_result_t result;
-  packet_context_t ctx;
+static void bootloader_mark_application_verified(void) {
+  uint32_t marker = APPLICATION_VERIFIED_MAGIC;
+
+  bootloader_program_flash(APPLICATION_META_ADDR +
+                               offsetof(firmware_info_t, verified),
+                           (uint8_t *)&marker, sizeof(marker));
+}
+
+/**
+ * @brief Check whether a flash page is erased
+ * @param page: Page address
+ * @return true if every word reads 0xFFFFFFFF
+ */
+static bool bootloader_is_page_blank(uint32_t page) {
+  const uint32_t *word = (const uint32_t *)page;
 
-  /* Initialize packet context */
-  memset(&ctx, 0, sizeof(packet_context_t));
-  ctx.current_flash_address = APPLICATION_START_ADDR;
-  ctx.file_crc32 = 0xFFFFFFFF;
-  ctx.flash_unlocked = false;
-  /* Initialize Y-modem receiver */
-  ymodem_result = ymodem_receive_init();
-  if (ymodem_result != YMODEM_OK) {
-    return BOOTLOADER_ERROR;
+  for (uint32_t i = 0; i < FLASH_PAGE_SIZE / sizeof(uint32_t); i++) {
+    if (word[i] != 0xFFFFFFFF) {
+      return false;
+    }
   }
+  return true;
+}
 
-  if (!ymodem_wait_receive_header(&g_file_info, 10)) {
-    BOOTLOADER_LOG("Timeout wait file");
-    return BOOTLOADER_ERROR;
+/**
+ * @brief Erase a page that holds data, retrying when it does not read blank
+ * @param page: Page address
+ * @return BOOTLOADER_OK once the page is blank
+ */
+bootloader_result_t bootloader_erase_page(uint32_t page) {
+  for (uint32_t attempt = 0; !bootloader_is_page_blank(page); attempt++) {
+    if (attempt > BOOTLOADER_ERASE_RETRIES) {
+      boot_stats_add(BOOT_STAT_FLASH_ERRORS, 1);
+      return BOOTLOADER_FLASH_ERROR;
+    }
+    if (attempt > 0) {
+      boot_stats_add(BOOT_STAT_FLASH_RETRIES, 1);
+    }
+    flash_if_erase(page, FLASH_PAGE_SIZE);
   }
+  return BOOTLOADER_OK;
+}
 
-  /* Erase application flash sectors first */
-  result = bootloader_erase_application_flash();
-  if (result != BOOTLOADER_OK) {
-    return result;
+/**
+ * @brief Erase the pages below an address that still hold data
+ * @note  Writes arrive in ascending order starting with the metadata page,
+ *        so nothing is erased before the first byte is accepted. Blank pages
+ *        are skipped, which leaves sparse holes and fresh flash alone.
+ * @param ctx: Packet context
+ * @param end: End of the range about to be programmed
+ * @return true on success
+ */
+static bool bootloader_prepare_flash(packet_context_t *ctx, uint32_t end) {
+#if BOOTLOADER_STAGING
+  if (ctx->slot != BOOT_STAGING_NONE) {
+    return boot_staging_prepare(ctx->slot, end - APPLICATION_START_ADDR);
   }
-  /* Receive file with callback for real-time processing */
-  ymodem_result = ymodem_receive_file_with_callback(
-      &g_file_info, bootloader_packet_callback, &ctx);
+#endif
+  for (; ctx->erased_end < end; ctx->erased_end += FLASH_PAGE_SIZE) {
+    if (bootloader_erase_page(ctx->erased_end) != BOOTLOADER_OK) {
+      BOOTLOADER_LOG("Flash erase failed");
+      return false;
+    }
+  }
+  return true;
+}
 
-  if (ymodem_result != YMODEM_OK) {
-    return BOOTLOADER_ERROR;
+/**
+ * @brief Fold image bytes into the image CRC32 and digest
+ */
+static void bootloader_hash_image(packet_context_t *ctx, const uint8_t *data,
+                                  uint32_t size) {
+  ctx->file_crc32 = crc32_update(ctx->file_crc32, data, size);
+
+  /* Digest on the fly so it is ready at EOT without another flash pass */
+  if (ctx->sha256.count < ctx->hash_size) {
+    uint32_t left = ctx->hash_size - ctx->sha256.count;
+    sha256_update(&ctx->sha256, data, size < left ? size : left);
   }
+  ctx->image_end += size;
+}
 
-  /* Update firmware info */
-  g_bootloader_context.firmware_info.size = g_file_info.file_size;
-  g_bootloader_context.firmware_info.crc32 = ctx.file_crc32;
+/**
+ * @brief Account for a hole up to an address, it reads 0xFF once erased
+ */
+static bool bootloader_skip_hole(packet_context_t *ctx, uint32_t address) {
+  uint8_t erased[32];
 
-  return BOOTLOADER_OK;
+  if (!bootloader_prepare_flash(ctx, address)) {
+    return false;
+  }
+  memset(erased, 0xFF, sizeof(erased));
+  while (ctx->image_end < address) {
+    uint32_t size = address - ctx->image_end;
+    bootloader_hash_image(ctx, erased,
+                          size < sizeof(erased) ? size : sizeof(erased));
+  }
+  return true;
 }
 
 /**
- * @brief Erase application flash pages
- * @return Bootloader result code
+ * @brief Program image bytes at an address at or above the image end
  */
-bootloader_result_t bootloader_erase_application_flash(void) {
-  FLASH_EraseInitTypeDef erase_init;
-  uint32_t page_error;
-  HAL_StatusTypeDef status;
+static bool bootloader_write_image(packet_context_t *ctx, uint32_t address,
+                                   const uint8_t *data, uint32_t size) {
+  if (!bootloader_skip_hole(ctx, address) ||
+      !bootloader_prepare_flash(ctx, address + size)) {
+    return false;
+  }
+#if BOOTLOADER_STAGING
+  if (ctx->slot != BOOT_STAGING_NONE) {
+    if (!boot_staging_write(ctx->slot, address - APPLICATION_START_ADDR, data,
+                            size)) {
+      return false;
+    }
+    bootloader_hash_image(ctx, data, size);
+    return true;
+  }
+#endif
+  if (bootloader_program_flash(address, data, size) != BOOTLOADER_OK) {
+    boot_stats_add(BOOT_STAT_FLASH_ERRORS, 1);
+    return false;
+  }
+  bootloader_hash_image(ctx, data, size);
+  return true;
+}
 
-  /* Unlock flash */
-  status = HAL_FLASH_Unlock();
-  if (status != HAL_OK) {
-    return BOOTLOADER_FLASH_ERROR;
+/**
+ * @brief Set the size of the image in flash, refuse one nobody asked for
+ * @note  Runs before the first write, the current image is still intact.
+ *        Only the image is hashed, not the signature block behind it.
+ * @return false if the application requested a different size
+ */
+static bool bootloader_set_image_size(packet_context_t *ctx,
+                                      uint32_t image_size) {
+  if (ctx->expected_size != 0 && ctx->expected_size != image_size) {
+    BOOTLOADER_LOG("Expected %d bytes, got %d", ctx->expected_size,
+                   image_size);
+    return false;
+  }
+  ctx->hash_size = image_size;
+#if BOOTLOADER_SECURE_BOOT
+  if (ctx->hash_size >= sizeof(firmware_signature_t)) {
+    ctx->hash_size -= sizeof(firmware_signature_t);
   }
+#endif
+  return true;
+}
 
-  /* Configure erase - erase all pages from application start to end */
-  erase_init.TypeErase = FLASH_TYPEERASE_PAGES;
-  erase_init.PageAddress = APPLICATION_META_ADDR;
-  erase_init.NbPages =
-      (FLASH_END_ADDR - APPLICATION_META_ADDR + 1) / FLASH_PAGE_SIZE;
+/**
+ * @brief Collect a header that may straddle packets
+ * @return true once all size bytes are in, data is advanced past them
+ */
+static bool bootloader_collect(packet_context_t *ctx, void *header,
+                               uint32_t size, const uint8_t **data,
+                               uint16_t *data_size) {
+  uint32_t take = size - ctx->fill;
 
-  /* Perform erase */
-  status = HAL_FLASHEx_Erase(&erase_init, &page_error);
+  if (take > *data_size) {
+    take = *data_size;
+  }
+  memcpy((uint8_t *)header + ctx->fill, *data, take);
+  ctx->fill += take;
+  *data += take;
+  *data_size -= take;
+  if (ctx->fill < size) {
+    return false;
+  }
+  ctx->fill = 0;
+  return true;
+}
 
-  /* Lock flash */
-  HAL_FLASH_Lock();
+/**
+ * @brief Start a sparse container once its header is in
+ * @return true if the header describes an image that fits
+ */
+static bool bootloader_start_sparse(packet_context_t *ctx) {
+  const firmware_sparse_t *container = &ctx->container;
 
-  if (status != HAL_OK) {
-    BOOTLOADER_LOG("Flash erase failed, page error: 0x%x", page_error);
-    return BOOTLOADER_FLASH_ERROR;
+  if (container->image_size == 0 ||
+      container->image_size > APPLICATION_MAX_SIZE ||
+      container->segment_count == 0) {
+    BOOTLOADER_LOG("Invalid sparse container");
+    return false;
   }
-
-  return BOOTLOADER_OK;
+  ctx->segments_left = container->segment_count;
+  ctx->container_ready = true;
+  return bootloader_set_image_size(ctx, container->image_size);
 }
 
 /**
- * @brief Program flash memory
- * @param address: Start address to program
- * @param data: Data buffer
- * @param size: Data size
- * @return Bootloader result code
+ * @brief Unpack a sparse container into flash
+ * @note  Segments are checked against their CRC32 as they complete. Holes
+ *        between them are never sent, and only erased when they hold data.
+ * @return false on a malformed container or a flash error
  */
-bootloader_result_t
-bootloader_program_flash(uint32_t address, const uint8_t *data, uint32_t size) {
-  HAL_StatusTypeDef status;
-  uint32_t current_address = address;
-  uint32_t data_index = 0;
+static bool bootloader_unpack_sparse(packet_context_t *ctx,
+                                     const uint8_t *data, uint16_t data_size) {
+  while (data_size > 0) {
+    uint32_t image_limit = APPLICATION_START_ADDR + ctx->container.image_size;
+    uint32_t take;
+
+    if (!ctx->container_ready) {
+      if (!bootloader_collect(ctx, &ctx->container, sizeof(ctx->container),
+                              &data, &data_size)) {
+        return true;
+      }
+      if (!bootloader_start_sparse(ctx)) {
+        return false;
+      }
+      continue;
+    }
+    if (ctx->segment_left == 0) {
+      if (ctx->segments_left == 0) {
+        return false; /* data behind the last segment */
+      }
+      if (!bootloader_collect(ctx, &ctx->segment, sizeof(ctx->segment),
+                              &data, &data_size)) {
+        return true;
+      }
+      if (ctx->segment.address < ctx->image_end ||
+          ctx->segment.address > image_limit ||
+          ((ctx->segment.address | ctx->segment.size) & 1) != 0 ||
+          ctx->segment.size == 0 ||
+          ctx->segment.size > image_limit - ctx->segment.address) {
+        BOOTLOADER_LOG("Invalid segment 0x%08X, %u bytes",
+                       ctx->segment.address, ctx->segment.size);
+        return false;
+      }
+      ctx->segments_left--;
+      ctx->segment_left = ctx->segment.size;
+      ctx->segment_crc32 = 0xFFFFFFFF;
+      continue;
+    }
 
-  /* Unlock flash */
-  status = HAL_FLASH_Unlock();
-  if (status != HAL_OK) {
-    return BOOTLOADER_FLASH_ERROR;
+    take = data_size < ctx->segment_left ? data_size : ctx->segment_left;
+    if (!bootloader_write_image(ctx, ctx->segment.address, data, take)) {
+      return false;
+    }
+    ctx->segment_crc32 = crc32_update(ctx->segment_crc32, data, take);
+    ctx->segment.address += take;
+    ctx->segment_left -= take;
+    data += take;
+    data_size -= (uint16_t)take;
+    if (ctx->segment_left == 0 && ctx->segment_crc32 != ctx->segment.crc32) {
+      BOOTLOADER_LOG("Segment CRC mismatch at 0x%08X", ctx->segment.address);
+      return false;
+    }
   }
+  return true;
+}
 
-  /* Program flash halfword by halfword (16-bit) for STM32F1xx */
-  while (data_index < size) {
-    uint16_t halfword_data = 0;
+/**
+ * @brief Check that a sparse container arrived complete and pad its tail
+ * @return true if every segment was received and the image CRC32 matches
+ */
+static bool bootloader_finish_sparse(packet_context_t *ctx) {
+  if (ctx->segments_left != 0 || ctx->segment_left != 0 ||
+      !bootloader_skip_hole(ctx, APPLICATION_START_ADDR +
+                                     ctx->container.image_size)) {
+    return false;
+  }
+  return ctx->file_crc32 == ctx->container.image_crc32;
+}
+/**
+ * @brief Decrypt, unpack and program one packet of the transfer
+ * @param data: Packet data
+ * @param data_size: Size of packet data
+ * @return true on success, false cancels the transfer
+ */
+static bool bootloader_process_packet(const uint8_t *data,
+                                      uint16_t data_size) {
+  packet_context_t *ctx = &s_work.receive;
+  uint32_t start_cycles = boot_timing_now();
+  bool ok;
+
+#if BOOTLOADER_ENCRYPTION
+  /* The file starts with the encryption header, which is not flashed */
+  if (ctx->header_size < sizeof(ctx->header)) {
+    uint32_t take = sizeof(ctx->header) - ctx->header_size;
+    if (take > data_size) {
+      take = data_size;
+    }
+    memcpy((uint8_t *)&ctx->header + ctx->header_size, data, take);
+    ctx->header_size += take;
+    data += take;
+    data_size -= take;
+    if (ctx->header_size < sizeof(ctx->header)) {
+      return true;
+    }
+    if (ctx->header.magic != FIRMWARE_ENCRYPTION_MAGIC) {
+      return false; /* plaintext image, refuse it */
+    }
+    chacha20_init(&ctx->cipher, bootloader_encryption_key, ctx->header.nonce,
+                  0);
+  }
 
-    /* Prepare 16-bit halfword from byte array */
-    halfword_data = data[data_index];
-    if ((data_index + 1) < size) {
-      halfword_data |= ((uint16_t)data[data_index + 1]) << 8;
+  /* Decrypt into the packet buffer, everything below sees plaintext */
+  chacha20_crypt(&ctx->cipher, data, ctx->buffer, data_size);
+  data = ctx->buffer;
+#endif
+
+  /* The first bytes tell a sparse container from a flat image */
+  if (!ctx->format_known) {
+    ctx->format_known = true;
+    ctx->sparse = data_size >= sizeof(uint32_t) &&
+                  memcmp(data, &(uint32_t){FIRMWARE_SPARSE_MAGIC},
+                         sizeof(uint32_t)) == 0;
+    if (!ctx->sparse && !bootloader_set_image_size(ctx, ctx->file_size)) {
+      return false;
     }
+  }
 
-    /* Program halfword */
-    status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, current_address,
-                               halfword_data);
-    if (status != HAL_OK) {
-      HAL_FLASH_Lock();
+  if (ctx->sparse) {
+    ok = bootloader_unpack_sparse(ctx, data, data_size);
+  } else {
+    ok = bootloader_write_image(ctx, ctx->image_end, data, data_size);
+  }
+
+  boot_timing_packet(start_cycles);
+  return ok;
+}
+
+/**
+ * @brief Single-byte host commands accepted while waiting for a transfer
+ * @param command: Received byte
+ * @return true if the byte was a command and has been answered
+ */
+static bool bootloader_command_handler(uint8_t command) {
+  switch (command) {
+  case BOOT_TIMING_COMMAND:
+    boot_timing_report();
+    return true;
+  case BOOT_STATS_COMMAND:
+    boot_stats_report();
+    return true;
+  default:
+    return false;
+  }
+}
+
+/**
+ * @brief Reset the packet context and wait for a Y-modem transfer
+ */
+static void bootloader_begin_receive(void) {
+  packet_context_t *ctx = &s_work.receive;
+
+  /* Initialize packet context, nothing is erased before the first write */
+  memset(ctx, 0, sizeof(packet_context_t));
+  ctx->image_end = APPLICATION_START_ADDR;
+  ctx->erased_end = APPLICATION_META_PAGE_ADDR;
+  ctx->file_crc32 = 0xFFFFFFFF;
+#if BOOTLOADER_STAGING
+  ctx->slot = BOOT_STAGING_NONE;
+#endif
+  ymodem_receiver_start(&s_receiver, &g_file_info);
+}
+
+/**
+ * @brief Set up the receive from the header packet
+ * @return Bootloader result code, anything but OK cancels the transfer
+ */
+static bootloader_result_t bootloader_accept_header(void) {
+  packet_context_t *ctx = &s_work.receive;
+
+  /* The encryption header in front of the image is not hashed */
+  sha256_init(&ctx->sha256);
+  ctx->file_size = g_file_info.file_size;
+#if BOOTLOADER_ENCRYPTION
+  if (ctx->file_size < sizeof(firmware_encryption_t)) {
+    return BOOTLOADER_INVALID_APPLICATION;
+  }
+  ctx->file_size -= sizeof(firmware_encryption_t);
+#endif
+
+  /* Checked once the first packet shows the image size */
+  ctx->expected_size = bootloader_take_request()->image_size;
+
+#if BOOTLOADER_STAGING
+  /* The application is left alone until the whole image is staged */
+  if (boot_staging_present()) {
+    ctx->slot = strcmp(g_file_info.filename, BOOT_STAGING_GOLDEN_NAME) == 0
+                    ? BOOT_STAGING_GOLDEN
+                    : BOOT_STAGING_UPDATE;
+    if (!boot_staging_open(ctx->slot)) {
       return BOOTLOADER_FLASH_ERROR;
     }
+  }
+#endif
+  return BOOTLOADER_OK;
+}
 
-    /* Verify programmed data */
-    if (*((uint16_t *)current_address) != halfword_data) {
-      HAL_FLASH_Lock();
+/**
+ * @brief Check a complete transfer and fill in the firmware info
+ * @return Bootloader result code
+ */
+static bootloader_result_t bootloader_finish_receive(void) {
+  const boot_mailbox_t *request = bootloader_take_request();
+  packet_context_t *ctx = &s_work.receive;
+
+  if (ctx->sparse && !bootloader_finish_sparse(ctx)) {
+    BOOTLOADER_LOG("Sparse image incomplete");
+    return BOOTLOADER_VERIFY_ERROR;
+  }
+  if (request->image_crc32 != 0 && request->image_crc32 != ctx->file_crc32) {
+    return BOOTLOADER_VERIFY_ERROR;
+  }
+
+  /* Update firmware info */
+  g_bootloader_context.firmware_info.size =
+      ctx->image_end - APPLICATION_START_ADDR;
+  g_bootloader_context.firmware_info.crc32 = ctx->file_crc32;
+  sha256_final(&ctx->sha256, g_bootloader_context.firmware_info.sha256);
+
+#if BOOTLOADER_STAGING
+  if (ctx->slot != BOOT_STAGING_NONE) {
+    if (!boot_staging_close(ctx->slot, &g_bootloader_context.firmware_info)) {
       return BOOTLOADER_FLASH_ERROR;
     }
+    s_install_slot = ctx->slot;
+  }
+#endif
+  return BOOTLOADER_OK;
+}
 
-    current_address += 2;
-    data_index += 2;
+/**
+ * @brief Erase application flash pages
+ * @return Bootloader result code
+ */
+bootloader_result_t bootloader_erase_application_flash(void) {
+  /* Erase all pages from the metadata page to the end */
+  if (flash_if_erase(APPLICATION_META_PAGE_ADDR,
+                     FLASH_END_ADDR + 1 - APPLICATION_META_PAGE_ADDR) !=
+      FLASH_IF_OK) {
+    BOOTLOADER_LOG("Flash erase failed");
+    return BOOTLOADER_FLASH_ERROR;
+  }
 
-    /* Toggle LED to show progress */
-    if ((data_index % 128) == 0) {
-      bootloader_led_toggle();
-    }
+  return BOOTLOADER_OK;
+}
+
+/**
+ * @brief Program flash memory
+ * @param address: Start address to program
+ * @param data: Data buffer
+ * @param size: Data size
+ * @return Bootloader result code
+ */
+bootloader_result_t
+bootloader_program_flash(uint32_t address, const uint8_t *data, uint32_t size) {
+  if (flash_if_program(address, data, size) != FLASH_IF_OK) {
+    return BOOTLOADER_FLASH_ERROR;
   }
 
-  /* Lock flash */
-  HAL_FLASH_Lock();
+  /* Toggle LED to show progress */
+  bootloader_led_toggle();
 
   return BOOTLOADER_OK;
 }
@@ -385,22 +1590,111 @@ bootloader_verify_firmware(const firmware_info_t *firmware_info) {
   uint32_t calculated_crc;
   uint8_t *flash_data = (uint8_t *)APPLICATION_START_ADDR;
 
+  if (firmware_info->size == 0 ||
+      firmware_info->size > APPLICATION_MAX_SIZE) {
+    return BOOTLOADER_INVALID_APPLICATION;
+  }
+
   /* Calculate CRC32 of flash contents */
-  calculated_crc = crc32_update(0xffffffff, flash_data, firmware_info->size);
+  calculated_crc =
+      bootloader_crc32_update(0xffffffff, flash_data, firmware_info->size);
 
-  BOOTLOADER_LOG("CRC verification: expected 0x%x, got 0x%x",
+  BOOTLOADER_LOG("CRC verification: expected 0x%08X, got 0x%08X",
                  firmware_info->crc32, calculated_crc);
   /* Compare with expected CRC */
   if (calculated_crc != firmware_info->crc32) {
     return BOOTLOADER_VERIFY_ERROR;
   }
 
-  /* Check if application looks valid */
-  if (!bootloader_is_application_valid()) {
-    BOOTLOADER_LOG("Invalid firmware");
-    return BOOTLOADER_INVALID_APPLICATION;
+  return BOOTLOADER_OK;
+}
+
+/**
+ * @brief Check the signature block at the end of the received image
+ * @param firmware_info: Firmware information, switched over to the signed
+ *        image (size, version and CRC32 without the block) on success
+ * @return Bootloader result code, always OK without secure boot
+ */
+bootloader_result_t
+bootloader_verify_signature(firmware_info_t *firmware_info) {
+#if BOOTLOADER_SECURE_BOOT
+  firmware_signature_t *block = &s_work.signature.block;
+  firmware_info_t *header = &s_work.signature.header;
+  sha512_ctx_t *hash = &s_work.signature.hash;
+  uint32_t start_tick;
+  bool valid;
+
+  if (firmware_info->size < sizeof(*block)) {
+    return BOOTLOADER_VERIFY_ERROR;
+  }
+
+  /* The block follows the image at any byte offset, copy it out aligned */
+  memcpy(block,
+         (const uint8_t *)APPLICATION_START_ADDR + firmware_info->size -
+             sizeof(*block),
+         sizeof(*block));
+  if (block->magic != FIRMWARE_SIGNATURE_MAGIC ||
+      block->size != firmware_info->size - sizeof(*block)) {
+    BOOTLOADER_LOG("Image is not signed");
+    return BOOTLOADER_VERIFY_ERROR;
+  }
+  if (bootloader_crc32_update(0xffffffff, (uint8_t *)APPLICATION_START_ADDR,
+                              block->size) != block->crc32) {
+    return BOOTLOADER_VERIFY_ERROR;
+  }
+
+  header->magic = APPLICATION_META_MAGIC;
+  header->version = block->version;
+  header->size = block->size;
+  header->crc32 = block->crc32;
+  memcpy(header->sha256, firmware_info->sha256, sizeof(header->sha256));
+  header->verified = 0xFFFFFFFF;
+
+  /* Hash straight from flash, the image never has to fit in RAM */
+  start_tick = HAL_GetTick();
+  ed25519_verify_start(hash, block->signature, bootloader_signing_key);
+  sha512_update(hash, (const uint8_t *)APPLICATION_START_ADDR, block->size);
+  sha512_update(hash, (const uint8_t *)header,
+                offsetof(firmware_info_t, verified));
+  valid = ed25519_verify_finish(hash, block->signature, bootloader_signing_key);
+
+  BOOTLOADER_LOG("Signature %s, %d ms", valid ? "valid" : "INVALID",
+                 HAL_GetTick() - start_tick);
+  if (!valid) {
+    return BOOTLOADER_VERIFY_ERROR;
+  }
+
+  *firmware_info = *header;
+#else
+  (void)firmware_info;
+#endif
+  return BOOTLOADER_OK;
+}
+
+/**
+ * @brief Commit firmware metadata after a successful verification
+ * @param firmware_info: Firmware information, magic is filled in here
+ * @return Bootloader result code
+ */
+bootloader_result_t
+bootloader_write_firmware_info(firmware_info_t *firmware_info) {
+  bootloader_result_t result;
+
+  firmware_info->magic = APPLICATION_META_MAGIC;
+  firmware_info->verified = 0xFFFFFFFF;
+
+  /* The verified mark stays erased so it can be programmed later */
+  result = bootloader_program_flash(APPLICATION_META_ADDR,
+                                    (uint8_t *)firmware_info,
+                                    offsetof(firmware_info_t, verified));
+  if (result != BOOTLOADER_OK) {
+    return result;
   }
 
+#if BOOT_INTEGRITY_USES_MARK
+  /* The image was just checked, spare the next boot the CRC pass */
+  bootloader_mark_application_verified();
+#endif
   return BOOTLOADER_OK;
 }
 
@@ -408,20 +1702,40 @@ bootloader_verify_firmware(const firmware_info_t *firmware_info) {
  * @brief Jump to application
  */
 void bootloader_jump_to_application(void) {
-  uint32_t app_stack_ptr = *((uint32_t *)APPLICATION_START_ADDR);
-  uint32_t app_reset_vector = *((uint32_t *)(APPLICATION_START_ADDR + 4));
-
-  /* Function pointer for application reset handler */
-  void (*app_reset_handler)(void) = (void (*)(void))(app_reset_vector);
+  bootloader_jump_to_image(APPLICATION_START_ADDR);
+}
 
+/**
+ * @brief Jump to an image, the application or a RAM image
+ * @param vectors: Address of its vector table
+ */
+void bootloader_jump_to_image(uint32_t vectors) {
   /* Disable all interrupts */
   bootloader_disable_interrupts();
 
   /* Deinitialize peripherals */
   bootloader_deinit_peripherals();
 
-  /* Set vector table to application */
-  bootloader_set_application_vector_table();
+  bootloader_start_image(vectors);
+}
+
+/**
+ * @brief Hand control to the reset handler of an image
+ * @note  Expects peripherals already in reset state, used directly by the
+ *        fast-boot path where nothing has been initialized
+ * @param vectors: Address of its vector table, VTOR alignment
+ */
+static void bootloader_start_image(uint32_t vectors) {
+  uint32_t app_stack_ptr = *((uint32_t *)vectors);
+  uint32_t app_reset_vector = *((uint32_t *)(vectors + 4));
+
+  /* Function pointer for application reset handler */
+  void (*app_reset_handler)(void) = (void (*)(void))(app_reset_vector);
+
+  boot_timing_mark(BOOT_PHASE_JUMP);
+
+  /* Set vector table to the image */
+  SCB->VTOR = vectors;
 
   /* Set main stack pointer */
   __set_MSP(app_stack_ptr);
@@ -430,13 +1744,6 @@ void bootloader_jump_to_application(void) {
   app_reset_handler();
 }
 
-/**
- * @brief Set vector table to application address
- */
-static void bootloader_set_application_vector_table(void) {
-  SCB->VTOR = APPLICATION_START_ADDR;
-}
-
 /**
  * @brief Print bootloader banner
  */
@@ -452,26 +1759,49 @@ void bootloader_print_banner(void) {
 }
 
 /**
- * @brief Calculate CRC32
+ * @brief Calculate CRC32 with the CRC peripheral, same result as crc32_update()
+ * @note  The F1 CRC unit is MSB-first with a fixed 0xFFFFFFFF seed, so words
+ *        are bit-reversed on the way in and out and the running CRC is folded
+ *        into the first word. Unaligned buffers and the tail use the table.
+ * @param crc: Running CRC32 (0xFFFFFFFF to start)
  * @param data: Data buffer
  * @param size: Data size
  * @return CRC32 value
  */
-uint32_t bootloader_calculate_crc32(uint8_t *data, uint32_t size) {
-  uint32_t crc = 0xFFFFFFFF;
+uint32_t bootloader_crc32_update(uint32_t crc, const uint8_t *data,
+                                 uint32_t size) {
+#if BOOTLOADER_HW_CRC
+  const uint32_t *words = (const uint32_t *)data;
+  uint32_t count = size / 4;
+
+  if (count == 0 || ((uintptr_t)data & 3) != 0) {
+    return crc32_update(crc, data, size);
+  }
 
-  for (uint32_t i = 0; i < size; i++) {
-    crc ^= data[i];
-    for (int j = 0; j < 8; j++) {
-      if (crc & 1) {
-        crc = (crc >> 1) ^ 0xEDB88320;
-      } else {
-        crc >>= 1;
-      }
-    }
+  __HAL_RCC_CRC_CLK_ENABLE();
+  CRC->CR = CRC_CR_RESET;
+
+  CRC->DR = __RBIT(*words++ ^ crc);
+  count--;
+  while (count >= 4) {
+    CRC->DR = __RBIT(words[0]);
+    CRC->DR = __RBIT(words[1]);
+    CRC->DR = __RBIT(words[2]);
+    CRC->DR = __RBIT(words[3]);
+    words += 4;
+    count -= 4;
+  }
+  while (count--) {
+    CRC->DR = __RBIT(*words++);
   }
+  crc = __RBIT(CRC->DR) ^ 0xFFFFFFFF;
+
+  __HAL_RCC_CRC_CLK_DISABLE();
 
-  return ~crc;
+  return crc32_update(crc, (const uint8_t *)words, size & 3);
+#else
+  return crc32_update(crc, data, size);
+#endif
 }
 
 /**
@@ -513,6 +1843,15 @@ void bootloader_disable_interrupts(void) {
  * @brief Deinitialize peripherals
  */
 void bootloader_deinit_peripherals(void) {
+#if BOOTLOADER_IDLE != BOOT_IDLE_RUN
+  boot_idle_deinit();
+#endif
+#if BOOTLOADER_STAGING
+  boot_staging_deinit();
+#endif
+#if BOOTLOADER_CAN
+  boot_can_deinit();
+#endif
   HAL_UART_DeInit(&huart1);
   HAL_DeInit();
 }
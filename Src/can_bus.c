@@ -0,0 +1,182 @@
+#include "bootloader.h"
+#include "can_bus.h"
+#include "boot_can.h"
+#include "main.h"
+
+#if BOOTLOADER_CAN
+
+/*
+ * bxCAN at BOOT_CAN_BITRATE from PCLK1 = 36 MHz: prescaler 4, 18 time
+ * quanta of 1 + 15 + 2, sampled at 89%, resync jump width 1.
+ *
+ *   PA11 CAN_RX  PA12 CAN_TX  (no remap)
+ *
+ * No interrupt handler: FMPIE0 only makes the RX0 IRQ pending, which the
+ * idle wait (boot_idle.c) turns into a wake-up event.
+ */
+_Static_assert(BOOT_CAN_BITRATE == 500000, "bit timing is set for 500 kbit/s");
+#define CAN_BUS_BTR                                                            \
+  ((3U << CAN_BTR_BRP_Pos) | (14U << CAN_BTR_TS1_Pos) | (1U << CAN_BTR_TS2_Pos))
+
+/* PA11 input with pull-up, PA12 alternate push-pull 50 MHz, in CRH bits
+ * 12-19 */
+#define CAN_BUS_CRH_MASK 0x000FF000U
+#define CAN_BUS_CRH_PINS 0x000B8000U
+#define CAN_BUS_CRH_RESET 0x00044000U
+#define CAN_BUS_RX_PIN GPIO_BSRR_BS11
+
+#define CAN_BUS_INIT_TIMEOUT_MS 10 /* 11 recessive bits, or no transceiver */
+#define CAN_BUS_DRAIN_TIMEOUT_MS 5 /* frames still queued at the jump */
+
+/* Filter 0 in 32-bit mask mode: extended data frames of the host types,
+ * BOOT_CAN_HOST_FIRST up to the node types */
+#define CAN_BUS_FILTER_ID                                                      \
+  ((uint32_t)BOOT_CAN_HOST_FIRST << 24 << CAN_TI0R_EXID_Pos | CAN_TI0R_IDE)
+#define CAN_BUS_FILTER_MASK                                                    \
+  ((uint32_t)BOOT_CAN_HOST_MASK << 24 << CAN_TI0R_EXID_Pos | CAN_TI0R_IDE |   \
+   CAN_TI0R_RTR)
+
+/**
+ * @brief Wait for the controller to confirm a mode change
+ * @return false if it did not within CAN_BUS_INIT_TIMEOUT_MS
+ */
+static bool can_bus_wait_init(bool init) {
+  uint32_t start = HAL_GetTick();
+
+  while (((CAN1->MSR & CAN_MSR_INAK) != 0) != init) {
+    if (HAL_GetTick() - start > CAN_BUS_INIT_TIMEOUT_MS) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Clock and configure CAN1, its pins and the receive filter
+ * @note  Without a transceiver the controller never sees the bus idle and
+ *        stays in initialization mode, sends then fail and nothing arrives
+ */
+void can_bus_init(void) {
+  RCC->APB2ENR |= RCC_APB2ENR_IOPAEN;
+  RCC->APB1ENR |= RCC_APB1ENR_CAN1EN;
+
+  GPIOA->BSRR = CAN_BUS_RX_PIN;
+  GPIOA->CRH = (GPIOA->CRH & ~CAN_BUS_CRH_MASK) | CAN_BUS_CRH_PINS;
+
+  CAN1->MCR = CAN_MCR_INRQ;
+  if (!can_bus_wait_init(true)) {
+    return;
+  }
+  /* Leave bus-off on its own, send in request order */
+  CAN1->MCR = CAN_MCR_INRQ | CAN_MCR_ABOM | CAN_MCR_TXFP;
+  CAN1->BTR = CAN_BUS_BTR;
+
+  CAN1->FMR |= CAN_FMR_FINIT;
+  CAN1->FA1R &= ~1U;
+  CAN1->FS1R |= 1U;
+  CAN1->FM1R &= ~1U;
+  CAN1->FFA1R &= ~1U;
+  CAN1->sFilterRegister[0].FR1 = CAN_BUS_FILTER_ID;
+  CAN1->sFilterRegister[0].FR2 = CAN_BUS_FILTER_MASK;
+  CAN1->FA1R |= 1U;
+  CAN1->FMR &= ~CAN_FMR_FINIT;
+
+  CAN1->IER = CAN_IER_FMPIE0;
+  CAN1->MCR &= ~CAN_MCR_INRQ;
+  can_bus_wait_init(false);
+}
+
+/**
+ * @brief Check for a received frame without taking it
+ */
+bool can_bus_pending(void) { return (CAN1->RF0R & CAN_RF0R_FMP0) != 0; }
+
+/**
+ * @brief Take the oldest frame out of FIFO 0
+ * @return false if the FIFO is empty
+ */
+bool can_bus_receive(can_frame_t *frame) {
+  const CAN_FIFOMailBox_TypeDef *mailbox = &CAN1->sFIFOMailBox[0];
+  uint32_t low;
+  uint32_t high;
+
+  if (!can_bus_pending()) {
+    return false;
+  }
+  frame->id = mailbox->RIR >> CAN_RI0R_EXID_Pos;
+  frame->size = (uint8_t)(mailbox->RDTR & CAN_RDT0R_DLC);
+  if (frame->size > sizeof(frame->data)) {
+    frame->size = sizeof(frame->data);
+  }
+  low = mailbox->RDLR;
+  high = mailbox->RDHR;
+  for (uint32_t i = 0; i < 4; i++) {
+    frame->data[i] = (uint8_t)(low >> (8 * i));
+    frame->data[4 + i] = (uint8_t)(high >> (8 * i));
+  }
+  CAN1->RF0R = CAN_RF0R_RFOM0 | CAN_RF0R_FOVR0;
+  return true;
+}
+
+/**
+ * @brief Queue a frame in a free transmit mailbox
+ * @return false if none freed up within CAN_BUS_TX_TIMEOUT_MS
+ */
+bool can_bus_send(const can_frame_t *frame) {
+  uint32_t start = HAL_GetTick();
+  CAN_TxMailBox_TypeDef *mailbox;
+  uint32_t low = 0;
+  uint32_t high = 0;
+
+  while ((CAN1->TSR & CAN_TSR_TME) == 0) {
+    if (HAL_GetTick() - start > CAN_BUS_TX_TIMEOUT_MS) {
+      return false;
+    }
+  }
+  mailbox = &CAN1->sTxMailBox[(CAN1->TSR & CAN_TSR_CODE) >> CAN_TSR_CODE_Pos];
+
+  for (uint32_t i = 0; i < 4; i++) {
+    low |= (uint32_t)frame->data[i] << (8 * i);
+    high |= (uint32_t)frame->data[4 + i] << (8 * i);
+  }
+  mailbox->TIR = frame->id << CAN_TI0R_EXID_Pos | CAN_TI0R_IDE;
+  mailbox->TDTR = frame->size;
+  mailbox->TDLR = low;
+  mailbox->TDHR = high;
+  mailbox->TIR |= CAN_TI0R_TXRQ;
+  return true;
+}
+
+/**
+ * @brief Node address from the 96-bit unique ID
+ * @return Never BOOT_CAN_ALL
+ */
+uint16_t can_bus_node_id(void) {
+  const uint16_t *uid = (const uint16_t *)UID_BASE;
+  uint16_t id = 0;
+
+  for (uint32_t i = 0; i < 6; i++) {
+    id ^= uid[i];
+  }
+  return id == BOOT_CAN_ALL ? (uint16_t)(BOOT_CAN_ALL - 1) : id;
+}
+
+/**
+ * @brief Hand CAN1 and PA11/PA12 back in their reset state
+ * @note  Answers still in the mailboxes get a moment to go out
+ */
+void can_bus_deinit(void) {
+  uint32_t start = HAL_GetTick();
+
+  while ((CAN1->TSR & CAN_TSR_TME) != CAN_TSR_TME &&
+         HAL_GetTick() - start <= CAN_BUS_DRAIN_TIMEOUT_MS) {
+  }
+  RCC->APB1RSTR |= RCC_APB1RSTR_CAN1RST;
+  RCC->APB1RSTR &= ~RCC_APB1RSTR_CAN1RST;
+  GPIOA->CRH = (GPIOA->CRH & ~CAN_BUS_CRH_MASK) | CAN_BUS_CRH_RESET;
+  GPIOA->BSRR = CAN_BUS_RX_PIN << 16;
+  RCC->APB1ENR &= ~RCC_APB1ENR_CAN1EN;
+  NVIC_ClearPendingIRQ(USB_LP_CAN1_RX0_IRQn);
+}
+
+#endif
@@ -0,0 +1,130 @@
+#include "chacha20.h"
+#include <string.h>
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/* Each rotate folds into the following EOR/ADD on Cortex-M3 */
+#define QUARTER_ROUND(a, b, c, d)                                              \
+  do {                                                                         \
+    a += b;                                                                    \
+    d = ROL32(d ^ a, 16);                                                      \
+    c += d;                                                                    \
+    b = ROL32(b ^ c, 12);                                                      \
+    a += b;                                                                    \
+    d = ROL32(d ^ a, 8);                                                       \
+    c += d;                                                                    \
+    b = ROL32(b ^ c, 7);                                                       \
+  } while (0)
+
+static uint32_t load_le32(const uint8_t *p) {
+  uint32_t v;
+
+  /* Single LDR on Cortex-M3, little endian and unaligned capable */
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/**
+ * @brief Produce the next keystream block and advance the block counter
+ * @note  The working state lives in 16 locals, the compiler keeps most of
+ *        them in registers across the 10 double rounds
+ */
+static void chacha20_block(chacha20_ctx_t *ctx) {
+  uint32_t *s = ctx->state;
+  uint32_t x0 = s[0], x1 = s[1], x2 = s[2], x3 = s[3];
+  uint32_t x4 = s[4], x5 = s[5], x6 = s[6], x7 = s[7];
+  uint32_t x8 = s[8], x9 = s[9], x10 = s[10], x11 = s[11];
+  uint32_t x12 = s[12], x13 = s[13], x14 = s[14], x15 = s[15];
+
+  for (int i = 0; i < 10; i++) {
+    QUARTER_ROUND(x0, x4, x8, x12);
+    QUARTER_ROUND(x1, x5, x9, x13);
+    QUARTER_ROUND(x2, x6, x10, x14);
+    QUARTER_ROUND(x3, x7, x11, x15);
+    QUARTER_ROUND(x0, x5, x10, x15);
+    QUARTER_ROUND(x1, x6, x11, x12);
+    QUARTER_ROUND(x2, x7, x8, x13);
+    QUARTER_ROUND(x3, x4, x9, x14);
+  }
+
+  ctx->keystream[0] = x0 + s[0];
+  ctx->keystream[1] = x1 + s[1];
+  ctx->keystream[2] = x2 + s[2];
+  ctx->keystream[3] = x3 + s[3];
+  ctx->keystream[4] = x4 + s[4];
+  ctx->keystream[5] = x5 + s[5];
+  ctx->keystream[6] = x6 + s[6];
+  ctx->keystream[7] = x7 + s[7];
+  ctx->keystream[8] = x8 + s[8];
+  ctx->keystream[9] = x9 + s[9];
+  ctx->keystream[10] = x10 + s[10];
+  ctx->keystream[11] = x11 + s[11];
+  ctx->keystream[12] = x12 + s[12];
+  ctx->keystream[13] = x13 + s[13];
+  ctx->keystream[14] = x14 + s[14];
+  ctx->keystream[15] = x15 + s[15];
+  s[12]++;
+  ctx->used = 0;
+}
+
+/**
+ * @brief Initialize ChaCha20 context
+ * @param ctx: Cipher context
+ * @param key: 256-bit key
+ * @param nonce: 96-bit nonce
+ * @param counter: Initial block counter
+ */
+void chacha20_init(chacha20_ctx_t *ctx, const uint8_t key[CHACHA20_KEY_SIZE],
+                   const uint8_t nonce[CHACHA20_NONCE_SIZE], uint32_t counter) {
+  ctx->state[0] = 0x61707865; /* "expand 32-byte k" */
+  ctx->state[1] = 0x3320646e;
+  ctx->state[2] = 0x79622d32;
+  ctx->state[3] = 0x6b206574;
+  for (int i = 0; i < 8; i++) {
+    ctx->state[4 + i] = load_le32(key + i * 4);
+  }
+  ctx->state[12] = counter;
+  for (int i = 0; i < 3; i++) {
+    ctx->state[13 + i] = load_le32(nonce + i * 4);
+  }
+  ctx->used = CHACHA20_BLOCK_SIZE;
+}
+
+/**
+ * @brief Encrypt or decrypt, the operation is the same
+ * @param ctx: Cipher context
+ * @param in: Input data
+ * @param out: Output data, may be the same buffer as in
+ * @param size: Data size, calls may split the stream anywhere
+ */
+void chacha20_crypt(chacha20_ctx_t *ctx, const uint8_t *in, uint8_t *out,
+                    uint32_t size) {
+  const uint8_t *ks = (const uint8_t *)ctx->keystream;
+
+  /* Finish the keystream left over from the previous call */
+  while (size > 0 && ctx->used < CHACHA20_BLOCK_SIZE) {
+    *out++ = *in++ ^ ks[ctx->used++];
+    size--;
+  }
+
+  /* Whole blocks a word at a time */
+  while (size >= CHACHA20_BLOCK_SIZE) {
+    chacha20_block(ctx);
+    for (int i = 0; i < 16; i++) {
+      uint32_t v = load_le32(in + i * 4) ^ ctx->keystream[i];
+      memcpy(out + i * 4, &v, sizeof(v));
+    }
+    ctx->used = CHACHA20_BLOCK_SIZE;
+    in += CHACHA20_BLOCK_SIZE;
+    out += CHACHA20_BLOCK_SIZE;
+    size -= CHACHA20_BLOCK_SIZE;
+  }
+
+  if (size > 0) {
+    chacha20_block(ctx);
+    while (size > 0) {
+      *out++ = *in++ ^ ks[ctx->used++];
+      size--;
+    }
+  }
+}
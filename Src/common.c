@@ -1,5 +1,22 @@
 #include "common.h"
 
+/* Half-byte tables, 96 bytes instead of 1.5 KB for one more lookup per
+ * byte. Used by the 8 KB LL build. */
+#ifndef CRC_SMALL_TABLES
+#define CRC_SMALL_TABLES 0
+#endif
+
+#if CRC_SMALL_TABLES
+static const uint32_t crc32_table[16] = {
+    0x00000000U, 0x1DB71064U, 0x3B6E20C8U, 0x26D930ACU,
+    0x76DC4190U, 0x6B6B51F4U, 0x4DB26158U, 0x5005713CU,
+    0xEDB88320U, 0xF00F9344U, 0xD6D6A3E8U, 0xCB61B38CU,
+    0x9B64C2B0U, 0x86D3D2D4U, 0xA00AE278U, 0xBDBDF21CU};
+
+static const uint16_t crc16_table[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF};
+#else
 static const uint32_t crc32_table[256] = {
     0x00000000U, 0x77073096U, 0xEE0E612CU, 0x990951BAU, 0x076DC419U,
     0x706AF48FU, 0xE963A535U, 0x9E6495A3U, 0x0EDB8832U, 0x79DCB8A4U,
@@ -85,12 +102,18 @@ static const uint16_t crc16_table[256] = {
     0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1, 0xEF1F, 0xFF3E, 0xCF5D,
     0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8, 0x6E17, 0x7E36, 0x4E55, 0x5E74,
     0x2E93, 0x3EB2, 0x0ED1, 0x1EF0};
+#endif
 
 uint32_t crc32_update(uint32_t crc, const uint8_t *data, uint32_t length) {
   crc = ~crc;
   for (uint32_t i = 0; i < length; ++i) {
     uint8_t byte = data[i];
+#if CRC_SMALL_TABLES
+    crc = crc32_table[(crc ^ byte) & 0x0F] ^ (crc >> 4);
+    crc = crc32_table[(crc ^ (byte >> 4)) & 0x0F] ^ (crc >> 4);
+#else
     crc = crc32_table[(crc ^ byte) & 0xFF] ^ (crc >> 8);
+#endif
   }
 
   return ~crc; // 最终反转
@@ -99,7 +122,12 @@ uint32_t crc32_update(uint32_t crc, const uint8_t *data, uint32_t length) {
 uint16_t crc16_update(uint16_t crc, const uint8_t *data, uint16_t length) {
 
   for (uint16_t i = 0; i < length; i++) {
+#if CRC_SMALL_TABLES
+    crc = (crc << 4) ^ crc16_table[((crc >> 12) ^ (data[i] >> 4)) & 0x0F];
+    crc = (crc << 4) ^ crc16_table[((crc >> 12) ^ data[i]) & 0x0F];
+#else
     crc = (crc << 8) ^ crc16_table[((crc >> 8) ^ data[i]) & 0xFF];
+#endif
   }
 
   return crc;
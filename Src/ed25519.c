@@ -0,0 +1,603 @@
+#include "ed25519.h"
+#include <string.h>
+
+/*
+ * Field elements mod p = 2^255 - 19 are eight little-endian 32-bit words,
+ * kept below 2^256 and only fully reduced for encoding and comparison. The
+ * multiply is a plain 8x8 schoolbook with 64-bit accumulators, which the
+ * Cortex-M3 does with UMULL/UMLAL, then folded with 2^256 = 38 (mod p).
+ *
+ * Verification only handles public data, so nothing here is constant time.
+ */
+typedef uint32_t fe25519[8];
+
+/* Extended coordinates: x = X/Z, y = Y/Z, x*y = T/Z */
+typedef struct {
+  fe25519 X, Y, Z, T;
+} ge_p3;
+
+/* Point prepared for addition */
+typedef struct {
+  fe25519 YplusX, YminusX, Z, T2d;
+} ge_cached;
+
+/* Affine point prepared for addition (Z = 1) */
+typedef struct {
+  fe25519 yplusx, yminusx, xy2d;
+} ge_precomp;
+
+static const fe25519 fe_d2 = {0x26B2F159, 0xEBD69B94, 0x8283B156, 0x00E0149A,
+                              0xEEF3D130, 0x198E80F2, 0x56DFFCE7, 0x2406D9DC};
+static const fe25519 fe_d = {0x135978A3, 0x75EB4DCA, 0x4141D8AB, 0x00700A4D,
+                             0x7779E898, 0x8CC74079, 0x2B6FFE73, 0x52036CEE};
+static const fe25519 fe_sqrtm1 = {0x4A0EA0B0, 0xC4EE1B27, 0xAD2FE478,
+                                  0x2F431806, 0x3DFBD7A7, 0x2B4D0099,
+                                  0x4FC1DF0B, 0x2B832480};
+
+/* Group order L = 2^252 + 27742317777372353535851937790883648493 */
+static const uint32_t sc_l[9] = {0x5CF5D3ED, 0x5812631A, 0xA2F79CD6,
+                                 0x14DEF9DE, 0x00000000, 0x00000000,
+                                 0x00000000, 0x10000000, 0x00000000};
+
+/* Fixed-base table: B, 3B, 5B, ... 15B for the sliding window */
+static const ge_precomp ge_base_odd[8] = {
+    {{0xF58C3B85, 0x2FBC93C6, 0xFB8C0E19, 0xCF932DC6, 0x643D42C2, 0x270B4898, 0x33D4BA65, 0x07CF9D3A},
+     {0xD740913E, 0x9D103905, 0xD140BEB3, 0xFD399F05, 0x688F8A09, 0xA5C18434, 0x98F81267, 0x44FD2F92},
+     {0x877AAA68, 0xABC91205, 0xCCAAC49E, 0x26D9E823, 0xDD43598C, 0x5A1B7DCB, 0x9F0C65A8, 0x6F117B68}},
+    {{0x4CEE9730, 0xAF25B0A8, 0xE8864B8A, 0x025A8430, 0x9F016732, 0xC11B5002, 0x9A80F8F4, 0x7A164E1B},
+     {0xA4FCD265, 0x56611FE8, 0xE5C1BA7D, 0x3BD353FD, 0x214BD6BD, 0x8131F31A, 0x555BDA62, 0x2AB91587},
+     {0x0DD0D889, 0x14AE933F, 0x1C35DA62, 0x58942322, 0x8CF2DB4C, 0xD170E545, 0x12B9B4C6, 0x5A2826AF}},
+    {{0x08A5BB33, 0xA212BC44, 0xC75EED02, 0x8D5048C3, 0x5ABFEC44, 0xDD1BEB0C, 0x46E206EB, 0x2945CCF1},
+     {0xA447D6BA, 0x7F9182C3, 0x4B2729B7, 0xD50014D1, 0xB864A087, 0xE33CF11C, 0xEB1B55F3, 0x154A7E73},
+     {0x812A8285, 0xBCBBDBF1, 0xD0BDD1FC, 0x270E0807, 0x1BBDA72D, 0xB41B670B, 0x6B3BB69A, 0x43AABE69}},
+    {{0x944EA3BF, 0x6B1A5CD0, 0xB39DC0D2, 0x7470353A, 0x28542E49, 0x71B25282, 0x283C927E, 0x461BEA69},
+     {0xAA3221B1, 0xBA6F2C9A, 0x3BBA23A7, 0x6CA02153, 0x92192C3A, 0x9DEA764F, 0x2E5317E0, 0x1D6EDD5D},
+     {0x01B8B3A2, 0xF1836DC8, 0x053EA49A, 0xB3035F47, 0x5877ADF3, 0x529C41BA, 0x6A0F90A7, 0x7A9FBB1C}},
+    {{0xA6A8632F, 0x9B2E678A, 0x51BC46C5, 0xA6509E6F, 0xC686F5B5, 0xCEB233C9, 0x8ADD7F59, 0x34B9ED33},
+     {0x039D8064, 0xF36E217E, 0xF520419B, 0x98A081B6, 0xE75EB044, 0x96CBC608, 0xFADC9C8F, 0x49C05A51},
+     {0x9045AF1B, 0x06B4E8BF, 0xA719D22F, 0xE2FF83E8, 0x93D4CF16, 0xAAF6FC29, 0x1B008B06, 0x73C17202}},
+    {{0x8A802ADE, 0x2FBF0084, 0x02302E27, 0xE5D9FECF, 0x17703406, 0x113E8471, 0x546D8FAF, 0x4275AAE2},
+     {0x49864348, 0x315F5B02, 0x77088381, 0x3ED6B369, 0x6A8DEB95, 0xA3A07555, 0x29D5C77F, 0x18AB5980},
+     {0xFD6089E9, 0xD82B2CC5, 0x3282E4A4, 0x031EB4A1, 0xB51A8622, 0x44311199, 0xB53DF948, 0x3DC65522}},
+    {{0xA2007F6D, 0xBF70C222, 0xB5BCDEDB, 0xBF84B39A, 0xFB07BA07, 0x537A0E12, 0xC346F241, 0x234FD7EE},
+     {0x327FBF93, 0x506F013B, 0x9B776F6B, 0xAEFCEBC9, 0xAAAD5968, 0x9D12B232, 0x176024A7, 0x0267882D},
+     {0x732EA378, 0x5360A119, 0xDF8DD471, 0x2437E6B1, 0x91A7E533, 0xA2EF37F8, 0xAA097863, 0x497BA6FD}},
+    {{0x13CFEAA0, 0x24CECC03, 0x189C246D, 0x8648C28D, 0xC1F2D4D0, 0x2DBDBDFA, 0xF12DE72B, 0x61E22917},
+     {0x468CCF0B, 0x040BCD86, 0x2A9910D6, 0xD3829BA4, 0x07B25192, 0x75083008, 0x18D05EBF, 0x43B5CD42},
+     {0x9BD0B516, 0x5D9A762F, 0x373FDEEE, 0xEB38AF4E, 0x93D64270, 0x032E5A7D, 0x0AE4D842, 0x511D6121}},
+};
+
+static void fe_copy(fe25519 r, const fe25519 a) { memcpy(r, a, sizeof(fe25519)); }
+
+static void fe_set(fe25519 r, uint32_t v) {
+  memset(r, 0, sizeof(fe25519));
+  r[0] = v;
+}
+
+/* r += v, folding any carry out of bit 256 back in as 38 */
+static void fe_add_small(fe25519 r, uint32_t v) {
+  uint64_t c = v;
+
+  for (int i = 0; i < 8 && c != 0; i++) {
+    c += r[i];
+    r[i] = (uint32_t)c;
+    c >>= 32;
+  }
+  if (c != 0) {
+    /* Wrapped, so r < v now and adding 38 cannot carry */
+    r[0] += 38;
+  }
+}
+
+static void fe_add(fe25519 r, const fe25519 a, const fe25519 b) {
+  uint64_t c = 0;
+
+  for (int i = 0; i < 8; i++) {
+    c += (uint64_t)a[i] + b[i];
+    r[i] = (uint32_t)c;
+    c >>= 32;
+  }
+  fe_add_small(r, (uint32_t)c * 38);
+}
+
+static void fe_sub(fe25519 r, const fe25519 a, const fe25519 b) {
+  int64_t c = 0;
+
+  for (int i = 0; i < 8; i++) {
+    c += (int64_t)a[i] - b[i];
+    r[i] = (uint32_t)c;
+    c >>= 32;
+  }
+  if (c == 0) {
+    return;
+  }
+
+  /* Borrowed 2^256, take 38 back off */
+  c = -38;
+  for (int i = 0; i < 8 && c != 0; i++) {
+    c += r[i];
+    r[i] = (uint32_t)c;
+    c >>= 32;
+  }
+  if (c != 0) {
+    /* Wrapped again, r is now just below 2^256 */
+    r[0] -= 38;
+  }
+}
+
+static void fe_neg(fe25519 r, const fe25519 a) {
+  static const fe25519 zero = {0};
+  fe_sub(r, zero, a);
+}
+
+static void fe_mul(fe25519 r, const fe25519 a, const fe25519 b) {
+  uint32_t t[16];
+  uint64_t c;
+
+  memset(t, 0, sizeof(t));
+  for (int i = 0; i < 8; i++) {
+    uint32_t ai = a[i];
+    c = 0;
+    for (int j = 0; j < 8; j++) {
+      c += (uint64_t)ai * b[j] + t[i + j];
+      t[i + j] = (uint32_t)c;
+      c >>= 32;
+    }
+    t[i + 8] = (uint32_t)c;
+  }
+
+  /* Fold the high half: 2^256 = 38 (mod p) */
+  c = 0;
+  for (int i = 0; i < 8; i++) {
+    c += (uint64_t)t[i + 8] * 38 + t[i];
+    r[i] = (uint32_t)c;
+    c >>= 32;
+  }
+  fe_add_small(r, (uint32_t)c * 38);
+}
+
+static void fe_sq(fe25519 r, const fe25519 a) { fe_mul(r, a, a); }
+
+/* r = a^(2^n) */
+static void fe_sq_n(fe25519 r, const fe25519 a, int n) {
+  fe_sq(r, a);
+  while (--n > 0) {
+    fe_sq(r, r);
+  }
+}
+
+/* Fully reduce to [0, p) */
+static void fe_freeze(fe25519 r) {
+  uint32_t t[8];
+  uint64_t c;
+
+  /* 2^255 = 19 (mod p), leaves r < 2^255 + 19 */
+  c = (r[7] >> 31) * 19;
+  r[7] &= 0x7FFFFFFF;
+  fe_add_small(r, (uint32_t)c);
+
+  /* r >= p exactly when r + 19 reaches 2^255 */
+  c = 19;
+  for (int i = 0; i < 8; i++) {
+    c += r[i];
+    t[i] = (uint32_t)c;
+    c >>= 32;
+  }
+  if (t[7] & 0x80000000) {
+    t[7] &= 0x7FFFFFFF;
+    memcpy(r, t, sizeof(t));
+  }
+}
+
+static void fe_frombytes(fe25519 r, const uint8_t s[32]) {
+  for (int i = 0; i < 8; i++) {
+    r[i] = (uint32_t)s[4 * i] | ((uint32_t)s[4 * i + 1] << 8) |
+           ((uint32_t)s[4 * i + 2] << 16) | ((uint32_t)s[4 * i + 3] << 24);
+  }
+  r[7] &= 0x7FFFFFFF;
+}
+
+static void fe_tobytes(uint8_t s[32], const fe25519 a) {
+  fe25519 t;
+
+  fe_copy(t, a);
+  fe_freeze(t);
+  for (int i = 0; i < 8; i++) {
+    s[4 * i] = (uint8_t)t[i];
+    s[4 * i + 1] = (uint8_t)(t[i] >> 8);
+    s[4 * i + 2] = (uint8_t)(t[i] >> 16);
+    s[4 * i + 3] = (uint8_t)(t[i] >> 24);
+  }
+}
+
+static bool fe_equal(const fe25519 a, const fe25519 b) {
+  fe25519 ta, tb;
+
+  fe_copy(ta, a);
+  fe_copy(tb, b);
+  fe_freeze(ta);
+  fe_freeze(tb);
+  return memcmp(ta, tb, sizeof(fe25519)) == 0;
+}
+
+static int fe_isneg(const fe25519 a) {
+  fe25519 t;
+
+  fe_copy(t, a);
+  fe_freeze(t);
+  return t[0] & 1;
+}
+
+/* z^(2^250 - 1) and z^11, shared by the inversion and the square root */
+static void fe_pow250(fe25519 r, fe25519 z11, const fe25519 z) {
+  fe25519 t, z9, z_5_0, z_10_0, z_50_0;
+
+  fe_sq(t, z);          /* 2 */
+  fe_sq_n(z9, t, 2);    /* 8 */
+  fe_mul(z9, z9, z);    /* 9 */
+  fe_mul(z11, z9, t);   /* 11 */
+  fe_sq(t, z11);        /* 22 */
+  fe_mul(z_5_0, t, z9); /* 2^5 - 1 */
+
+  fe_sq_n(t, z_5_0, 5);
+  fe_mul(z_10_0, t, z_5_0); /* 2^10 - 1 */
+  fe_sq_n(t, z_10_0, 10);
+  fe_mul(t, t, z_10_0); /* 2^20 - 1 */
+  fe_sq_n(r, t, 20);
+  fe_mul(r, r, t); /* 2^40 - 1 */
+  fe_sq_n(r, r, 10);
+  fe_mul(z_50_0, r, z_10_0); /* 2^50 - 1 */
+  fe_sq_n(t, z_50_0, 50);
+  fe_mul(t, t, z_50_0); /* 2^100 - 1 */
+  fe_sq_n(r, t, 100);
+  fe_mul(r, r, t); /* 2^200 - 1 */
+  fe_sq_n(r, r, 50);
+  fe_mul(r, r, z_50_0); /* 2^250 - 1 */
+}
+
+/* r = z^(p - 2) = 1/z, r may alias z */
+static void fe_invert(fe25519 r, const fe25519 z) {
+  fe25519 z11, t;
+
+  fe_copy(t, z);
+  fe_pow250(r, z11, t);
+  fe_sq_n(r, r, 5);
+  fe_mul(r, r, z11); /* 2^255 - 21 */
+}
+
+/* r = z^((p - 5) / 8), r may alias z */
+static void fe_pow22523(fe25519 r, const fe25519 z) {
+  fe25519 z11, t;
+
+  fe_copy(t, z);
+  fe_pow250(r, z11, t);
+  fe_sq_n(r, r, 2);
+  fe_mul(r, r, t); /* 2^252 - 3 */
+}
+
+static void ge_set_identity(ge_p3 *r) {
+  fe_set(r->X, 0);
+  fe_set(r->Y, 1);
+  fe_set(r->Z, 1);
+  fe_set(r->T, 0);
+}
+
+static void ge_to_cached(ge_cached *r, const ge_p3 *p) {
+  fe_add(r->YplusX, p->Y, p->X);
+  fe_sub(r->YminusX, p->Y, p->X);
+  fe_copy(r->Z, p->Z);
+  fe_mul(r->T2d, p->T, fe_d2);
+}
+
+/*
+ * r = p + q or p - q (negate != 0), add-2008-hwcd-3. q is given by its
+ * prepared coordinates, qz == NULL means Z = 1. r may alias p.
+ */
+static void ge_add(ge_p3 *r, const ge_p3 *p, const fe25519 ypx,
+                   const fe25519 ymx, const uint32_t *qz, const fe25519 t2d,
+                   int negate) {
+  fe25519 a, b, c, d, e, f, g, h;
+
+  fe_sub(a, p->Y, p->X);
+  fe_add(b, p->Y, p->X);
+  /* -q swaps Y+X with Y-X and flips T */
+  fe_mul(a, a, negate ? ypx : ymx);
+  fe_mul(b, b, negate ? ymx : ypx);
+  fe_mul(c, p->T, t2d);
+  if (qz != NULL) {
+    fe_mul(d, p->Z, qz);
+    fe_add(d, d, d);
+  } else {
+    fe_add(d, p->Z, p->Z);
+  }
+
+  fe_sub(e, b, a);
+  fe_add(h, b, a);
+  if (negate) {
+    fe_add(f, d, c);
+    fe_sub(g, d, c);
+  } else {
+    fe_sub(f, d, c);
+    fe_add(g, d, c);
+  }
+
+  fe_mul(r->X, e, f);
+  fe_mul(r->Y, g, h);
+  fe_mul(r->T, e, h);
+  fe_mul(r->Z, f, g);
+}
+
+/* r = 2p, dbl-2008-hwcd with a = -1. r may alias p. */
+static void ge_dbl(ge_p3 *r, const ge_p3 *p) {
+  fe25519 a, b, c, e, f, g, h;
+
+  fe_sq(a, p->X);
+  fe_sq(b, p->Y);
+  fe_sq(c, p->Z);
+  fe_add(c, c, c);
+  fe_add(e, p->X, p->Y);
+  fe_sq(e, e);
+  fe_add(h, a, b); /* -H */
+  fe_sub(e, e, h); /* E */
+  fe_sub(g, b, a); /* G = B - A */
+  fe_sub(f, g, c); /* F = G - C */
+  fe_neg(h, h);    /* H = -A - B */
+
+  fe_mul(r->X, e, f);
+  fe_mul(r->Y, g, h);
+  fe_mul(r->T, e, h);
+  fe_mul(r->Z, f, g);
+}
+
+/* Decode a point and negate it, rejects non-canonical encodings */
+static bool ge_frombytes_negate(ge_p3 *r, const uint8_t s[32]) {
+  fe25519 u, v, v3, vxx, check;
+  uint8_t y_bytes[32];
+  int sign = s[31] >> 7;
+
+  fe_frombytes(r->Y, s);
+  fe_tobytes(y_bytes, r->Y);
+  y_bytes[31] |= (uint8_t)(sign << 7);
+  if (memcmp(y_bytes, s, 32) != 0) {
+    return false;
+  }
+  fe_set(r->Z, 1);
+
+  /* x^2 = (y^2 - 1) / (d y^2 + 1) = u / v */
+  fe_sq(u, r->Y);
+  fe_mul(v, u, fe_d);
+  fe_sub(u, u, r->Z);
+  fe_add(v, v, r->Z);
+
+  /* x = u v^3 (u v^7)^((p - 5) / 8) */
+  fe_sq(v3, v);
+  fe_mul(v3, v3, v);
+  fe_sq(r->X, v3);
+  fe_mul(r->X, r->X, v);
+  fe_mul(r->X, r->X, u);
+  fe_pow22523(r->X, r->X);
+  fe_mul(r->X, r->X, v3);
+  fe_mul(r->X, r->X, u);
+
+  fe_sq(vxx, r->X);
+  fe_mul(vxx, vxx, v);
+  if (!fe_equal(vxx, u)) {
+    fe_neg(check, u);
+    if (!fe_equal(vxx, check)) {
+      return false;
+    }
+    fe_mul(r->X, r->X, fe_sqrtm1);
+  }
+
+  fe_set(check, 0);
+  if (sign && fe_equal(r->X, check)) {
+    return false;
+  }
+  /* Keep the opposite sign: this is -A */
+  if (fe_isneg(r->X) == sign) {
+    fe_neg(r->X, r->X);
+  }
+  fe_mul(r->T, r->X, r->Y);
+  return true;
+}
+
+static void ge_tobytes(uint8_t s[32], const ge_p3 *p) {
+  fe25519 zinv, x, y;
+
+  fe_invert(zinv, p->Z);
+  fe_mul(x, p->X, zinv);
+  fe_mul(y, p->Y, zinv);
+  fe_tobytes(s, y);
+  s[31] ^= (uint8_t)(fe_isneg(x) << 7);
+}
+
+/* Signed sliding-window digits in [-15, 15], odd or zero */
+static void sc_slide(int8_t r[256], const uint8_t a[32]) {
+  for (int i = 0; i < 256; i++) {
+    r[i] = 1 & (a[i >> 3] >> (i & 7));
+  }
+
+  for (int i = 0; i < 256; i++) {
+    if (r[i] == 0) {
+      continue;
+    }
+    for (int b = 1; b <= 6 && i + b < 256; b++) {
+      if (r[i + b] == 0) {
+        continue;
+      }
+      if (r[i] + (r[i + b] << b) <= 15) {
+        r[i] += r[i + b] << b;
+        r[i + b] = 0;
+      } else if (r[i] - (r[i + b] << b) >= -15) {
+        r[i] -= r[i + b] << b;
+        for (int k = i + b; k < 256; k++) {
+          if (r[k] == 0) {
+            r[k] = 1;
+            break;
+          }
+          r[k] = 0;
+        }
+      } else {
+        break;
+      }
+    }
+  }
+}
+
+/* r = a * A + b * B, B being the base point */
+static void ge_double_scalarmult(ge_p3 *r, const uint8_t a[32],
+                                 const ge_p3 *A, const uint8_t b[32]) {
+  int8_t aslide[256];
+  int8_t bslide[256];
+  ge_cached Ai[8]; /* A, 3A, 5A, ... 15A */
+  ge_p3 A2, t;
+  int i;
+
+  sc_slide(aslide, a);
+  sc_slide(bslide, b);
+
+  ge_to_cached(&Ai[0], A);
+  ge_dbl(&A2, A);
+  for (i = 1; i < 8; i++) {
+    ge_add(&t, &A2, Ai[i - 1].YplusX, Ai[i - 1].YminusX, Ai[i - 1].Z,
+           Ai[i - 1].T2d, 0);
+    ge_to_cached(&Ai[i], &t);
+  }
+
+  ge_set_identity(r);
+  for (i = 255; i >= 0; i--) {
+    if (aslide[i] || bslide[i]) {
+      break;
+    }
+  }
+
+  for (; i >= 0; i--) {
+    ge_dbl(r, r);
+
+    if (aslide[i] != 0) {
+      const ge_cached *q = &Ai[(aslide[i] < 0 ? -aslide[i] : aslide[i]) / 2];
+      ge_add(r, r, q->YplusX, q->YminusX, q->Z, q->T2d, aslide[i] < 0);
+    }
+    if (bslide[i] != 0) {
+      const ge_precomp *q =
+          &ge_base_odd[(bslide[i] < 0 ? -bslide[i] : bslide[i]) / 2];
+      ge_add(r, r, q->yplusx, q->yminusx, NULL, q->xy2d, bslide[i] < 0);
+    }
+  }
+}
+
+/* s < L, rejects malleable signatures */
+static bool sc_is_canonical(const uint8_t s[32]) {
+  for (int i = 7; i >= 0; i--) {
+    uint32_t w = (uint32_t)s[4 * i] | ((uint32_t)s[4 * i + 1] << 8) |
+                 ((uint32_t)s[4 * i + 2] << 16) |
+                 ((uint32_t)s[4 * i + 3] << 24);
+    if (w != sc_l[i]) {
+      return w < sc_l[i];
+    }
+  }
+  return false;
+}
+
+/* out = in mod L, bit-serial long division, only runs once per verify */
+static void sc_reduce(uint8_t out[32], const uint8_t in[64]) {
+  uint32_t r[9];
+
+  memset(r, 0, sizeof(r));
+  for (int bit = 511; bit >= 0; bit--) {
+    uint32_t carry = (in[bit >> 3] >> (bit & 7)) & 1;
+    int geq = 1;
+
+    for (int i = 0; i < 9; i++) {
+      uint32_t next = r[i] >> 31;
+      r[i] = (r[i] << 1) | carry;
+      carry = next;
+    }
+
+    for (int i = 8; i >= 0; i--) {
+      if (r[i] != sc_l[i]) {
+        geq = r[i] > sc_l[i];
+        break;
+      }
+    }
+    if (geq) {
+      int64_t c = 0;
+      for (int i = 0; i < 9; i++) {
+        c += (int64_t)r[i] - sc_l[i];
+        r[i] = (uint32_t)c;
+        c >>= 32;
+      }
+    }
+  }
+
+  for (int i = 0; i < 8; i++) {
+    out[4 * i] = (uint8_t)r[i];
+    out[4 * i + 1] = (uint8_t)(r[i] >> 8);
+    out[4 * i + 2] = (uint8_t)(r[i] >> 16);
+    out[4 * i + 3] = (uint8_t)(r[i] >> 24);
+  }
+}
+
+/**
+ * @brief Start verifying a signature, the message is hashed by the caller
+ * @param hash: Hash context, message goes in with sha512_update()
+ * @param signature: 64-byte signature (R || S)
+ * @param public_key: 32-byte public key
+ */
+void ed25519_verify_start(sha512_ctx_t *hash,
+                          const uint8_t signature[ED25519_SIGNATURE_SIZE],
+                          const uint8_t public_key[ED25519_PUBLIC_KEY_SIZE]) {
+  sha512_init(hash);
+  sha512_update(hash, signature, 32);
+  sha512_update(hash, public_key, ED25519_PUBLIC_KEY_SIZE);
+}
+
+/**
+ * @brief Finish verifying a signature
+ * @param hash: Hash context after the whole message was added
+ * @param signature: 64-byte signature (R || S)
+ * @param public_key: 32-byte public key
+ * @return true if the signature is valid, false otherwise
+ */
+bool ed25519_verify_finish(sha512_ctx_t *hash,
+                           const uint8_t signature[ED25519_SIGNATURE_SIZE],
+                           const uint8_t public_key[ED25519_PUBLIC_KEY_SIZE]) {
+  uint8_t digest[SHA512_DIGEST_SIZE];
+  uint8_t h[32];
+  uint8_t check[32];
+  ge_p3 A, R;
+
+  sha512_final(hash, digest);
+
+  if (!sc_is_canonical(signature + 32)) {
+    return false;
+  }
+  if (!ge_frombytes_negate(&A, public_key)) {
+    return false;
+  }
+
+  /* R' = S B - h A, must encode to R */
+  sc_reduce(h, digest);
+  ge_double_scalarmult(&R, h, &A, signature + 32);
+  ge_tobytes(check, &R);
+
+  return memcmp(check, signature, 32) == 0;
+}
+
+/**
+ * @brief Verify a signature over a message held in memory
+ * @param signature: 64-byte signature (R || S)
+ * @param message: Message buffer
+ * @param size: Message size
+ * @param public_key: 32-byte public key
+ * @return true if the signature is valid, false otherwise
+ */
+bool ed25519_verify(const uint8_t signature[ED25519_SIGNATURE_SIZE],
+                    const uint8_t *message, uint32_t size,
+                    const uint8_t public_key[ED25519_PUBLIC_KEY_SIZE]) {
+  sha512_ctx_t hash;
+
+  ed25519_verify_start(&hash, signature, public_key);
+  sha512_update(&hash, message, size);
+  return ed25519_verify_finish(&hash, signature, public_key);
+}
@@ -0,0 +1,106 @@
+#include "flash_if.h"
+#include "stm32f1xx_hal.h"
+
+/**
+ * @brief Wait for the current operation and collect its status
+ * @return FLASH_IF_OK or FLASH_IF_ERROR, the status flags are cleared
+ */
+static flash_if_result_t flash_if_wait(void) {
+  uint32_t sr;
+
+  while (FLASH->SR & FLASH_SR_BSY) {
+  }
+  sr = FLASH->SR;
+  FLASH->SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+  return (sr & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR)) ? FLASH_IF_ERROR
+                                                     : FLASH_IF_OK;
+}
+
+/**
+ * @brief Unlock the flash controller
+ * @return true if it was locked before, the caller locks it again
+ */
+static int flash_if_unlock(void) {
+  if ((FLASH->CR & FLASH_CR_LOCK) == 0) {
+    return 0;
+  }
+  FLASH->KEYR = FLASH_KEY1;
+  FLASH->KEYR = FLASH_KEY2;
+  return 1;
+}
+
+/**
+ * @brief Erase every page touched by an address range
+ * @param address: Start address
+ * @param size: Range size in bytes
+ * @return Flash result code
+ */
+flash_if_result_t flash_if_erase(uint32_t address, uint32_t size) {
+  uint32_t page = address & ~(FLASH_PAGE_SIZE - 1);
+  uint32_t end = address + size;
+  flash_if_result_t result = FLASH_IF_OK;
+  int relock = flash_if_unlock();
+
+  for (; page < end && result == FLASH_IF_OK; page += FLASH_PAGE_SIZE) {
+    FLASH->CR |= FLASH_CR_PER;
+    FLASH->AR = page;
+    FLASH->CR |= FLASH_CR_STRT;
+    result = flash_if_wait();
+    FLASH->CR &= ~FLASH_CR_PER;
+  }
+
+  if (relock) {
+    FLASH->CR |= FLASH_CR_LOCK;
+  }
+  return result;
+}
+
+/**
+ * @brief Program and verify a buffer, halfword by halfword
+ * @note  PG stays set for the whole buffer instead of being toggled around
+ *        every halfword. An odd size pads the last halfword with 0xFF.
+ *        Erased halfwords (0xFFFF) are only checked, not programmed.
+ * @param address: Start address, halfword aligned
+ * @param data: Data buffer, any alignment
+ * @param size: Data size
+ * @return Flash result code
+ */
+flash_if_result_t flash_if_program(uint32_t address, const uint8_t *data,
+                                   uint32_t size) {
+  volatile uint16_t *dst = (volatile uint16_t *)address;
+  flash_if_result_t result = FLASH_IF_OK;
+  int relock;
+
+  if (address & 1) {
+    return FLASH_IF_ERROR;
+  }
+
+  relock = flash_if_unlock();
+  FLASH->CR |= FLASH_CR_PG;
+  for (uint32_t i = 0; i < size; i += 2, dst++) {
+    uint16_t halfword = data[i];
+
+    halfword |= (uint16_t)((i + 1 < size) ? data[i + 1] : 0xFF) << 8;
+    if (halfword == 0xFFFF) {
+      if (*dst != halfword) {
+        result = FLASH_IF_VERIFY_ERROR;
+        break;
+      }
+      continue;
+    }
+    *dst = halfword;
+    result = flash_if_wait();
+    if (result == FLASH_IF_OK && *dst != halfword) {
+      result = FLASH_IF_VERIFY_ERROR;
+    }
+    if (result != FLASH_IF_OK) {
+      break;
+    }
+  }
+  FLASH->CR &= ~FLASH_CR_PG;
+
+  if (relock) {
+    FLASH->CR |= FLASH_CR_LOCK;
+  }
+  return result;
+}
@@ -0,0 +1,168 @@
+/*
+ * The HAL calls the bootloader makes, on the LL drivers and registers.
+ *
+ * Replaces the HAL modules in the LL build (make LL=1), the same way
+ * tools/host_sim/sim_hal.c replaces them on the host, so bootloader.c and
+ * ymodem.c build unchanged against either. Only USART1 on PB6/PB7 in 8N1 is
+ * supported, which is all the bootloader uses. Everything polls, the only
+ * interrupt is SysTick.
+ */
+#include "bootloader.h"
+#include "stm32f1xx_ll_bus.h"
+#include "stm32f1xx_ll_gpio.h"
+#include "stm32f1xx_ll_system.h"
+#include "stm32f1xx_ll_usart.h"
+
+__IO uint32_t uwTick;
+
+/**
+ * @brief Prefetch, priority grouping and a 1 ms SysTick on the current clock
+ * @note  SystemClock_Config() sets SysTick again once the PLL runs
+ */
+HAL_StatusTypeDef HAL_Init(void) {
+  LL_FLASH_EnablePrefetch();
+  NVIC_SetPriorityGrouping(NVIC_PRIORITYGROUP_4);
+  SysTick_Config(SystemCoreClock / 1000U);
+  NVIC_SetPriority(SysTick_IRQn, TICK_INT_PRIORITY);
+  LL_APB2_GRP1_EnableClock(LL_APB2_GRP1_PERIPH_AFIO);
+  return HAL_OK;
+}
+
+/**
+ * @brief Reset every peripheral and stop SysTick before the jump
+ */
+HAL_StatusTypeDef HAL_DeInit(void) {
+  SysTick->CTRL = 0;
+  RCC->APB1RSTR = 0xFFFFFFFFU;
+  RCC->APB1RSTR = 0;
+  RCC->APB2RSTR = 0xFFFFFFFFU;
+  RCC->APB2RSTR = 0;
+  return HAL_OK;
+}
+
+void HAL_IncTick(void) { uwTick++; }
+
+uint32_t HAL_GetTick(void) { return uwTick; }
+
+/**
+ * @brief Wait at least delay ms, one extra tick like the HAL
+ */
+void HAL_Delay(uint32_t delay) {
+  uint32_t start = uwTick;
+
+  if (delay < HAL_MAX_DELAY) {
+    delay++;
+  }
+  while ((uwTick - start) < delay) {
+  }
+}
+
+void HAL_NVIC_SystemReset(void) { NVIC_SystemReset(); }
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin) {
+  return (GPIOx->IDR & GPIO_Pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin,
+                       GPIO_PinState PinState) {
+  if (PinState == GPIO_PIN_SET) {
+    GPIOx->BSRR = GPIO_Pin;
+  } else {
+    GPIOx->BSRR = (uint32_t)GPIO_Pin << 16U;
+  }
+}
+
+void HAL_GPIO_TogglePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin) {
+  uint32_t odr = GPIOx->ODR;
+
+  GPIOx->BSRR = ((odr & GPIO_Pin) << 16U) | (~odr & GPIO_Pin);
+}
+
+/**
+ * @brief Route USART1 to PB6/PB7 and start it at huart->Init.BaudRate, 8N1
+ * @note  Also used to change the baud rate, the other Init fields are ignored
+ * @return HAL_ERROR for any other instance
+ */
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart) {
+  if (huart->Instance != USART1) {
+    return HAL_ERROR;
+  }
+
+  LL_APB2_GRP1_EnableClock(LL_APB2_GRP1_PERIPH_USART1 |
+                           LL_APB2_GRP1_PERIPH_GPIOB |
+                           LL_APB2_GRP1_PERIPH_AFIO);
+  LL_GPIO_AF_EnableRemap_USART1();
+  LL_GPIO_SetPinMode(GPIOB, LL_GPIO_PIN_6, LL_GPIO_MODE_ALTERNATE);
+  LL_GPIO_SetPinSpeed(GPIOB, LL_GPIO_PIN_6, LL_GPIO_SPEED_FREQ_HIGH);
+  LL_GPIO_SetPinOutputType(GPIOB, LL_GPIO_PIN_6, LL_GPIO_OUTPUT_PUSHPULL);
+  LL_GPIO_SetPinMode(GPIOB, LL_GPIO_PIN_7, LL_GPIO_MODE_FLOATING);
+
+  /* USART1 is on APB2, which runs at HCLK */
+  LL_USART_Disable(USART1);
+  USART1->CR2 = 0;
+  USART1->CR3 = 0;
+  LL_USART_SetBaudRate(USART1, SystemCoreClock, huart->Init.BaudRate);
+  USART1->CR1 = USART_CR1_TE | USART_CR1_RE | USART_CR1_UE;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef *huart) {
+  if (huart->Instance != USART1) {
+    return HAL_ERROR;
+  }
+  LL_USART_Disable(USART1);
+  LL_APB2_GRP1_DisableClock(LL_APB2_GRP1_PERIPH_USART1);
+  return HAL_OK;
+}
+
+/**
+ * @brief Wait for a USART1 status flag
+ * @return HAL_TIMEOUT once timeout ms have passed since start, right away
+ *         for a timeout of 0 as in the HAL
+ */
+static HAL_StatusTypeDef ll_uart_wait(uint32_t flag, uint32_t start,
+                                      uint32_t timeout) {
+  while ((USART1->SR & flag) == 0) {
+    if (timeout == 0 ||
+        (timeout != HAL_MAX_DELAY && (uwTick - start) > timeout)) {
+      return HAL_TIMEOUT;
+    }
+  }
+  return HAL_OK;
+}
+
+/**
+ * @brief Send size bytes and wait until the last one left the shifter
+ */
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart,
+                                    const uint8_t *pData, uint16_t Size,
+                                    uint32_t Timeout) {
+  uint32_t start = uwTick;
+
+  (void)huart;
+  while (Size-- > 0) {
+    if (ll_uart_wait(USART_SR_TXE, start, Timeout) != HAL_OK) {
+      return HAL_TIMEOUT;
+    }
+    USART1->DR = *pData++;
+  }
+  return ll_uart_wait(USART_SR_TC, start, Timeout);
+}
+
+/**
+ * @brief Receive size bytes within Timeout ms
+ * @note  Reading SR then DR also clears an overrun, as in the HAL
+ */
+HAL_StatusTypeDef HAL_UART_Receive(UART_HandleTypeDef *huart, uint8_t *pData,
+                                   uint16_t Size, uint32_t Timeout) {
+  uint32_t start = uwTick;
+
+  (void)huart;
+  while (Size-- > 0) {
+    if (ll_uart_wait(USART_SR_RXNE, start, Timeout) != HAL_OK) {
+      return HAL_TIMEOUT;
+    }
+    *pData++ = (uint8_t)USART1->DR;
+  }
+  return HAL_OK;
+}
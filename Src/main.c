@@ -22,6 +22,13 @@
 
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "boot_timing.h"
+#if BOOTLOADER_LL
+#include "stm32f1xx_ll_bus.h"
+#include "stm32f1xx_ll_gpio.h"
+#include "stm32f1xx_ll_rcc.h"
+#include "stm32f1xx_ll_system.h"
+#endif
 
 /* USER CODE END Includes */
 
@@ -69,7 +76,8 @@ static void MX_USART3_UART_Init(void);
 int main(void) {
 
   /* USER CODE BEGIN 1 */
-
+  /* Jumps to the application unless we have to stay in the bootloader */
+  bootloader_fast_boot();
   /* USER CODE END 1 */
 
   /* MCU Configuration--------------------------------------------------------*/
@@ -79,6 +87,7 @@ int main(void) {
   HAL_Init();
 
   /* USER CODE BEGIN Init */
+  boot_timing_mark(BOOT_PHASE_HAL_INIT);
 
   /* USER CODE END Init */
 
@@ -86,13 +95,17 @@ int main(void) {
   SystemClock_Config();
 
   /* USER CODE BEGIN SysInit */
+  boot_timing_mark(BOOT_PHASE_CLOCK_LOCK);
 
   /* USER CODE END SysInit */
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
   MX_USART1_UART_Init();
+#if !BOOTLOADER_LL
+  /* Unused by the bootloader, ll_hal.c only drives USART1 */
   MX_USART3_UART_Init();
+#endif
   /* USER CODE BEGIN 2 */
   bootloader_init();
   bootloader_run();
@@ -115,6 +128,26 @@ int main(void) {
  * @retval None
  */
 void SystemClock_Config(void) {
+#if BOOTLOADER_LL
+  /* HSE x9 = 72 MHz, APB1 36 MHz, same settings as the HAL path below */
+  LL_RCC_HSE_Enable();
+  while (!LL_RCC_HSE_IsReady()) {
+  }
+  LL_FLASH_SetLatency(LL_FLASH_LATENCY_2);
+  LL_RCC_PLL_ConfigDomain_SYS(LL_RCC_PLLSOURCE_HSE_DIV_1, LL_RCC_PLL_MUL_9);
+  LL_RCC_PLL_Enable();
+  while (!LL_RCC_PLL_IsReady()) {
+  }
+  LL_RCC_SetAHBPrescaler(LL_RCC_SYSCLK_DIV_1);
+  LL_RCC_SetAPB1Prescaler(LL_RCC_APB1_DIV_2);
+  LL_RCC_SetAPB2Prescaler(LL_RCC_APB2_DIV_1);
+  LL_RCC_SetSysClkSource(LL_RCC_SYS_CLKSOURCE_PLL);
+  while (LL_RCC_GetSysClkSource() != LL_RCC_SYS_CLKSOURCE_STATUS_PLL) {
+  }
+  SystemCoreClock = HSE_VALUE * 9U;
+  SysTick_Config(SystemCoreClock / 1000U);
+  LL_RCC_HSE_EnableCSS();
+#else
   RCC_OscInitTypeDef RCC_OscInitStruct = {0};
   RCC_ClkInitTypeDef RCC_ClkInitStruct = {0};
 
@@ -148,6 +181,7 @@ void SystemClock_Config(void) {
   /** Enables the Clock Security System
    */
   HAL_RCC_EnableCSS();
+#endif
 }
 
 /**
@@ -216,6 +250,19 @@ static void MX_USART3_UART_Init(void) {
  * @retval None
  */
 static void MX_GPIO_Init(void) {
+#if BOOTLOADER_LL
+  /* LL pin masks differ from the HAL GPIO_PIN_x ones used in main.h */
+  LL_APB2_GRP1_EnableClock(
+      LL_APB2_GRP1_PERIPH_GPIOA | LL_APB2_GRP1_PERIPH_GPIOB |
+      LL_APB2_GRP1_PERIPH_GPIOC | LL_APB2_GRP1_PERIPH_GPIOD);
+
+  HAL_GPIO_WritePin(GPIOA, LED_1_Pin | LED_2_Pin | LED_3_Pin, GPIO_PIN_SET);
+  LL_GPIO_SetPinMode(KEY_2_GPIO_Port, LL_GPIO_PIN_13, LL_GPIO_MODE_FLOATING);
+  LL_GPIO_SetPinMode(KEY_1_GPIO_Port, LL_GPIO_PIN_0, LL_GPIO_MODE_FLOATING);
+  LL_GPIO_SetPinMode(GPIOA, LL_GPIO_PIN_1, LL_GPIO_MODE_OUTPUT);
+  LL_GPIO_SetPinMode(GPIOA, LL_GPIO_PIN_2, LL_GPIO_MODE_OUTPUT);
+  LL_GPIO_SetPinMode(GPIOA, LL_GPIO_PIN_3, LL_GPIO_MODE_OUTPUT);
+#else
   GPIO_InitTypeDef GPIO_InitStruct = {0};
   /* USER CODE BEGIN MX_GPIO_Init_1 */
 
@@ -248,6 +295,7 @@ static void MX_GPIO_Init(void) {
   GPIO_InitStruct.Pull = GPIO_NOPULL;
   GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
   HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+#endif
 
   /* USER CODE BEGIN MX_GPIO_Init_2 */
 
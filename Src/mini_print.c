@@ -1,103 +1,220 @@
 #include "mini_print.h"
-#include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 
-// 将整数转成字符串（支持十进制/十六进制）
-static void int_to_str(int64_t value, char *buf, int base) {
-  char tmp[16];
-  const char *digits = "0123456789ABCDEF";
-  int i = 0, neg = 0;
+/* Output cursor, the last byte of the buffer is kept for the terminator */
+typedef struct {
+  char *p;
+  char *end;
+} mini_out_t;
 
-  if (value == 0) {
-    buf[0] = '0';
-    buf[1] = '\0';
-    return;
+/* One conversion: %[-0][width][l]type */
+typedef struct {
+  bool left;
+  bool zero;
+  int width;
+} mini_spec_t;
+
+static const char mini_digits_lower[] = "0123456789abcdef";
+static const char mini_digits_upper[] = "0123456789ABCDEF";
+
+static void out_char(mini_out_t *out, char c) {
+  if (out->p < out->end) {
+    *out->p++ = c;
   }
+}
 
-  if (value < 0 && base == 10) {
-    neg = 1;
-    value = -value;
+static void out_repeat(mini_out_t *out, char c, int count) {
+  while (count-- > 0) {
+    out_char(out, c);
   }
-  if (base == 10) {
-    while (value && i < (int)sizeof(tmp) - 1) {
-      tmp[i++] = digits[value % base];
-      value /= base;
-    }
-  } else if (base == 16) {
-    while (value && i < 8) {
-      tmp[i++] = digits[value & 0x0F];
-      value >>= 4;
-    }
+}
+
+/**
+ * @brief Decimal digits, least significant first
+ * @note  v / 10 is a multiply by the reciprocal 0xCCCCCCCD / 2^35, exact for
+ *        every 32-bit value. On the Cortex-M3 that is one UMULL per digit,
+ *        where the old int64_t code called __aeabi_ldivmod.
+ * @return Number of digits
+ */
+static int utoa_dec(uint32_t value, char *rev) {
+  int n = 0;
+
+  do {
+    uint32_t q = (uint32_t)(((uint64_t)value * 0xCCCCCCCDu) >> 35);
+
+    rev[n++] = (char)('0' + (value - q * 10));
+    value = q;
+  } while (value != 0);
+  return n;
+}
+
+/**
+ * @brief Hex digits, least significant first
+ * @return Number of digits
+ */
+static int utoa_hex(uintptr_t value, char *rev, const char *digits) {
+  int n = 0;
+
+  do {
+    rev[n++] = digits[value & 0x0F];
+    value >>= 4;
+  } while (value != 0);
+  return n;
+}
+
+/**
+ * @brief Write prefix and reversed digits padded to the field width
+ * @note  Zero padding goes between the prefix and the digits, space padding
+ *        in front of the prefix or, left aligned, after the digits.
+ */
+static void out_number(mini_out_t *out, const mini_spec_t *spec,
+                       const char *prefix, const char *rev, int n) {
+  int len = n;
+  int pad;
+
+  for (const char *s = prefix; *s; s++) {
+    len++;
+  }
+  pad = spec->width > len ? spec->width - len : 0;
+  if (!spec->left && !spec->zero) {
+    out_repeat(out, ' ', pad);
+  }
+  while (*prefix) {
+    out_char(out, *prefix++);
+  }
+  if (!spec->left && spec->zero) {
+    out_repeat(out, '0', pad);
   }
+  while (n > 0) {
+    out_char(out, rev[--n]);
+  }
+  if (spec->left) {
+    out_repeat(out, ' ', pad);
+  }
+}
 
-  if (neg)
-    tmp[i++] = '-';
+static void out_string(mini_out_t *out, const mini_spec_t *spec,
+                       const char *s) {
+  int len = 0;
 
-  // 反转 tmp 到 buf
-  for (int j = 0; j < i; ++j) {
-    buf[j] = tmp[i - 1 - j];
+  if (s == NULL) {
+    s = "(null)";
+  }
+  while (s[len]) {
+    len++;
+  }
+  if (!spec->left) {
+    out_repeat(out, ' ', spec->width - len);
+  }
+  while (*s) {
+    out_char(out, *s++);
+  }
+  if (spec->left) {
+    out_repeat(out, ' ', spec->width - len);
   }
-  buf[i] = '\0';
 }
 
-// 简化版 printf，写入目标 buffer
-int mini_printf(char *buffer, size_t max, const char *fmt, ...) {
-  va_list args;
-  va_start(args, fmt);
-  char *p = buffer;
-  char num_buf[32];
+int mini_vprintf(char *buffer, size_t max, const char *fmt, va_list args) {
+  mini_out_t out;
+  char rev[16]; /* 10 decimal digits, 16 hex digits of a host pointer */
 
+  if (max == 0) {
+    return 0;
+  }
+  out.p = buffer;
+  out.end = buffer + max - 1;
   while (*fmt) {
-    if (p - buffer >= max - 1) // keep one byte for null-terminator
-      break;
+    mini_spec_t spec = {0};
+    bool is_long = false;
+    uint32_t value;
+    int n;
+
     if (*fmt != '%') {
-      *p++ = *fmt++;
+      out_char(&out, *fmt++);
       continue;
     }
+    fmt++;
 
-    fmt++; // skip '%'
+    for (;; fmt++) {
+      if (*fmt == '-') {
+        spec.left = true;
+      } else if (*fmt == '0') {
+        spec.zero = true;
+      } else {
+        break;
+      }
+    }
+    while (*fmt >= '0' && *fmt <= '9') {
+      spec.width = spec.width * 10 + (*fmt++ - '0');
+    }
+    if (*fmt == 'l') {
+      is_long = true;
+      fmt++;
+    }
 
     switch (*fmt) {
-    case 's': {
-      const char *s = va_arg(args, const char *);
-      while (*s && p - buffer < max - 1) {
-        *p++ = *s++;
-      }
+    case 'd':
+    case 'i': {
+      int32_t v = is_long ? (int32_t)va_arg(args, long) : va_arg(args, int);
+
+      /* Negate as unsigned so INT32_MIN survives */
+      value = v < 0 ? 0u - (uint32_t)v : (uint32_t)v;
+      n = utoa_dec(value, rev);
+      out_number(&out, &spec, v < 0 ? "-" : "", rev, n);
       break;
     }
-    case 'd': {
-      int64_t val = va_arg(args, int);
-      int_to_str(val, num_buf, 10);
-      const char *s = num_buf;
-      while (*s && p - buffer < max - 1) {
-        *p++ = *s++;
-      }
+    case 'u':
+      value = is_long ? (uint32_t)va_arg(args, unsigned long)
+                      : va_arg(args, unsigned int);
+      n = utoa_dec(value, rev);
+      out_number(&out, &spec, "", rev, n);
       break;
-    }
     case 'x':
-    case 'X': {
-      int64_t val = va_arg(args, int);
-      int_to_str(val, num_buf, 16);
-      const char *s = num_buf;
-      while (*s && p - buffer < max - 1) {
-        *p++ = *s++;
-      }
+    case 'X':
+      value = is_long ? (uint32_t)va_arg(args, unsigned long)
+                      : va_arg(args, unsigned int);
+      n = utoa_hex(value, rev,
+                   *fmt == 'x' ? mini_digits_lower : mini_digits_upper);
+      out_number(&out, &spec, "", rev, n);
       break;
-    }
-    case 'c': {
-      char c = (char)va_arg(args, int);
-      *p++ = c;
+    case 'p':
+      n = utoa_hex((uintptr_t)va_arg(args, void *), rev, mini_digits_lower);
+      out_number(&out, &spec, "0x", rev, n);
       break;
-    }
+    case 's':
+      out_string(&out, &spec, va_arg(args, const char *));
+      break;
+    case 'c':
+      out_repeat(&out, ' ', spec.left ? 0 : spec.width - 1);
+      out_char(&out, (char)va_arg(args, int));
+      out_repeat(&out, ' ', spec.left ? spec.width - 1 : 0);
+      break;
+    case '%':
+      out_char(&out, '%');
+      break;
+    case '\0':
+      /* A lone '%' at the end */
+      out_char(&out, '%');
+      continue;
     default:
-      *p++ = '%';
-      *p++ = *fmt;
+      out_char(&out, '%');
+      out_char(&out, *fmt);
       break;
     }
     fmt++;
   }
 
-  *p = '\0'; // null-terminate
+  *out.p = '\0';
+  return (int)(out.p - buffer);
+}
+
+int mini_printf(char *buffer, size_t max, const char *fmt, ...) {
+  va_list args;
+  int len;
+
+  va_start(args, fmt);
+  len = mini_vprintf(buffer, max, fmt, args);
   va_end(args);
-  return p - buffer;
+  return len;
 }
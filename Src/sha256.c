@@ -0,0 +1,169 @@
+#include "sha256.h"
+#include <string.h>
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/* Next schedule word in place, w is a rolling 16-word window */
+#define SCHEDULE(i)                                                            \
+  (w[(i) & 15] += (ROR32(w[((i) - 2) & 15], 17) ^                              \
+                   ROR32(w[((i) - 2) & 15], 19) ^ (w[((i) - 2) & 15] >> 10)) + \
+                  w[((i) - 7) & 15] +                                          \
+                  (ROR32(w[((i) - 15) & 15], 7) ^                              \
+                   ROR32(w[((i) - 15) & 15], 18) ^ (w[((i) - 15) & 15] >> 3)))
+
+/* One round, the caller rotates the variable names instead of the values */
+#define ROUND(a, b, c, d, e, f, g, h, i, wi)                                   \
+  do {                                                                         \
+    uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +            \
+                  (g ^ (e & (f ^ g))) + sha256_k[i] + (wi);                    \
+    d += t1;                                                                   \
+    h = t1 + (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +                     \
+        ((a & b) | (c & (a | b)));                                             \
+  } while (0)
+
+#define ROUNDS8(i, W)                                                          \
+  do {                                                                         \
+    ROUND(a, b, c, d, e, f, g, h, (i) + 0, W((i) + 0));                        \
+    ROUND(h, a, b, c, d, e, f, g, (i) + 1, W((i) + 1));                        \
+    ROUND(g, h, a, b, c, d, e, f, (i) + 2, W((i) + 2));                        \
+    ROUND(f, g, h, a, b, c, d, e, (i) + 3, W((i) + 3));                        \
+    ROUND(e, f, g, h, a, b, c, d, (i) + 4, W((i) + 4));                        \
+    ROUND(d, e, f, g, h, a, b, c, (i) + 5, W((i) + 5));                        \
+    ROUND(c, d, e, f, g, h, a, b, (i) + 6, W((i) + 6));                        \
+    ROUND(b, c, d, e, f, g, h, a, (i) + 7, W((i) + 7));                        \
+  } while (0)
+
+#define W_LOAD(i) (w[i])
+#define W_NEXT(i) SCHEDULE(i)
+
+static uint32_t load_be32(const uint8_t *p) {
+  uint32_t v;
+
+  /* Single LDR + REV on Cortex-M3, which handles the unaligned load */
+  memcpy(&v, p, sizeof(v));
+  return __builtin_bswap32(v);
+}
+
+static void store_be32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)(v >> 24);
+  p[1] = (uint8_t)(v >> 16);
+  p[2] = (uint8_t)(v >> 8);
+  p[3] = (uint8_t)v;
+}
+
+/**
+ * @brief Compress one 64-byte block
+ * @note  Rounds are unrolled by 8 so the working variables stay in
+ *        registers and are never shuffled, the schedule is expanded in
+ *        place in a 16-word window
+ */
+static void sha256_compress(uint32_t state[8], const uint8_t *block) {
+  uint32_t w[16];
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+  for (int i = 0; i < 16; i++) {
+    w[i] = load_be32(block + i * 4);
+  }
+
+  ROUNDS8(0, W_LOAD);
+  ROUNDS8(8, W_LOAD);
+  for (int i = 16; i < 64; i += 8) {
+    ROUNDS8(i, W_NEXT);
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+/**
+ * @brief Initialize SHA-256 context
+ * @param ctx: Hash context
+ */
+void sha256_init(sha256_ctx_t *ctx) {
+  ctx->state[0] = 0x6a09e667;
+  ctx->state[1] = 0xbb67ae85;
+  ctx->state[2] = 0x3c6ef372;
+  ctx->state[3] = 0xa54ff53a;
+  ctx->state[4] = 0x510e527f;
+  ctx->state[5] = 0x9b05688c;
+  ctx->state[6] = 0x1f83d9ab;
+  ctx->state[7] = 0x5be0cd19;
+  ctx->count = 0;
+}
+
+/**
+ * @brief Hash more data
+ * @param ctx: Hash context
+ * @param data: Data buffer
+ * @param size: Data size
+ */
+void sha256_update(sha256_ctx_t *ctx, const uint8_t *data, uint32_t size) {
+  uint32_t used = ctx->count % SHA256_BLOCK_SIZE;
+
+  ctx->count += size;
+
+  if (used != 0) {
+    uint32_t fill = SHA256_BLOCK_SIZE - used;
+    if (size < fill) {
+      memcpy(ctx->buffer + used, data, size);
+      return;
+    }
+    memcpy(ctx->buffer + used, data, fill);
+    sha256_compress(ctx->state, ctx->buffer);
+    data += fill;
+    size -= fill;
+  }
+
+  /* Hash whole blocks straight from the source, no copy */
+  while (size >= SHA256_BLOCK_SIZE) {
+    sha256_compress(ctx->state, data);
+    data += SHA256_BLOCK_SIZE;
+    size -= SHA256_BLOCK_SIZE;
+  }
+
+  memcpy(ctx->buffer, data, size);
+}
+
+/**
+ * @brief Finish the hash
+ * @param ctx: Hash context
+ * @param digest: 32-byte output
+ */
+void sha256_final(sha256_ctx_t *ctx, uint8_t digest[SHA256_DIGEST_SIZE]) {
+  uint32_t used = ctx->count % SHA256_BLOCK_SIZE;
+
+  ctx->buffer[used++] = 0x80;
+  if (used > SHA256_BLOCK_SIZE - 8) {
+    memset(ctx->buffer + used, 0, SHA256_BLOCK_SIZE - used);
+    sha256_compress(ctx->state, ctx->buffer);
+    used = 0;
+  }
+  memset(ctx->buffer + used, 0, SHA256_BLOCK_SIZE - 8 - used);
+  store_be32(ctx->buffer + SHA256_BLOCK_SIZE - 8, ctx->count >> 29);
+  store_be32(ctx->buffer + SHA256_BLOCK_SIZE - 4, ctx->count << 3);
+  sha256_compress(ctx->state, ctx->buffer);
+
+  for (int i = 0; i < 8; i++) {
+    store_be32(digest + i * 4, ctx->state[i]);
+  }
+}
@@ -0,0 +1,110 @@
+#include "bootloader.h"
+#include "main.h"
+#include "spi_flash.h"
+
+#if BOOTLOADER_STAGING
+
+/*
+ * SPI1 master, mode 0, PCLK2 / 2 = 36 MHz, chip select in software.
+ *
+ *   PA4 CS (GPIO)  PA5 SCK  PA6 MISO  PA7 MOSI
+ *
+ * Every transfer runs on two DMA1 channels, RX (2) and TX (3), so the SPI
+ * never waits for the core between bytes. A missing buffer is a single
+ * byte with the memory increment off.
+ */
+#define SPI_BUS_CS_PIN GPIO_BSRR_BS4
+#define SPI_BUS_RX DMA1_Channel2
+#define SPI_BUS_TX DMA1_Channel3
+
+/* PA4 push-pull output, PA5/PA7 alternate push-pull, all 50 MHz, PA6
+ * floating input, in CRL bits 16-31 */
+#define SPI_BUS_CRL_MASK 0xFFFF0000U
+#define SPI_BUS_CRL_PINS 0xB4B30000U
+#define SPI_BUS_CRL_RESET 0x44440000U
+
+#define SPI_BUS_DMA_MAX 0xFFFFU /* CNDTR is 16 bits */
+
+static const uint8_t s_fill = 0xFF;
+static uint8_t s_drain;
+
+/**
+ * @brief Clock and configure SPI1, its pins and DMA channels
+ */
+void spi_bus_init(void) {
+  RCC->APB2ENR |= RCC_APB2ENR_IOPAEN | RCC_APB2ENR_SPI1EN;
+  RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+
+  GPIOA->BSRR = SPI_BUS_CS_PIN;
+  GPIOA->CRL = (GPIOA->CRL & ~SPI_BUS_CRL_MASK) | SPI_BUS_CRL_PINS;
+
+  SPI1->CR1 = SPI_CR1_MSTR | SPI_CR1_SSM | SPI_CR1_SSI;
+  SPI1->CR2 = SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN;
+  SPI1->CR1 |= SPI_CR1_SPE;
+
+  SPI_BUS_RX->CPAR = (uint32_t)&SPI1->DR;
+  SPI_BUS_TX->CPAR = (uint32_t)&SPI1->DR;
+}
+
+/**
+ * @brief Hand SPI1 and PA4-PA7 back in their reset state
+ * @note  The chip keeps CS high through its external pull-up
+ */
+void spi_bus_deinit(void) {
+  while ((SPI1->SR & SPI_SR_BSY) != 0) {
+  }
+  SPI_BUS_RX->CCR = 0;
+  SPI_BUS_TX->CCR = 0;
+  SPI1->CR1 = 0;
+  SPI1->CR2 = 0;
+  GPIOA->CRL = (GPIOA->CRL & ~SPI_BUS_CRL_MASK) | SPI_BUS_CRL_RESET;
+  RCC->APB2ENR &= ~RCC_APB2ENR_SPI1EN;
+}
+
+/**
+ * @brief Drive CS, the transaction ends with the chip deselected
+ */
+void spi_bus_select(bool select) {
+  GPIOA->BSRR = select ? SPI_BUS_CS_PIN << 16 : SPI_BUS_CS_PIN;
+}
+
+/**
+ * @brief Clock size bytes out and in
+ * @note  RX has the higher DMA priority, so the data register is read
+ *        before the next byte lands in it. The call returns with the last
+ *        byte clocked and the bus idle.
+ */
+void spi_bus_transfer(const uint8_t *tx, uint8_t *rx, uint32_t size) {
+  while (size > 0) {
+    uint32_t chunk = size < SPI_BUS_DMA_MAX ? size : SPI_BUS_DMA_MAX;
+
+    SPI_BUS_RX->CCR = 0;
+    SPI_BUS_TX->CCR = 0;
+    DMA1->IFCR = DMA_IFCR_CGIF2 | DMA_IFCR_CGIF3;
+
+    SPI_BUS_RX->CMAR = (uint32_t)(rx != NULL ? rx : &s_drain);
+    SPI_BUS_RX->CNDTR = chunk;
+    SPI_BUS_RX->CCR =
+        DMA_CCR_PL_1 | (rx != NULL ? DMA_CCR_MINC : 0) | DMA_CCR_EN;
+
+    SPI_BUS_TX->CMAR = (uint32_t)(tx != NULL ? tx : &s_fill);
+    SPI_BUS_TX->CNDTR = chunk;
+    SPI_BUS_TX->CCR =
+        DMA_CCR_DIR | (tx != NULL ? DMA_CCR_MINC : 0) | DMA_CCR_EN;
+
+    while ((DMA1->ISR & (DMA_ISR_TCIF2 | DMA_ISR_TEIF2)) == 0) {
+    }
+    while ((SPI1->SR & SPI_SR_BSY) != 0) {
+    }
+
+    if (tx != NULL) {
+      tx += chunk;
+    }
+    if (rx != NULL) {
+      rx += chunk;
+    }
+    size -= chunk;
+  }
+}
+
+#endif
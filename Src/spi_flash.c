@@ -0,0 +1,185 @@
+#include "spi_flash.h"
+#include "bootloader.h"
+
+#if BOOTLOADER_STAGING
+
+/* Commands, all with a 24-bit address where they take one */
+#define SPI_FLASH_CMD_WRITE_ENABLE 0x06
+#define SPI_FLASH_CMD_READ_STATUS 0x05
+#define SPI_FLASH_CMD_READ 0x03
+#define SPI_FLASH_CMD_PAGE_PROGRAM 0x02
+#define SPI_FLASH_CMD_SECTOR_ERASE 0x20
+#define SPI_FLASH_CMD_BLOCK_ERASE 0xD8
+#define SPI_FLASH_CMD_JEDEC_ID 0x9F
+#define SPI_FLASH_CMD_RELEASE 0xAB /* wake from power-down */
+
+#define SPI_FLASH_STATUS_BUSY 0x01
+
+/* JEDEC ID: Winbond, SPI NOR, capacity as a power of two */
+#define SPI_FLASH_MAX_CAPACITY 24 /* 16MB, 24-bit addresses */
+
+static uint32_t s_size; /* 0 until spi_flash_init() found a chip */
+
+/**
+ * @brief Send a command and its address, the chip stays selected
+ */
+static void spi_flash_command(uint8_t command, uint32_t address) {
+  uint8_t frame[4] = {command, (uint8_t)(address >> 16),
+                      (uint8_t)(address >> 8), (uint8_t)address};
+
+  spi_bus_select(true);
+  spi_bus_transfer(frame, NULL, sizeof(frame));
+}
+
+/**
+ * @brief Send a command without arguments
+ */
+static void spi_flash_simple(uint8_t command) {
+  spi_bus_select(true);
+  spi_bus_transfer(&command, NULL, 1);
+  spi_bus_select(false);
+}
+
+/**
+ * @brief Wait for the end of a program or erase
+ * @param timeout_ms: Datasheet maximum of the operation
+ * @return SPI_FLASH_TIMEOUT if the chip is still busy after it
+ */
+static spi_flash_result_t spi_flash_wait(uint32_t timeout_ms) {
+  uint8_t command = SPI_FLASH_CMD_READ_STATUS;
+  uint32_t start = HAL_GetTick();
+  uint8_t status;
+
+  /* The status register is sent over and over while the chip is selected */
+  spi_bus_select(true);
+  spi_bus_transfer(&command, NULL, 1);
+  do {
+    spi_bus_transfer(NULL, &status, 1);
+  } while ((status & SPI_FLASH_STATUS_BUSY) != 0 &&
+           HAL_GetTick() - start <= timeout_ms);
+  spi_bus_select(false);
+  return (status & SPI_FLASH_STATUS_BUSY) != 0 ? SPI_FLASH_TIMEOUT
+                                               : SPI_FLASH_OK;
+}
+
+static bool spi_flash_in_range(uint32_t address, uint32_t size) {
+  return address < s_size && size <= s_size - address;
+}
+
+/**
+ * @brief Start the bus and identify the chip
+ * @param size: Capacity in bytes
+ * @return SPI_FLASH_ERROR if no SPI NOR answers
+ */
+spi_flash_result_t spi_flash_init(uint32_t *size) {
+  uint8_t command = SPI_FLASH_CMD_JEDEC_ID;
+  uint8_t id[3];
+
+  spi_bus_init();
+  /* The application may have left it in power-down, tRES1 is 3 us */
+  spi_flash_simple(SPI_FLASH_CMD_RELEASE);
+  HAL_Delay(1);
+
+  spi_bus_select(true);
+  spi_bus_transfer(&command, NULL, 1);
+  spi_bus_transfer(NULL, id, sizeof(id));
+  spi_bus_select(false);
+
+  /* An empty footprint reads 0xFF or 0x00 from a floating MISO */
+  if (id[0] == 0x00 || id[0] == 0xFF || id[2] < 16 ||
+      id[2] > SPI_FLASH_MAX_CAPACITY) {
+    s_size = 0;
+    return SPI_FLASH_ERROR;
+  }
+  s_size = 1UL << id[2];
+  *size = s_size;
+  return spi_flash_wait(SPI_FLASH_BLOCK_TIMEOUT_MS);
+}
+
+/**
+ * @brief Read any number of bytes from any address
+ */
+spi_flash_result_t spi_flash_read(uint32_t address, void *data,
+                                  uint32_t size) {
+  if (!spi_flash_in_range(address, size)) {
+    return SPI_FLASH_ERROR;
+  }
+  spi_flash_command(SPI_FLASH_CMD_READ, address);
+  spi_bus_transfer(NULL, data, size);
+  spi_bus_select(false);
+  return SPI_FLASH_OK;
+}
+
+/**
+ * @brief Program erased flash, split at the page boundaries
+ * @note  A page program past the end of its page wraps to the page start
+ */
+spi_flash_result_t spi_flash_program(uint32_t address, const void *data,
+                                     uint32_t size) {
+  const uint8_t *p = data;
+
+  if (!spi_flash_in_range(address, size)) {
+    return SPI_FLASH_ERROR;
+  }
+  while (size > 0) {
+    uint32_t chunk = SPI_FLASH_PAGE_SIZE - (address % SPI_FLASH_PAGE_SIZE);
+    spi_flash_result_t result;
+
+    if (chunk > size) {
+      chunk = size;
+    }
+    spi_flash_simple(SPI_FLASH_CMD_WRITE_ENABLE);
+    spi_flash_command(SPI_FLASH_CMD_PAGE_PROGRAM, address);
+    spi_bus_transfer(p, NULL, chunk);
+    spi_bus_select(false);
+    result = spi_flash_wait(SPI_FLASH_PROGRAM_TIMEOUT_MS);
+    if (result != SPI_FLASH_OK) {
+      return result;
+    }
+    address += chunk;
+    p += chunk;
+    size -= chunk;
+  }
+  return SPI_FLASH_OK;
+}
+
+/**
+ * @brief Erase the sectors a range touches, whole blocks where it can
+ * @note  A 64KB block erases in about the time of three sectors
+ */
+spi_flash_result_t spi_flash_erase(uint32_t address, uint32_t size) {
+  uint32_t end = address + size;
+
+  address &= ~(SPI_FLASH_SECTOR_SIZE - 1);
+  if (!spi_flash_in_range(address, end - address)) {
+    return SPI_FLASH_ERROR;
+  }
+  while (address < end) {
+    bool block = (address & (SPI_FLASH_BLOCK_SIZE - 1)) == 0 &&
+                 end - address >= SPI_FLASH_BLOCK_SIZE;
+    spi_flash_result_t result;
+
+    spi_flash_simple(SPI_FLASH_CMD_WRITE_ENABLE);
+    spi_flash_command(block ? SPI_FLASH_CMD_BLOCK_ERASE
+                            : SPI_FLASH_CMD_SECTOR_ERASE,
+                      address);
+    spi_bus_select(false);
+    result = spi_flash_wait(block ? SPI_FLASH_BLOCK_TIMEOUT_MS
+                                  : SPI_FLASH_SECTOR_TIMEOUT_MS);
+    if (result != SPI_FLASH_OK) {
+      return result;
+    }
+    address += block ? SPI_FLASH_BLOCK_SIZE : SPI_FLASH_SECTOR_SIZE;
+  }
+  return SPI_FLASH_OK;
+}
+
+/**
+ * @brief Release the bus before the jump, the chip stays powered up
+ */
+void spi_flash_deinit(void) {
+  spi_bus_deinit();
+  s_size = 0;
+}
+
+#endif
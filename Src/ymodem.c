@@ -1,4 +1,5 @@
 #include "ymodem.h"
+#include "boot_arena.h"
 #include "common.h"
 #include "stm32f1xx_hal.h"
 #include <stdio.h>
@@ -11,7 +12,9 @@ extern UART_HandleTypeDef huart1;
 /* Static functions */
 static ymodem_result_t ymodem_receive_byte(uint8_t *byte, uint32_t timeout_ms);
 static ymodem_result_t ymodem_send_byte(uint8_t byte);
-static void ymodem_flush_input_buffer(void);
+
+/* The header packet and then each data packet, never two at once */
+static ymodem_packet_t s_packet BOOT_ARENA;
 
 /**
  * @brief Verify packet CRC
@@ -32,16 +35,9 @@ bool ymodem_verify_crc(const ymodem_packet_t *packet, uint16_t data_size) {
  */
 bool ymodem_is_packet_valid(const ymodem_packet_t *packet,
                             uint8_t expected_packet_num) {
-  // /* Check packet number and its inverse */
-  // if (packet->packet_num != expected_packet_num) {
-  //   return false;
-  // }
-
-  if (packet->packet_num + packet->packet_num_inv != 0xFF) {
-    return false;
-  }
-
-  return true;
+  /* Check packet number and its inverse */
+  return packet->packet_num == expected_packet_num &&
+         packet->packet_num + packet->packet_num_inv == 0xFF;
 }
 
 /**
@@ -53,18 +49,6 @@ void ymodem_reset_state(ymodem_file_info_t *file_info) {
   file_info->state = YMODEM_STATE_IDLE;
 }
 
-/**
- * @brief Initialize Y-modem receiver
- * @return Y-modem result code
- */
-ymodem_result_t ymodem_receive_init(void) {
-  /* Flush any pending data in UART buffer */
-  ymodem_flush_input_buffer();
-
-  /* Send initial NAK to request transmission start */
-  return ymodem_send_response(YMODEM_C);
-}
-
 /**
  * @brief Send response byte
  * @param response: Response byte (ACK, NAK, CAN)
@@ -105,95 +89,6 @@ static ymodem_result_t ymodem_send_byte(uint8_t byte) {
   return (status == HAL_OK) ? YMODEM_OK : YMODEM_ERROR;
 }
 
-/**
- * @brief Flush input buffer
- */
-static void ymodem_flush_input_buffer(void) {
-  uint8_t dummy;
-
-  /* Read all pending bytes with short timeout */
-  while (ymodem_receive_byte(&dummy, 10) == YMODEM_OK) {
-    /* Continue reading until timeout */
-  }
-}
-
-/**
- * @brief Receive a Y-modem packet
- * @param packet: Pointer to packet structure
- * @return Y-modem result code
- */
-ymodem_result_t ymodem_receive_packet(ymodem_packet_t *packet) {
-  ymodem_result_t result;
-  uint16_t data_size;
-  uint8_t crc_bytes[2];
-
-  /* Receive packet header */
-  result = ymodem_receive_byte(&packet->header, YMODEM_TIMEOUT_MS);
-  if (result != YMODEM_OK) {
-    return result;
-  }
-
-  /* Check if it's EOT */
-  if (packet->header == YMODEM_EOT) {
-    return YMODEM_OK;
-  }
-
-  /* Check if it's CAN */
-  if (packet->header == YMODEM_CAN) {
-    return YMODEM_CANCELLED;
-  }
-
-  /* Determine packet size based on header */
-  if (packet->header == YMODEM_SOH) {
-    data_size = YMODEM_PACKET_SIZE_128;
-  } else if (packet->header == YMODEM_STX) {
-    data_size = YMODEM_PACKET_SIZE_1024;
-  } else {
-    return YMODEM_PACKET_ERROR;
-  }
-
-  /* Receive packet number */
-  result = ymodem_receive_byte(&packet->packet_num, YMODEM_TIMEOUT_MS);
-  if (result != YMODEM_OK) {
-    return result;
-  }
-
-  /* Receive inverted packet number */
-  result = ymodem_receive_byte(&packet->packet_num_inv, YMODEM_TIMEOUT_MS);
-  if (result != YMODEM_OK) {
-    return result;
-  }
-
-  /* Receive data */
-  for (uint16_t i = 0; i < data_size; i++) {
-    result = ymodem_receive_byte(&packet->data[i], YMODEM_TIMEOUT_MS);
-    if (result != YMODEM_OK) {
-      return result;
-    }
-  }
-
-  /* Receive CRC */
-  result = ymodem_receive_byte(&crc_bytes[0], YMODEM_TIMEOUT_MS);
-  if (result != YMODEM_OK) {
-    return result;
-  }
-
-  result = ymodem_receive_byte(&crc_bytes[1], YMODEM_TIMEOUT_MS);
-  if (result != YMODEM_OK) {
-    return result;
-  }
-
-  /* Convert CRC bytes to 16-bit value (big-endian) */
-  packet->crc = (crc_bytes[0] << 8) | crc_bytes[1];
-
-  /* Verify CRC */
-  if (!ymodem_verify_crc(packet, data_size)) {
-    return YMODEM_CRC_ERROR;
-  }
-
-  return YMODEM_OK;
-}
-
 /**
  * @brief Parse header packet to extract file information
  * @param packet: Pointer to header packet
@@ -237,149 +132,369 @@ ymodem_result_t ymodem_parse_header_packet(const ymodem_packet_t *packet,
   return YMODEM_OK;
 }
 
-/* Handle header packet (packet 0) */
-bool ymodem_wait_receive_header(ymodem_file_info_t *file_info, int times) {
-  ymodem_result_t result = YMODEM_ERROR;
-  ymodem_packet_t packet;
-  /* Initialize file info */
-  ymodem_reset_state(file_info);
-  int i = 0;
-  while (i++ < times) {
-    result = ymodem_receive_packet(&packet);
-    if (result == YMODEM_OK) {
-      result = ymodem_parse_header_packet(&packet, file_info);
-      if (result != YMODEM_OK) {
-        ymodem_send_response(YMODEM_NAK);
-        return false;
-      }
-      ymodem_send_response(YMODEM_ACK);
-      return true;
-    } else {
-      ymodem_send_response(YMODEM_C);
-    }
+/**
+ * @brief Check whether the receiver still expects bytes from the sender
+ * @param rx: Receiver
+ * @return true while waiting for the header or the data
+ */
+static bool ymodem_receiver_active(const ymodem_receiver_t *rx) {
+  ymodem_state_t state;
+
+  if (rx->file_info == NULL || rx->pending) {
+    return false;
   }
-  return false;
+  state = rx->file_info->state;
+  return state == YMODEM_STATE_RECEIVING_HEADER ||
+         state == YMODEM_STATE_RECEIVING_DATA;
 }
 
 /**
- * @brief Receive a complete file using Y-modem protocol with packet callback
- * @param file_info: Pointer to file info structure
- * @param callback: Callback function to process each data packet
- * @param user_data: User data passed to callback function
- * @return Y-modem result code
+ * @brief Set the next timeout
+ * @param rx: Receiver
+ * @param timeout_ms: Milliseconds from now
  */
-ymodem_result_t
-ymodem_receive_file_with_callback(ymodem_file_info_t *file_info,
-                                  ymodem_packet_callback_t callback,
-                                  void *user_data) {
-  ymodem_packet_t packet;
-  ymodem_result_t result;
-  uint8_t expected_packet_num = 1;
-
-  while (file_info->state != YMODEM_STATE_COMPLETE &&
-         file_info->state != YMODEM_STATE_ERROR &&
-         file_info->state != YMODEM_STATE_CANCELLED) {
-
-    /* Receive packet */
-    result = ymodem_receive_packet(&packet);
-
-    if (result == YMODEM_TIMEOUT) {
-      file_info->error_count++;
-      if (file_info->error_count >= YMODEM_MAX_ERRORS) {
-        file_info->state = YMODEM_STATE_ERROR;
-        ymodem_send_response(YMODEM_CAN);
-        return YMODEM_ERROR;
-      }
-      ymodem_send_response(YMODEM_NAK);
-      continue;
-    }
+static void ymodem_receiver_arm(ymodem_receiver_t *rx, uint32_t timeout_ms) {
+  rx->deadline = HAL_GetTick() + timeout_ms;
+}
+
+/**
+ * @brief Ask the sender for the current packet again
+ * @note  'C' while waiting for the header, NAK during the data
+ * @param rx: Receiver
+ */
+static void ymodem_receiver_retry(ymodem_receiver_t *rx) {
+  rx->count = 0;
+  if (rx->file_info->state == YMODEM_STATE_RECEIVING_HEADER) {
+    ymodem_send_response(YMODEM_C);
+    ymodem_receiver_arm(rx, YMODEM_POLL_INTERVAL_MS);
+  } else {
+    ymodem_send_response(YMODEM_NAK);
+    rx->file_info->naks++;
+    ymodem_receiver_arm(rx, YMODEM_TIMEOUT_MS);
+  }
+}
+
+/**
+ * @brief End the transfer unsuccessfully
+ * @param rx: Receiver
+ * @param state: YMODEM_STATE_ERROR or YMODEM_STATE_CANCELLED
+ * @param cancel: Tell the sender with CAN
+ * @return YMODEM_EVENT_FAILED
+ */
+static ymodem_event_t ymodem_receiver_fail(ymodem_receiver_t *rx,
+                                           ymodem_state_t state, bool cancel) {
+  rx->file_info->state = state;
+  rx->pending = false;
+  if (cancel) {
+    ymodem_send_response(YMODEM_CAN);
+  }
+  return YMODEM_EVENT_FAILED;
+}
+
+/**
+ * @brief Count a bad packet and ask for it again
+ * @param rx: Receiver
+ * @param purge: The packet boundary is lost, wait for a quiet line first
+ * @return YMODEM_EVENT_FAILED after too many errors, else YMODEM_EVENT_NONE
+ */
+static ymodem_event_t ymodem_receiver_reject(ymodem_receiver_t *rx,
+                                             bool purge) {
+  ymodem_file_info_t *file_info = rx->file_info;
+
+  /* Only the data counts errors, the header wait has its own limit */
+  if (file_info->state == YMODEM_STATE_RECEIVING_DATA &&
+      ++file_info->error_count >= YMODEM_MAX_ERRORS) {
+    return ymodem_receiver_fail(rx, YMODEM_STATE_ERROR, true);
+  }
+  if (purge) {
+    rx->count = 0;
+    rx->purging = true;
+    ymodem_receiver_arm(rx, YMODEM_PURGE_MS);
+  } else {
+    ymodem_receiver_retry(rx);
+  }
+  return YMODEM_EVENT_NONE;
+}
+
+/**
+ * @brief Check the received size once the sender is done
+ * @param rx: Receiver
+ * @return YMODEM_EVENT_COMPLETE, or YMODEM_EVENT_FAILED when data is missing
+ */
+static ymodem_event_t ymodem_receiver_finish(ymodem_receiver_t *rx) {
+  ymodem_file_info_t *file_info = rx->file_info;
+
+  if (file_info->received_size < file_info->file_size) {
+    return ymodem_receiver_fail(rx, YMODEM_STATE_ERROR, false);
+  }
+  file_info->state = YMODEM_STATE_COMPLETE;
+  return YMODEM_EVENT_COMPLETE;
+}
+
+/**
+ * @brief Handle EOT, the first one is acknowledged and asked again
+ * @param rx: Receiver
+ * @return Receiver event
+ */
+static ymodem_event_t ymodem_receiver_eot(ymodem_receiver_t *rx) {
+  ymodem_send_response(YMODEM_ACK);
+  if (++rx->eot_count == 1) {
+    ymodem_send_response(YMODEM_C);
+    ymodem_receiver_arm(rx, YMODEM_TIMEOUT_MS);
+    return YMODEM_EVENT_NONE;
+  }
+  return ymodem_receiver_finish(rx);
+}
 
-    if (result == YMODEM_CANCELLED) {
-      file_info->state = YMODEM_STATE_CANCELLED;
-      return YMODEM_CANCELLED;
+/**
+ * @brief Handle the byte that starts a packet
+ * @param rx: Receiver
+ * @param byte: Received byte
+ * @return Receiver event
+ */
+static ymodem_event_t ymodem_receiver_start_packet(ymodem_receiver_t *rx,
+                                                   uint8_t byte) {
+  bool header = rx->file_info->state == YMODEM_STATE_RECEIVING_HEADER;
+
+  switch (byte) {
+  case YMODEM_SOH:
+  case YMODEM_STX:
+    s_packet.header = byte;
+    rx->size = (byte == YMODEM_SOH) ? YMODEM_PACKET_SIZE_128
+                                    : YMODEM_PACKET_SIZE_1024;
+    rx->count = 1;
+    ymodem_receiver_arm(rx, YMODEM_TIMEOUT_MS);
+    return YMODEM_EVENT_NONE;
+  case YMODEM_EOT:
+    if (!header) {
+      return ymodem_receiver_eot(rx);
+    }
+    break;
+  case YMODEM_CAN:
+    if (!header) {
+      return ymodem_receiver_fail(rx, YMODEM_STATE_CANCELLED, false);
+    }
+    break;
+  default:
+    if (!header) {
+      rx->file_info->crc_errors++;
+      return ymodem_receiver_reject(rx, true);
     }
+    break;
+  }
+
+  /* Not a transfer, the caller may treat it as a command */
+  rx->command = byte;
+  return YMODEM_EVENT_COMMAND;
+}
+
+/**
+ * @brief Handle a packet received in full
+ * @param rx: Receiver
+ * @return Receiver event
+ */
+static ymodem_event_t ymodem_receiver_packet(ymodem_receiver_t *rx) {
+  ymodem_file_info_t *file_info = rx->file_info;
+  uint32_t remaining_bytes;
+
+  if (!ymodem_verify_crc(&s_packet, rx->size)) {
+    file_info->crc_errors++;
+    return ymodem_receiver_reject(rx, false);
+  }
+
+  /* A null header instead of the second EOT ends the batch */
+  if (rx->eot_count > 0 && ymodem_is_packet_valid(&s_packet, 0) &&
+      s_packet.data[0] == 0) {
+    ymodem_send_response(YMODEM_ACK);
+    return ymodem_receiver_finish(rx);
+  }
 
-    if (result != YMODEM_OK) {
-      file_info->error_count++;
-      if (file_info->error_count >= YMODEM_MAX_ERRORS) {
-        file_info->state = YMODEM_STATE_ERROR;
-        ymodem_send_response(YMODEM_CAN);
-        return result;
-      }
-      ymodem_send_response(YMODEM_NAK);
-      continue;
+  /* Our ACK was lost and the sender repeats its last packet, which is
+   * already taken: acknowledge it again, deliver nothing */
+  if (file_info->state == YMODEM_STATE_RECEIVING_DATA &&
+      ymodem_is_packet_valid(&s_packet,
+                             (uint8_t)(rx->expected_packet_num - 1))) {
+    ymodem_send_response(YMODEM_ACK);
+    if (file_info->packet_count == 1) {
+      ymodem_send_response(YMODEM_C); /* the header, as the first time */
     }
+    ymodem_receiver_arm(rx, YMODEM_TIMEOUT_MS);
+    return YMODEM_EVENT_NONE;
+  }
+
+  if (!ymodem_is_packet_valid(&s_packet, rx->expected_packet_num)) {
+    file_info->crc_errors++;
+    return ymodem_receiver_reject(rx, false);
+  }
 
-    /* Handle EOT (End of Transmission) */
-    if (packet.header == YMODEM_EOT) {
+  if (file_info->state == YMODEM_STATE_RECEIVING_HEADER) {
+    ymodem_parse_header_packet(&s_packet, file_info);
+    if (file_info->state == YMODEM_STATE_COMPLETE) {
+      /* End of an empty batch, keep waiting for a file */
       ymodem_send_response(YMODEM_ACK);
-      ymodem_send_response(YMODEM_C);
-
-      /* After first EOT, expect second EOT or next file header */
-      result = ymodem_receive_packet(&packet);
-      if (result == YMODEM_OK && packet.header == YMODEM_EOT) {
-        ymodem_send_response(YMODEM_ACK);
-        /* Check if file is complete */
-        if (file_info->received_size >= file_info->file_size) {
-          file_info->state = YMODEM_STATE_COMPLETE;
-        } else {
-          file_info->state = YMODEM_STATE_ERROR;
-        }
-        break;
-      } else {
-        /* This might be the start of end-of-batch packet */
-        if (packet.data[0] == 0) {
-          ymodem_send_response(YMODEM_ACK);
-          file_info->state = YMODEM_STATE_COMPLETE;
-          break;
-        }
-      }
-      continue;
+      file_info->state = YMODEM_STATE_RECEIVING_HEADER;
+      ymodem_receiver_arm(rx, YMODEM_POLL_INTERVAL_MS);
+      return YMODEM_EVENT_NONE;
     }
+    rx->pending = true;
+    return YMODEM_EVENT_HEADER;
+  }
 
-    /* Validate packet number */
-    if (!ymodem_is_packet_valid(&packet, expected_packet_num)) {
-      file_info->error_count++;
-      if (file_info->error_count >= YMODEM_MAX_ERRORS) {
-        file_info->state = YMODEM_STATE_ERROR;
-        ymodem_send_response(YMODEM_CAN);
-        return YMODEM_PACKET_ERROR;
-      }
-      ymodem_send_response(YMODEM_NAK);
-      continue;
-    }
+  /* The last packet may be padded past the file size */
+  remaining_bytes = file_info->received_size < file_info->file_size
+                        ? file_info->file_size - file_info->received_size
+                        : 0;
+  rx->data = s_packet.data;
+  rx->data_size = (remaining_bytes < rx->size) ? remaining_bytes : rx->size;
+  rx->pending = true;
+  return YMODEM_EVENT_DATA;
+}
 
-    uint16_t packet_data_size = (packet.header == YMODEM_SOH)
-                                    ? YMODEM_PACKET_SIZE_128
-                                    : YMODEM_PACKET_SIZE_1024;
+/**
+ * @brief Start waiting for a transfer
+ * @note  Drops what the UART already holds and sends the first 'C'
+ * @param rx: Receiver
+ * @param file_info: Filled in as the transfer goes
+ */
+void ymodem_receiver_start(ymodem_receiver_t *rx,
+                           ymodem_file_info_t *file_info) {
+  uint8_t stale;
 
-    /* Calculate actual data size (may be less than packet size for last
-     * packet) */
-    uint32_t remaining_bytes = file_info->file_size - file_info->received_size;
-    uint16_t actual_data_size = (remaining_bytes < packet_data_size)
-                                    ? remaining_bytes
-                                    : packet_data_size;
-
-    /* Call the callback function to process the data */
-    if (callback != NULL) {
-      bool ret = callback(packet.data, actual_data_size, expected_packet_num,
-                          user_data);
-      if (!ret) {
-        file_info->state = YMODEM_STATE_ERROR;
-        ymodem_send_response(YMODEM_CAN);
-        return YMODEM_FLASH_ERROR;
-      }
+  memset(rx, 0, sizeof(ymodem_receiver_t));
+  rx->file_info = file_info;
+  ymodem_reset_state(file_info);
+  file_info->state = YMODEM_STATE_RECEIVING_HEADER;
+
+  while (ymodem_receive_byte(&stale, 0) == YMODEM_OK) {
+    /* Only what is there, no waiting for more */
+  }
+  rx->header_start = HAL_GetTick();
+  ymodem_receiver_retry(rx);
+}
+
+/**
+ * @brief Process one received byte
+ * @param rx: Receiver
+ * @param byte: Received byte
+ * @return Receiver event, YMODEM_EVENT_NONE until a packet is complete
+ */
+ymodem_event_t ymodem_receiver_feed(ymodem_receiver_t *rx, uint8_t byte) {
+  uint16_t crc_offset = YMODEM_PACKET_HEADER_SIZE + rx->size;
+
+  /* Nothing is expected while the sender waits for our answer */
+  if (!ymodem_receiver_active(rx)) {
+    return YMODEM_EVENT_NONE;
+  }
+  if (rx->purging) {
+    ymodem_receiver_arm(rx, YMODEM_PURGE_MS);
+    return YMODEM_EVENT_NONE;
+  }
+  if (rx->count == 0) {
+    return ymodem_receiver_start_packet(rx, byte);
+  }
+
+  ymodem_receiver_arm(rx, YMODEM_TIMEOUT_MS);
+  if (rx->count == 1) {
+    s_packet.packet_num = byte;
+  } else if (rx->count == 2) {
+    s_packet.packet_num_inv = byte;
+  } else if (rx->count < crc_offset) {
+    s_packet.data[rx->count - YMODEM_PACKET_HEADER_SIZE] = byte;
+  } else if (rx->count == crc_offset) {
+    /* CRC is big-endian */
+    s_packet.crc = (uint16_t)(byte << 8);
+  } else {
+    s_packet.crc |= byte;
+    rx->count = 0;
+    return ymodem_receiver_packet(rx);
+  }
+  rx->count++;
+  return YMODEM_EVENT_NONE;
+}
+
+/**
+ * @brief Handle the deadline from ymodem_receiver_deadline()
+ * @param rx: Receiver
+ * @return Receiver event
+ */
+ymodem_event_t ymodem_receiver_timeout(ymodem_receiver_t *rx) {
+  if (!ymodem_receiver_active(rx)) {
+    return YMODEM_EVENT_NONE;
+  }
+  if (rx->purging) {
+    rx->purging = false;
+    ymodem_receiver_retry(rx);
+    return YMODEM_EVENT_NONE;
+  }
+  if (rx->file_info->state == YMODEM_STATE_RECEIVING_HEADER) {
+    if (HAL_GetTick() - rx->header_start >= YMODEM_HEADER_TIMEOUT_MS) {
+      return ymodem_receiver_fail(rx, YMODEM_STATE_ERROR, false);
     }
+    ymodem_receiver_retry(rx);
+    return YMODEM_EVENT_NONE;
+  }
+  rx->file_info->timeouts++;
+  return ymodem_receiver_reject(rx, false);
+}
 
-    ymodem_send_response(YMODEM_ACK);
-    expected_packet_num++;
+/**
+ * @brief Next time ymodem_receiver_timeout() is due
+ * @param rx: Receiver
+ * @param deadline: HAL_GetTick() value
+ * @return false when nothing is due, the transfer is over or a packet is
+ *         with the caller
+ */
+bool ymodem_receiver_deadline(const ymodem_receiver_t *rx,
+                              uint32_t *deadline) {
+  if (!ymodem_receiver_active(rx)) {
+    return false;
+  }
+  *deadline = rx->deadline;
+  return true;
+}
 
-    file_info->received_size += actual_data_size;
-    file_info->packet_count++;
+/**
+ * @brief Answer a YMODEM_EVENT_HEADER or YMODEM_EVENT_DATA
+ * @note  Nothing is acknowledged before this, so the caller may take its
+ *        time with the packet, the sender waits
+ * @param rx: Receiver
+ * @param ok: ACK and continue, or cancel the transfer
+ */
+void ymodem_receiver_done(ymodem_receiver_t *rx, bool ok) {
+  ymodem_file_info_t *file_info = rx->file_info;
 
+  if (!rx->pending) {
+    return;
+  }
+  rx->pending = false;
+  if (!ok) {
+    ymodem_receiver_fail(rx, YMODEM_STATE_ERROR, true);
+    return;
+  }
+
+  ymodem_send_response(YMODEM_ACK);
+  if (!rx->header_taken) {
+    /* Header taken, ask for the data */
+    rx->header_taken = true;
+    ymodem_send_response(YMODEM_C);
+  } else {
+    file_info->received_size += rx->data_size;
+    file_info->packet_count++;
     /* Reset error count on successful packet */
     file_info->error_count = 0;
   }
+  rx->expected_packet_num++;
+  ymodem_receiver_arm(rx, YMODEM_TIMEOUT_MS);
+}
 
-  return YMODEM_OK;
+/**
+ * @brief Send 'C' now instead of at the next poll interval
+ * @note  For the caller once it answered a command
+ * @param rx: Receiver
+ */
+void ymodem_receiver_poll(ymodem_receiver_t *rx) {
+  if (ymodem_receiver_active(rx) && !rx->purging && rx->count == 0 &&
+      rx->file_info->state == YMODEM_STATE_RECEIVING_HEADER) {
+    ymodem_receiver_retry(rx);
+  }
 }
@@ -0,0 +1,152 @@
+#!/usr/bin/env python3
+
+import argparse
+import os
+import struct
+import sys
+
+from merge import read_file
+
+ENCRYPTION_MAGIC = 0x52434E45  # 'ENCR'
+NONCE_SIZE = 12
+
+
+def rotl32(v, n):
+    return ((v << n) & 0xFFFFFFFF) | (v >> (32 - n))
+
+
+def quarter_round(x, a, b, c, d):
+    x[a] = (x[a] + x[b]) & 0xFFFFFFFF
+    x[d] = rotl32(x[d] ^ x[a], 16)
+    x[c] = (x[c] + x[d]) & 0xFFFFFFFF
+    x[b] = rotl32(x[b] ^ x[c], 12)
+    x[a] = (x[a] + x[b]) & 0xFFFFFFFF
+    x[d] = rotl32(x[d] ^ x[a], 8)
+    x[c] = (x[c] + x[d]) & 0xFFFFFFFF
+    x[b] = rotl32(x[b] ^ x[c], 7)
+
+
+def chacha20_block(key: bytes, counter: int, nonce: bytes) -> bytes:
+    """One 64-byte ChaCha20 (RFC 8439) keystream block."""
+    state = [0x61707865, 0x3320646E, 0x79622D32, 0x6B206574]
+    state += list(struct.unpack("<8I", key))
+    state += [counter] + list(struct.unpack("<3I", nonce))
+    x = state[:]
+    for _ in range(10):
+        quarter_round(x, 0, 4, 8, 12)
+        quarter_round(x, 1, 5, 9, 13)
+        quarter_round(x, 2, 6, 10, 14)
+        quarter_round(x, 3, 7, 11, 15)
+        quarter_round(x, 0, 5, 10, 15)
+        quarter_round(x, 1, 6, 11, 12)
+        quarter_round(x, 2, 7, 8, 13)
+        quarter_round(x, 3, 4, 9, 14)
+    return struct.pack("<16I",
+                       *[(a + b) & 0xFFFFFFFF for a, b in zip(x, state)])
+
+
+def chacha20(key: bytes, nonce: bytes, data: bytes) -> bytes:
+    """Encrypt or decrypt data, the block counter starts at 0."""
+    out = bytearray()
+    for i in range(0, len(data), 64):
+        block = chacha20_block(key, i // 64, nonce)
+        out += bytes(a ^ b for a, b in zip(data[i:i + 64], block))
+    return bytes(out)
+
+
+def encrypt_image(app: bytes, key: bytes) -> bytes:
+    """Prefix firmware_encryption_t and encrypt the image."""
+    if len(key) != 32:
+        raise ValueError("ChaCha20 key must be 32 bytes")
+    nonce = os.urandom(NONCE_SIZE)
+    return struct.pack("<I", ENCRYPTION_MAGIC) + nonce + chacha20(
+        key, nonce, app)
+
+
+def write_key_header(path, key: bytes):
+    """Write the key as a C header, placed in the .keystore flash section."""
+    with open(path, "w") as f:
+        f.write("/* Generated by encrypt.py, ChaCha20 key for update images "
+                "*/\n")
+        f.write("#pragma once\n#include <stdint.h>\n\n")
+        f.write("static const uint8_t bootloader_encryption_key[32]\n")
+        f.write("    __attribute__((section(\".keystore\"), used)) = {\n")
+        for i in range(0, 32, 8):
+            f.write("        " + ", ".join(f"0x{b:02X}"
+                                           for b in key[i:i + 8]) + ",\n")
+        f.write("};\n")
+
+
+def cmd_keygen(args):
+    if os.path.exists(args.key) and not args.force:
+        print(f"Error: '{args.key}' already exists, use --force",
+              file=sys.stderr)
+        sys.exit(1)
+    key = os.urandom(32)
+    with open(args.key, "wb") as f:
+        f.write(key)
+    os.chmod(args.key, 0o600)
+    write_key_header(args.header, key)
+    print(f"✅ Key: {args.key}")
+    print(f"   Key header: {args.header}")
+
+
+def cmd_encrypt(args):
+    key = read_file(args.key)
+    app = read_file(args.app)
+    try:
+        encrypted = encrypt_image(app, key)
+    except ValueError as e:
+        print(f"Error: {e}", file=sys.stderr)
+        sys.exit(1)
+    with open(args.output, "wb") as f:
+        f.write(encrypted)
+    print(f"✅ Encrypted image: {args.output}")
+    print(f"   Application:    {len(app):6d} bytes")
+    print(f"   Encrypted size: {len(encrypted):6d} bytes")
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Encrypt application images for the SimpleBoot bootloader",
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="""
+Encrypted image layout:
+  firmware_encryption_t: magic 'ENCR' (4), nonce (12)
+  application binary, ChaCha20 encrypted (signed first, if secure boot is on)
+
+Examples:
+  %(prog)s keygen
+  %(prog)s encrypt app_signed.bin app_encrypted.bin
+        """)
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    keygen = sub.add_parser("keygen", help="Generate an encryption key")
+    keygen.add_argument("-k",
+                        "--key",
+                        default="encryption_key.bin",
+                        help="Key output (default: encryption_key.bin)")
+    keygen.add_argument(
+        "--header",
+        default="Inc/encryption_key.h",
+        help="Key C header (default: Inc/encryption_key.h)")
+    keygen.add_argument("--force",
+                        action="store_true",
+                        help="Overwrite an existing key")
+    keygen.set_defaults(func=cmd_keygen)
+
+    enc = sub.add_parser("encrypt", help="Encrypt an image")
+    enc.add_argument("app", help="Path to application binary file")
+    enc.add_argument("output", help="Path for the encrypted image")
+    enc.add_argument("-k",
+                     "--key",
+                     default="encryption_key.bin",
+                     help="Key (default: encryption_key.bin)")
+    enc.set_defaults(func=cmd_encrypt)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -11,6 +11,10 @@
  ******************************************************************************
  */
 
+#include "boot_mailbox.h"
+#include "boot_services.h"
+#include "boot_stats.h"
+#include "boot_timing.h"
 #include "main.h"
 #include "stm32f1xx_hal.h"
 #include "stm32f1xx_hal_gpio.h"
@@ -19,10 +23,6 @@
 #include <stdio.h>
 #include <string.h>
 
-/* Private defines */
-#define BOOTLOADER_MAGIC_ADDR 0x20000000
-#define BOOTLOADER_MAGIC 0xDEADBEEF
-
 /* Private variables */
 UART_HandleTypeDef huart1;
 uint32_t tick_counter = 0;
@@ -36,6 +36,9 @@ void Error_Handler(void);
 void App_Print(const char *message);
 void Check_Button(void);
 void Enter_Bootloader(void);
+void Print_Boot_Timing(void);
+void Print_Image_Info(void);
+void Print_Update_Stats(void);
 
 /**
  * @brief  The application entry point.
@@ -64,6 +67,9 @@ int main(void) {
   App_Print("  - Press USER button to enter bootloader");
   App_Print("  - LED will blink every second");
   App_Print("  - Send 'B' via UART to enter bootloader");
+  App_Print("  - Send 'T' via UART to show boot timing");
+  App_Print("  - Send 'I' via UART to check the image");
+  App_Print("  - Send 'U' via UART to show update statistics");
   App_Print("========================================\r\n");
 
   /* Main application loop */
@@ -82,10 +88,19 @@ int main(void) {
         sprintf(status_msg, "App Status: Running for %lu seconds",
                 tick_counter / 1000);
         App_Print(status_msg);
+      } else if (rx_data == 'T' || rx_data == 't') {
+        Print_Boot_Timing();
+      } else if (rx_data == 'I' || rx_data == 'i') {
+        Print_Image_Info();
+      } else if (rx_data == 'U' || rx_data == 'u') {
+        Print_Update_Stats();
       } else if (rx_data == 'H' || rx_data == 'h') {
         App_Print("Available commands:");
         App_Print("  B - Enter bootloader");
         App_Print("  S - Show status");
+        App_Print("  T - Show boot timing");
+        App_Print("  I - Check image through the bootloader services");
+        App_Print("  U - Show update statistics");
         App_Print("  H - Show help");
       }
     }
@@ -140,26 +155,116 @@ void Check_Button(void) {
 }
 
 /**
- * @brief Enter bootloader by setting magic number and resetting
+ * @brief Enter bootloader by posting a mailbox request and resetting
  */
 void Enter_Bootloader(void) {
+  boot_mailbox_t request = {0};
+
   HAL_GPIO_WritePin(LED_2_GPIO_Port, LED_2_Pin, GPIO_PIN_RESET);
-  App_Print("Setting bootloader magic number...");
+  App_Print("Requesting bootloader update mode...");
   App_Print("System will reset and enter bootloader mode");
   App_Print("You can now send firmware via Y-modem");
 
-  HAL_Delay(3000); // Allow UART transmission to complete
+  /* Reset as soon as the last byte has left the shift register */
+  while (__HAL_UART_GET_FLAG(&huart1, UART_FLAG_TC) == RESET) {
+  }
 
   /* Disable interrupts */
   __disable_irq();
 
-  /* Set magic number at specific RAM location */
-  *((uint32_t *)BOOTLOADER_MAGIC_ADDR) = BOOTLOADER_MAGIC;
+  request.command = BOOT_MAILBOX_CMD_ENTER_UPDATE;
+  boot_mailbox_write(&request);
 
   /* Reset the system */
   HAL_NVIC_SystemReset();
 }
 
+/**
+ * @brief Print the phase timestamps the bootloader left for this boot
+ */
+void Print_Boot_Timing(void) {
+  volatile boot_timing_t *t = BOOT_TIMING;
+  char msg[80];
+
+  if (t->magic != BOOT_TIMING_MAGIC) {
+    App_Print("No boot timing from the bootloader");
+    return;
+  }
+  for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+    if (i == BOOT_PHASE_RESET || t->phase[i] != 0) {
+      snprintf(msg, sizeof(msg), "Boot phase %d at %lu cycles", i,
+               (unsigned long)t->phase[i]);
+      App_Print(msg);
+    }
+  }
+}
+
+/**
+ * @brief Show the image metadata and re-check the image, using the
+ *        bootloader's services instead of flash and CRC code of our own
+ */
+void Print_Image_Info(void) {
+  const boot_services_t *services = boot_services();
+  boot_image_info_t info;
+  char msg[80];
+
+  if (services == NULL) {
+    App_Print("Bootloader provides no services");
+    return;
+  }
+  snprintf(msg, sizeof(msg), "Bootloader %s, services v%u",
+           services->bootloader_version, services->version);
+  App_Print(msg);
+
+  if (services->image_info(&info) != BOOT_SERVICE_OK) {
+    App_Print("No image metadata");
+    return;
+  }
+  snprintf(msg, sizeof(msg), "Image v%lu, %lu bytes, CRC32 0x%08lX%s",
+           (unsigned long)info.version, (unsigned long)info.size,
+           (unsigned long)info.crc32, info.verified ? ", verified" : "");
+  App_Print(msg);
+  if (services->image_check() == BOOT_SERVICE_OK) {
+    App_Print("Image CRC32 OK");
+  } else {
+    App_Print("Image CRC32 mismatch");
+  }
+}
+
+/**
+ * @brief Print the update statistics the bootloader kept across resets
+ */
+void Print_Update_Stats(void) {
+  boot_stats_t s;
+  char msg[80];
+
+  if (!boot_stats_read(&s)) {
+    App_Print("No update statistics from the bootloader");
+    return;
+  }
+  snprintf(msg, sizeof(msg), "Sessions %lu, updates %lu, failures %lu",
+           (unsigned long)s.sessions, (unsigned long)s.updates,
+           (unsigned long)s.failures);
+  App_Print(msg);
+  snprintf(msg, sizeof(msg),
+           "Last: %lu bytes in %lu ms, %lu B/s, %lu CRC, %lu timeouts",
+           (unsigned long)s.last[BOOT_STAT_BYTES],
+           (unsigned long)s.last[BOOT_STAT_DURATION_MS],
+           (unsigned long)boot_stats_rate(s.last[BOOT_STAT_BYTES],
+                                          s.last[BOOT_STAT_DURATION_MS]),
+           (unsigned long)s.last[BOOT_STAT_CRC_ERRORS],
+           (unsigned long)s.last[BOOT_STAT_TIMEOUTS]);
+  App_Print(msg);
+  snprintf(msg, sizeof(msg),
+           "Total: %lu NAKs, %lu overruns, %lu erase retries, %lu flash "
+           "errors",
+           (unsigned long)s.total[BOOT_STAT_NAKS],
+           (unsigned long)s.total[BOOT_STAT_OVERRUNS],
+           (unsigned long)s.total[BOOT_STAT_FLASH_RETRIES],
+           (unsigned long)s.total[BOOT_STAT_FLASH_ERRORS]);
+  App_Print(msg);
+}
+
 /**
  * @brief Print message via UART
  * @param message: Message to print
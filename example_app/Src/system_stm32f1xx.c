@@ -96,9 +96,11 @@
 /*!< Uncomment the following line if you need to relocate your vector Table in
      Internal SRAM. */
 /* #define VECT_TAB_SRAM */
+#ifndef VECT_TAB_OFFSET /* the Makefile passes BOOTLOADER_SIZE */
 #define VECT_TAB_OFFSET                                                        \
   0x4000 /*!< Vector Table base offset field.                                  \
            This value must be a multiple of 0x200. */
+#endif
 
 /**
  * @}
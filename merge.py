@@ -1,14 +1,19 @@
 #!/usr/bin/env python3
 
 import argparse
+import hashlib
 import struct
 import sys
 import os
 
 ADDR_BOOTLOADER = 0x08000000
-ADDR_APPMETA = 0x08003FD0
-APPMETA_SIZE = 0x30
+ADDR_APPMETA = 0x08003FC0
+APPMETA_SIZE = 0x40
 ADDR_APP = 0x08004000
+FLASH_END = 0x08010000
+FLASH_PAGE_SIZE = 0x400
+SPARSE_MAGIC = 0x53525053  # 'SPRS'
+SEGMENT_HEADER_SIZE = 12  # firmware_segment_t
 crc32_table = [
     0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F,
     0xE963A535, 0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
@@ -90,20 +95,151 @@ def pad_to_offset(blob: bytes, target_offset: int,
     return blob + b'\xFF' * pad_len
 
 
-def generate_appmeta(app_size, app_crc32, version: int = 1) -> bytes:
-    """Generate application metadata with magic, version, size and CRC32."""
+def read_elf_segments(path):
+    """Loadable segments of a 32-bit little-endian ELF, at their load
+    address, without the zero-initialised tail that is not in the file."""
+    elf = read_file(path)
+    if elf[:4] != b"\x7fELF" or elf[4] != 1 or elf[5] != 1:
+        raise ValueError(f"'{path}' is not a 32-bit little-endian ELF")
+    phoff, = struct.unpack_from("<I", elf, 28)
+    phentsize, phnum = struct.unpack_from("<HH", elf, 42)
+    segments = []
+    for i in range(phnum):
+        (p_type, p_offset, _, p_paddr, p_filesz, _, _,
+         _) = struct.unpack_from("<8I", elf, phoff + i * phentsize)
+        if p_type == 1 and p_filesz > 0:  # PT_LOAD
+            segments.append((p_paddr, elf[p_offset:p_offset + p_filesz]))
+    return sorted(segments)
+
+
+def set_layout(bootloader_size):
+    """Place the metadata and the application behind a bootloader of
+    bootloader_size bytes, the Makefile's BOOTLOADER_SIZE."""
+    global ADDR_APPMETA, ADDR_APP
+    if (bootloader_size % FLASH_PAGE_SIZE or bootloader_size <= 0
+            or ADDR_BOOTLOADER + bootloader_size >= FLASH_END):
+        raise ValueError(f"Bootloader size {hex(bootloader_size)} is not a "
+                         "whole number of pages inside the flash")
+    ADDR_APP = ADDR_BOOTLOADER + bootloader_size
+    ADDR_APPMETA = ADDR_APP - APPMETA_SIZE
+
+
+def linked_bootloader_size(app_path):
+    """Bootloader size an application ELF was linked for, from its lowest
+    load address. None for a flat binary."""
+    if not app_path.endswith(".elf"):
+        return None
+    return read_elf_segments(app_path)[0][0] - ADDR_BOOTLOADER
+
+
+def read_image(path, base):
+    """Segments of an ELF, or of a flat binary that starts at base."""
+    if path.endswith(".elf"):
+        return read_elf_segments(path)
+    return [(base, read_file(path))]
+
+
+def flatten(segments, base):
+    """The span from base to the end of the last segment as flash holds it,
+    holes read 0xFF."""
+    end = max(addr + len(data) for addr, data in segments)
+    flat = bytearray(b"\xFF" * (end - base))
+    for addr, data in segments:
+        if addr < base:
+            raise ValueError(f"Segment at {hex(addr)} is below {hex(base)}")
+        flat[addr - base:addr - base + len(data)] = data
+    return bytes(flat)
+
+
+def populated_ranges(flat: bytes,
+                     base,
+                     min_hole=SEGMENT_HEADER_SIZE + 4):
+    """Split an even-sized flat image at runs of erased halfwords.
+
+    Holes shorter than min_hole stay inside a range, another segment header
+    would cost more than sending them.
+    """
+    erased = b"\xFF\xFF"
+    ranges = []
+    i = 0
+    while i < len(flat):
+        while i < len(flat) and flat[i:i + 2] == erased:
+            i += 2
+        start = i
+        while i < len(flat):
+            hole = i
+            while hole < len(flat) and flat[hole:hole + 2] == erased:
+                hole += 2
+            if hole > i and (hole - i >= min_hole or hole == len(flat)):
+                break
+            i = hole if hole > i else i + 2
+        if i > start:
+            ranges.append((base + start, flat[start:i]))
+    return ranges
+
+
+def sparse_container(segments) -> bytes:
+    """Y-modem payload for the bootloader: firmware_sparse_t, then each
+    populated range as firmware_segment_t and its data."""
+    flat = flatten(segments, ADDR_APP)
+    flat += b"\xFF" * (len(flat) & 1)  # programmed in halfwords
+    if len(flat) > FLASH_END - ADDR_APP:
+        raise ValueError(f"Image of {len(flat)} bytes does not fit")
+    ranges = populated_ranges(flat, ADDR_APP)
+    out = struct.pack("<IIII", SPARSE_MAGIC, len(flat),
+                      crc32_update(0xFFFFFFFF, flat), len(ranges))
+    for addr, data in ranges:
+        out += struct.pack("<III", addr, len(data),
+                           crc32_update(0xFFFFFFFF, data)) + data
+    return out
+
+
+def intel_hex(ranges) -> str:
+    """Intel HEX with only the given ranges, for openocd's program."""
+    lines = []
+    upper = None
+    for addr, data in ranges:
+        offset = 0
+        while offset < len(data):
+            at = addr + offset
+            # A record must not cross a 64KB boundary
+            chunk = data[offset:offset + min(16, 0x10000 - (at & 0xFFFF))]
+            if at >> 16 != upper:
+                upper = at >> 16
+                lines.append(hex_record(0, 4, struct.pack(">H", upper)))
+            lines.append(hex_record(at & 0xFFFF, 0, chunk))
+            offset += len(chunk)
+    lines.append(hex_record(0, 1, b""))
+    return "\n".join(lines) + "\n"
+
+
+def hex_record(addr, kind, data: bytes) -> str:
+    body = struct.pack(">BHB", len(data), addr, kind) + data
+    checksum = -sum(body) & 0xFF
+    return ":" + (body + bytes([checksum])).hex().upper()
+
+
+def generate_appmeta(app_size,
+                     app_crc32,
+                     app_sha256: bytes,
+                     version: int = 1) -> bytes:
+    """Generate application metadata with magic, version, size, CRC32 and
+    SHA-256."""
     magic = 0x424F4F54  # 'BOOT'
 
-    meta_head = struct.pack("<IIII", magic, version, app_size, app_crc32)
+    meta_head = struct.pack("<IIII", magic, version, app_size,
+                            app_crc32) + app_sha256
 
-    # Pad with 0xFF to make total metadata size 0x30 bytes
+    # Pad with 0xFF to make total metadata size 0x40 bytes. The verified mark
+    # right after the header stays erased, the bootloader programs it after
+    # its first boot-time integrity check.
     meta_tail = b'\xFF' * (APPMETA_SIZE - len(meta_head))
     return meta_head + meta_tail
 
 
-def validate_files(bootloader_path, app_path):
+def validate_files(paths):
     """Validate input files exist and are readable."""
-    for path in [bootloader_path, app_path]:
+    for path in paths:
         if not os.path.exists(path):
             print(f"Error: File '{path}' does not exist", file=sys.stderr)
             return False
@@ -129,6 +265,31 @@ def create_output_dir(output_path):
     return True
 
 
+def write_output(output_path, output: bytes):
+    """Write the output file or exit with an error."""
+    try:
+        with open(output_path, "wb") as f:
+            f.write(output)
+    except PermissionError:
+        print(f"Error: Permission denied writing to '{output_path}'",
+              file=sys.stderr)
+        sys.exit(1)
+    except Exception as e:
+        print(f"Error writing to '{output_path}': {e}", file=sys.stderr)
+        sys.exit(1)
+
+
+def write_container(app_path, output_path):
+    """Write the sparse Y-modem container of an application."""
+    segments = read_image(app_path, ADDR_APP)
+    container = sparse_container(segments)
+    image_size, image_crc32, count = struct.unpack_from("<III", container, 4)
+    write_output(output_path, container)
+    print(f"✅ Successfully created sparse container: {output_path}")
+    print(f"   Image     : {image_size:6d} bytes (CRC32: 0x{image_crc32:08X})")
+    print(f"   Container : {len(container):6d} bytes, {count} segments")
+
+
 def merge_firmware(bootloader_path,
                    app_path,
                    output_path,
@@ -143,9 +304,10 @@ def merge_firmware(bootloader_path,
         print(f"Application metadata version: {version}")
         print()
 
-    # Read input files
-    bootloader = read_file(bootloader_path)
-    app = read_file(app_path)
+    # Read input files, ELF segments are laid out as flash will hold them
+    bootloader = flatten(read_image(bootloader_path, ADDR_BOOTLOADER),
+                         ADDR_BOOTLOADER)
+    app = flatten(read_image(app_path, ADDR_APP), ADDR_APP)
 
     if verbose:
         print(f"Bootloader size: {len(bootloader)} bytes")
@@ -154,7 +316,27 @@ def merge_firmware(bootloader_path,
     # Generate application metadata
     app_crc32 = crc32_update(0xFFFFFFFF, app)
     app_size = len(app)
-    appmeta = generate_appmeta(app_size, app_crc32, version=version)
+    appmeta = generate_appmeta(app_size,
+                               app_crc32,
+                               hashlib.sha256(app).digest(),
+                               version=version)
+
+    if output_path.endswith(".hex"):
+        if ADDR_BOOTLOADER + len(bootloader) > ADDR_APPMETA:
+            raise ValueError("Bootloader overlaps the application metadata")
+        # Only populated ranges, the programmer skips everything else
+        even = lambda blob: blob + b"\xFF" * (len(blob) & 1)
+        ranges = (populated_ranges(even(bootloader), ADDR_BOOTLOADER) +
+                  populated_ranges(appmeta, ADDR_APPMETA) +
+                  populated_ranges(even(app), ADDR_APP))
+        write_output(output_path, intel_hex(ranges).encode())
+        print(f"✅ Successfully created sparse firmware: {output_path}")
+        print(f"   Bootloader: {len(bootloader):6d} bytes")
+        print(f"   Application: {len(app):6d} bytes "
+              f"(CRC32: 0x{app_crc32:08X})")
+        print(f"   Populated : {sum(len(d) for _, d in ranges):6d} bytes in "
+              f"{len(ranges)} ranges")
+        return
 
     # Build output firmware
     output = bootloader
@@ -177,17 +359,7 @@ def merge_firmware(bootloader_path,
     # Add application
     output += app
 
-    # Write output file
-    try:
-        with open(output_path, "wb") as f:
-            f.write(output)
-    except PermissionError:
-        print(f"Error: Permission denied writing to '{output_path}'",
-              file=sys.stderr)
-        sys.exit(1)
-    except Exception as e:
-        print(f"Error writing to '{output_path}': {e}", file=sys.stderr)
-        sys.exit(1)
+    write_output(output_path, output)
 
     # Print results
     print(f"✅ Successfully created firmware: {output_path}")
@@ -203,25 +375,44 @@ def main():
         "Merge STM32 bootloader and application into single firmware image",
         formatter_class=argparse.RawDescriptionHelpFormatter,
         epilog="""
-Memory Layout:
-  0x08000000: Bootloader start
-  0x08003FD0: Application metadata (48 bytes)
+Memory Layout (default 16KB bootloader, -b moves everything after it):
+  0x08000000: Bootloader start (15KB)
+  0x08003C00: Metadata page, erased on every update
+  0x08003FC0: Application metadata (64 bytes)
   0x08004000: Application start
 
+Without -b an application ELF sets the layout from its link address, a flat
+binary gets the 16KB default.
+
+Inputs are flat binaries or ELF files, whose loadable segments are placed at
+their load addresses. A .hex output lists only the populated ranges, so the
+programmer skips the padding. --container writes the sparse update for the
+Y-modem transfer: firmware_sparse_t (magic 'SPRS', image size, image CRC32,
+segment count), then every populated range as address, size, CRC32 and data.
+
 Examples:
   %(prog)s bootloader.bin app.bin firmware.bin
   %(prog)s -v -V 2 boot.bin application.bin output/firmware.bin
+  %(prog)s build/bootloader.elf example_app/build/app.elf firmware_all.hex
+  %(prog)s --container example_app/build/app.elf app.sparse
+  %(prog)s -b 0x2000 build/bootloader.bin app.bin firmware.bin
         """)
 
-    parser.add_argument("boot",
-                        help="Path to bootloader binary file",
-                        default="build/bootloader.bin")
-    parser.add_argument("app",
-                        help="Path to application binary file",
-                        default="example_app/build/app.bin")
-    parser.add_argument("output",
-                        help="Path for output firmware file",
-                        default="firmware_all.bin")
+    parser.add_argument("files",
+                        nargs="+",
+                        metavar="FILE",
+                        help="Bootloader, application and output, or "
+                        "application and output with --container")
+    parser.add_argument("-c",
+                        "--container",
+                        action="store_true",
+                        help="Write a sparse update container")
+    parser.add_argument("-b",
+                        "--bootloader-size",
+                        type=lambda s: int(s, 0),
+                        help="Flash reserved for the bootloader, BOOTLOADER_"
+                        "SIZE of its build (default: from an application "
+                        "ELF, else 0x4000)")
     parser.add_argument("-V",
                         "--version",
                         type=int,
@@ -236,9 +427,17 @@ Examples:
                         help="Overwrite output file if it exists")
 
     args = parser.parse_args()
+    expected = 2 if args.container else 3
+    if len(args.files) != expected:
+        parser.error(f"expected {expected} files, got {len(args.files)}")
+    if args.container:
+        args.boot = None
+        args.app, args.output = args.files
+    else:
+        args.boot, args.app, args.output = args.files
 
     # Validate input files
-    if not validate_files(args.boot, args.app):
+    if not validate_files([p for p in (args.boot, args.app) if p]):
         sys.exit(1)
 
     # Check if output file exists
@@ -261,8 +460,20 @@ Examples:
 
     # Merge firmware
     try:
-        merge_firmware(args.boot, args.app, args.output, args.version,
-                       args.verbose)
+        linked = linked_bootloader_size(args.app)
+        if args.bootloader_size is None:
+            args.bootloader_size = linked
+        elif linked is not None and linked != args.bootloader_size:
+            raise ValueError(f"'{args.app}' is linked for a "
+                             f"{hex(linked)} byte bootloader, not "
+                             f"{hex(args.bootloader_size)}")
+        if args.bootloader_size is not None:
+            set_layout(args.bootloader_size)
+        if args.container:
+            write_container(args.app, args.output)
+        else:
+            merge_firmware(args.boot, args.app, args.output, args.version,
+                           args.verbose)
     except ValueError as e:
         print(f"Error: {e}", file=sys.stderr)
         sys.exit(1)
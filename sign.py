@@ -0,0 +1,232 @@
+#!/usr/bin/env python3
+
+import argparse
+import hashlib
+import os
+import struct
+import sys
+
+from merge import crc32_update, read_file
+
+APPLICATION_META_MAGIC = 0x424F4F54  # 'BOOT'
+SIGNATURE_MAGIC = 0x4E474953  # 'SIGN'
+
+# Ed25519 (RFC 8032) curve parameters
+P = 2**255 - 19
+L = 2**252 + 27742317777372353535851937790883648493
+D = -121665 * pow(121666, P - 2, P) % P
+SQRT_M1 = pow(2, (P - 1) // 4, P)
+BASE_Y = 4 * pow(5, P - 2, P) % P
+
+
+def recover_x(y, sign):
+    """Recover the x coordinate of a curve point from y and the sign bit."""
+    if y >= P:
+        return None
+    x2 = (y * y - 1) * pow(D * y * y + 1, P - 2, P) % P
+    if x2 == 0:
+        return None if sign else 0
+    x = pow(x2, (P + 3) // 8, P)
+    if (x * x - x2) % P != 0:
+        x = x * SQRT_M1 % P
+    if (x * x - x2) % P != 0:
+        return None
+    if (x & 1) != sign:
+        x = P - x
+    return x
+
+
+BASE = (recover_x(BASE_Y, 0), BASE_Y, 1, recover_x(BASE_Y, 0) * BASE_Y % P)
+
+
+def point_add(p, q):
+    """Add two points in extended coordinates."""
+    a = (p[1] - p[0]) * (q[1] - q[0]) % P
+    b = (p[1] + p[0]) * (q[1] + q[0]) % P
+    c = 2 * p[3] * q[3] * D % P
+    d = 2 * p[2] * q[2] % P
+    e, f, g, h = b - a, d - c, d + c, b + a
+    return (e * f % P, g * h % P, f * g % P, e * h % P)
+
+
+def point_mul(s, p):
+    """Multiply a point by a scalar (double and add)."""
+    q = (0, 1, 1, 0)
+    while s > 0:
+        if s & 1:
+            q = point_add(q, p)
+        p = point_add(p, p)
+        s >>= 1
+    return q
+
+
+def point_compress(p):
+    """Encode a point as 32 bytes: y with the sign of x in the top bit."""
+    zinv = pow(p[2], P - 2, P)
+    x = p[0] * zinv % P
+    y = p[1] * zinv % P
+    return int.to_bytes(y | ((x & 1) << 255), 32, "little")
+
+
+def sha512_int(data: bytes) -> int:
+    return int.from_bytes(hashlib.sha512(data).digest(), "little")
+
+
+def secret_expand(seed: bytes):
+    """Derive the secret scalar and the nonce prefix from a 32-byte seed."""
+    if len(seed) != 32:
+        raise ValueError("Ed25519 seed must be 32 bytes")
+    h = hashlib.sha512(seed).digest()
+    a = int.from_bytes(h[:32], "little")
+    a &= (1 << 254) - 8
+    a |= 1 << 254
+    return a, h[32:]
+
+
+def public_key(seed: bytes) -> bytes:
+    a, _ = secret_expand(seed)
+    return point_compress(point_mul(a, BASE))
+
+
+def sign(seed: bytes, msg: bytes) -> bytes:
+    """Ed25519 signature of msg."""
+    a, prefix = secret_expand(seed)
+    pk = point_compress(point_mul(a, BASE))
+    r = sha512_int(prefix + msg) % L
+    rs = point_compress(point_mul(r, BASE))
+    h = sha512_int(rs + pk + msg) % L
+    s = (r + h * a) % L
+    return rs + int.to_bytes(s, 32, "little")
+
+
+def verify(pk: bytes, msg: bytes, signature: bytes) -> bool:
+    """Ed25519 verification, used to double check what we produce."""
+    if len(signature) != 64 or len(pk) != 32:
+        return False
+    y = int.from_bytes(pk, "little")
+    x = recover_x(y & ((1 << 255) - 1), y >> 255)
+    if x is None:
+        return False
+    a = (x, y & ((1 << 255) - 1), 1, x * (y & ((1 << 255) - 1)) % P)
+    s = int.from_bytes(signature[32:], "little")
+    if s >= L:
+        return False
+    h = sha512_int(signature[:32] + pk + msg) % L
+    sb = point_mul(s, BASE)
+    ha = point_mul(h, a)
+    rs = point_compress(point_add(sb, (P - ha[0], ha[1], ha[2], P - ha[3])))
+    return rs == signature[:32]
+
+
+def firmware_header(app: bytes, version) -> bytes:
+    """firmware_info_t up to the verified mark, as the bootloader writes it."""
+    crc32 = crc32_update(0xFFFFFFFF, app)
+    return struct.pack("<IIII", APPLICATION_META_MAGIC, version, len(app),
+                       crc32) + hashlib.sha256(app).digest()
+
+
+def sign_image(app: bytes, seed: bytes, version: int) -> bytes:
+    """Append the signature block (firmware_signature_t) to an image."""
+    crc32 = crc32_update(0xFFFFFFFF, app)
+    signature = sign(seed, app + firmware_header(app, version))
+    block = struct.pack("<IIII", SIGNATURE_MAGIC, version, len(app), crc32)
+    return app + block + signature
+
+
+def write_key_header(path, pk: bytes):
+    """Write the public key as a C header for the bootloader build."""
+    with open(path, "w") as f:
+        f.write("/* Generated by sign.py, Ed25519 public key for image "
+                "signatures */\n")
+        f.write("#pragma once\n#include <stdint.h>\n\n")
+        f.write("static const uint8_t bootloader_signing_key[32] = {\n")
+        for i in range(0, 32, 8):
+            f.write("    " + ", ".join(f"0x{b:02X}"
+                                       for b in pk[i:i + 8]) + ",\n")
+        f.write("};\n")
+
+
+def cmd_keygen(args):
+    if os.path.exists(args.key) and not args.force:
+        print(f"Error: '{args.key}' already exists, use --force",
+              file=sys.stderr)
+        sys.exit(1)
+    seed = os.urandom(32)
+    with open(args.key, "wb") as f:
+        f.write(seed)
+    os.chmod(args.key, 0o600)
+    pk = public_key(seed)
+    write_key_header(args.header, pk)
+    print(f"✅ Private key: {args.key}")
+    print(f"   Public key header: {args.header}")
+    print(f"   Public key: {pk.hex()}")
+
+
+def cmd_sign(args):
+    seed = read_file(args.key)
+    app = read_file(args.app)
+    if args.version < 1 or args.version > 0xFFFFFFFF:
+        print(f"Error: Version must be between 1 and {0xFFFFFFFF}",
+              file=sys.stderr)
+        sys.exit(1)
+    signed = sign_image(app, seed, args.version)
+    header = firmware_header(app, args.version)
+    if not verify(public_key(seed), app + header, signed[-64:]):
+        print("Error: signature self-check failed", file=sys.stderr)
+        sys.exit(1)
+    with open(args.output, "wb") as f:
+        f.write(signed)
+    print(f"✅ Signed image: {args.output}")
+    print(f"   Application: {len(app):6d} bytes")
+    print(f"   Signed size: {len(signed):6d} bytes")
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Sign application images for the SimpleBoot bootloader",
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="""
+Signed image layout:
+  application binary
+  firmware_signature_t: magic 'SIGN', version, size, crc32 (16 bytes)
+  Ed25519 signature over application + firmware_info_t header (64 bytes)
+
+Examples:
+  %(prog)s keygen
+  %(prog)s sign -V 2 example_app/build/app.bin app_signed.bin
+        """)
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    keygen = sub.add_parser("keygen", help="Generate a signing key pair")
+    keygen.add_argument("-k",
+                        "--key",
+                        default="signing_key.bin",
+                        help="Private key output (default: signing_key.bin)")
+    keygen.add_argument("--header",
+                        default="Inc/signing_key.h",
+                        help="Public key C header (default: Inc/signing_key.h)")
+    keygen.add_argument("--force",
+                        action="store_true",
+                        help="Overwrite an existing private key")
+    keygen.set_defaults(func=cmd_keygen)
+
+    signp = sub.add_parser("sign", help="Append a signature to an image")
+    signp.add_argument("app", help="Path to application binary file")
+    signp.add_argument("output", help="Path for the signed image")
+    signp.add_argument("-k",
+                       "--key",
+                       default="signing_key.bin",
+                       help="Private key (default: signing_key.bin)")
+    signp.add_argument("-V",
+                       "--version",
+                       type=int,
+                       default=1,
+                       help="Application metadata version (default: 1)")
+    signp.set_defaults(func=cmd_sign)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()
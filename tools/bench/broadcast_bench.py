@@ -0,0 +1,178 @@
+#!/usr/bin/env python3
+"""One-way broadcast update benchmark on the host simulator.
+
+Every case starts N fresh simpleboot_sim nodes with the update button held
+and an erased flash each, streams one generated image to all of them with
+sbcast and never lets a node answer. Each simulator gets its own bit error
+rate seed, so every node loses different packets, and the overrun model
+drops bytes that arrive while a node programs flash. Every node's flash is
+compared with the image afterwards.
+
+The point is the loss rate the code absorbs: the repair symbols of a
+generation stand in for whichever packets a node lost, a later pass covers
+what they could not, and no node ever asks for anything.
+"""
+
+import argparse
+import json
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+SIM_STATS = re.compile(r"\[sim\] application at ([0-9.]+) ms: .*"
+                       r"uart rx (\d+) \(lost (\d+), corrupted (\d+)\)")
+APP_OFFSET = 0x4000  # application start in the flash file
+
+
+def make_image(size):
+    """Vector table the bootloader accepts, deterministic filler after it."""
+    rng = random.Random(size)
+    head = (0x20005000).to_bytes(4, "little") + \
+        (0x08004141).to_bytes(4, "little")
+    return head + bytes(rng.getrandbits(8) for _ in range(size - len(head)))
+
+
+def sbcast_report(output):
+    """Stream time in ms and bytes sent."""
+    m = re.search(r"Sent:\s+(\d+) packets, (\d+) bytes in ([0-9.]+) ms",
+                  output)
+    return (float(m.group(3)), int(m.group(2))) if m else (None, None)
+
+
+def run_case(args, ber, workdir):
+    name = f"ber{ber:g}"
+    image = os.path.join(workdir, f"{name}.bin")
+    data = make_image(args.size)
+    with open(image, "wb") as f:
+        f.write(data)
+
+    sims = []
+    ttys = [os.path.join(workdir, f"{name}-{node}.tty")
+            for node in range(1, args.nodes + 1)]
+    try:
+        for node, tty in enumerate(ttys, 1):
+            sims.append(subprocess.Popen(
+                [args.sim, "-k", "-x", "-l", tty,
+                 "-f", os.path.join(workdir, f"{name}-{node}.flash"),
+                 "-r", str(ber), "-s", str(args.seed + node)],
+                stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True))
+        # Every node waits for firmware once its pty is there
+        deadline = time.monotonic() + 5
+        for tty in ttys:
+            while not os.path.exists(tty):
+                if time.monotonic() > deadline:
+                    raise RuntimeError(f"{name}: simulator did not start")
+                time.sleep(0.01)
+        time.sleep(0.2)
+        upload = subprocess.run(
+            [args.sbcast, "-q", "-e", "", "-p", str(args.passes),
+             "-r", str(args.repair), "-s", str(args.seed), image] + ttys,
+            capture_output=True, text=True, timeout=args.timeout)
+        # A node that got the image has jumped and exited by now
+        time.sleep(0.5)
+    finally:
+        logs = []
+        for sim in sims:
+            sim.terminate()
+            logs.append(sim.communicate(timeout=10)[1])
+
+    result = {"ber": ber, "nodes": args.nodes, "size": args.size,
+              "ok": upload.returncode == 0}
+    if not result["ok"]:
+        result["error"] = (upload.stderr.strip().splitlines() or ["?"])[-1]
+        return name, result
+
+    complete = 0
+    for node in range(1, args.nodes + 1):
+        with open(os.path.join(workdir, f"{name}-{node}.flash"), "rb") as f:
+            f.seek(APP_OFFSET)
+            complete += f.read(len(data)) == data
+    stats = [m for m in map(SIM_STATS.search, logs) if m]
+    stream_ms, sent = sbcast_report(upload.stdout)
+    result.update({
+        "complete": complete,
+        "last_ms": max((float(m.group(1)) for m in stats), default=0),
+        "stream_ms": stream_ms,
+        "sent": sent,
+        "lost_max": max((int(m.group(3)) for m in stats), default=0),
+        "corrupted_max": max((int(m.group(4)) for m in stats), default=0),
+    })
+    if complete != args.nodes:
+        result.update(ok=False, error=f"{args.nodes - complete} nodes "
+                      "without the image")
+    return name, result
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Benchmark one-way broadcast updates across line BER",
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="""
+Examples:
+  %(prog)s --sim build/broadcast/host/simpleboot_sim
+  %(prog)s --nodes 16 --ber 0,1e-4,3e-4 --passes 4 --repair 50
+        """)
+    parser.add_argument("--sim", default="build/broadcast/host/simpleboot_sim",
+                        help="Simulator built with BROADCAST=1 "
+                        "(default: build/broadcast/host/simpleboot_sim)")
+    parser.add_argument("--sbcast", default="build/host/sbcast",
+                        help="Sender (default: build/host/sbcast)")
+    parser.add_argument("--nodes", type=int, default=8,
+                        help="Nodes on the line (default: 8)")
+    parser.add_argument("--ber", default="0,1e-5,5e-5,1e-4",
+                        help="Comma separated bit error rates "
+                        "(default: 0,1e-5,5e-5,1e-4)")
+    parser.add_argument("--size", type=int, default=16384,
+                        help="Image size in bytes (default: 16384)")
+    parser.add_argument("--passes", type=int, default=3,
+                        help="sbcast passes (default: 3)")
+    parser.add_argument("--repair", type=int, default=25,
+                        help="sbcast repair %% (default: 25)")
+    parser.add_argument("-s", "--seed", type=int, default=1,
+                        help="Simulator and sender seed (default: 1)")
+    parser.add_argument("-t", "--timeout", type=float, default=120,
+                        help="Seconds per case (default: 120)")
+    parser.add_argument("--save", help="Write the results as JSON")
+    args = parser.parse_args()
+
+    rates = [float(r) for r in args.ber.split(",")]
+    results = {}
+    with tempfile.TemporaryDirectory() as workdir:
+        try:
+            for ber in rates:
+                name, result = run_case(args, ber, workdir)
+                results[name] = result
+        except (RuntimeError, OSError, subprocess.TimeoutExpired) as e:
+            print(f"Error: {e}", file=sys.stderr)
+            sys.exit(1)
+
+    print(f"{'case':<10} {'nodes':>5} {'last ms':>9} {'stream':>9} "
+          f"{'sent':>7} {'lost':>5} {'corrupt':>7}")
+    for name, r in results.items():
+        if "complete" not in r:
+            print(f"{name:<10} failed: {r['error']}")
+            continue
+        print(f"{name:<10} {r['complete']:>2}/{r['nodes']:<2} "
+              f"{r['last_ms']:>9.1f} {r['stream_ms']:>9.1f} {r['sent']:>7} "
+              f"{r['lost_max']:>5} {r['corrupted_max']:>7}")
+
+    if args.save:
+        with open(args.save, "w") as f:
+            json.dump(results, f, indent=2)
+            f.write("\n")
+        print(f"✅ Results: {args.save}")
+
+    failed = [name for name, r in results.items() if not r["ok"]]
+    for name in failed:
+        print(f"❌ {name}: {results[name]['error']}", file=sys.stderr)
+    if failed:
+        sys.exit(1)
+    print("✅ Every node of every case has the image")
+
+
+if __name__ == "__main__":
+    main()
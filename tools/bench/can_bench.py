@@ -0,0 +1,210 @@
+#!/usr/bin/env python3
+"""CAN multicast update benchmark on the host simulator.
+
+Every case starts N fresh simpleboot_sim nodes with the update button held,
+an erased flash each and a shared bus file, pushes one generated image to
+all of them with sbcan and reads both sides: sbcan's phase table and repair
+rounds, and each simulator's CAN counters at the jump. Every node's flash
+is compared with the image afterwards.
+
+The point is the scaling: a Y-modem update per node costs N times the image,
+the broadcast costs the image once plus the repair rounds, so the time per
+update should stay nearly flat as N grows. The simulators model the bxCAN
+receive FIFO, frames that arrive while a node programs flash are lost the
+way they are on the board, and the repair rounds win them back.
+
+A last case repeats the most nodes with every node missing a share of the
+frames (--can-drop, its own seed each), so QUERY, MISSING and the resent
+blocks are exercised. It fails unless it needed at least one repair round.
+"""
+
+import argparse
+import json
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+SIM_STATS = re.compile(r"\[sim\] application at [0-9.]+ ms: .*"
+                       r"can rx (\d+) \(lost (\d+), dropped (\d+)\), "
+                       r"tx (\d+)")
+APP_OFFSET = 0x4000  # application start in the flash file
+
+
+def make_image(size):
+    """Vector table the bootloader accepts, deterministic filler after it."""
+    rng = random.Random(size)
+    head = (0x20005000).to_bytes(4, "little") + \
+        (0x08004141).to_bytes(4, "little")
+    return head + bytes(rng.getrandbits(8) for _ in range(size - len(head)))
+
+
+def sbcan_report(output):
+    """Phase times in ms, repair rounds and resent blocks."""
+    phases = {}
+    rounds = resent = None
+    for line in output.splitlines():
+        m = re.match(r"(\w+)\s+([0-9.]+)$", line.strip())
+        if m and m.group(1) != "Phase":
+            phases[m.group(1)] = float(m.group(2))
+        m = re.match(r"Rounds:\s+(\d+), (\d+) blocks resent", line)
+        if m:
+            rounds, resent = int(m.group(1)), int(m.group(2))
+    return phases, rounds, resent
+
+
+def run_case(args, nodes, workdir, drop=0.0):
+    name = f"n{nodes}-s{args.size}" + (f"-d{drop:g}" if drop else "")
+    bus = os.path.join(workdir, f"{name}.bus")
+    image = os.path.join(workdir, f"{name}.bin")
+    data = make_image(args.size)
+    with open(image, "wb") as f:
+        f.write(data)
+    open(bus, "wb").close()
+
+    sims = []
+    try:
+        for node in range(1, nodes + 1):
+            sims.append(subprocess.Popen(
+                [args.sim, "-k", "-x", "-C", bus, "-N", str(node),
+                 "-l", os.path.join(workdir, f"{name}-{node}.tty"),
+                 "-f", os.path.join(workdir, f"{name}-{node}.flash"),
+                 "-D", str(drop), "-s", str(args.seed + node)],
+                stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True))
+        # Every node waits for firmware once its pty is there
+        deadline = time.monotonic() + 5
+        for node in range(1, nodes + 1):
+            tty = os.path.join(workdir, f"{name}-{node}.tty")
+            while not os.path.exists(tty):
+                if time.monotonic() > deadline:
+                    raise RuntimeError(f"{name}: simulator did not start")
+                time.sleep(0.01)
+        time.sleep(0.2)
+        upload = subprocess.run(
+            [args.sbcan, "-q", "-n", ",".join(map(str, range(1, nodes + 1))),
+             bus, image],
+            capture_output=True, text=True, timeout=args.timeout)
+    finally:
+        logs = []
+        for sim in sims:
+            sim.terminate()
+            logs.append(sim.communicate(timeout=10)[1])
+
+    result = {"nodes": nodes, "size": args.size, "drop": drop,
+              "ok": upload.returncode == 0}
+    if not result["ok"]:
+        result["error"] = (upload.stderr.strip().splitlines() or ["?"])[-1]
+        return name, result
+
+    for node in range(1, nodes + 1):
+        with open(os.path.join(workdir, f"{name}-{node}.flash"), "rb") as f:
+            f.seek(APP_OFFSET)
+            if f.read(len(data)) != data:
+                result.update(ok=False, error=f"node {node}: flash differs")
+                return name, result
+
+    phases, rounds, resent = sbcan_report(upload.stdout)
+    stats = [m for m in map(SIM_STATS.search, logs) if m]
+    # Announce to verified, what the update itself takes
+    update_ms = sum(v for k, v in phases.items()
+                    if k not in ("enter", "total"))
+    result.update({
+        "wall_ms": round(update_ms, 1),
+        "data_ms": phases.get("data", 0),
+        "repair_ms": phases.get("repair", 0),
+        "rounds": rounds,
+        "resent": resent,
+        "lost_max": max((int(m.group(2)) for m in stats), default=0),
+        "dropped_max": max((int(m.group(3)) for m in stats), default=0),
+    })
+    if drop and not rounds:
+        result.update(ok=False, error="no repair round with dropped frames")
+    return name, result
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Benchmark CAN multicast updates across node counts",
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="""
+Examples:
+  %(prog)s --sim build/can/host/simpleboot_sim
+  %(prog)s --nodes 1,2,4,8,16 --size 49152 --save can.json
+  %(prog)s --nodes 8 --drop 0.02
+        """)
+    parser.add_argument("--sim", default="build/can/host/simpleboot_sim",
+                        help="Simulator built with CAN=1 "
+                        "(default: build/can/host/simpleboot_sim)")
+    parser.add_argument("--sbcan", default="build/host/sbcan",
+                        help="Updater (default: build/host/sbcan)")
+    parser.add_argument("--nodes", default="1,4,8",
+                        help="Comma separated node counts (default: 1,4,8)")
+    parser.add_argument("--size", type=int, default=16384,
+                        help="Image size in bytes (default: 16384)")
+    parser.add_argument("--drop", type=float, default=0.005,
+                        help="Share of frames each node misses in the "
+                        "repair case, 0 skips it (default: 0.005)")
+    parser.add_argument("-s", "--seed", type=int, default=1,
+                        help="Simulator seed (default: 1)")
+    parser.add_argument("-t", "--timeout", type=float, default=120,
+                        help="Seconds per case (default: 120)")
+    parser.add_argument("--max-growth", type=float, default=50,
+                        help="Allowed %% more time for the most nodes than "
+                        "for the fewest (default: 50)")
+    parser.add_argument("--save", help="Write the results as JSON")
+    args = parser.parse_args()
+
+    counts = [int(n) for n in args.nodes.split(",")]
+    results = {}
+    with tempfile.TemporaryDirectory() as workdir:
+        try:
+            for nodes in counts:
+                name, result = run_case(args, nodes, workdir)
+                results[name] = result
+            if args.drop:
+                name, result = run_case(args, counts[-1], workdir, args.drop)
+                results[name] = result
+        except (RuntimeError, OSError, subprocess.TimeoutExpired) as e:
+            print(f"Error: {e}", file=sys.stderr)
+            sys.exit(1)
+
+    print(f"{'case':<20} {'ms':>9} {'data':>8} {'repair':>7} {'rounds':>6} "
+          f"{'resent':>6} {'lost':>5} {'drop':>5} {'ms/node':>8}")
+    for name, r in results.items():
+        if "wall_ms" not in r:
+            print(f"{name:<20} failed: {r['error']}")
+            continue
+        print(f"{name:<20} {r['wall_ms']:>9.1f} {r['data_ms']:>8.1f} "
+              f"{r['repair_ms']:>7.1f} {r['rounds']:>6} {r['resent']:>6} "
+              f"{r['lost_max']:>5} {r['dropped_max']:>5} "
+              f"{r['wall_ms'] / r['nodes']:>8.1f}")
+
+    if args.save:
+        with open(args.save, "w") as f:
+            json.dump(results, f, indent=2)
+            f.write("\n")
+        print(f"✅ Results: {args.save}")
+
+    failed = [name for name, r in results.items() if not r["ok"]]
+    for name in failed:
+        print(f"❌ {name}: {results[name]['error']}", file=sys.stderr)
+    if failed:
+        sys.exit(1)
+    ok = [r for r in results.values() if not r["drop"]]
+    if len(ok) > 1:
+        first, last = ok[0], ok[-1]
+        growth = (last["wall_ms"] / first["wall_ms"] - 1) * 100
+        if growth > args.max_growth:
+            print(f"❌ {last['nodes']} nodes take {growth:.0f}% longer than "
+                  f"{first['nodes']}, more than {args.max_growth:g}%",
+                  file=sys.stderr)
+            sys.exit(1)
+        print(f"✅ {last['nodes']} nodes take {growth:+.0f}% of the time of "
+              f"{first['nodes']}")
+
+
+if __name__ == "__main__":
+    main()
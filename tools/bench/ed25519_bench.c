@@ -0,0 +1,89 @@
+/*
+ * Host benchmark for the signature check done in
+ * BOOTLOADER_STATE_VERIFYING_FIRMWARE. Build and run with `make bench`.
+ *
+ * The point arithmetic does a fixed amount of work per signature (about
+ * 3300 field multiplications), SHA-512 is the only part that grows with
+ * the image size.
+ */
+#include "ed25519.h"
+#include "sha512.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* RFC 8032 section 7.1, TEST 3 */
+static const uint8_t test_public_key[32] = {
+    0xFC, 0x51, 0xCD, 0x8E, 0x62, 0x18, 0xA1, 0xA3,
+    0x8D, 0xA4, 0x7E, 0xD0, 0x02, 0x30, 0xF0, 0x58,
+    0x08, 0x16, 0xED, 0x13, 0xBA, 0x33, 0x03, 0xAC,
+    0x5D, 0xEB, 0x91, 0x15, 0x48, 0x90, 0x80, 0x25,
+};
+static const uint8_t test_signature[64] = {
+    0x62, 0x91, 0xD6, 0x57, 0xDE, 0xEC, 0x24, 0x02,
+    0x48, 0x27, 0xE6, 0x9C, 0x3A, 0xBE, 0x01, 0xA3,
+    0x0C, 0xE5, 0x48, 0xA2, 0x84, 0x74, 0x3A, 0x44,
+    0x5E, 0x36, 0x80, 0xD7, 0xDB, 0x5A, 0xC3, 0xAC,
+    0x18, 0xFF, 0x9B, 0x53, 0x8D, 0x16, 0xF2, 0x90,
+    0xAE, 0x67, 0xF7, 0x60, 0x98, 0x4D, 0xC6, 0x59,
+    0x4A, 0x7C, 0x15, 0xE9, 0x71, 0x6E, 0xD2, 0x8D,
+    0xC0, 0x27, 0xBE, 0xCE, 0xEA, 0x1E, 0xC4, 0x0A,
+};
+static const uint8_t test_message[2] = {0xAF, 0x82};
+
+#define VERIFY_ROUNDS 200
+#define HASH_SIZE (48 * 1024) /* whole application area */
+#define HASH_ROUNDS 200
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(void) {
+  static uint8_t image[HASH_SIZE];
+  uint8_t digest[64];
+  uint8_t bad[64];
+  sha512_ctx_t hash;
+  double start, verify_us, hash_us;
+  int i;
+
+  if (!ed25519_verify(test_signature, test_message, sizeof(test_message),
+                      test_public_key)) {
+    printf("FAIL: RFC 8032 test vector rejected\n");
+    return 1;
+  }
+  for (i = 0; i < 64; i++) {
+    bad[i] = test_signature[i];
+  }
+  bad[10] ^= 0x01;
+  if (ed25519_verify(bad, test_message, sizeof(test_message),
+                     test_public_key)) {
+    printf("FAIL: corrupted signature accepted\n");
+    return 1;
+  }
+
+  start = now_us();
+  for (i = 0; i < VERIFY_ROUNDS; i++) {
+    ed25519_verify(test_signature, test_message, sizeof(test_message),
+                   test_public_key);
+  }
+  verify_us = (now_us() - start) / VERIFY_ROUNDS;
+
+  for (i = 0; i < HASH_SIZE; i++) {
+    image[i] = (uint8_t)rand();
+  }
+  start = now_us();
+  for (i = 0; i < HASH_ROUNDS; i++) {
+    sha512_init(&hash);
+    sha512_update(&hash, image, HASH_SIZE);
+    sha512_final(&hash, digest);
+  }
+  hash_us = (now_us() - start) / HASH_ROUNDS;
+
+  printf("ed25519 verify (short message): %8.1f us\n", verify_us);
+  printf("sha512 %d KB image:            %8.1f us\n", HASH_SIZE / 1024,
+         hash_us);
+  return 0;
+}
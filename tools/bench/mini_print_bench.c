@@ -0,0 +1,83 @@
+/*
+ * Host benchmark for mini_printf, the formatter behind BOOTLOADER_LOG.
+ * Build and run with `make bench`.
+ *
+ * Every log line is formatted while the CPU could be receiving, so the
+ * formatter should cost far less than the line takes on the wire (about
+ * 4 ms for 48 characters at 115200 baud). The results are checked against
+ * the C library first, then both are timed on typical log lines.
+ */
+#include "mini_print.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define ROUNDS 1000000
+
+#define CHECK(...)                                                             \
+  do {                                                                         \
+    char want[64], got[64];                                                    \
+    snprintf(want, sizeof(want), __VA_ARGS__);                                 \
+    mini_printf(got, sizeof(got), __VA_ARGS__);                                \
+    if (strcmp(want, got) != 0) {                                              \
+      printf("FAIL: %s: \"%s\", expected \"%s\"\n", #__VA_ARGS__, got, want); \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+static int check(void) {
+  int failures = 0;
+  char small[8];
+  int len;
+
+  CHECK("%d %d %d", 0, -1, 123456789);
+  CHECK("%d %d", (int)INT32_MAX, (int)INT32_MIN);
+  CHECK("%u %u", 0u, (unsigned)UINT32_MAX);
+  CHECK("%x %X %x", 0u, 0xDEADBEEFu, (unsigned)-16);
+  CHECK("0x%08X 0x%08x", 0x8004000u, 0xAu);
+  CHECK("[%5d] [%-5d] [%05d]", 42, 42, -42);
+  CHECK("[%8s] [%-8s] [%s]", "abc", "abc", "");
+  CHECK("[%c] [%3c] [%-3c]", 'A', 'B', 'C');
+  CHECK("%lu %ld %lx", 4000000000ul, -5l, 0xFFFFul);
+  CHECK("%p", (void *)0x20005000);
+  CHECK("100%% %s", "done");
+
+  /* Truncation keeps the terminator and reports what was written */
+  len = mini_printf(small, sizeof(small), "%s", "0123456789");
+  if (len != 7 || strcmp(small, "0123456") != 0) {
+    printf("FAIL: truncation: \"%s\" (%d)\n", small, len);
+    failures++;
+  }
+  return failures;
+}
+
+static double bench(int (*format)(char *, size_t, const char *, ...),
+                    const char *fmt) {
+  struct timespec t0, t1;
+  char buf[128];
+  volatile uint32_t sink = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (uint32_t i = 0; i < ROUNDS; i++) {
+    sink += format(buf, sizeof(buf), fmt, 0xEEC6D5E1u ^ i, i * 2654435761u);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / ROUNDS;
+}
+
+int main(void) {
+  static const char *const lines[] = {
+      "CRC verification: expected 0x%08X, got 0x%08X",
+      "TIMING packets %u max %u total 0 cycles",
+  };
+
+  if (check() != 0) {
+    return 1;
+  }
+  for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+    printf("%-48s mini %6.1f ns, libc %6.1f ns\n", lines[i],
+           bench(mini_printf, lines[i]), bench(snprintf, lines[i]));
+  }
+  return 0;
+}
@@ -0,0 +1,276 @@
+#!/usr/bin/env python3
+"""End-to-end update benchmark on the host simulator.
+
+Every case starts a fresh simpleboot_sim with the update button held and a
+flash that already holds an older application, so the bootloader erases every
+page it programs the way it does on a board in the field. It pushes a
+generated image with sbupload and reads both sides:
+sbupload's phase table and retry count, and the simulator's flash counters
+at the jump. The simulator costs the datasheet flash times and the wire time
+of the baud rate, so the numbers track the real board's receive path.
+
+Axes:
+  baud     UART rate, bootloader and host
+  packet   Y-modem data packet size, 128 or 1024
+  size     image size in bytes
+  ber      bit error rate injected on bytes the bootloader receives
+  latency  host turnaround in ms before every packet (USB-serial latency
+           timer, a busy host)
+
+By default one base case is run plus a sweep of each axis with the others at
+their base value. --full runs the whole cross product. Results go to stdout
+as a table and to --save as JSON. --baseline fails on cases that got slower
+or retried more than the saved run allows.
+"""
+
+import argparse
+import itertools
+import json
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+AXES = {
+    "baud": [57600, 115200, 460800, 921600],
+    "packet": [128, 1024],
+    "size": [4096, 16384, 49152],
+    "ber": [0, 1e-5, 5e-5],
+    "latency": [0, 2, 8],
+}
+BASE = {"baud": 115200, "packet": 1024, "size": 16384, "ber": 0,
+        "latency": 0}
+# Cases outside the sweeps: 384 packets of 128 bytes, the 8-bit packet
+# number wraps past 255 and the receiver must not take packet 256 for the
+# header
+EXTRA = [dict(BASE, packet=128, size=49152)]
+
+APP_OFFSET = 0x4000  # application start in the flash file
+FLASH_SIZE = 64 * 1024
+PRELOAD_SIZE = 48 * 1024  # older application covering the whole app area
+
+SIM_STATS = re.compile(r"\[sim\] application at [0-9.]+ ms: flash (\d+) "
+                       r"pages erased, (\d+) halfwords, ([0-9.]+) ms busy")
+
+
+def case_name(case):
+    return (f"b{case['baud']}-p{case['packet']}-s{case['size']}-"
+            f"e{case['ber']:g}-l{case['latency']}")
+
+
+def cases(axes, full):
+    """Base case and one-axis sweeps, or the cross product."""
+    if full:
+        keys = list(axes)
+        return [dict(zip(keys, values))
+                for values in itertools.product(*axes.values())]
+    result = [dict(BASE)]
+    for key, values in axes.items():
+        for value in values:
+            case = dict(BASE, **{key: value})
+            if case not in result:
+                result.append(case)
+    return result + [case for case in EXTRA if case not in result]
+
+
+def make_image(size, seed=None):
+    """Vector table the bootloader accepts, deterministic filler after it."""
+    rng = random.Random(size if seed is None else seed)
+    head = (0x20005000).to_bytes(4, "little") + \
+        (0x08004141).to_bytes(4, "little")
+    return head + bytes(rng.getrandbits(8) for _ in range(size - len(head)))
+
+
+def sbupload_report(output):
+    """Phase times in ms and the retry count from sbupload's report."""
+    phases = {}
+    retries = None
+    for line in output.splitlines():
+        m = re.match(r"(\w+)\s+([0-9.]+)$", line.strip())
+        if m and m.group(1) != "Phase":
+            phases[m.group(1)] = float(m.group(2))
+        m = re.match(r"Retries:\s+(\d+)", line)
+        if m:
+            retries = int(m.group(1))
+    return phases, retries
+
+
+def run_case(args, case, workdir):
+    name = case_name(case)
+    tty = os.path.join(workdir, f"{name}.tty")
+    image = os.path.join(workdir, f"{name}.bin")
+    flash = os.path.join(workdir, f"{name}.flash")
+    data = make_image(case["size"])
+    with open(image, "wb") as f:
+        f.write(data)
+    # The simulator keeps an existing flash file, blank pages would let the
+    # lazy erase skip every erase and leave it out of the numbers
+    old = make_image(PRELOAD_SIZE, seed=0)
+    with open(flash, "wb") as f:
+        f.write(b"\xff" * APP_OFFSET + old +
+                b"\xff" * (FLASH_SIZE - APP_OFFSET - len(old)))
+
+    sim = subprocess.Popen(
+        [args.sim, "-l", tty, "-f", flash, "-k",
+         "-b", str(case["baud"]), "-r", str(case["ber"]),
+         "-s", str(args.seed)],
+        stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+    try:
+        deadline = time.monotonic() + 5
+        while not os.path.exists(tty):
+            if time.monotonic() > deadline or sim.poll() is not None:
+                raise RuntimeError(f"{name}: simulator did not start")
+            time.sleep(0.01)
+        upload = subprocess.run(
+            [args.sbupload, "-q", "-e", "", "-b", str(case["baud"]),
+             "-p", str(case["packet"]), "-L", str(case["latency"]),
+             tty, image],
+            capture_output=True, text=True, timeout=args.timeout)
+    finally:
+        # The stand-in application keeps running, its counters are printed
+        sim.terminate()
+        sim_log = sim.communicate(timeout=10)[1]
+
+    result = dict(case, ok=upload.returncode == 0)
+    if not result["ok"]:
+        result["error"] = (upload.stderr.strip().splitlines() or ["?"])[-1]
+        return name, result
+    with open(flash, "rb") as f:
+        f.seek(APP_OFFSET)
+        if f.read(len(data)) != data:
+            return name, dict(result, ok=False, error="flash != image")
+
+    phases, retries = sbupload_report(upload.stdout)
+    m = SIM_STATS.search(sim_log)
+    # Header to verified, what the board spends on the update itself
+    update_ms = sum(v for k, v in phases.items()
+                    if k not in ("enter", "boot", "total"))
+    result.update({
+        "wall_ms": round(update_ms, 1),
+        "data_ms": phases.get("data", 0),
+        "throughput": round(case["size"] * 1000 / update_ms),
+        "retries": retries,
+    })
+    if m:
+        result.update({
+            "pages_erased": int(m.group(1)),
+            "flash_ms": float(m.group(3)),
+            "flash_share": round(float(m.group(3)) / update_ms, 3),
+        })
+    return name, result
+
+
+def compare(results, baseline, tolerance):
+    """Regressions against a saved run, as printable strings."""
+    failures = []
+    for name, expected in baseline.items():
+        got = results.get(name)
+        if got is None:
+            continue  # not part of this matrix
+        if not got["ok"]:
+            failures.append(f"{name}: {got.get('error', 'failed')}")
+            continue
+        limit = 1 + tolerance / 100
+        if got["wall_ms"] > expected["wall_ms"] * limit:
+            failures.append(f"{name}: {got['wall_ms']} ms > "
+                            f"{expected['wall_ms']} ms +{tolerance}%")
+        if got["throughput"] < expected["throughput"] / limit:
+            failures.append(f"{name}: {got['throughput']} B/s < "
+                            f"{expected['throughput']} B/s -{tolerance}%")
+        # Same seed, same bit errors: retries only move with the protocol
+        if got["retries"] > expected["retries"]:
+            failures.append(f"{name}: {got['retries']} retries > "
+                            f"{expected['retries']}")
+        # Every programmed page of the preloaded flash needs its erase
+        if got.get("pages_erased") != expected.get("pages_erased"):
+            failures.append(f"{name}: {got.get('pages_erased')} pages "
+                            f"erased, expected {expected.get('pages_erased')}")
+    return failures
+
+
+def axis(kind):
+    return lambda text: [kind(v) for v in text.split(",")]
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Benchmark complete updates on the host simulator",
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="""
+Examples:
+  %(prog)s --save tools/bench/update_baseline.json
+  %(prog)s --baseline tools/bench/update_baseline.json --tolerance 10
+  %(prog)s --full --baud 115200,921600 --ber 0,1e-5 -j 4
+        """)
+    parser.add_argument("--sim", default="build/host/simpleboot_sim",
+                        help="Simulator (default: build/host/simpleboot_sim)")
+    parser.add_argument("--sbupload", default="build/host/sbupload",
+                        help="Uploader (default: build/host/sbupload)")
+    for key, values in AXES.items():
+        kind = float if key == "ber" else int
+        parser.add_argument(f"--{key}", type=axis(kind), default=values,
+                            help="Comma separated values (default: "
+                            f"{','.join(f'{v:g}' for v in values)})")
+    parser.add_argument("--full", action="store_true",
+                        help="Run the cross product of all axes")
+    parser.add_argument("-j", "--jobs", type=int, default=1,
+                        help="Cases run at once, more adds host noise "
+                        "(default: 1)")
+    parser.add_argument("-s", "--seed", type=int, default=1,
+                        help="Simulator seed for bit errors (default: 1)")
+    parser.add_argument("-t", "--timeout", type=float, default=120,
+                        help="Seconds per case (default: 120)")
+    parser.add_argument("--save", help="Write the results as JSON")
+    parser.add_argument("--baseline",
+                        help="Fail on regressions against this JSON")
+    parser.add_argument("--tolerance", type=float, default=10,
+                        help="Allowed %% over the baseline for times and "
+                        "under it for throughput (default: 10)")
+    args = parser.parse_args()
+
+    matrix = cases({key: getattr(args, key) for key in AXES}, args.full)
+    with tempfile.TemporaryDirectory() as workdir:
+        with ThreadPoolExecutor(max_workers=args.jobs) as pool:
+            try:
+                results = dict(pool.map(
+                    lambda case: run_case(args, case, workdir), matrix))
+            except (RuntimeError, OSError, subprocess.TimeoutExpired) as e:
+                print(f"Error: {e}", file=sys.stderr)
+                sys.exit(1)
+
+    print(f"{'case':<32} {'ms':>9} {'B/s':>7} {'retries':>7} {'erased':>6} "
+          f"{'flash':>6}")
+    for name, r in results.items():
+        if not r["ok"]:
+            print(f"{name:<32} failed: {r['error']}")
+            continue
+        share = f"{r['flash_share'] * 100:.0f}%" if "flash_share" in r else "-"
+        print(f"{name:<32} {r['wall_ms']:>9.1f} {r['throughput']:>7} "
+              f"{r['retries']:>7} {r.get('pages_erased', '-'):>6} "
+              f"{share:>6}")
+
+    if args.save:
+        with open(args.save, "w") as f:
+            json.dump(results, f, indent=2)
+            f.write("\n")
+        print(f"✅ Results: {args.save}")
+
+    failed = [name for name, r in results.items() if not r["ok"]]
+    if args.baseline:
+        with open(args.baseline) as f:
+            failures = compare(results, json.load(f), args.tolerance)
+        for failure in failures:
+            print(f"❌ {failure}", file=sys.stderr)
+        if failures:
+            sys.exit(1)
+        print(f"✅ No regressions against {args.baseline}")
+    elif failed:
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
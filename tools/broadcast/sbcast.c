@@ -0,0 +1,530 @@
+/*
+ * One-way broadcast sender for SimpleBoot nodes on a shared RS-485 line or
+ * a radio downlink. Build with `make broadcast-tool`, run with
+ * `make broadcast-flash PORTS="/dev/ttyUSB0"`.
+ *
+ * Streams the image to every node at once and never reads an answer
+ * (Inc/boot_broadcast.h). Each pass announces the session, then sends
+ * every generation's plain symbols followed by repair symbols, random XORs
+ * of the same generation. A node that lost a few packets of a generation
+ * rebuilds them from as many repair packets, a node that lost more
+ * fills the gap on a later pass. The repair share and the number of passes
+ * trade airtime against the loss rate the line can take.
+ *
+ * Nobody tells the sender when a node programs flash, so it leaves the
+ * line quiet for as long as that takes at the worst case: after each
+ * packet, after each generation and after the ANNOUNCEs for the erase.
+ * Several ports get the same bytes, for several lines or the simulators.
+ */
+#include "boot_broadcast.h"
+#include "boot_layout.h"
+#include "common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_PORTS 64
+#define ANNOUNCE_COUNT 3
+#define ENTER_DELAY_MS 1000 /* reset and start of the bootloader */
+#define WAKE_MS 3           /* Stop mode wake up, bytes meanwhile are lost */
+
+typedef struct {
+  unsigned baudrate;
+  const char *enter;
+  unsigned repair; /* % of the symbols of a generation */
+  unsigned passes;
+  unsigned gap_ms;
+  unsigned generation_gap_ms;
+  unsigned seed;
+  unsigned bootloader_size; /* the application starts right after it */
+  bool quiet;
+} options_t;
+
+static options_t s_opt = {.baudrate = 115200, .enter = "B", .repair = 25,
+                          .passes = 2, .gap_ms = 3, .generation_gap_ms = 40,
+                          .bootloader_size = BOOTLOADER_SIZE};
+static int s_fds[MAX_PORTS];
+static const char *s_ports[MAX_PORTS];
+static size_t s_port_count;
+static size_t s_open;
+static double s_idle;  /* the last byte leaves the wire, ms */
+static double s_ready; /* the next packet may start, ms */
+static uint32_t s_rng;
+static unsigned long s_packets;
+static unsigned long s_bytes;
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static speed_t baud_to_speed(unsigned baudrate) {
+  switch (baudrate) {
+  case 9600:
+    return B9600;
+  case 19200:
+    return B19200;
+  case 38400:
+    return B38400;
+  case 57600:
+    return B57600;
+  case 115200:
+    return B115200;
+  case 230400:
+    return B230400;
+#ifdef B460800
+  case 460800:
+    return B460800;
+#endif
+#ifdef B921600
+  case 921600:
+    return B921600;
+#endif
+  default:
+    return 0;
+  }
+}
+
+/**
+ * @brief Open a port raw, 8N1, non-blocking
+ * @return File descriptor, -1 with errno set on error
+ */
+static int port_open(const char *port, speed_t speed) {
+  struct termios tio;
+  int fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+  if (fd < 0) {
+    return -1;
+  }
+  if (tcgetattr(fd, &tio) != 0) {
+    close(fd);
+    return -1;
+  }
+  cfmakeraw(&tio);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cflag &= ~(CSTOPB | PARENB);
+#ifdef CRTSCTS
+  tio.c_cflag &= ~CRTSCTS;
+#endif
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+  if (tcsetattr(fd, TCSANOW, &tio) != 0) {
+    close(fd);
+    return -1;
+  }
+  tcflush(fd, TCIOFLUSH);
+  return fd;
+}
+
+/**
+ * @brief Stop sending to a port, the node behind it went away
+ */
+static void port_drop(size_t i, const char *reason) {
+  if (!s_opt.quiet) {
+    printf("%s: %s\n", s_ports[i], reason);
+  }
+  close(s_fds[i]);
+  s_fds[i] = -1;
+  s_open--;
+}
+
+/**
+ * @brief Wait until a time, reading and dropping whatever the ports send
+ * @note  Nodes log on their transmit line, a port nobody reads fills up
+ */
+static void line_wait(double until) {
+  for (;;) {
+    struct pollfd fds[MAX_PORTS];
+    double now = now_ms();
+    uint8_t buf[256];
+
+    for (size_t i = 0; i < s_port_count; i++) {
+      fds[i].fd = s_fds[i];
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+    if (poll(fds, s_port_count, now < until ? (int)(until - now) + 1 : 0) <
+            0 &&
+        errno != EINTR) {
+      return;
+    }
+    for (size_t i = 0; i < s_port_count; i++) {
+      if (s_fds[i] < 0 || fds[i].revents == 0) {
+        continue;
+      }
+      if (read(s_fds[i], buf, sizeof(buf)) <= 0 &&
+          (fds[i].revents & (POLLHUP | POLLERR)) != 0) {
+        port_drop(i, "closed");
+      }
+    }
+    if (now_ms() >= until) {
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Write the same bytes to every port
+ */
+static void line_write(const uint8_t *data, size_t size) {
+  for (size_t i = 0; i < s_port_count; i++) {
+    size_t sent = 0;
+
+    while (s_fds[i] >= 0 && sent < size) {
+      ssize_t n = write(s_fds[i], data + sent, size - sent);
+
+      if (n > 0) {
+        sent += (size_t)n;
+      } else if (n < 0 && errno == EAGAIN) {
+        line_wait(now_ms() + 1);
+      } else {
+        port_drop(i, n < 0 ? strerror(errno) : "closed");
+      }
+    }
+  }
+}
+
+/**
+ * @brief Send bytes once the line is free, then keep it quiet for gap_ms
+ */
+static void line_send(const uint8_t *data, size_t size, unsigned gap_ms) {
+  double now;
+
+  line_wait(s_ready);
+  line_write(data, size);
+  now = now_ms();
+  s_idle = (s_idle > now ? s_idle : now) + size * 10e3 / s_opt.baudrate;
+  s_ready = s_idle + gap_ms;
+  s_bytes += size;
+}
+
+/**
+ * @brief Keep the line quiet for at least ms after the last byte
+ */
+static void line_quiet(unsigned ms) {
+  if (s_ready < s_idle + ms) {
+    s_ready = s_idle + ms;
+  }
+}
+
+static uint32_t random_next(void) {
+  s_rng ^= s_rng << 13;
+  s_rng ^= s_rng >> 17;
+  s_rng ^= s_rng << 5;
+  return s_rng;
+}
+
+static void put_be16(uint8_t *p, uint16_t value) {
+  p[0] = (uint8_t)(value >> 8);
+  p[1] = (uint8_t)value;
+}
+
+static void put_be32(uint8_t *p, uint32_t value) {
+  put_be16(p, (uint16_t)(value >> 16));
+  put_be16(p + 2, (uint16_t)value);
+}
+
+/**
+ * @brief Frame and send one packet, see Inc/boot_broadcast.h
+ */
+static void send_packet(uint8_t type, uint8_t session, uint8_t generation,
+                        uint16_t mask, const uint8_t *payload,
+                        size_t payload_size) {
+  uint8_t packet[BOOT_BROADCAST_PACKET_MAX];
+  size_t size = BOOT_BROADCAST_HEADER_SIZE + payload_size;
+
+  packet[0] = BOOT_BROADCAST_SYNC;
+  packet[1] = BOOT_BROADCAST_SYNC2;
+  packet[2] = type;
+  packet[3] = session;
+  packet[4] = generation;
+  put_be16(packet + 5, mask);
+  memcpy(packet + BOOT_BROADCAST_HEADER_SIZE, payload, payload_size);
+  put_be16(packet + size, crc16_update(0, packet + 2, (uint16_t)(size - 2)));
+  line_send(packet, size + 2, s_opt.gap_ms);
+  s_packets++;
+}
+
+/**
+ * @brief Wake the nodes and start or continue the session
+ * @note  The sync run enters the session on waiting bootloaders, the
+ *        erase gap lets nodes that start it now clear their pages
+ */
+static void send_announce(uint8_t session, uint32_t size, uint32_t crc32,
+                          unsigned pages) {
+  uint8_t wake[64];
+  uint8_t payload[BOOT_BROADCAST_ANNOUNCE_SIZE];
+  size_t wake_size = s_opt.baudrate * WAKE_MS / 10000 + 2;
+
+  if (wake_size > sizeof(wake)) {
+    wake_size = sizeof(wake);
+  }
+  memset(wake, BOOT_BROADCAST_SYNC, wake_size);
+  line_send(wake, wake_size, 0);
+  put_be32(payload, size);
+  put_be32(payload + 4, crc32);
+  for (int i = 0; i < ANNOUNCE_COUNT; i++) {
+    send_packet(BOOT_BROADCAST_ANNOUNCE, session, 0, 0, payload,
+                sizeof(payload));
+  }
+  line_quiet((pages + 1) * BOOT_BROADCAST_ERASE_MS);
+}
+
+/**
+ * @brief Send one generation, plain symbols first, then repair symbols
+ * @param data: The generation, padded with 0xFF
+ * @param count: Symbols of the image in it
+ */
+static void send_generation(uint8_t session, uint8_t generation,
+                            const uint8_t *data, unsigned count) {
+  unsigned repair = (count * s_opt.repair + 99) / 100;
+  uint16_t all = (uint16_t)((1u << count) - 1);
+
+  for (unsigned i = 0; i < count; i++) {
+    send_packet(BOOT_BROADCAST_DATA, session, generation, (uint16_t)(1u << i),
+                data + i * BOOT_BROADCAST_SYMBOL_SIZE,
+                BOOT_BROADCAST_SYMBOL_SIZE);
+  }
+  for (unsigned r = 0; r < repair; r++) {
+    uint8_t symbol[BOOT_BROADCAST_SYMBOL_SIZE];
+    uint16_t mask;
+
+    do {
+      mask = (uint16_t)random_next() & all;
+    } while (mask == 0);
+    memset(symbol, 0, sizeof(symbol));
+    for (unsigned i = 0; i < count; i++) {
+      if ((mask & (1u << i)) == 0) {
+        continue;
+      }
+      for (unsigned j = 0; j < BOOT_BROADCAST_SYMBOL_SIZE; j++) {
+        symbol[j] ^= data[i * BOOT_BROADCAST_SYMBOL_SIZE + j];
+      }
+    }
+    send_packet(BOOT_BROADCAST_DATA, session, generation, mask, symbol,
+                sizeof(symbol));
+  }
+  line_quiet(s_opt.generation_gap_ms);
+}
+
+/**
+ * @brief Read the image, padded to whole generations with 0xFF
+ * @return Image, NULL on error
+ */
+static uint8_t *load_image(const char *path, uint32_t *size) {
+  const size_t page = BOOT_BROADCAST_SYMBOL_SIZE * BOOT_BROADCAST_GENERATION;
+  FILE *f = fopen(path, "rb");
+  uint8_t *data;
+  long length;
+
+  if (f == NULL) {
+    fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  length = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (length <= 0 || length > BOOT_LAYOUT_APP_MAX(s_opt.bootloader_size)) {
+    fprintf(stderr, "Error: image must be 1..%u bytes\n",
+            BOOT_LAYOUT_APP_MAX(s_opt.bootloader_size));
+    fclose(f);
+    return NULL;
+  }
+  data = malloc(((size_t)length + page - 1) / page * page);
+  if (data == NULL || fread(data, 1, (size_t)length, f) != (size_t)length) {
+    fprintf(stderr, "Error: cannot read %s\n", path);
+    free(data);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+  memset(data + length, 0xFF,
+         ((size_t)length + page - 1) / page * page - (size_t)length);
+  *size = (uint32_t)length;
+  return data;
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [options] <image.bin> <port>...\n"
+         "\n"
+         "Options:\n"
+         "  -b, --baud RATE     Serial baud rate (default: 115200)\n"
+         "  -e, --enter STRING  Sent to running applications to enter the\n"
+         "                      bootloader (default: \"B\"), \"\" to skip\n"
+         "  -r, --repair PCT    Repair symbols per generation, %% of its\n"
+         "                      symbols (default: 25)\n"
+         "  -p, --passes N      Times the whole image is sent (default: 2)\n"
+         "  -g, --gap MS        Quiet time after each packet (default: 3)\n"
+         "  -G, --generation-gap MS\n"
+         "                      Quiet time after each generation "
+         "(default: 40)\n"
+         "  -s, --seed N        Seed for the repair symbols\n"
+         "  -B, --bootloader-size SIZE\n"
+         "                      Flash the bootloader reserves, as merge.py -b\n"
+         "                      (default: 0x%X)\n"
+         "  -q, --quiet         Only print the summary\n"
+         "  -h, --help          Show this help\n"
+         "\n"
+         "Example:\n"
+         "  %s -p 3 -r 50 example_app/build/app.bin /dev/ttyUSB0\n",
+         prog, BOOTLOADER_SIZE, prog);
+}
+
+int main(int argc, char **argv) {
+  static const struct option long_options[] = {
+      {"baud", required_argument, NULL, 'b'},
+      {"enter", required_argument, NULL, 'e'},
+      {"repair", required_argument, NULL, 'r'},
+      {"passes", required_argument, NULL, 'p'},
+      {"gap", required_argument, NULL, 'g'},
+      {"generation-gap", required_argument, NULL, 'G'},
+      {"seed", required_argument, NULL, 's'},
+      {"bootloader-size", required_argument, NULL, 'B'},
+      {"quiet", no_argument, NULL, 'q'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0}};
+  const size_t page = BOOT_BROADCAST_SYMBOL_SIZE * BOOT_BROADCAST_GENERATION;
+  uint8_t *image;
+  uint32_t size;
+  uint32_t crc32;
+  uint32_t symbols;
+  unsigned generations;
+  uint8_t session;
+  speed_t speed;
+  double start;
+  int c;
+
+  s_opt.seed = (unsigned)(time(NULL) ^ getpid());
+  while ((c = getopt_long(argc, argv, "b:e:r:p:g:G:s:B:qh", long_options,
+                          NULL)) != -1) {
+    switch (c) {
+    case 'b':
+      s_opt.baudrate = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'e':
+      s_opt.enter = optarg;
+      break;
+    case 'r':
+      s_opt.repair = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'p':
+      s_opt.passes = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'g':
+      s_opt.gap_ms = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'G':
+      s_opt.generation_gap_ms = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      s_opt.seed = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'B':
+      s_opt.bootloader_size = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'q':
+      s_opt.quiet = true;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind < 2 || argc - optind - 1 > MAX_PORTS ||
+      s_opt.passes == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  speed = baud_to_speed(s_opt.baudrate);
+  if (speed == 0) {
+    fprintf(stderr, "Error: unsupported baud rate %u\n", s_opt.baudrate);
+    return 1;
+  }
+  if (!BOOT_LAYOUT_SIZE_VALID(s_opt.bootloader_size)) {
+    fprintf(stderr, "Error: invalid bootloader size 0x%X\n",
+            s_opt.bootloader_size);
+    return 1;
+  }
+  image = load_image(argv[optind], &size);
+  if (image == NULL) {
+    return 1;
+  }
+  crc32 = crc32_update(0xFFFFFFFF, image, size);
+  symbols = (size + BOOT_BROADCAST_SYMBOL_SIZE - 1) /
+            BOOT_BROADCAST_SYMBOL_SIZE;
+  generations = (unsigned)((size + page - 1) / page);
+  /* The same image continues a session a node already started */
+  session = (uint8_t)crc32;
+  s_rng = s_opt.seed != 0 ? s_opt.seed : 1;
+
+  s_port_count = (size_t)(argc - optind - 1);
+  for (size_t i = 0; i < s_port_count; i++) {
+    s_ports[i] = argv[optind + 1 + i];
+    s_fds[i] = port_open(s_ports[i], speed);
+    if (s_fds[i] < 0) {
+      fprintf(stderr, "Error: %s: %s\n", s_ports[i], strerror(errno));
+      return 1;
+    }
+  }
+  s_open = s_port_count;
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  printf("Image:     %u bytes, CRC32 0x%08X, session %u\n", size, crc32,
+         session);
+  printf("Stream:    %u generations, %u passes, %u%% repair\n", generations,
+         s_opt.passes, s_opt.repair);
+
+  start = now_ms();
+  s_idle = s_ready = start;
+  if (s_opt.enter[0] != '\0') {
+    line_send((const uint8_t *)s_opt.enter, strlen(s_opt.enter),
+              ENTER_DELAY_MS);
+  }
+  for (unsigned pass = 0; pass < s_opt.passes && s_open != 0; pass++) {
+    double pass_start = now_ms();
+
+    send_announce(session, size, crc32, generations);
+    for (unsigned g = 0; g < generations && s_open != 0; g++) {
+      uint32_t first = g * BOOT_BROADCAST_GENERATION;
+      uint32_t count = symbols - first < BOOT_BROADCAST_GENERATION
+                           ? symbols - first
+                           : BOOT_BROADCAST_GENERATION;
+
+      send_generation(session, (uint8_t)g, image + g * page, count);
+    }
+    line_wait(s_ready);
+    if (!s_opt.quiet) {
+      printf("Pass %u:    %.1f ms\n", pass + 1, now_ms() - pass_start);
+    }
+  }
+  line_wait(s_ready);
+
+  printf("Sent:      %lu packets, %lu bytes in %.1f ms, %.0f%% overhead\n",
+         s_packets, s_bytes, now_ms() - start,
+         (s_bytes * 100.0) / size - 100);
+  if (s_open != s_port_count) {
+    printf("Closed:    %zu of %zu ports\n", s_port_count - s_open,
+           s_port_count);
+  }
+  for (size_t i = 0; i < s_port_count; i++) {
+    if (s_fds[i] >= 0) {
+      close(s_fds[i]);
+    }
+  }
+  free(image);
+  return 0;
+}
@@ -0,0 +1,853 @@
+/*
+ * Multicast updater for SimpleBoot nodes on a CAN bus. Build with
+ * `make can-tool`, run with `make can-flash CAN_BUS=can0`.
+ *
+ * Updates every node on the bus from one broadcast (Inc/boot_can.h): finds
+ * the nodes with PING, starts a session on each with ANNOUNCE, sends the
+ * image once to all of them, then asks which blocks each one missed and
+ * sends the union of those again until none is missing. COMMIT has the
+ * nodes check the image and start it. The data phase costs the same for
+ * one node or a hundred, only the repair rounds grow with the worst link.
+ *
+ * The bus is a SocketCAN interface (ip link set can0 up type can bitrate
+ * 500000), or the bus file of the host simulators started with --can-bus.
+ */
+#include "boot_can.h"
+#include "boot_layout.h"
+#include "common.h"
+#include "sim_can_bus.h"
+#include <errno.h>
+#include <getopt.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <net/if.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_NODES 64
+#define PING_WINDOW_MS 300    /* answers to one PING */
+#define ANNOUNCE_RETRY_MS 1500 /* erasing 48 pages takes about 1 s */
+#define ANNOUNCE_TIMEOUT_MS 5000
+#define QUERY_WINDOW_MS 300
+#define QUERY_RETRIES 3
+#define VERIFY_TIMEOUT_MS 30000 /* SHA-256 and signature check */
+#define COMMIT_RETRY_MS 2000
+#define ENTER_DELAY_MS 500 /* reset and start of the bootloader */
+#define RECEIVE_POLL_US 200 /* simulated bus */
+
+typedef enum {
+  PHASE_ENTER = 0, /* ENTER until the nodes answer PING */
+  PHASE_ANNOUNCE,  /* ANNOUNCE until every node has erased */
+  PHASE_DATA,      /* the image, once */
+  PHASE_REPAIR,    /* QUERY rounds and resent blocks */
+  PHASE_COMMIT,    /* COMMIT until every node reports the verification */
+  PHASE_COUNT
+} phase_t;
+
+static const char *const phase_names[PHASE_COUNT] = {
+    "enter", "announce", "data", "repair", "commit"};
+
+typedef struct {
+  int fd;             /* SocketCAN, -1 for the simulated bus */
+  sim_can_bus_t *sim; /* simulated bus, NULL for SocketCAN */
+  uint32_t next;      /* simulated bus frame to look at next */
+  double idle_us;     /* our frames are on the wire until then */
+} bus_t;
+
+typedef struct {
+  uint16_t id;
+  uint8_t state; /* boot_can_state_t */
+  uint8_t result;
+  uint16_t missing;
+  uint32_t version;
+  bool answered; /* a STATUS of the current step came in */
+  bool active;   /* still in the session */
+} node_t;
+
+typedef struct {
+  const char *bus;
+  const char *image;
+  uint16_t targets[MAX_NODES]; /* --nodes, discovered with PING if none */
+  unsigned target_count;
+  bool list;
+  bool enter;
+  unsigned gap_ms;
+  unsigned rounds;
+  unsigned timeout_s;
+  unsigned bootloader_size; /* the application starts right after it */
+  bool quiet;
+} options_t;
+
+static double now_ms(void) { return sim_can_bus_now() / 1000; }
+
+static void sleep_us(double us) {
+  struct timespec ts;
+
+  if (us <= 0) {
+    return;
+  }
+  ts.tv_sec = (time_t)(us / 1e6);
+  ts.tv_nsec = (long)((us - ts.tv_sec * 1e6) * 1000);
+  nanosleep(&ts, NULL);
+}
+
+static uint32_t load_be(const uint8_t *p, int size) {
+  uint32_t value = 0;
+
+  while (size-- > 0) {
+    value = value << 8 | *p++;
+  }
+  return value;
+}
+
+static uint8_t *store_be(uint8_t *p, uint32_t value, int size) {
+  while (size-- > 0) {
+    *p++ = (uint8_t)(value >> (size * 8));
+  }
+  return p;
+}
+
+/**
+ * @brief Open the bus, a bus file of the simulators or a CAN interface
+ * @note  On SocketCAN a filter passes the node frame types only
+ * @return false on error, reported
+ */
+static bool bus_open(bus_t *bus, const char *name) {
+  struct can_filter filter = {
+      .can_id = (canid_t)BOOT_CAN_NODE_FIRST << 24 | CAN_EFF_FLAG,
+      .can_mask = (canid_t)BOOT_CAN_HOST_MASK << 24 | CAN_EFF_FLAG |
+                  CAN_RTR_FLAG};
+  struct sockaddr_can addr = {.can_family = AF_CAN};
+  struct stat st;
+
+  memset(bus, 0, sizeof(*bus));
+  bus->fd = -1;
+  if (stat(name, &st) == 0 && S_ISREG(st.st_mode)) {
+    bus->sim = sim_can_bus_open(name, BOOT_CAN_BITRATE);
+    if (bus->sim == NULL) {
+      fprintf(stderr, "Error: %s: %s\n", name, strerror(errno));
+      return false;
+    }
+    bus->next = sim_can_bus_head(bus->sim);
+    return true;
+  }
+
+  addr.can_ifindex = (int)if_nametoindex(name);
+  if (addr.can_ifindex == 0) {
+    fprintf(stderr, "Error: %s: no such CAN interface or bus file\n", name);
+    return false;
+  }
+  bus->fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if (bus->fd < 0 ||
+      setsockopt(bus->fd, SOL_CAN_RAW, CAN_RAW_FILTER, &filter,
+                 sizeof(filter)) != 0 ||
+      bind(bus->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    fprintf(stderr, "Error: %s: %s\n", name, strerror(errno));
+    if (bus->fd >= 0) {
+      close(bus->fd);
+    }
+    return false;
+  }
+  return true;
+}
+
+static void bus_close(bus_t *bus) {
+  if (bus->fd >= 0) {
+    close(bus->fd);
+  }
+}
+
+/**
+ * @brief Send one frame
+ * @note  Returns once the frame is queued behind at most one other, so a
+ *        wait on idle_us covers everything sent so far
+ */
+static bool bus_send(bus_t *bus, uint32_t id, const uint8_t *data,
+                     uint8_t size) {
+  double frame_us = (67 + 8 * size) * 1.1 * 1e6 / BOOT_CAN_BITRATE;
+  double now = sim_can_bus_now();
+
+  if (bus->sim != NULL) {
+    bus->idle_us = sim_can_bus_send(bus->sim, id, data, size);
+  } else {
+    struct can_frame frame = {.can_id = id | CAN_EFF_FLAG, .can_dlc = size};
+
+    memcpy(frame.data, data, size);
+    /* ENOBUFS: the interface queue is full, it drains at the bit rate */
+    while (write(bus->fd, &frame, sizeof(frame)) != sizeof(frame)) {
+      if (errno != ENOBUFS && errno != EINTR) {
+        fprintf(stderr, "Error: CAN send: %s\n", strerror(errno));
+        return false;
+      }
+      sleep_us(frame_us);
+    }
+    bus->idle_us = (bus->idle_us > now ? bus->idle_us : now) + frame_us;
+  }
+  sleep_us(bus->idle_us - frame_us - sim_can_bus_now());
+  return true;
+}
+
+static bool bus_send_empty(bus_t *bus, uint32_t id) {
+  return bus_send(bus, id, NULL, 0);
+}
+
+/**
+ * @brief Wait until our frames have gone out, then ms more
+ */
+static void bus_quiet(const bus_t *bus, unsigned ms) {
+  sleep_us(bus->idle_us + ms * 1000.0 - sim_can_bus_now());
+}
+
+/**
+ * @brief Receive a node frame
+ * @param deadline: now_ms() value
+ * @return false once the deadline has passed
+ */
+static bool bus_receive(bus_t *bus, can_frame_t *frame, double deadline) {
+  for (;;) {
+    double left = deadline - now_ms();
+
+    if (bus->sim != NULL) {
+      uint32_t head = sim_can_bus_head(bus->sim);
+      double now = sim_can_bus_now();
+
+      for (; bus->next != head; bus->next++) {
+        const sim_can_bus_frame_t *f =
+            &bus->sim->frames[bus->next % SIM_CAN_BUS_FRAMES];
+
+        if (f->end_us > now) {
+          break;
+        }
+        if ((BOOT_CAN_TYPE(f->id) & BOOT_CAN_HOST_MASK) ==
+            BOOT_CAN_NODE_FIRST) {
+          frame->id = f->id;
+          frame->size = f->size;
+          memcpy(frame->data, f->data, sizeof(frame->data));
+          bus->next++;
+          return true;
+        }
+      }
+      if (left <= 0) {
+        return false;
+      }
+      sleep_us(RECEIVE_POLL_US);
+    } else {
+      struct pollfd pfd = {.fd = bus->fd, .events = POLLIN};
+      struct can_frame f;
+
+      if (poll(&pfd, 1, left > 0 ? (int)left + 1 : 0) <= 0) {
+        return false;
+      }
+      if (read(bus->fd, &f, sizeof(f)) != sizeof(f)) {
+        continue;
+      }
+      frame->id = f.can_id & CAN_EFF_MASK;
+      frame->size = f.can_dlc;
+      memcpy(frame->data, f.data, sizeof(frame->data));
+      return true;
+    }
+  }
+}
+
+static node_t *find_node(node_t *nodes, unsigned count, uint16_t id) {
+  for (unsigned i = 0; i < count; i++) {
+    if (nodes[i].id == id) {
+      return &nodes[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Record a STATUS frame
+ * @param session: Only STATUS of this session counts, -1 for any
+ * @return The node, NULL if it is none of ours
+ */
+static node_t *take_status(node_t *nodes, unsigned count,
+                           const can_frame_t *frame, int session) {
+  node_t *node = find_node(nodes, count, BOOT_CAN_A(frame->id));
+
+  if (node == NULL || frame->size < 8 ||
+      (session >= 0 && BOOT_CAN_B(frame->id) != session)) {
+    return NULL;
+  }
+  node->state = frame->data[0];
+  node->result = frame->data[1];
+  node->missing = (uint16_t)load_be(frame->data + 2, 2);
+  node->version = load_be(frame->data + 4, 4);
+  node->answered = true;
+  return node;
+}
+
+static unsigned silent_nodes(const node_t *nodes, unsigned count) {
+  unsigned silent = 0;
+
+  for (unsigned i = 0; i < count; i++) {
+    silent += nodes[i].active && !nodes[i].answered;
+  }
+  return silent;
+}
+
+/**
+ * @brief Find the nodes with PING, or check the ones on the command line
+ * @note  Keeps pinging until the timeout while listed nodes are silent
+ *        (after an ENTER, they are still resetting)
+ * @return Entries in nodes, the silent ones inactive
+ */
+static unsigned discover(const options_t *opt, bus_t *bus, node_t *nodes) {
+  double deadline = now_ms() + opt->timeout_s * 1000.0;
+  unsigned count = opt->target_count;
+  can_frame_t frame;
+
+  for (unsigned i = 0; i < count; i++) {
+    nodes[i] = (node_t){.id = opt->targets[i], .active = true};
+  }
+  do {
+    double window = now_ms() + PING_WINDOW_MS;
+
+    if (opt->target_count == 0) {
+      bus_send_empty(bus, BOOT_CAN_ID(BOOT_CAN_PING, BOOT_CAN_ALL, 0));
+    }
+    for (unsigned i = 0; i < opt->target_count; i++) {
+      if (!nodes[i].answered) {
+        bus_send_empty(bus, BOOT_CAN_ID(BOOT_CAN_PING, nodes[i].id, 0));
+      }
+    }
+    while (bus_receive(bus, &frame, window)) {
+      uint16_t id = BOOT_CAN_A(frame.id);
+
+      if (BOOT_CAN_TYPE(frame.id) != BOOT_CAN_STATUS) {
+        continue;
+      }
+      if (opt->target_count == 0 && find_node(nodes, count, id) == NULL &&
+          count < MAX_NODES) {
+        nodes[count++] = (node_t){.id = id, .active = true};
+      }
+      take_status(nodes, count, &frame, -1);
+    }
+    /* Without a list, the nodes that answer a PING or two are all */
+  } while (now_ms() < deadline &&
+           (opt->target_count == 0 ? count == 0 && opt->enter
+                                   : silent_nodes(nodes, count) != 0));
+
+  for (unsigned i = 0; i < count; i++) {
+    if (!nodes[i].answered) {
+      fprintf(stderr, "Warning: node 0x%04X does not answer\n", nodes[i].id);
+      nodes[i].active = false;
+    }
+  }
+  return count;
+}
+
+static const char *state_name(uint8_t state) {
+  switch (state) {
+  case BOOT_CAN_STATE_IDLE:
+    return "waiting";
+  case BOOT_CAN_STATE_RECEIVING:
+    return "receiving";
+  case BOOT_CAN_STATE_VERIFIED:
+    return "verified";
+  case BOOT_CAN_STATE_FAILED:
+    return "failed";
+  default:
+    return "?";
+  }
+}
+
+static void print_nodes(const node_t *nodes, unsigned count) {
+  printf("\nNode    State      Result  Version\n");
+  for (unsigned i = 0; i < count; i++) {
+    printf("0x%04X  %-9s  %6u  %u\n", nodes[i].id,
+           nodes[i].answered ? state_name(nodes[i].state) : "silent",
+           nodes[i].result, (unsigned)nodes[i].version);
+  }
+}
+
+/**
+ * @brief Start the session on every node, wait until each has erased
+ * @return Nodes in the session
+ */
+static unsigned announce(bus_t *bus, node_t *nodes, unsigned count,
+                         uint8_t session, const uint8_t *image, size_t size) {
+  double deadline = now_ms() + ANNOUNCE_TIMEOUT_MS;
+  uint8_t data[8];
+  unsigned joined = 0;
+  can_frame_t frame;
+
+  store_be(store_be(data, (uint32_t)size, 4),
+           crc32_update(0xFFFFFFFF, image, (uint32_t)size), 4);
+  for (unsigned i = 0; i < count; i++) {
+    nodes[i].answered = false;
+  }
+  while (silent_nodes(nodes, count) != 0 && now_ms() < deadline) {
+    double retry = now_ms() + ANNOUNCE_RETRY_MS;
+
+    for (unsigned i = 0; i < count; i++) {
+      if (nodes[i].active && !nodes[i].answered) {
+        bus_send(bus, BOOT_CAN_ID(BOOT_CAN_ANNOUNCE, nodes[i].id, session),
+                 data, sizeof(data));
+      }
+    }
+    while (silent_nodes(nodes, count) != 0 &&
+           bus_receive(bus, &frame, retry < deadline ? retry : deadline)) {
+      if (BOOT_CAN_TYPE(frame.id) == BOOT_CAN_STATUS) {
+        take_status(nodes, count, &frame, session);
+      }
+    }
+  }
+
+  for (unsigned i = 0; i < count; i++) {
+    if (!nodes[i].active) {
+      continue;
+    }
+    if (!nodes[i].answered || nodes[i].state != BOOT_CAN_STATE_RECEIVING) {
+      fprintf(stderr, "Warning: node 0x%04X did not join (%s, result %u)\n",
+              nodes[i].id,
+              nodes[i].answered ? state_name(nodes[i].state) : "silent",
+              nodes[i].result);
+      nodes[i].active = false;
+      continue;
+    }
+    joined++;
+  }
+  return joined;
+}
+
+/**
+ * @brief Send the blocks marked in want, a quiet gap after each
+ */
+static bool send_blocks(bus_t *bus, uint8_t session, const uint8_t *image,
+                        size_t size, const bool *want, unsigned gap_ms) {
+  unsigned blocks = (unsigned)((size + BOOT_CAN_BLOCK_SIZE - 1) /
+                               BOOT_CAN_BLOCK_SIZE);
+
+  for (unsigned block = 0; block < blocks; block++) {
+    if (!want[block]) {
+      continue;
+    }
+    for (unsigned i = 0; i < BOOT_CAN_BLOCK_FRAMES; i++) {
+      unsigned index = block * BOOT_CAN_BLOCK_FRAMES + i;
+      size_t offset = (size_t)index * BOOT_CAN_FRAME_SIZE;
+      uint8_t data[BOOT_CAN_FRAME_SIZE];
+
+      if (offset >= size) {
+        break;
+      }
+      memset(data, 0xFF, sizeof(data));
+      memcpy(data, image + offset,
+             size - offset < sizeof(data) ? size - offset : sizeof(data));
+      if (!bus_send(bus, BOOT_CAN_ID(BOOT_CAN_DATA, index, session), data,
+                    sizeof(data))) {
+        return false;
+      }
+    }
+    /* The nodes program the block meanwhile */
+    bus_quiet(bus, gap_ms);
+  }
+  return true;
+}
+
+/**
+ * @brief Ask every node in the session which blocks it is missing
+ * @param want: Set for every block at least one node is missing
+ * @return Blocks in want, -1 if a node stopped answering
+ */
+static int query(bus_t *bus, node_t *nodes, unsigned count, uint8_t session,
+                 bool *want, unsigned blocks) {
+  can_frame_t frame;
+  int wanted = 0;
+
+  memset(want, 0, blocks * sizeof(*want));
+  for (unsigned i = 0; i < count; i++) {
+    nodes[i].answered = false;
+  }
+  for (int tries = 0; tries < QUERY_RETRIES && silent_nodes(nodes, count);
+       tries++) {
+    double window = now_ms() + QUERY_WINDOW_MS;
+
+    if (tries == 0) {
+      bus_send_empty(bus, BOOT_CAN_ID(BOOT_CAN_QUERY, BOOT_CAN_ALL, session));
+    } else {
+      for (unsigned i = 0; i < count; i++) {
+        if (nodes[i].active && !nodes[i].answered) {
+          bus_send_empty(bus,
+                         BOOT_CAN_ID(BOOT_CAN_QUERY, nodes[i].id, session));
+        }
+      }
+    }
+    while (silent_nodes(nodes, count) != 0 &&
+           bus_receive(bus, &frame, window)) {
+      node_t *node = find_node(nodes, count, BOOT_CAN_A(frame.id));
+
+      if (node == NULL || !node->active ||
+          BOOT_CAN_B(frame.id) != session) {
+        continue;
+      }
+      if (BOOT_CAN_TYPE(frame.id) == BOOT_CAN_STATUS) {
+        take_status(nodes, count, &frame, session);
+      } else if (BOOT_CAN_TYPE(frame.id) == BOOT_CAN_MISSING) {
+        unsigned first = load_be(frame.data, 2);
+
+        for (unsigned i = 0; i < BOOT_CAN_MISSING_SPAN; i++) {
+          if (first + i < blocks &&
+              (frame.data[2 + i / 8] & (1u << (i % 8))) != 0) {
+            want[first + i] = true;
+          }
+        }
+      }
+    }
+  }
+
+  for (unsigned i = 0; i < count; i++) {
+    if (!nodes[i].active) {
+      continue;
+    }
+    if (!nodes[i].answered || nodes[i].state != BOOT_CAN_STATE_RECEIVING ||
+        nodes[i].result != 0) {
+      fprintf(stderr, "Warning: node 0x%04X left the session (%s, result "
+                      "%u)\n",
+              nodes[i].id,
+              nodes[i].answered ? state_name(nodes[i].state) : "silent",
+              nodes[i].result);
+      nodes[i].active = false;
+      continue;
+    }
+    if (nodes[i].missing != 0) {
+      /* A MISSING frame got lost, STATUS still has the count */
+      wanted = -1;
+    }
+  }
+  for (unsigned block = 0; block < blocks && wanted >= 0; block++) {
+    wanted += want[block];
+  }
+  return wanted;
+}
+
+/**
+ * @brief COMMIT, then wait for each node's verification result
+ * @return Nodes that verified the image
+ */
+static unsigned commit(bus_t *bus, node_t *nodes, unsigned count,
+                       uint8_t session) {
+  double deadline = now_ms() + VERIFY_TIMEOUT_MS;
+  unsigned verified = 0;
+  can_frame_t frame;
+
+  for (unsigned i = 0; i < count; i++) {
+    nodes[i].answered = false;
+  }
+  while (silent_nodes(nodes, count) != 0 && now_ms() < deadline) {
+    double retry = now_ms() + COMMIT_RETRY_MS;
+
+    bus_send_empty(bus, BOOT_CAN_ID(BOOT_CAN_COMMIT, BOOT_CAN_ALL, session));
+    while (silent_nodes(nodes, count) != 0 &&
+           bus_receive(bus, &frame, retry < deadline ? retry : deadline)) {
+      node_t *node;
+
+      if (BOOT_CAN_TYPE(frame.id) != BOOT_CAN_STATUS) {
+        continue;
+      }
+      node = take_status(nodes, count, &frame, session);
+      /* RECEIVING: still busy with the last block, asked again */
+      if (node != NULL && node->state == BOOT_CAN_STATE_RECEIVING) {
+        node->answered = false;
+      }
+    }
+  }
+
+  for (unsigned i = 0; i < count; i++) {
+    if (!nodes[i].active) {
+      continue;
+    }
+    if (nodes[i].answered && nodes[i].state == BOOT_CAN_STATE_VERIFIED) {
+      verified++;
+    } else {
+      fprintf(stderr, "Error: node 0x%04X %s (result %u)\n", nodes[i].id,
+              nodes[i].answered ? "failed the verification" : "is silent",
+              nodes[i].result);
+    }
+  }
+  return verified;
+}
+
+static void report(const double *phase_ms, size_t size, unsigned nodes,
+                   unsigned rounds, unsigned resent) {
+  double total = 0;
+
+  printf("\nPhase        ms\n");
+  for (int i = 0; i < PHASE_COUNT; i++) {
+    printf("%-8s %9.1f\n", phase_names[i], phase_ms[i]);
+    total += phase_ms[i];
+  }
+  printf("%-8s %9.1f\n", "total", total);
+  if (phase_ms[PHASE_DATA] > 0) {
+    printf("\nData:      %.0f bytes/s\n",
+           size * 1000.0 / phase_ms[PHASE_DATA]);
+  }
+  printf("Overall:   %.0f bytes/s to %u nodes (announce to verified)\n",
+         size * 1000.0 / (total - phase_ms[PHASE_ENTER]), nodes);
+  printf("Rounds:    %u, %u blocks resent\n", rounds, resent);
+}
+
+static uint8_t *read_image(const char *path, size_t *size) {
+  FILE *f = fopen(path, "rb");
+  uint8_t *data;
+  long length;
+
+  if (f == NULL) {
+    fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  length = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  data = malloc(length > 0 ? (size_t)length : 1);
+  if (data == NULL || fread(data, 1, (size_t)length, f) != (size_t)length) {
+    fprintf(stderr, "Error: cannot read %s\n", path);
+    free(data);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+  *size = (size_t)length;
+  return data;
+}
+
+static int update(const options_t *opt, bus_t *bus, const uint8_t *image,
+                  size_t size) {
+  static node_t nodes[MAX_NODES];
+  static bool want[BOOT_CAN_MAX_BLOCKS];
+  unsigned blocks = (unsigned)((size + BOOT_CAN_BLOCK_SIZE - 1) /
+                               BOOT_CAN_BLOCK_SIZE);
+  double phase_ms[PHASE_COUNT] = {0};
+  double start = now_ms();
+  unsigned count;
+  unsigned joined;
+  unsigned verified;
+  unsigned rounds = 0;
+  unsigned resent = 0;
+  uint8_t session;
+  int wanted;
+
+  if (opt->enter) {
+    printf("Requesting bootloader entry...\n");
+    for (unsigned i = 0; i < (opt->target_count ? opt->target_count : 1);
+         i++) {
+      bus_send_empty(bus, BOOT_CAN_ID(BOOT_CAN_ENTER,
+                                      opt->target_count ? opt->targets[i]
+                                                        : BOOT_CAN_ALL,
+                                      0));
+    }
+    sleep_us(ENTER_DELAY_MS * 1000.0);
+  }
+  count = discover(opt, bus, nodes);
+  phase_ms[PHASE_ENTER] = now_ms() - start;
+  if (opt->list || !opt->quiet) {
+    print_nodes(nodes, count);
+  }
+  if (opt->list) {
+    return count != 0 ? 0 : 1;
+  }
+
+  /* Not 0, the session of STATUS frames outside a session */
+  srand((unsigned)(time(NULL) ^ getpid()));
+  session = (uint8_t)(rand() % 255 + 1);
+  start = now_ms();
+  joined = announce(bus, nodes, count, session, image, size);
+  phase_ms[PHASE_ANNOUNCE] = now_ms() - start;
+  if (joined == 0) {
+    fprintf(stderr, "Error: no node waits for firmware\n");
+    return 1;
+  }
+  printf("\nSession %u: %zu bytes, %u blocks to %u nodes\n", session, size,
+         blocks, joined);
+
+  start = now_ms();
+  for (unsigned block = 0; block < blocks; block++) {
+    want[block] = true;
+  }
+  if (!send_blocks(bus, session, image, size, want, opt->gap_ms)) {
+    return 1;
+  }
+  phase_ms[PHASE_DATA] = now_ms() - start;
+
+  start = now_ms();
+  for (;;) {
+    wanted = query(bus, nodes, count, session, want, blocks);
+    if (wanted == 0 || rounds == opt->rounds) {
+      break;
+    }
+    if (wanted < 0) {
+      /* Resend what the maps showed, the next QUERY lists the rest */
+      wanted = 0;
+      for (unsigned block = 0; block < blocks; block++) {
+        wanted += want[block];
+      }
+    }
+    rounds++;
+    resent += (unsigned)wanted;
+    if (!opt->quiet) {
+      printf("Round %u: %d blocks\n", rounds, wanted);
+    }
+    if (!send_blocks(bus, session, image, size, want, opt->gap_ms)) {
+      return 1;
+    }
+  }
+  phase_ms[PHASE_REPAIR] = now_ms() - start;
+  if (wanted != 0) {
+    fprintf(stderr, "Error: blocks still missing after %u rounds\n", rounds);
+    return 1;
+  }
+
+  start = now_ms();
+  verified = commit(bus, nodes, count, session);
+  phase_ms[PHASE_COMMIT] = now_ms() - start;
+
+  if (!opt->quiet) {
+    print_nodes(nodes, count);
+  }
+  report(phase_ms, size, verified, rounds, resent);
+  printf("Verified:  %u of %u nodes\n", verified, count);
+  return verified == count ? 0 : 1;
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [options] <bus> <image.bin>\n"
+         "       %s -l [options] <bus>\n"
+         "\n"
+         "bus is a SocketCAN interface at 500 kbit/s, or the bus file of\n"
+         "the host simulators.\n"
+         "\n"
+         "Options:\n"
+         "  -n, --nodes LIST    Comma separated node addresses (default:\n"
+         "                      every node that answers PING)\n"
+         "  -l, --list          List the nodes and their versions, no update\n"
+         "  -e, --enter         Ask the running applications to enter the\n"
+         "                      bootloader first\n"
+         "  -g, --gap MS        Quiet time after each block (default: %u)\n"
+         "  -r, --rounds N      Repair rounds at most (default: 10)\n"
+         "  -t, --timeout SEC   Wait for the nodes (default: 10)\n"
+         "  -B, --bootloader-size SIZE\n"
+         "                      Flash the bootloader reserves, as merge.py -b\n"
+         "                      (default: 0x%X)\n"
+         "  -q, --quiet         Only print the report\n"
+         "  -h, --help          Show this help\n"
+         "\n"
+         "Examples:\n"
+         "  %s can0 example_app/build/app.bin\n"
+         "  %s -e -n 0x1A2B,0x3C4D can0 app.bin\n",
+         prog, prog, BOOT_CAN_BLOCK_GAP_MS, BOOTLOADER_SIZE, prog, prog);
+}
+
+int main(int argc, char **argv) {
+  static const struct option long_options[] = {
+      {"nodes", required_argument, NULL, 'n'},
+      {"list", no_argument, NULL, 'l'},
+      {"enter", no_argument, NULL, 'e'},
+      {"gap", required_argument, NULL, 'g'},
+      {"rounds", required_argument, NULL, 'r'},
+      {"timeout", required_argument, NULL, 't'},
+      {"bootloader-size", required_argument, NULL, 'B'},
+      {"quiet", no_argument, NULL, 'q'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0}};
+  options_t opt = {.gap_ms = BOOT_CAN_BLOCK_GAP_MS,
+                   .rounds = 10,
+                   .timeout_s = 10,
+                   .bootloader_size = BOOTLOADER_SIZE};
+  bus_t bus;
+  uint8_t *image = NULL;
+  size_t size = 0;
+  char *p;
+  int c;
+  int ret;
+
+  while ((c = getopt_long(argc, argv, "n:leg:r:t:B:qh", long_options, NULL)) !=
+         -1) {
+    switch (c) {
+    case 'n':
+      for (p = optarg; *p != '\0' && opt.target_count < MAX_NODES;) {
+        unsigned long id = strtoul(p, &p, 0);
+
+        if (id == 0 || id >= BOOT_CAN_ALL || (*p != ',' && *p != '\0')) {
+          fprintf(stderr, "Error: bad node list %s\n", optarg);
+          return 1;
+        }
+        opt.targets[opt.target_count++] = (uint16_t)id;
+        p += *p == ',';
+      }
+      break;
+    case 'l':
+      opt.list = true;
+      break;
+    case 'e':
+      opt.enter = true;
+      break;
+    case 'g':
+      opt.gap_ms = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'r':
+      opt.rounds = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 't':
+      opt.timeout_s = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'B':
+      opt.bootloader_size = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'q':
+      opt.quiet = true;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != (opt.list ? 1 : 2)) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (!BOOT_LAYOUT_SIZE_VALID(opt.bootloader_size)) {
+    fprintf(stderr, "Error: invalid bootloader size 0x%X\n",
+            opt.bootloader_size);
+    return 1;
+  }
+  opt.bus = argv[optind];
+  if (!opt.list) {
+    opt.image = argv[optind + 1];
+    image = read_image(opt.image, &size);
+    if (image == NULL) {
+      return 1;
+    }
+    if (size == 0 || size > BOOT_LAYOUT_APP_MAX(opt.bootloader_size)) {
+      fprintf(stderr, "Error: image must be 1..%u bytes\n",
+              BOOT_LAYOUT_APP_MAX(opt.bootloader_size));
+      free(image);
+      return 1;
+    }
+    printf("Image:     %s\n", opt.image);
+    printf("Size:      %zu bytes\n", size);
+    printf("CRC32:     0x%08X\n",
+           (unsigned)crc32_update(0xFFFFFFFF, image, (uint32_t)size));
+  }
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  if (!bus_open(&bus, opt.bus)) {
+    free(image);
+    return 1;
+  }
+  ret = update(&opt, &bus, image, size);
+  bus_close(&bus);
+  free(image);
+  return ret;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Host simulator internals, shared by the HAL shim, the flash model and
+ * the boot loop in sim_main.c.
+ */
+#define SIM_FLASH_BASE 0x08000000UL
+#define SIM_FLASH_SIZE (64 * 1024)
+#define SIM_RAM_BASE 0x20000000UL
+#define SIM_RAM_SIZE (20 * 1024)
+#define SIM_SPI_FLASH_SIZE (2 * 1024 * 1024) /* W25Q16 on SPI1 */
+
+/* Exit codes of one simulated boot */
+#define SIM_EXIT_APP 0   /* application started, --exit-on-app */
+#define SIM_EXIT_RESET 3 /* HAL_NVIC_SystemReset(), boot again */
+
+typedef struct {
+  unsigned baudrate;      /* UART speed until the bootloader changes it */
+  unsigned erase_us;      /* per page */
+  unsigned program_us;    /* per halfword */
+  unsigned protect_below; /* write protected flash below this address */
+  unsigned spi_page_us;   /* SPI flash page program */
+  unsigned spi_sector_us; /* 4KB sector erase */
+  unsigned spi_block_us;  /* 64KB block erase */
+  double rx_ber;          /* bit error rate on received bytes */
+  double can_drop;        /* share of host CAN frames a node misses */
+  unsigned fail_program;  /* fail the Nth flash program call, 0 = never */
+  bool overrun;           /* one byte RX register, late bytes are lost */
+  bool button;            /* KEY_2 held */
+  bool exit_on_app;
+  unsigned seed;
+} sim_config_t;
+
+/* Counters across all boots, kept in shared memory */
+typedef struct {
+  uint32_t boots;
+  uint32_t pages_erased;
+  uint32_t halfwords_programmed;
+  uint32_t flash_errors;
+  double flash_busy_us;
+  uint32_t rx_bytes;
+  uint32_t rx_lost;
+  uint32_t rx_corrupted;
+  uint32_t tx_bytes;
+  double sleep_us; /* boot_idle_wait() in Sleep mode */
+  double stop_us;  /* and in Stop mode */
+  uint32_t stops;
+  uint32_t spi_pages;     /* SPI flash pages programmed */
+  uint32_t spi_erased_kb; /* and erased */
+  uint32_t can_rx;        /* frames taken out of FIFO 0 */
+  uint32_t can_lost;      /* and lost, the FIFO was full */
+  uint32_t can_dropped;   /* and missed on purpose, --can-drop */
+  uint32_t can_tx;
+} sim_stats_t;
+
+extern sim_config_t sim_config;
+extern sim_stats_t *sim_stats;
+
+/* Clock, microseconds since the simulated reset */
+void sim_clock_reset(void);
+double sim_now_us(void);
+
+/* Let time pass with the CPU busy (not polling the UART) */
+void sim_busy_us(double us);
+
+/* UART backed by the pty master */
+void sim_uart_start(int fd);
+
+/* SPI flash contents in a file, no chip is fitted without it */
+void sim_spi_map(const char *path);
+
+/* CAN bus shared with other simulators and sbcan, see sim_can_bus.h */
+void sim_can_attach(const char *path);
+bool sim_can_attached(void);
+void sim_can_set_node(uint16_t node);
+void sim_can_busy(double us);
+
+void sim_print_stats(const char *event);
@@ -0,0 +1,197 @@
+#include "boot_can.h"
+#include "can_bus.h"
+#include "sim.h"
+#include "sim_can_bus.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * bxCAN model behind the can_bus_* calls of Src/boot_can.c, on the bus of
+ * sim_can_bus.h. The filter passes the host frame types, FIFO 0 holds three
+ * frames. A frame that arrives while the CPU is busy (sim_busy_us(): flash
+ * programming, UART transmit) with the FIFO full is lost, as on the F1.
+ * Frames that arrive while the bootloader polls or sleeps are taken in
+ * time, however late the host process gets to them. Three transmit
+ * mailboxes, a fourth frame waits for the first to leave.
+ *
+ * --can-drop has a node miss that share of the host frames, as with
+ * interference on its stub, so the repair rounds have something to do.
+ *
+ * Without --can-bus no transceiver is fitted, nothing is received and
+ * sends fail.
+ */
+#define SIM_CAN_FIFO_SIZE 3
+#define SIM_CAN_MAILBOXES 3
+#define SIM_CAN_BUSY_WINDOWS 64
+
+static sim_can_bus_t *s_bus;
+static uint16_t s_node = 1;
+static unsigned s_rand_state;
+
+static struct {
+  bool on;
+  uint32_t next; /* bus frame to look at next */
+  can_frame_t fifo[SIM_CAN_FIFO_SIZE];
+  uint32_t head;
+  uint32_t count;
+  double mailbox_us[SIM_CAN_MAILBOXES]; /* end of the frame in each */
+} s_can;
+
+/* CPU busy windows on the bus clock, the latest SIM_CAN_BUSY_WINDOWS */
+static struct {
+  double start_us;
+  double end_us;
+} s_busy[SIM_CAN_BUSY_WINDOWS];
+static uint32_t s_busy_count;
+
+void sim_can_attach(const char *path) {
+  s_bus = sim_can_bus_open(path, BOOT_CAN_BITRATE);
+  if (s_bus == NULL) {
+    fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+}
+
+bool sim_can_attached(void) { return s_bus != NULL; }
+
+void sim_can_set_node(uint16_t node) { s_node = node; }
+
+/**
+ * @brief Note a busy window that just ended, called by sim_busy_us()
+ */
+void sim_can_busy(double us) {
+  double now = sim_can_bus_now();
+
+  s_busy[s_busy_count % SIM_CAN_BUSY_WINDOWS].start_us = now - us;
+  s_busy[s_busy_count % SIM_CAN_BUSY_WINDOWS].end_us = now;
+  s_busy_count++;
+}
+
+static bool sim_can_in_busy_window(double t) {
+  uint32_t count = s_busy_count < SIM_CAN_BUSY_WINDOWS ? s_busy_count
+                                                        : SIM_CAN_BUSY_WINDOWS;
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (t >= s_busy[i].start_us && t <= s_busy[i].end_us) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Move the frames that went by into FIFO 0
+ * @note  A frame that finds the FIFO full waits in the bus ring if the CPU
+ *        was free to read it, and is lost if it was busy
+ */
+static void sim_can_sync(void) {
+  double now = sim_can_bus_now();
+  uint32_t head = sim_can_bus_head(s_bus);
+
+  if (head - s_can.next > SIM_CAN_BUS_FRAMES) {
+    /* Fell a whole ring behind */
+    sim_stats->can_lost += head - s_can.next - SIM_CAN_BUS_FRAMES;
+    s_can.next = head - SIM_CAN_BUS_FRAMES;
+  }
+  for (; s_can.next != head; s_can.next++) {
+    const sim_can_bus_frame_t *frame =
+        &s_bus->frames[s_can.next % SIM_CAN_BUS_FRAMES];
+    can_frame_t *slot;
+
+    if (frame->end_us > now) {
+      break;
+    }
+    if (frame->sender == (int32_t)getpid() ||
+        (BOOT_CAN_TYPE(frame->id) & BOOT_CAN_HOST_MASK) !=
+            BOOT_CAN_HOST_FIRST) {
+      continue;
+    }
+    if (s_can.count == SIM_CAN_FIFO_SIZE) {
+      if (!sim_can_in_busy_window(frame->end_us)) {
+        break;
+      }
+      sim_stats->can_lost++;
+      continue;
+    }
+    if (sim_config.can_drop > 0 &&
+        rand_r(&s_rand_state) <
+            sim_config.can_drop * ((double)RAND_MAX + 1)) {
+      sim_stats->can_dropped++;
+      continue;
+    }
+    slot = &s_can.fifo[(s_can.head + s_can.count++) % SIM_CAN_FIFO_SIZE];
+    slot->id = frame->id;
+    slot->size = frame->size;
+    memcpy(slot->data, frame->data, sizeof(slot->data));
+  }
+}
+
+void can_bus_init(void) {
+  memset(&s_can, 0, sizeof(s_can));
+  s_rand_state = sim_config.seed ^ s_node;
+  if (s_bus != NULL) {
+    s_can.on = true;
+    s_can.next = sim_can_bus_head(s_bus);
+  }
+}
+
+void can_bus_deinit(void) { s_can.on = false; }
+
+bool can_bus_pending(void) {
+  if (!s_can.on) {
+    return false;
+  }
+  sim_can_sync();
+  return s_can.count != 0;
+}
+
+bool can_bus_receive(can_frame_t *frame) {
+  if (!can_bus_pending()) {
+    return false;
+  }
+  *frame = s_can.fifo[s_can.head];
+  s_can.head = (s_can.head + 1) % SIM_CAN_FIFO_SIZE;
+  s_can.count--;
+  sim_stats->can_rx++;
+  return true;
+}
+
+/**
+ * @brief Queue a frame, waiting for a free mailbox like the driver
+ */
+bool can_bus_send(const can_frame_t *frame) {
+  double first;
+  int free_box = -1;
+
+  if (!s_can.on) {
+    return false;
+  }
+  for (;;) {
+    double now = sim_can_bus_now();
+
+    first = s_can.mailbox_us[0];
+    for (int i = 0; i < SIM_CAN_MAILBOXES; i++) {
+      if (s_can.mailbox_us[i] <= now) {
+        free_box = i;
+        break;
+      }
+      if (s_can.mailbox_us[i] < first) {
+        first = s_can.mailbox_us[i];
+      }
+    }
+    if (free_box >= 0) {
+      break;
+    }
+    if (first - now > CAN_BUS_TX_TIMEOUT_MS * 1000.0) {
+      return false;
+    }
+    sim_busy_us(first - now);
+  }
+  s_can.mailbox_us[free_box] =
+      sim_can_bus_send(s_bus, frame->id, frame->data, frame->size);
+  sim_stats->can_tx++;
+  return true;
+}
+
+uint16_t can_bus_node_id(void) { return s_node; }
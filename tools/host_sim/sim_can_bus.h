@@ -0,0 +1,128 @@
+#pragma once
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Simulated CAN bus between processes: simulators, one per node, and the
+ * host tool (tools/can/sbcan.c). Header only, both sides include it.
+ *
+ * The bus is a file mapped by every process. Frames go into a ring in the
+ * order they win the bus: each takes its time on the wire at the bit rate
+ * after the previous one, and carries the time its last bit went by on
+ * CLOCK_MONOTONIC. A receiver sees a frame from then on. Every process
+ * keeps its own read position, a frame reaches all of them, the sender
+ * skips its own.
+ */
+#define SIM_CAN_BUS_MAGIC 0x53554243 // CBUS
+#define SIM_CAN_BUS_FRAMES 8192
+
+typedef struct {
+  uint32_t id;
+  uint8_t size;
+  uint8_t data[8];
+  int32_t sender; /* pid */
+  double end_us;  /* last bit on the wire, sim_can_bus_now() */
+} sim_can_bus_frame_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t bitrate;
+  int lock;
+  uint32_t head; /* frames ever sent, slot head % SIM_CAN_BUS_FRAMES next */
+  double idle_us; /* bus free from then on */
+  sim_can_bus_frame_t frames[SIM_CAN_BUS_FRAMES];
+} sim_can_bus_t;
+
+/**
+ * @brief Absolute time in us, the same in every process on the host
+ */
+static inline double sim_can_bus_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+ * @brief Map the bus in path, the first process sets it up
+ * @return NULL with errno set on failure
+ */
+static inline sim_can_bus_t *sim_can_bus_open(const char *path,
+                                              uint32_t bitrate) {
+  sim_can_bus_t *bus;
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+
+  if (fd < 0) {
+    return NULL;
+  }
+  flock(fd, LOCK_EX);
+  if (ftruncate(fd, sizeof(sim_can_bus_t)) != 0) {
+    close(fd);
+    return NULL;
+  }
+  bus = mmap(NULL, sizeof(*bus), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (bus == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  if (bus->magic != SIM_CAN_BUS_MAGIC) {
+    memset(bus, 0, sizeof(*bus));
+    bus->magic = SIM_CAN_BUS_MAGIC;
+    bus->bitrate = bitrate;
+  }
+  flock(fd, LOCK_UN);
+  close(fd);
+  return bus;
+}
+
+/**
+ * @brief Time a data frame with an extended ID takes on the wire
+ * @note  67 bits of framing and 8 per data byte, stuff bits add up to a
+ *        fifth of that, a tenth is typical
+ */
+static inline double sim_can_bus_frame_us(const sim_can_bus_t *bus,
+                                          uint8_t size) {
+  return (67 + 8 * size) * 1.1 * 1e6 / bus->bitrate;
+}
+
+/**
+ * @brief Put a frame on the bus behind the ones already queued
+ * @return Time its last bit goes by
+ */
+static inline double sim_can_bus_send(sim_can_bus_t *bus, uint32_t id,
+                                      const uint8_t *data, uint8_t size) {
+  sim_can_bus_frame_t *frame;
+  double start = sim_can_bus_now();
+  double end;
+
+  while (__atomic_exchange_n(&bus->lock, 1, __ATOMIC_ACQUIRE) != 0) {
+  }
+  if (bus->idle_us > start) {
+    start = bus->idle_us;
+  }
+  end = start + sim_can_bus_frame_us(bus, size);
+  bus->idle_us = end;
+
+  frame = &bus->frames[bus->head % SIM_CAN_BUS_FRAMES];
+  frame->id = id;
+  frame->size = size;
+  memset(frame->data, 0, sizeof(frame->data));
+  memcpy(frame->data, data, size);
+  frame->sender = (int32_t)getpid();
+  frame->end_us = end;
+  __atomic_store_n(&bus->head, bus->head + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&bus->lock, 0, __ATOMIC_RELEASE);
+  return end;
+}
+
+/**
+ * @brief Frames sent so far, where a new reader starts
+ */
+static inline uint32_t sim_can_bus_head(const sim_can_bus_t *bus) {
+  return __atomic_load_n(&bus->head, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,82 @@
+#include "flash_if.h"
+#include "sim.h"
+#include "stm32f1xx_hal.h"
+
+/*
+ * Flash model with the F1 rules the register engine in Src/flash_if.c runs
+ * into on silicon: whole page erase, halfword programming, a halfword can
+ * only be programmed when erased (or to 0x0000), write protected pages
+ * refuse both. Each operation costs its configured time.
+ */
+
+static bool sim_flash_writable(uint32_t address) {
+  return address >= sim_config.protect_below &&
+         address < SIM_FLASH_BASE + SIM_FLASH_SIZE;
+}
+
+flash_if_result_t flash_if_erase(uint32_t address, uint32_t size) {
+  uint32_t page = address & ~(FLASH_PAGE_SIZE - 1);
+  uint32_t end = address + size;
+  flash_if_result_t result = FLASH_IF_OK;
+  uint32_t pages = 0;
+
+  for (; page < end; page += FLASH_PAGE_SIZE) {
+    if (!sim_flash_writable(page)) {
+      result = FLASH_IF_ERROR;
+      break;
+    }
+    for (uint32_t i = 0; i < FLASH_PAGE_SIZE; i += 4) {
+      *(volatile uint32_t *)(uintptr_t)(page + i) = 0xFFFFFFFF;
+    }
+    pages++;
+  }
+
+  sim_busy_us((double)pages * sim_config.erase_us);
+  sim_stats->pages_erased += pages;
+  sim_stats->flash_busy_us += (double)pages * sim_config.erase_us;
+  if (result != FLASH_IF_OK) {
+    sim_stats->flash_errors++;
+  }
+  return result;
+}
+
+flash_if_result_t flash_if_program(uint32_t address, const uint8_t *data,
+                                   uint32_t size) {
+  static uint32_t calls;
+  flash_if_result_t result = FLASH_IF_OK;
+  uint32_t halfwords = 0;
+
+  if (address & 1) {
+    return FLASH_IF_ERROR;
+  }
+  if (++calls == sim_config.fail_program) {
+    /* Injected fault: the first halfword does not take */
+    sim_stats->flash_errors++;
+    return FLASH_IF_VERIFY_ERROR;
+  }
+
+  for (uint32_t i = 0; i < size; i += 2, address += 2) {
+    volatile uint16_t *dst = (volatile uint16_t *)(uintptr_t)address;
+    uint16_t halfword = data[i];
+
+    halfword |= (uint16_t)((i + 1 < size) ? data[i + 1] : 0xFF) << 8;
+    if (halfword == 0xFFFF && *dst == 0xFFFF) {
+      continue; /* flash_if skips erased halfwords */
+    }
+    if (!sim_flash_writable(address) ||
+        (*dst != 0xFFFF && halfword != 0x0000)) {
+      result = FLASH_IF_ERROR; /* WRPRTERR or PGERR */
+      break;
+    }
+    *dst = halfword;
+    halfwords++;
+  }
+
+  sim_busy_us((double)halfwords * sim_config.program_us);
+  sim_stats->halfwords_programmed += halfwords;
+  sim_stats->flash_busy_us += (double)halfwords * sim_config.program_us;
+  if (result != FLASH_IF_OK) {
+    sim_stats->flash_errors++;
+  }
+  return result;
+}
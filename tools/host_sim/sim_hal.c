@@ -0,0 +1,378 @@
+#include "boot_idle.h"
+#include "can_bus.h"
+#include "sim.h"
+#include "stm32f1xx_hal.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+GPIO_TypeDef sim_gpio[3];
+SCB_Type sim_scb;
+CoreDebug_Type sim_core_debug;
+uint32_t SystemCoreClock = HSI_VALUE;
+
+static DWT_Type s_dwt;
+static double s_dwt_sync_us;
+static struct timespec s_reset_time;
+
+/* Received bytes with the time their stop bit went by */
+#define RX_QUEUE_SIZE 8192
+typedef struct {
+  uint8_t byte;
+  double arrival_us;
+} rx_slot_t;
+
+static struct {
+  int fd;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  rx_slot_t queue[RX_QUEUE_SIZE];
+  uint32_t head;
+  uint32_t tail;
+  double last_arrival_us;
+  double byte_us;
+  unsigned rand_state;
+  bool overrun; /* ORE, cleared by the next read */
+} s_uart = {.fd = -1,
+            .lock = PTHREAD_MUTEX_INITIALIZER,
+            .ready = PTHREAD_COND_INITIALIZER};
+
+/* CPU busy windows since the last UART read, for the overrun model */
+#define BUSY_WINDOWS 16
+static struct {
+  double start_us;
+  double end_us;
+} s_busy[BUSY_WINDOWS];
+static uint32_t s_busy_count;
+
+void sim_clock_reset(void) {
+  clock_gettime(CLOCK_MONOTONIC, &s_reset_time);
+  s_dwt_sync_us = 0;
+  s_dwt.CYCCNT = 0;
+}
+
+double sim_now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec - s_reset_time.tv_sec) * 1e6 +
+         (ts.tv_nsec - s_reset_time.tv_nsec) / 1e3;
+}
+
+static void sim_sleep_until(double until_us) {
+  double left = until_us - sim_now_us();
+
+  if (left > 0) {
+    struct timespec ts = {.tv_sec = (time_t)(left / 1e6),
+                          .tv_nsec = (long)((left - (time_t)(left / 1e6) *
+                                                        1e6) * 1e3)};
+    nanosleep(&ts, NULL);
+  }
+}
+
+void sim_busy_us(double us) {
+  double start = sim_now_us();
+
+  sim_sleep_until(start + us);
+  pthread_mutex_lock(&s_uart.lock);
+  if (s_busy_count < BUSY_WINDOWS) {
+    s_busy[s_busy_count].start_us = start;
+    s_busy[s_busy_count].end_us = start + us;
+    s_busy_count++;
+  } else {
+    s_busy[BUSY_WINDOWS - 1].end_us = start + us;
+  }
+  pthread_mutex_unlock(&s_uart.lock);
+  sim_can_busy(us);
+}
+
+/**
+ * @brief DWT with CYCCNT advanced to the current simulated time
+ */
+DWT_Type *sim_dwt(void) {
+  double now = sim_now_us();
+
+  s_dwt.CYCCNT += (uint32_t)((now - s_dwt_sync_us) * (SystemCoreClock / 1e6));
+  s_dwt_sync_us = now;
+  return &s_dwt;
+}
+
+HAL_StatusTypeDef HAL_Init(void) { return HAL_OK; }
+
+HAL_StatusTypeDef HAL_DeInit(void) { return HAL_OK; }
+
+uint32_t HAL_GetTick(void) { return (uint32_t)(sim_now_us() / 1000); }
+
+void HAL_Delay(uint32_t delay) { sim_busy_us(delay * 1000.0); }
+
+void HAL_NVIC_SystemReset(void) {
+  sim_print_stats("reset");
+  fflush(stdout);
+  _exit(SIM_EXIT_RESET);
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *port, uint16_t pin) {
+  return (port->IDR & pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *port, uint16_t pin, GPIO_PinState state) {
+  if (state == GPIO_PIN_SET) {
+    port->ODR |= pin;
+  } else {
+    port->ODR &= ~(uint32_t)pin;
+  }
+}
+
+void HAL_GPIO_TogglePin(GPIO_TypeDef *port, uint16_t pin) { port->ODR ^= pin; }
+
+/**
+ * @brief Timestamp incoming bytes as they would leave the wire
+ */
+static void *sim_uart_reader(void *arg) {
+  uint8_t buf[256];
+
+  (void)arg;
+  for (;;) {
+    ssize_t n = read(s_uart.fd, buf, sizeof(buf));
+
+    if (n <= 0) {
+      if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EIO) {
+        return NULL;
+      }
+      usleep(1000);
+      continue;
+    }
+    pthread_mutex_lock(&s_uart.lock);
+    for (ssize_t i = 0; i < n; i++) {
+      double now = sim_now_us();
+      double arrival = s_uart.last_arrival_us + s_uart.byte_us;
+
+      if (arrival < now) {
+        arrival = now;
+      }
+      s_uart.last_arrival_us = arrival;
+      if (s_uart.tail - s_uart.head < RX_QUEUE_SIZE) {
+        s_uart.queue[s_uart.tail % RX_QUEUE_SIZE] =
+            (rx_slot_t){.byte = buf[i], .arrival_us = arrival};
+        s_uart.tail++;
+      } else {
+        sim_stats->rx_lost++;
+      }
+    }
+    pthread_cond_signal(&s_uart.ready);
+    pthread_mutex_unlock(&s_uart.lock);
+  }
+}
+
+void sim_uart_start(int fd) {
+  pthread_t thread;
+
+  s_uart.fd = fd;
+  s_uart.rand_state = sim_config.seed;
+  pthread_create(&thread, NULL, sim_uart_reader, NULL);
+}
+
+static bool sim_in_busy_window(double t) {
+  for (uint32_t i = 0; i < s_busy_count; i++) {
+    if (t >= s_busy[i].start_us && t <= s_busy[i].end_us) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Corrupt a received byte at the configured bit error rate
+ */
+static uint8_t sim_uart_noise(uint8_t byte) {
+  bool hit = false;
+
+  if (sim_config.rx_ber <= 0) {
+    return byte;
+  }
+  for (int bit = 0; bit < 8; bit++) {
+    if (rand_r(&s_uart.rand_state) < sim_config.rx_ber * ((double)RAND_MAX + 1)) {
+      byte ^= 1u << bit;
+      hit = true;
+    }
+  }
+  if (hit) {
+    sim_stats->rx_corrupted++;
+  }
+  return byte;
+}
+
+/**
+ * @brief __HAL_UART_GET_FLAG(), only ORE is modelled
+ */
+bool sim_uart_flag(uint32_t flag) {
+  bool set;
+
+  pthread_mutex_lock(&s_uart.lock);
+  set = flag == UART_FLAG_ORE && s_uart.overrun;
+  pthread_mutex_unlock(&s_uart.lock);
+  return set;
+}
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart) {
+  pthread_mutex_lock(&s_uart.lock);
+  s_uart.byte_us = 10e6 / huart->Init.BaudRate; /* 8N1 */
+  pthread_mutex_unlock(&s_uart.lock);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef *huart) {
+  (void)huart;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart,
+                                    const uint8_t *data, uint16_t size,
+                                    uint32_t timeout) {
+  (void)huart;
+  (void)timeout;
+  /* Polled transmit, the CPU waits for the wire. The host sees the bytes
+   * once the last one is out, so its answer cannot land in this window. */
+  sim_busy_us(size * s_uart.byte_us);
+  for (uint16_t done = 0; done < size;) {
+    ssize_t n = write(s_uart.fd, data + done, size - done);
+
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      return HAL_ERROR;
+    }
+    done += (uint16_t)n;
+  }
+  sim_stats->tx_bytes += size;
+  return HAL_OK;
+}
+
+/**
+ * @brief Wait until the next byte is in the data register
+ * @note  Called and returns with the lock held
+ * @param deadline: sim_now_us() value
+ * @param can: Also return early once a CAN frame is pending
+ * @return false at the deadline without a byte
+ */
+static bool sim_uart_wait(double deadline, bool can) {
+  for (;;) {
+    double now = sim_now_us();
+
+    if (s_uart.head != s_uart.tail &&
+        s_uart.queue[s_uart.head % RX_QUEUE_SIZE].arrival_us <= now) {
+      return true;
+    }
+    if (now >= deadline || (can && can_bus_pending())) {
+      return false;
+    }
+    if (s_uart.head != s_uart.tail) {
+      /* On the wire, wait for its stop bit */
+      double until = s_uart.queue[s_uart.head % RX_QUEUE_SIZE].arrival_us;
+
+      pthread_mutex_unlock(&s_uart.lock);
+      sim_sleep_until(until < deadline ? until : deadline);
+      pthread_mutex_lock(&s_uart.lock);
+    } else {
+      struct timespec ts;
+
+      /* The bus has no thread to signal, look at it every frame time */
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += can && sim_can_attached() ? 200000 : 1000000;
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&s_uart.ready, &s_uart.lock, &ts);
+    }
+  }
+}
+
+/**
+ * @brief Polled receive through a one byte data register
+ * @note  With the overrun model a byte that arrives while the CPU is busy
+ *        and the register still holds an unread byte is lost, as on the F1.
+ */
+HAL_StatusTypeDef HAL_UART_Receive(UART_HandleTypeDef *huart, uint8_t *data,
+                                   uint16_t size, uint32_t timeout) {
+  double deadline = sim_now_us() + timeout * 1000.0;
+
+  (void)huart;
+  for (uint16_t i = 0; i < size; i++) {
+    rx_slot_t slot;
+
+    pthread_mutex_lock(&s_uart.lock);
+    if (!sim_uart_wait(deadline, false)) {
+      s_busy_count = 0;
+      pthread_mutex_unlock(&s_uart.lock);
+      return HAL_TIMEOUT;
+    }
+
+    slot = s_uart.queue[s_uart.head++ % RX_QUEUE_SIZE];
+    s_uart.overrun = false;
+    if (sim_config.overrun) {
+      double now = sim_now_us();
+
+      while (s_uart.head != s_uart.tail) {
+        rx_slot_t *next = &s_uart.queue[s_uart.head % RX_QUEUE_SIZE];
+
+        if (next->arrival_us > now || !sim_in_busy_window(next->arrival_us)) {
+          break;
+        }
+        s_uart.head++;
+        sim_stats->rx_lost++;
+        s_uart.overrun = true;
+      }
+    }
+    s_busy_count = 0;
+    pthread_mutex_unlock(&s_uart.lock);
+
+    data[i] = sim_uart_noise(slot.byte);
+    sim_stats->rx_bytes++;
+  }
+  return HAL_OK;
+}
+
+/* Wake from Stop until the PLL runs again, bytes meanwhile are lost */
+#define SIM_STOP_WAKE_US 2000.0
+
+/**
+ * @brief boot_idle_wait() on the host, see Src/boot_idle.c
+ * @note  Sleep mode waits for the byte as the polled receive would, or a
+ *        CAN frame. Stop mode drops the byte that ends it and those within
+ *        the restart.
+ */
+bool boot_idle_wait(uint32_t deadline, bool stop) {
+  double start = sim_now_us();
+  bool woken = false;
+
+  pthread_mutex_lock(&s_uart.lock);
+  woken = sim_uart_wait(deadline * 1000.0, !stop) && stop;
+  if (woken) {
+    double restart = sim_now_us() + SIM_STOP_WAKE_US;
+
+    while (s_uart.head != s_uart.tail &&
+           s_uart.queue[s_uart.head % RX_QUEUE_SIZE].arrival_us <= restart) {
+      s_uart.head++;
+      sim_stats->rx_lost++;
+    }
+    pthread_mutex_unlock(&s_uart.lock);
+    sim_sleep_until(restart);
+  } else {
+    pthread_mutex_unlock(&s_uart.lock);
+  }
+
+  if (stop) {
+    sim_stats->stops++;
+    sim_stats->stop_us += sim_now_us() - start;
+  } else {
+    sim_stats->sleep_us += sim_now_us() - start;
+  }
+  return woken;
+}
+
+void boot_idle_deinit(void) {}
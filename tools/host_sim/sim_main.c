@@ -0,0 +1,377 @@
+/*
+ * Host simulator for the bootloader. Build with `make host-sim`.
+ *
+ * Runs Src/bootloader.c, ymodem.c and friends on Linux against the HAL shim
+ * in this directory. Flash (64KB) and RAM (20KB) are mapped at their real
+ * addresses, so the bootloader's absolute addresses work unchanged. USART1
+ * is the master side of a pty; point sbupload or sz at the printed slave.
+ *
+ * Each boot runs in a forked child, so a reset starts from fresh .data and
+ * .bss while flash and RAM (mailbox, boot timing) survive it. Once the
+ * bootloader jumps, a stand-in application answers 'B' the way example_app
+ * does: it posts an update request in the mailbox and resets. On a CAN bus
+ * (--can-bus) it does the same for an ENTER frame addressed to its node.
+ */
+#include "boot_can.h"
+#include "boot_mailbox.h"
+#include "bootloader.h"
+#include "boot_timing.h"
+#include "main.h"
+#include "sim.h"
+#include "stm32f1xx_hal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+UART_HandleTypeDef huart1;
+
+sim_config_t sim_config = {
+    .baudrate = BOOTLOADER_UART_BAUDRATE,
+    .erase_us = 20000,  /* F103 datasheet tERASE typ, 40 ms max */
+    .program_us = 53,   /* F103 datasheet tPROG typ, 70 us max */
+    .protect_below = APPLICATION_META_PAGE_ADDR,
+    .spi_page_us = 400,     /* W25Q16JV tPP typ, 3 ms max */
+    .spi_sector_us = 45000, /* tSE typ, 400 ms max */
+    .spi_block_us = 150000, /* tBE2 typ, 2 s max */
+    .overrun = true,
+    .seed = 1,
+};
+sim_stats_t *sim_stats;
+
+static pid_t s_child;
+
+void sim_print_stats(const char *event) {
+  fprintf(stderr,
+          "[sim] %s at %.1f ms: flash %u pages erased, %u halfwords, "
+          "%.1f ms busy, %u errors; uart rx %u (lost %u, corrupted %u), "
+          "tx %u; idle %.1f ms sleep, %.1f ms stop (%u stops); "
+          "spi %u pages, %u KB erased; can rx %u (lost %u, dropped %u), "
+          "tx %u\n",
+          event, sim_now_us() / 1000, sim_stats->pages_erased,
+          sim_stats->halfwords_programmed, sim_stats->flash_busy_us / 1000,
+          sim_stats->flash_errors, sim_stats->rx_bytes, sim_stats->rx_lost,
+          sim_stats->rx_corrupted, sim_stats->tx_bytes,
+          sim_stats->sleep_us / 1000, sim_stats->stop_us / 1000,
+          sim_stats->stops, sim_stats->spi_pages, sim_stats->spi_erased_kb,
+          sim_stats->can_rx, sim_stats->can_lost, sim_stats->can_dropped,
+          sim_stats->can_tx);
+}
+
+/**
+ * @brief Check for an ENTER frame addressed to this node
+ */
+static bool sim_application_can_enter(void) {
+  can_frame_t frame;
+
+  while (can_bus_receive(&frame)) {
+    uint16_t target = BOOT_CAN_A(frame.id);
+
+    if (BOOT_CAN_TYPE(frame.id) == BOOT_CAN_ENTER &&
+        (target == can_bus_node_id() || target == BOOT_CAN_ALL)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief What example_app does on the UART: 'B' requests an update
+ */
+void sim_application_start(uint32_t stack_pointer) {
+  uint32_t reset_vector = *(volatile uint32_t *)(SCB->VTOR + 4);
+  static const char banner[] = "[APP] simulated application, send B to "
+                               "enter the bootloader\r\n";
+
+  fprintf(stderr,
+          "[sim] jump to %s, vectors 0x%08X SP 0x%08X reset 0x%08X\n",
+          SCB->VTOR == APPLICATION_START_ADDR ? "application" : "RAM image",
+          SCB->VTOR, stack_pointer, reset_vector);
+  sim_print_stats("application");
+  if (sim_config.exit_on_app) {
+    _exit(SIM_EXIT_APP);
+  }
+
+  HAL_UART_Transmit(&huart1, (const uint8_t *)banner, sizeof(banner) - 1,
+                    1000);
+  can_bus_init();
+  for (;;) {
+    boot_mailbox_t request = {.command = BOOT_MAILBOX_CMD_ENTER_UPDATE};
+    uint8_t command;
+
+    if (HAL_UART_Receive(&huart1, &command, 1, 10) == HAL_OK &&
+        (command == 'B' || command == 'b')) {
+      boot_mailbox_write(&request);
+      HAL_NVIC_SystemReset();
+    }
+    if (sim_application_can_enter()) {
+      request.transport = BOOT_MAILBOX_TRANSPORT_CAN1;
+      boot_mailbox_write(&request);
+      HAL_NVIC_SystemReset();
+    }
+  }
+}
+
+/**
+ * @brief One boot, the same sequence as main() in Src/main.c
+ */
+static void sim_boot(int uart_fd) {
+  sim_clock_reset();
+  SystemCoreClock = HSI_VALUE;
+  if (sim_config.button) {
+    KEY_2_GPIO_Port->IDR |= KEY_2_Pin;
+  }
+  sim_uart_start(uart_fd);
+
+  bootloader_fast_boot();
+
+  HAL_Init();
+  boot_timing_mark(BOOT_PHASE_HAL_INIT);
+  SystemCoreClock = 72000000;
+  boot_timing_mark(BOOT_PHASE_CLOCK_LOCK);
+
+  huart1.Init.BaudRate = sim_config.baudrate;
+  HAL_UART_Init(&huart1);
+  bootloader_init();
+  bootloader_run();
+}
+
+/**
+ * @brief Map a region at the address the bootloader expects
+ */
+static void *sim_map(uintptr_t address, size_t size, int fd) {
+  int flags = MAP_SHARED | MAP_FIXED_NOREPLACE | (fd < 0 ? MAP_ANONYMOUS : 0);
+  void *p = mmap((void *)address, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+
+  if (p == MAP_FAILED || (uintptr_t)p != address) {
+    fprintf(stderr, "Error: cannot map 0x%08lX: %s\n", (unsigned long)address,
+            strerror(errno));
+    exit(1);
+  }
+  return p;
+}
+
+static void sim_map_flash(const char *path) {
+  int fd = -1;
+  bool fresh = true;
+  uint8_t *flash;
+
+  if (path != NULL) {
+    struct stat st;
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+      exit(1);
+    }
+    fresh = st.st_size == 0;
+    if (ftruncate(fd, SIM_FLASH_SIZE) != 0) {
+      fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+      exit(1);
+    }
+  }
+  flash = sim_map(SIM_FLASH_BASE, SIM_FLASH_SIZE, fd);
+  if (fresh) {
+    memset(flash, 0xFF, SIM_FLASH_SIZE);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+static void sim_map_ram(void) {
+  uint8_t *ram = sim_map(SIM_RAM_BASE, SIM_RAM_SIZE, -1);
+  unsigned state = sim_config.seed;
+
+  /* SRAM powers up with noise, not zeros */
+  for (size_t i = 0; i < SIM_RAM_SIZE; i++) {
+    ram[i] = (uint8_t)rand_r(&state);
+  }
+  sim_stats = mmap(NULL, sizeof(*sim_stats), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  memset(sim_stats, 0, sizeof(*sim_stats));
+}
+
+/**
+ * @brief Create the pty standing in for the USB-serial adapter
+ * @return Master fd, the slave stays open so the master never sees EIO
+ */
+static int sim_open_pty(const char *link) {
+  struct termios tio;
+  const char *name;
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  int slave;
+
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0 ||
+      (name = ptsname(master)) == NULL) {
+    fprintf(stderr, "Error: cannot create a pty: %s\n", strerror(errno));
+    exit(1);
+  }
+  slave = open(name, O_RDWR | O_NOCTTY);
+  if (slave < 0 || tcgetattr(slave, &tio) != 0) {
+    fprintf(stderr, "Error: %s: %s\n", name, strerror(errno));
+    exit(1);
+  }
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+
+  if (link != NULL) {
+    unlink(link);
+    if (symlink(name, link) != 0) {
+      fprintf(stderr, "Error: %s: %s\n", link, strerror(errno));
+      exit(1);
+    }
+    name = link;
+  }
+  printf("UART: %s\n", name);
+  fflush(stdout);
+  return master;
+}
+
+static void sim_stop(int sig) {
+  if (s_child > 0) {
+    kill(s_child, SIGKILL);
+  }
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [options]\n"
+         "\n"
+         "Options:\n"
+         "  -f, --flash FILE       Keep the 64KB flash in FILE across runs\n"
+         "  -S, --spi-flash FILE   Fit a 2MB SPI flash, kept in FILE\n"
+         "  -C, --can-bus FILE     Fit a CAN transceiver on the bus in FILE\n"
+         "  -N, --node ID          CAN node address (default: 1)\n"
+         "  -D, --can-drop RATE    Share of host CAN frames this node misses\n"
+         "  -l, --link PATH        Symlink to the pty slave\n"
+         "  -b, --baud RATE        Initial USART1 baud rate (default: %u)\n"
+         "  -E, --erase-us US      Page erase time (default: %u)\n"
+         "  -P, --program-us US    Halfword program time (default: %u)\n"
+         "  -r, --ber RATE         Bit error rate on received bytes\n"
+         "  -F, --fail-program N   Fail the Nth flash program call\n"
+         "  -O, --no-overrun       Buffer every received byte\n"
+         "  -k, --button           Hold the update button at every boot\n"
+         "  -x, --exit-on-app      Exit once the application is started\n"
+         "  -s, --seed N           Seed for noise and RAM contents\n"
+         "  -h, --help             Show this help\n",
+         prog, sim_config.baudrate, sim_config.erase_us,
+         sim_config.program_us);
+}
+
+int main(int argc, char **argv) {
+  static const struct option long_options[] = {
+      {"flash", required_argument, NULL, 'f'},
+      {"spi-flash", required_argument, NULL, 'S'},
+      {"can-bus", required_argument, NULL, 'C'},
+      {"node", required_argument, NULL, 'N'},
+      {"can-drop", required_argument, NULL, 'D'},
+      {"link", required_argument, NULL, 'l'},
+      {"baud", required_argument, NULL, 'b'},
+      {"erase-us", required_argument, NULL, 'E'},
+      {"program-us", required_argument, NULL, 'P'},
+      {"ber", required_argument, NULL, 'r'},
+      {"fail-program", required_argument, NULL, 'F'},
+      {"no-overrun", no_argument, NULL, 'O'},
+      {"button", no_argument, NULL, 'k'},
+      {"exit-on-app", no_argument, NULL, 'x'},
+      {"seed", required_argument, NULL, 's'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0}};
+  const char *flash_path = NULL;
+  const char *link = NULL;
+  int uart_fd;
+  int c;
+
+  while ((c = getopt_long(argc, argv, "f:S:C:N:D:l:b:E:P:r:F:Okxs:h",
+                          long_options, NULL)) != -1) {
+    switch (c) {
+    case 'f':
+      flash_path = optarg;
+      break;
+    case 'S':
+      sim_spi_map(optarg);
+      break;
+    case 'C':
+      sim_can_attach(optarg);
+      break;
+    case 'N':
+      sim_can_set_node((uint16_t)strtoul(optarg, NULL, 0));
+      break;
+    case 'D':
+      sim_config.can_drop = strtod(optarg, NULL);
+      break;
+    case 'l':
+      link = optarg;
+      break;
+    case 'b':
+      sim_config.baudrate = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'E':
+      sim_config.erase_us = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'P':
+      sim_config.program_us = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'r':
+      sim_config.rx_ber = strtod(optarg, NULL);
+      break;
+    case 'F':
+      sim_config.fail_program = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'O':
+      sim_config.overrun = false;
+      break;
+    case 'k':
+      sim_config.button = true;
+      break;
+    case 'x':
+      sim_config.exit_on_app = true;
+      break;
+    case 's':
+      sim_config.seed = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  sim_map_flash(flash_path);
+  sim_map_ram();
+  uart_fd = sim_open_pty(link);
+  signal(SIGINT, sim_stop);
+  signal(SIGTERM, sim_stop);
+
+  for (;;) {
+    int status;
+
+    sim_stats->boots++;
+    fprintf(stderr, "[sim] boot %u\n", sim_stats->boots);
+    fflush(stderr);
+    s_child = fork();
+    if (s_child == 0) {
+      sim_boot(uart_fd);
+      _exit(1); /* bootloader_run() does not return */
+    }
+    if (s_child < 0 || waitpid(s_child, &status, 0) < 0) {
+      fprintf(stderr, "Error: boot failed: %s\n", strerror(errno));
+      return 1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != SIM_EXIT_RESET) {
+      return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+    }
+  }
+}
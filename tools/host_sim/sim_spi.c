@@ -0,0 +1,193 @@
+#include "sim.h"
+#include "spi_flash.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * W25Q16 model behind the spi_bus_* calls of Src/spi_flash.c: JEDEC ID,
+ * status with BUSY and WEL, read, page program that wraps inside its page,
+ * 4KB sector and 64KB block erase. Programming only clears bits and starts
+ * when CS goes high, like on the chip; while it is busy every command but
+ * READ STATUS is ignored. The bus costs 8 bits at 36 MHz per byte.
+ *
+ * Without --spi-flash nothing drives MISO and every byte reads 0xFF, the
+ * board has no chip.
+ */
+#define SIM_SPI_JEDEC_ID 0xEF4015 /* Winbond W25Q16, 2MB */
+#define SIM_SPI_CLOCK_MHZ 36.0
+#define SIM_SPI_DEBT_US 100 /* bus time is slept off in pieces this large */
+
+static uint8_t *s_flash; /* shared across boots like the internal flash */
+
+static struct {
+  bool selected;
+  uint8_t command;
+  uint32_t count; /* bytes into the transaction */
+  uint32_t address;
+  bool write_enabled;
+  double busy_until_us;
+  uint8_t page[SPI_FLASH_PAGE_SIZE];
+  bool page_used[SPI_FLASH_PAGE_SIZE];
+  double debt_us;
+} s_spi;
+
+/**
+ * @brief Map the chip contents from path, a new file is erased
+ */
+void sim_spi_map(const char *path) {
+  struct stat st;
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  bool fresh;
+
+  if (fd < 0 || fstat(fd, &st) != 0 ||
+      ftruncate(fd, SIM_SPI_FLASH_SIZE) != 0) {
+    fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  fresh = st.st_size == 0;
+  s_flash = mmap(NULL, SIM_SPI_FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd, 0);
+  if (s_flash == MAP_FAILED) {
+    fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  if (fresh) {
+    memset(s_flash, 0xFF, SIM_SPI_FLASH_SIZE);
+  }
+  close(fd);
+}
+
+static bool sim_spi_busy(void) { return sim_now_us() < s_spi.busy_until_us; }
+
+static void sim_spi_start(double us) {
+  s_spi.busy_until_us = sim_now_us() + us;
+  s_spi.write_enabled = false;
+}
+
+void spi_bus_init(void) { memset(&s_spi, 0, sizeof(s_spi)); }
+
+void spi_bus_deinit(void) {}
+
+/**
+ * @brief The rising edge of CS runs what the transaction asked for
+ */
+static void sim_spi_finish(void) {
+  uint32_t base = s_spi.address & ~(SPI_FLASH_PAGE_SIZE - 1);
+  uint32_t size;
+
+  switch (s_spi.command) {
+  case 0x06:
+    s_spi.write_enabled = s_spi.count == 1;
+    break;
+  case 0x02:
+    if (s_spi.count <= 4) {
+      break;
+    }
+    for (uint32_t i = 0; i < SPI_FLASH_PAGE_SIZE; i++) {
+      if (s_spi.page_used[i]) {
+        s_flash[base + i] &= s_spi.page[i];
+      }
+    }
+    sim_spi_start(sim_config.spi_page_us);
+    sim_stats->spi_pages++;
+    break;
+  case 0x20:
+  case 0xD8:
+    if (s_spi.count != 4) {
+      break;
+    }
+    size = s_spi.command == 0x20 ? SPI_FLASH_SECTOR_SIZE : SPI_FLASH_BLOCK_SIZE;
+    memset(&s_flash[s_spi.address & ~(size - 1)], 0xFF, size);
+    sim_spi_start(s_spi.command == 0x20 ? sim_config.spi_sector_us
+                                        : sim_config.spi_block_us);
+    sim_stats->spi_erased_kb += size / 1024;
+    break;
+  default:
+    break;
+  }
+}
+
+void spi_bus_select(bool select) {
+  if (s_flash != NULL && s_spi.selected && !select) {
+    sim_spi_finish();
+  }
+  s_spi.selected = select;
+  s_spi.count = 0;
+  s_spi.command = 0;
+}
+
+/**
+ * @brief One byte of the current transaction
+ * @return What the chip drives on MISO meanwhile
+ */
+static uint8_t sim_spi_byte(uint8_t mosi) {
+  uint32_t n = s_spi.count++;
+  uint8_t miso = 0xFF;
+
+  if (n == 0) {
+    /* A busy chip only answers READ STATUS */
+    s_spi.command = sim_spi_busy() && mosi != 0x05 ? 0 : mosi;
+    if (s_spi.command == 0x02) {
+      memset(s_spi.page_used, 0, sizeof(s_spi.page_used));
+    }
+    return miso;
+  }
+
+  switch (s_spi.command) {
+  case 0x05:
+    miso = (uint8_t)((sim_spi_busy() ? 0x01 : 0) |
+                     (s_spi.write_enabled ? 0x02 : 0));
+    break;
+  case 0x9F:
+    if (n <= 3) {
+      miso = (uint8_t)(SIM_SPI_JEDEC_ID >> (8 * (3 - n)));
+    }
+    break;
+  case 0x03:
+  case 0x02:
+  case 0x20:
+  case 0xD8:
+    if (n <= 3) {
+      s_spi.address = (s_spi.address << 8 | mosi) & (SIM_SPI_FLASH_SIZE - 1);
+      break;
+    }
+    if (s_spi.command == 0x03) {
+      miso = s_flash[s_spi.address];
+      s_spi.address = (s_spi.address + 1) & (SIM_SPI_FLASH_SIZE - 1);
+    } else if (s_spi.command == 0x02 && s_spi.write_enabled) {
+      uint32_t i = (s_spi.address + n - 4) % SPI_FLASH_PAGE_SIZE;
+
+      s_spi.page[i] = mosi;
+      s_spi.page_used[i] = true;
+    }
+    break;
+  default:
+    break;
+  }
+  return miso;
+}
+
+void spi_bus_transfer(const uint8_t *tx, uint8_t *rx, uint32_t size) {
+  for (uint32_t i = 0; i < size; i++) {
+    uint8_t miso = 0xFF;
+
+    if (s_flash != NULL && s_spi.selected) {
+      miso = sim_spi_byte(tx != NULL ? tx[i] : 0xFF);
+    }
+    if (rx != NULL) {
+      rx[i] = miso;
+    }
+  }
+
+  s_spi.debt_us += size * 8 / SIM_SPI_CLOCK_MHZ;
+  if (s_spi.debt_us >= SIM_SPI_DEBT_US) {
+    sim_busy_us(s_spi.debt_us);
+    s_spi.debt_us = 0;
+  }
+}
@@ -0,0 +1,106 @@
+#pragma once
+/*
+ * Host simulator stand-in for the STM32F1 HAL and CMSIS headers.
+ *
+ * Only what the bootloader sources use. Core registers are plain host
+ * structs, DWT->CYCCNT follows the simulated clock. Flash and RAM live at
+ * their real addresses (see sim_main.c), flash is written through
+ * sim_flash.c instead of the FLASH registers.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+  HAL_OK = 0x00U,
+  HAL_ERROR = 0x01U,
+  HAL_BUSY = 0x02U,
+  HAL_TIMEOUT = 0x03U
+} HAL_StatusTypeDef;
+
+/* GPIO */
+typedef enum { GPIO_PIN_RESET = 0, GPIO_PIN_SET } GPIO_PinState;
+typedef struct {
+  uint32_t ODR;
+  uint32_t IDR;
+} GPIO_TypeDef;
+
+extern GPIO_TypeDef sim_gpio[3];
+#define GPIOA (&sim_gpio[0])
+#define GPIOB (&sim_gpio[1])
+#define GPIOC (&sim_gpio[2])
+#define GPIO_PIN_0 ((uint16_t)0x0001)
+#define GPIO_PIN_1 ((uint16_t)0x0002)
+#define GPIO_PIN_2 ((uint16_t)0x0004)
+#define GPIO_PIN_3 ((uint16_t)0x0008)
+#define GPIO_PIN_13 ((uint16_t)0x2000)
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *port, uint16_t pin);
+void HAL_GPIO_WritePin(GPIO_TypeDef *port, uint16_t pin, GPIO_PinState state);
+void HAL_GPIO_TogglePin(GPIO_TypeDef *port, uint16_t pin);
+
+/* UART */
+typedef struct {
+  uint32_t BaudRate;
+} UART_InitTypeDef;
+typedef struct {
+  UART_InitTypeDef Init;
+} UART_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart,
+                                    const uint8_t *data, uint16_t size,
+                                    uint32_t timeout);
+HAL_StatusTypeDef HAL_UART_Receive(UART_HandleTypeDef *huart, uint8_t *data,
+                                   uint16_t size, uint32_t timeout);
+
+/* Overrun only, set when the overrun model drops a byte */
+#define UART_FLAG_ORE 0x08U
+bool sim_uart_flag(uint32_t flag);
+#define __HAL_UART_GET_FLAG(huart, flag) sim_uart_flag(flag)
+
+/* System */
+#define HSI_VALUE 8000000U
+extern uint32_t SystemCoreClock;
+
+HAL_StatusTypeDef HAL_Init(void);
+HAL_StatusTypeDef HAL_DeInit(void);
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t delay);
+void HAL_NVIC_SystemReset(void);
+
+/* Core registers */
+typedef struct {
+  uint32_t VTOR;
+} SCB_Type;
+typedef struct {
+  uint32_t CTRL;
+  uint32_t CYCCNT;
+} DWT_Type;
+typedef struct {
+  uint32_t DEMCR;
+} CoreDebug_Type;
+
+extern SCB_Type sim_scb;
+extern CoreDebug_Type sim_core_debug;
+DWT_Type *sim_dwt(void);
+#define SCB (&sim_scb)
+#define CoreDebug (&sim_core_debug)
+#define DWT (sim_dwt())
+#define CoreDebug_DEMCR_TRCENA_Msk (1UL << 24)
+#define DWT_CTRL_CYCCNTENA_Msk (1UL << 0)
+
+__attribute__((noreturn)) void sim_application_start(uint32_t stack_pointer);
+#define __set_MSP(sp) sim_application_start(sp)
+#define __set_PRIMASK(x) ((void)(x))
+#define __disable_irq() ((void)0)
+#define __enable_irq() ((void)0)
+
+/* Clocks, nothing to gate on the host */
+#define __HAL_RCC_GPIOC_CLK_ENABLE() ((void)0)
+#define __HAL_RCC_GPIOC_CLK_DISABLE() ((void)0)
+
+/* Flash */
+#define FLASH_BASE 0x08000000UL
+#define FLASH_PAGE_SIZE 0x400U
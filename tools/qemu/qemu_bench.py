@@ -0,0 +1,335 @@
+#!/usr/bin/env python3
+"""Boot and update benchmark of the real firmware under qemu-system-arm.
+
+The bootloader ELF and the example application run unmodified in QEMU with
+-icount, so every guest instruction advances the virtual clock by exactly
+one nanosecond. The harness stops the guest at the application's reset
+handler through the gdbstub and reads the instruction counter over QMP while
+it is halted, which makes the boot counts exact and reproducible.
+
+Scenarios:
+  first-boot  reset to application entry with the verified mark erased, the
+              bootloader checks CRC32 and SHA-256 and programs the mark
+  boot        reset to application entry on a verified image (fast path)
+  update      'B' to the running application, sbupload pushes the image,
+              until the new application is entered again
+
+Update instruction counts include the guest polling the UART while the host
+prepares the next packet, so they carry host noise. With --baseline the
+tolerance applies to them and to the wall times, boot counts are compared
+exactly. No baseline ships with the tree: none has been recorded on a machine
+that models the STM32F103C8 yet, record one with --save before gating on it.
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import re
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), "..", ".."))
+from merge import (ADDR_APP, ADDR_APPMETA, crc32_update,  # noqa: E402
+                   generate_appmeta, read_file)
+
+
+class Qmp:
+    """Minimal QMP client, one command at a time."""
+
+    def __init__(self, path, timeout):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        deadline = time.monotonic() + timeout
+        while True:
+            try:
+                self.sock.connect(path)
+                break
+            except (FileNotFoundError, ConnectionRefusedError):
+                if time.monotonic() > deadline:
+                    raise RuntimeError("QEMU did not open its QMP socket")
+                time.sleep(0.05)
+        self.file = self.sock.makefile("rwb")
+        self._read()  # greeting
+        self.command("qmp_capabilities")
+
+    def _read(self):
+        while True:
+            line = self.file.readline()
+            if not line:
+                raise RuntimeError("QMP connection closed")
+            reply = json.loads(line)
+            if "event" not in reply:
+                return reply
+
+    def command(self, name, **arguments):
+        msg = {"execute": name}
+        if arguments:
+            msg["arguments"] = arguments
+        self.file.write(json.dumps(msg).encode() + b"\n")
+        self.file.flush()
+        reply = self._read()
+        if "error" in reply:
+            raise RuntimeError(f"QMP {name}: {reply['error']['desc']}")
+        return reply["return"]
+
+    def icount(self):
+        """Instructions executed since QEMU started (needs -icount)."""
+        return self.command("query-replay")["icount"]
+
+
+class Gdb:
+    """Just enough of the GDB remote protocol to stop at an address."""
+
+    def __init__(self, port, timeout):
+        deadline = time.monotonic() + timeout
+        while True:
+            try:
+                self.sock = socket.create_connection(("127.0.0.1", port))
+                break
+            except ConnectionRefusedError:
+                if time.monotonic() > deadline:
+                    raise RuntimeError("QEMU did not open its gdbstub")
+                time.sleep(0.05)
+        self.buf = b""
+
+    def _send(self, data):
+        cs = sum(data.encode()) & 0xFF
+        self.sock.sendall(f"${data}#{cs:02x}".encode())
+
+    def _packet(self, timeout):
+        self.sock.settimeout(timeout)
+        while True:
+            m = re.search(rb"\$([^#]*)#..", self.buf)
+            if m:
+                self.buf = self.buf[m.end():]
+                self.sock.sendall(b"+")
+                return m.group(1).decode()
+            chunk = self.sock.recv(4096)
+            if not chunk:
+                raise RuntimeError("gdbstub connection closed")
+            self.buf += chunk.replace(b"+", b"")
+
+    def command(self, data, timeout=5):
+        self._send(data)
+        return self._packet(timeout)
+
+    def resume_to(self, address):
+        """Let the guest run until it executes the Thumb address."""
+        self.stop_at = address & ~1
+        if self.command(f"Z0,{self.stop_at:x},2") != "OK":
+            raise RuntimeError(f"cannot set a breakpoint at 0x{address:08X}")
+        self._send("c")
+
+    def wait_stop(self, timeout):
+        """Wait for the breakpoint, the guest stays halted afterwards."""
+        reply = self._packet(timeout)
+        self.command(f"z0,{self.stop_at:x},2")
+        if not reply.startswith(("S", "T")):
+            raise RuntimeError(f"unexpected stop reply '{reply}'")
+
+
+def flash_image(app: bytes, version: int) -> bytes:
+    """Metadata page tail plus application, loaded at ADDR_APPMETA."""
+    meta = generate_appmeta(len(app), crc32_update(0xFFFFFFFF, app),
+                            hashlib.sha256(app).digest(), version)
+    return meta + b"\xFF" * (ADDR_APP - ADDR_APPMETA - len(meta)) + app
+
+
+class Machine:
+    """One QEMU instance, halted at reset until the first resume_to()."""
+
+    def __init__(self, args, image_path, workdir):
+        self.qmp_path = os.path.join(workdir, "qmp.sock")
+        self.gdb_port = args.gdb_port
+        cmd = [
+            args.qemu, "-M", args.machine, "-nographic", "-S",
+            "-icount", "shift=0,align=off,sleep=off",
+            "-kernel", args.bootloader,
+            "-device", f"loader,file={image_path},addr=0x{ADDR_APPMETA:08X},"
+                       "force-raw=on",
+            "-chardev", "pty,id=uart", "-serial", "chardev:uart",
+            "-qmp", f"unix:{self.qmp_path},server=on,wait=off",
+            "-gdb", f"tcp:127.0.0.1:{self.gdb_port}",
+            "-monitor", "none",
+        ] + args.qemu_arg
+        self.proc = subprocess.Popen(cmd, stdin=subprocess.DEVNULL,
+                                     stdout=subprocess.PIPE,
+                                     stderr=subprocess.STDOUT, text=True)
+        self.pty = self._find_pty(args.timeout)
+        self.qmp = Qmp(self.qmp_path, args.timeout)
+        self.gdb = Gdb(self.gdb_port, args.timeout)
+
+    def _find_pty(self, timeout):
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            line = self.proc.stdout.readline()
+            if not line:
+                break
+            m = re.search(r"char device redirected to (\S+)", line)
+            if m:
+                return m.group(1)
+        raise RuntimeError("QEMU did not report the USART pty")
+
+    def close(self):
+        try:
+            self.qmp.command("quit")
+        except Exception:
+            pass
+        try:
+            self.proc.wait(timeout=5)
+        except subprocess.TimeoutExpired:
+            self.proc.kill()
+
+
+def measure_boot(m, app_entry, timeout):
+    """Wall time and instructions from reset until the application entry."""
+    start = m.qmp.icount()
+    t = time.monotonic()
+    m.gdb.resume_to(app_entry)
+    m.gdb.wait_stop(timeout)
+    return {
+        "instructions": m.qmp.icount() - start,
+        "wall_ms": round((time.monotonic() - t) * 1000, 1),
+    }
+
+
+def sbupload_phases(output):
+    """Phase table printed by sbupload, in ms."""
+    phases = {}
+    for line in output.splitlines():
+        m = re.match(r"(\w+)\s+([0-9.]+)$", line.strip())
+        if m and m.group(1) != "Phase":
+            phases[m.group(1)] = float(m.group(2))
+    return phases
+
+
+def measure_update(m, args, app_entry):
+    """'B' to the running application until the new one is entered."""
+    start = m.qmp.icount()
+    m.gdb.resume_to(app_entry)
+    upload = subprocess.run(
+        [args.sbupload, "-q", "-t", str(int(args.timeout)), m.pty, args.app],
+        capture_output=True, text=True, timeout=args.timeout * 4)
+    if upload.returncode != 0:
+        raise RuntimeError("sbupload failed:\n" + upload.stdout +
+                           upload.stderr)
+    # sbupload returns once the bootloader logs the jump
+    m.gdb.wait_stop(args.timeout)
+    result = {"instructions": m.qmp.icount() - start}
+    result.update({f"{k}_ms": v for k, v in
+                   sbupload_phases(upload.stdout).items()})
+    return result
+
+
+def run(args):
+    app = read_file(args.app)
+    app_entry = struct.unpack_from("<I", app, 4)[0]
+    results = {}
+
+    with tempfile.TemporaryDirectory() as workdir:
+        image_path = os.path.join(workdir, "image.bin")
+        with open(image_path, "wb") as f:
+            f.write(flash_image(app, args.version))
+
+        m = Machine(args, image_path, workdir)
+        try:
+            results["first-boot"] = measure_boot(m, app_entry, args.timeout)
+            m.qmp.command("system_reset")
+            results["boot"] = measure_boot(m, app_entry, args.timeout)
+            results["update"] = measure_update(m, args, app_entry)
+        finally:
+            m.close()
+    return results
+
+
+def compare(results, baseline, tolerance):
+    """Regressions against a saved run, as printable strings."""
+    failures = []
+    for scenario, metrics in baseline.items():
+        for name, expected in metrics.items():
+            got = results.get(scenario, {}).get(name)
+            if got is None:
+                failures.append(f"{scenario}.{name}: missing")
+                continue
+            exact = scenario != "update" and name == "instructions"
+            limit = expected if exact else expected * (1 + tolerance / 100)
+            if got > limit:
+                failures.append(f"{scenario}.{name}: {got} > {expected}"
+                                f"{'' if exact else f' +{tolerance}%'}")
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Benchmark boot and update of the firmware under QEMU",
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="""
+The machine must model the STM32F103C8: 64KB flash with the F1 flash
+interface at 0x40022000, 20KB SRAM and USART1. Mainline QEMU has no such
+board (stm32vldiscovery is an F100 with 8KB SRAM and read-only flash), pass
+one with --machine.
+
+Examples:
+  %(prog)s -M stm32f103c8 --save baseline.json
+  %(prog)s -M stm32f103c8 --baseline baseline.json --tolerance 10
+        """)
+    parser.add_argument("-M", "--machine", required=True,
+                        help="QEMU machine modelling the STM32F103C8")
+    parser.add_argument("--qemu", default="qemu-system-arm",
+                        help="QEMU binary (default: qemu-system-arm)")
+    parser.add_argument("--qemu-arg", action="append", default=[],
+                        help="Extra QEMU argument, repeatable")
+    parser.add_argument("--bootloader", default="build/bootloader.elf",
+                        help="Bootloader ELF (default: build/bootloader.elf)")
+    parser.add_argument("--app", default="example_app/build/app.bin",
+                        help="Application binary "
+                        "(default: example_app/build/app.bin)")
+    parser.add_argument("--sbupload", default="build/host/sbupload",
+                        help="Uploader (default: build/host/sbupload)")
+    parser.add_argument("-V", "--version", type=int, default=1,
+                        help="Application metadata version (default: 1)")
+    parser.add_argument("--gdb-port", type=int, default=1234,
+                        help="gdbstub TCP port (default: 1234)")
+    parser.add_argument("-t", "--timeout", type=float, default=30,
+                        help="Seconds per step (default: 30)")
+    parser.add_argument("--save", help="Write the results as JSON")
+    parser.add_argument("--baseline",
+                        help="Fail on regressions against this JSON")
+    parser.add_argument("--tolerance", type=float, default=5,
+                        help="Allowed %% over the baseline for wall times "
+                        "and update counts (default: 5)")
+    args = parser.parse_args()
+
+    try:
+        results = run(args)
+    except (RuntimeError, OSError, subprocess.TimeoutExpired) as e:
+        print(f"Error: {e}", file=sys.stderr)
+        sys.exit(1)
+
+    print(f"{'scenario':<12} {'instructions':>14} {'wall ms':>10}")
+    for scenario, metrics in results.items():
+        wall = metrics.get("wall_ms", metrics.get("total_ms", 0))
+        print(f"{scenario:<12} {metrics['instructions']:>14} {wall:>10.1f}")
+
+    if args.save:
+        with open(args.save, "w") as f:
+            json.dump(results, f, indent=2)
+            f.write("\n")
+        print(f"✅ Results: {args.save}")
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            failures = compare(results, json.load(f), args.tolerance)
+        for failure in failures:
+            print(f"❌ {failure}", file=sys.stderr)
+        if failures:
+            sys.exit(1)
+        print(f"✅ No regressions against {args.baseline}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,243 @@
+#!/usr/bin/env python3
+"""Worst-case stack and static RAM check for the bootloader build.
+
+Reads the call graph files GCC writes with -fstack-usage
+-fcallgraph-info=su (one .ci per object, GCC 11 or newer) and the linked
+ELF. Every frame size comes from the compiler. The deepest path is summed
+from main and from each exception handler. A handler can preempt main at
+any point, so the worst case is main plus the deepest handler plus the
+32-byte exception frame the core pushes. The bootloader does not nest
+interrupt priorities.
+
+The check passes when the worst case fits in the stack the linker script
+reserves (_Min_Stack_Size). The linker already refuses a build where .data,
+.bss, the arena and that reservation do not fit in RAM. Together the two
+checks mean the stack cannot grow into static data.
+
+Calls through function pointers show up as __indirect_call. The targets of
+the ones reachable in this bootloader are listed in INDIRECT, others can be
+added with --indirect. An unresolved indirect call, recursion or an
+unbounded dynamic frame fails the check, since none of them has a bound.
+"""
+
+import argparse
+import re
+import struct
+import sys
+
+EXCEPTION_FRAME = 32  # r0-r3, r12, lr, pc, xpsr on the Cortex-M3
+
+# caller -> functions it reaches through a pointer. The event loop calls
+# every handler directly, so there are none at the moment.
+INDIRECT = {}
+
+NODE = re.compile(r'node: \{ title: "([^"]+)" label: "([^"]*)"')
+EDGE = re.compile(r'edge: \{ sourcename: "([^"]+)" targetname: "([^"]+)"')
+FRAME = re.compile(r"\\n(\d+) bytes \(([a-z,]+)\)")
+
+
+class CallGraph:
+    def __init__(self):
+        self.frames = {}  # title -> (bytes, kind)
+        self.calls = {}   # title -> set of titles
+        self.names = {}   # plain name -> titles
+
+    def load(self, path):
+        with open(path) as f:
+            for line in f:
+                m = NODE.match(line)
+                if m:
+                    title, label = m.groups()
+                    frame = FRAME.search(label)
+                    if frame:
+                        self.frames[title] = (int(frame.group(1)),
+                                              frame.group(2))
+                        name = title.rsplit(":", 1)[-1]
+                        self.names.setdefault(name, set()).add(title)
+                    continue
+                m = EDGE.match(line)
+                if m:
+                    self.calls.setdefault(m.group(1), set()).add(m.group(2))
+
+    def resolve(self, name):
+        return self.names.get(name, {name})
+
+    def add_indirect(self, caller, callees):
+        for title in self.resolve(caller):
+            targets = self.calls.setdefault(title, set())
+            targets.discard("__indirect_call")
+            for callee in callees:
+                targets |= self.resolve(callee)
+
+
+class Analysis:
+    """Deepest path from a root, with everything that has no bound."""
+
+    def __init__(self, graph, extern_stack):
+        self.graph = graph
+        self.extern_stack = extern_stack
+        self.memo = {}
+        self.errors = []
+        self.externs = set()
+
+    def depth(self, title, path=()):
+        """Worst stack from entering title, and the path that reaches it."""
+        if title in path:
+            cycle = " -> ".join(path[path.index(title):] + (title,))
+            self.errors.append(f"recursion: {cycle}")
+            return 0, [title]
+        if title in self.memo:
+            return self.memo[title]
+        if title == "__indirect_call":
+            self.errors.append(f"unresolved indirect call in {path[-1]}, "
+                               "add --indirect CALLER=CALLEE")
+            return 0, [title]
+        frame = self.graph.frames.get(title)
+        if frame is None:
+            # Library code built without -fcallgraph-info
+            self.externs.add(title)
+            return self.extern_stack, [title]
+        size, kind = frame
+        if kind == "dynamic":
+            self.errors.append(f"unbounded dynamic stack in {title}")
+
+        deepest, chain = 0, []
+        for callee in sorted(self.graph.calls.get(title, ())):
+            d, c = self.depth(callee, path + (title,))
+            if d > deepest:
+                deepest, chain = d, c
+        self.memo[title] = (size + deepest, [title] + chain)
+        return self.memo[title]
+
+
+def elf_symbols(path):
+    """Values of the global and absolute symbols of an ELF file."""
+    with open(path, "rb") as f:
+        data = f.read()
+    if data[:4] != b"\x7fELF":
+        raise ValueError(f"{path} is not an ELF file")
+    is64 = data[4] == 2
+    endian = "<" if data[5] == 1 else ">"
+    if is64:
+        shoff, = struct.unpack_from(endian + "Q", data, 0x28)
+        shentsize, shnum = struct.unpack_from(endian + "HH", data, 0x3A)
+        sh_fmt, sym_fmt, sym_size = "IIQQQQIIQQ", "IBBHQQ", 24
+    else:
+        shoff, = struct.unpack_from(endian + "I", data, 0x20)
+        shentsize, shnum = struct.unpack_from(endian + "HH", data, 0x2E)
+        sh_fmt, sym_fmt, sym_size = "IIIIIIIIII", "IIIBBH", 16
+
+    sections = [struct.unpack_from(endian + sh_fmt, data,
+                                   shoff + i * shentsize)
+                for i in range(shnum)]
+    symbols = {}
+    for sh in sections:
+        if sh[1] != 2:  # SHT_SYMTAB
+            continue
+        offset, size, link = sh[4], sh[5], sh[6]
+        strtab = sections[link][4]
+        for i in range(size // sym_size):
+            fields = struct.unpack_from(endian + sym_fmt, data,
+                                        offset + i * sym_size)
+            if is64:
+                name_off, value = fields[0], fields[4]
+            else:
+                name_off, value = fields[0], fields[1]
+            end = data.index(b"\0", strtab + name_off)
+            name = data[strtab + name_off:end].decode()
+            if name:
+                symbols[name] = value
+    return symbols
+
+
+def parse_indirect(text):
+    caller, _, callees = text.partition("=")
+    return caller, [c for c in callees.split(",") if c]
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Check the worst-case stack against the linker script",
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="""
+Example:
+  make stack
+  %(prog)s build/stack/bootloader.elf build/stack/*.ci
+        """)
+    parser.add_argument("elf", help="Linked bootloader")
+    parser.add_argument("ci", nargs="+", help="Call graph files (.ci)")
+    parser.add_argument("--indirect", action="append", default=[],
+                        type=parse_indirect, metavar="CALLER=CALLEE[,...]",
+                        help="Targets of a call through a pointer, "
+                        "repeatable")
+    parser.add_argument("--extern-stack", type=int, default=64,
+                        help="Bytes assumed for library functions without "
+                        "call graph (default: 64)")
+    parser.add_argument("-v", "--verbose", action="store_true",
+                        help="Print the deepest path of every handler")
+    args = parser.parse_args()
+
+    graph = CallGraph()
+    for path in args.ci:
+        graph.load(path)
+    for caller, callees in list(INDIRECT.items()) + args.indirect:
+        graph.add_indirect(caller, callees)
+
+    analysis = Analysis(graph, args.extern_stack)
+    main_depth, main_chain = analysis.depth(next(iter(graph.resolve("main"))))
+    handlers = sorted(t for t in graph.frames
+                      if re.search(r"(_Handler|IRQHandler)$", t))
+    isr_depth, isr_chain = 0, []
+    for handler in handlers:
+        d, chain = analysis.depth(handler)
+        if args.verbose:
+            print(f"{handler:<28} {d:>6} bytes")
+        if d > isr_depth:
+            isr_depth, isr_chain = d, chain
+    worst = main_depth + isr_depth + (EXCEPTION_FRAME if handlers else 0)
+
+    try:
+        symbols = elf_symbols(args.elf)
+        reserved = symbols["_Min_Stack_Size"]
+        ram_start = symbols["_sdata"]
+        static_end = symbols["_earena"]
+        ram_end = symbols["_estack"]
+    except (OSError, ValueError, KeyError) as e:
+        print(f"Error: {args.elf}: missing {e}", file=sys.stderr)
+        sys.exit(1)
+    static = static_end - ram_start
+
+    print("Deepest path from main:")
+    for title in main_chain:
+        size = graph.frames.get(title, (args.extern_stack,))[0]
+        print(f"  {size:>6}  {title.rsplit(':', 1)[-1]}")
+    if isr_chain:
+        print(f"Deepest handler: {' -> '.join(isr_chain)}")
+    if analysis.externs:
+        print(f"Assumed {args.extern_stack} bytes for: "
+              f"{', '.join(sorted(analysis.externs))}")
+
+    print(f"\nWorst case stack: {worst:>6} bytes (main {main_depth}, "
+          f"handler {isr_depth}, exception frame "
+          f"{EXCEPTION_FRAME if handlers else 0})")
+    print(f"Stack reserved:   {reserved:>6} bytes (_Min_Stack_Size)")
+    print(f"Static RAM:       {static:>6} bytes (.data, .bss, .arena)")
+    print(f"RAM:              {ram_end - ram_start:>6} bytes, "
+          f"{ram_end - ram_start - static - worst} left")
+
+    failures = list(dict.fromkeys(analysis.errors))
+    if worst > reserved:
+        failures.append(f"worst case stack {worst} exceeds the "
+                        f"{reserved} bytes reserved")
+    if static + worst > ram_end - ram_start:
+        failures.append(f"static RAM plus stack exceeds the "
+                        f"{ram_end - ram_start} bytes of RAM")
+    for failure in failures:
+        print(f"❌ {failure}", file=sys.stderr)
+    if failures:
+        sys.exit(1)
+    print("✅ Stack fits")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,882 @@
+/*
+ * Production flashing station for the SimpleBoot bootloader. Build with
+ * `make station`, run with `make station-flash PORTS="/dev/ttyUSB*"`.
+ *
+ * Updates many boards at once from one process. Every port has its own
+ * state machine, the same sequence sbupload runs: entry request, Y-modem
+ * header, data, EOT, then the device log through verification and the jump.
+ * One epoll set multiplexes the ports and the earliest pending deadline
+ * bounds each wait, so a slow or dead board never holds up the others.
+ * The image is read once and shared. Entry requests are staggered so the
+ * boards do not all reset and start erasing in the same millisecond.
+ *
+ * The report has one line per board: result, phase times, retries and the
+ * CRC32 the bootloader computed over what it programmed.
+ */
+#include "boot_layout.h"
+#include "common.h"
+#include "ymodem.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Keep in sync with Inc/bootloader.h */
+#define FIRMWARE_ENCRYPTION_MAGIC 0x52434E45 // ENCR
+#define FIRMWARE_ENCRYPTION_SIZE 16          // sizeof(firmware_encryption_t)
+#define FIRMWARE_SPARSE_MAGIC 0x53525053     // SPRS
+#define FIRMWARE_SPARSE_SIZE 16              // sizeof(firmware_sparse_t)
+
+/* Same limits as sbupload */
+#define PACKET_TIMEOUT_MS 5000
+#define ERASE_TIMEOUT_MS 5000
+#define VERIFY_TIMEOUT_MS 30000
+#define BOOT_TIMEOUT_MS 5000
+#define EOT_C_TIMEOUT_MS 1000
+#define C_QUIET_MS 20
+#define MAX_RETRIES 10
+
+#define PACKET_MAX_SIZE                                                        \
+  (YMODEM_PACKET_HEADER_SIZE + YMODEM_PACKET_SIZE_1024 +                       \
+   YMODEM_PACKET_TRAILER_SIZE)
+
+typedef enum {
+  PHASE_ENTER = 0,
+  PHASE_HEADER,
+  PHASE_ERASE,
+  PHASE_DATA,
+  PHASE_FINISH,
+  PHASE_VERIFY,
+  PHASE_BOOT,
+  PHASE_COUNT
+} phase_t;
+
+static const char *const phase_names[PHASE_COUNT] = {
+    "enter", "header", "erase", "data", "finish", "verify", "boot"};
+
+typedef enum {
+  DEV_IDLE,      /* waiting for its entry slot */
+  DEV_ENTER,     /* entry request sent, waiting for 'C' */
+  DEV_HEADER,    /* header packet sent */
+  DEV_ERASE,     /* header acknowledged, waiting for 'C' */
+  DEV_DATA,      /* data packet sent */
+  DEV_EOT,       /* first EOT sent */
+  DEV_EOT_C,     /* first EOT acknowledged, the device asks again */
+  DEV_EOT_FINAL, /* second EOT sent */
+  DEV_VERIFY,    /* following the log until the verification result */
+  DEV_BOOT,      /* following the log until the jump */
+  DEV_PASS,
+  DEV_FAIL
+} dev_state_t;
+
+/* The image every device gets, read once */
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+  const char *name;
+  bool crc_known; /* false for encrypted images */
+  uint32_t crc32; /* what the bootloader should report */
+} image_t;
+
+typedef struct {
+  const char *port;
+  int fd;
+  dev_state_t state;
+  double start_at; /* entry slot */
+  double deadline; /* the current state times out */
+  double c_at;     /* a 'C' started a line here, 0 = none pending */
+  char line[256];
+  size_t line_len;
+  /* Packet in flight, kept for resends */
+  uint8_t packet[PACKET_MAX_SIZE];
+  size_t packet_len;
+  size_t packet_sent;
+  bool want_write;
+  uint8_t seq;
+  size_t offset; /* image bytes acknowledged */
+  size_t chunk;  /* image bytes in the packet in flight */
+  unsigned attempts;
+  unsigned retries;
+  phase_t phase;
+  double phase_start;
+  double phase_ms[PHASE_COUNT];
+  bool crc_reported;
+  uint32_t device_crc32;
+  char error[64];
+} device_t;
+
+typedef struct {
+  unsigned baudrate;
+  const char *enter;
+  unsigned timeout_s;
+  unsigned stagger_ms;
+  unsigned bootloader_size; /* the application starts right after it */
+  const char *report;
+  bool verbose;
+} options_t;
+
+static options_t s_opt = {.baudrate = 115200, .enter = "B", .timeout_s = 10,
+                          .stagger_ms = 50,
+                          .bootloader_size = BOOTLOADER_SIZE};
+static image_t s_image;
+static int s_epoll = -1;
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static speed_t baud_to_speed(unsigned baudrate) {
+  switch (baudrate) {
+  case 9600:
+    return B9600;
+  case 19200:
+    return B19200;
+  case 38400:
+    return B38400;
+  case 57600:
+    return B57600;
+  case 115200:
+    return B115200;
+  case 230400:
+    return B230400;
+#ifdef B460800
+  case 460800:
+    return B460800;
+#endif
+#ifdef B921600
+  case 921600:
+    return B921600;
+#endif
+#ifdef B1000000
+  case 1000000:
+    return B1000000;
+#endif
+#ifdef B2000000
+  case 2000000:
+    return B2000000;
+#endif
+  default:
+    return 0;
+  }
+}
+
+static uint32_t load_le32(const uint8_t *p) {
+  return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+/**
+ * @brief Open a port raw, 8N1, non-blocking
+ * @return File descriptor, -1 with errno set on error
+ */
+static int port_open(const char *port, speed_t speed) {
+  struct termios tio;
+  int fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+  if (fd < 0) {
+    return -1;
+  }
+  if (tcgetattr(fd, &tio) != 0) {
+    close(fd);
+    return -1;
+  }
+  cfmakeraw(&tio);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cflag &= ~(CSTOPB | PARENB);
+#ifdef CRTSCTS
+  tio.c_cflag &= ~CRTSCTS;
+#endif
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+  if (tcsetattr(fd, TCSANOW, &tio) != 0) {
+    close(fd);
+    return -1;
+  }
+  tcflush(fd, TCIOFLUSH);
+  return fd;
+}
+
+static void dev_watch(device_t *dev, bool want_write) {
+  struct epoll_event ev = {.events = EPOLLIN | (want_write ? EPOLLOUT : 0),
+                           .data.ptr = dev};
+
+  if (dev->want_write != want_write) {
+    dev->want_write = want_write;
+    epoll_ctl(s_epoll, EPOLL_CTL_MOD, dev->fd, &ev);
+  }
+}
+
+static void dev_phase(device_t *dev, phase_t phase, double now) {
+  dev->phase_ms[dev->phase] += now - dev->phase_start;
+  dev->phase = phase;
+  dev->phase_start = now;
+}
+
+static bool dev_in_transfer(const device_t *dev) {
+  return dev->state >= DEV_HEADER && dev->state <= DEV_EOT_FINAL;
+}
+
+static void dev_fail(device_t *dev, const char *reason, double now) {
+  if (dev->fd >= 0 && dev_in_transfer(dev)) {
+    /* Two CANs stop a receiver that still waits for packets */
+    static const uint8_t cancel[] = {YMODEM_CAN, YMODEM_CAN};
+    ssize_t n = write(dev->fd, cancel, sizeof(cancel));
+    (void)n;
+  }
+  if (dev->state != DEV_IDLE) {
+    dev_phase(dev, dev->phase, now);
+  }
+  snprintf(dev->error, sizeof(dev->error), "%s", reason);
+  dev->state = DEV_FAIL;
+  if (dev->fd >= 0) {
+    epoll_ctl(s_epoll, EPOLL_CTL_DEL, dev->fd, NULL);
+  }
+}
+
+/**
+ * @brief Push the pending packet bytes, EPOLLOUT picks up the rest
+ */
+static void dev_flush(device_t *dev, double now) {
+  while (dev->packet_sent < dev->packet_len) {
+    ssize_t n = write(dev->fd, dev->packet + dev->packet_sent,
+                      dev->packet_len - dev->packet_sent);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN) {
+        dev_watch(dev, true);
+        return;
+      }
+      dev_fail(dev, "write failed", now);
+      return;
+    }
+    dev->packet_sent += (size_t)n;
+  }
+  dev_watch(dev, false);
+}
+
+static void dev_send(device_t *dev, const uint8_t *data, size_t size,
+                     dev_state_t state, int timeout_ms, double now) {
+  memcpy(dev->packet, data, size);
+  dev->packet_len = size;
+  dev->packet_sent = 0;
+  dev->state = state;
+  dev->deadline = now + timeout_ms;
+  dev_flush(dev, now);
+}
+
+/**
+ * @brief Frame and send a Y-modem packet, the first attempt
+ */
+static void dev_send_packet(device_t *dev, uint8_t seq, const uint8_t *data,
+                            size_t size, dev_state_t state, double now) {
+  uint8_t packet[PACKET_MAX_SIZE];
+  uint8_t header =
+      size > YMODEM_PACKET_SIZE_128 ? YMODEM_STX : YMODEM_SOH;
+  size_t payload = header == YMODEM_STX ? YMODEM_PACKET_SIZE_1024
+                                        : YMODEM_PACKET_SIZE_128;
+  uint16_t crc;
+
+  packet[0] = header;
+  packet[1] = seq;
+  packet[2] = (uint8_t)~seq;
+  memset(&packet[3], YMODEM_CTRLZ, payload);
+  memcpy(&packet[3], data, size);
+  crc = crc16_update(0, &packet[3], (uint16_t)payload);
+  packet[3 + payload] = (uint8_t)(crc >> 8);
+  packet[4 + payload] = (uint8_t)crc;
+  dev->attempts = 0;
+  dev_send(dev, packet, payload + 5, state, PACKET_TIMEOUT_MS, now);
+}
+
+static void dev_resend(device_t *dev, double now) {
+  if (++dev->attempts >= MAX_RETRIES) {
+    dev_fail(dev, dev->state == DEV_HEADER ? "header not acknowledged"
+                                           : "packet not acknowledged",
+             now);
+    return;
+  }
+  dev->retries++;
+  dev->packet_sent = 0;
+  dev->deadline = now + PACKET_TIMEOUT_MS;
+  dev_flush(dev, now);
+}
+
+static void dev_send_header(device_t *dev, double now) {
+  uint8_t header[YMODEM_PACKET_SIZE_128] = {0};
+
+  snprintf((char *)header, sizeof(header) - 12, "%s", s_image.name);
+  snprintf((char *)header + strlen((char *)header) + 1, 12, "%u",
+           (unsigned)s_image.size);
+  dev_phase(dev, PHASE_HEADER, now);
+  dev->seq = 0;
+  dev_send_packet(dev, 0, header, sizeof(header), DEV_HEADER, now);
+}
+
+/**
+ * @brief Next data packet, 1KB or a short one for a small tail
+ */
+static void dev_send_data(device_t *dev, double now) {
+  size_t left = s_image.size - dev->offset;
+
+  if (left == 0) {
+    static const uint8_t eot = YMODEM_EOT;
+
+    dev_phase(dev, PHASE_FINISH, now);
+    dev_send(dev, &eot, 1, DEV_EOT, PACKET_TIMEOUT_MS, now);
+    return;
+  }
+  dev->chunk = left > YMODEM_PACKET_SIZE_1024 ? YMODEM_PACKET_SIZE_1024 : left;
+  dev_send_packet(dev, ++dev->seq, s_image.data + dev->offset, dev->chunk,
+                  DEV_DATA, now);
+}
+
+/**
+ * @brief ACK, NAK, CAN or a transfer request ('C') from the device
+ */
+static void dev_protocol(device_t *dev, uint8_t c, double now) {
+  static const uint8_t eot = YMODEM_EOT;
+
+  if (c == YMODEM_CAN && dev_in_transfer(dev)) {
+    dev_fail(dev, "cancelled by the device", now);
+    return;
+  }
+  switch (dev->state) {
+  case DEV_ENTER:
+    if (c == YMODEM_C) {
+      dev_send_header(dev, now);
+    }
+    break;
+  case DEV_HEADER:
+    if (c == YMODEM_ACK) {
+      dev_phase(dev, PHASE_ERASE, now);
+      dev->state = DEV_ERASE;
+      dev->deadline = now + ERASE_TIMEOUT_MS;
+    } else if (c == YMODEM_NAK) {
+      dev_resend(dev, now);
+    }
+    break;
+  case DEV_ERASE:
+    /* Older versions only NAK once their receive timeout runs out */
+    if (c == YMODEM_C || c == YMODEM_NAK) {
+      dev_phase(dev, PHASE_DATA, now);
+      dev_send_data(dev, now);
+    }
+    break;
+  case DEV_DATA:
+    if (c == YMODEM_ACK) {
+      dev->offset += dev->chunk;
+      dev_send_data(dev, now);
+    } else if (c == YMODEM_NAK) {
+      dev_resend(dev, now);
+    }
+    break;
+  case DEV_EOT:
+    /* This bootloader ACKs the first EOT and asks again, the classic
+     * receiver NAKs it */
+    if (c == YMODEM_ACK) {
+      dev->state = DEV_EOT_C;
+      dev->deadline = now + EOT_C_TIMEOUT_MS;
+    } else if (c == YMODEM_NAK) {
+      dev_send(dev, &eot, 1, DEV_EOT_FINAL, PACKET_TIMEOUT_MS, now);
+    }
+    break;
+  case DEV_EOT_C:
+    if (c == YMODEM_C) {
+      dev_send(dev, &eot, 1, DEV_EOT_FINAL, PACKET_TIMEOUT_MS, now);
+    }
+    break;
+  case DEV_EOT_FINAL:
+    if (c == YMODEM_ACK) {
+      dev_phase(dev, PHASE_VERIFY, now);
+      dev->state = DEV_VERIFY;
+      dev->deadline = now + VERIFY_TIMEOUT_MS;
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+static bool dev_wants_c(const device_t *dev) {
+  return dev->state == DEV_ENTER || dev->state == DEV_ERASE ||
+         dev->state == DEV_EOT_C;
+}
+
+/**
+ * @brief A complete device log line
+ */
+static void dev_log_line(device_t *dev, double now) {
+  const char *crc;
+
+  dev->line[dev->line_len] = '\0';
+  if (dev->line_len == 0) {
+    return;
+  }
+  dev->line_len = 0;
+  if (s_opt.verbose) {
+    printf("%s | %s\n", dev->port, dev->line);
+  }
+
+  crc = strstr(dev->line, "got 0x");
+  if (strstr(dev->line, "CRC verification") != NULL && crc != NULL) {
+    dev->device_crc32 = (uint32_t)strtoul(crc + 6, NULL, 16);
+    dev->crc_reported = true;
+  }
+  /* Failures logged before the header are left over from earlier */
+  if (dev->state >= DEV_ERASE && dev->state <= DEV_BOOT &&
+      strstr(dev->line, "failed") != NULL) {
+    dev_fail(dev, "device reported a failure", now);
+  } else if (dev->state == DEV_VERIFY &&
+             strstr(dev->line, "verification successful") != NULL) {
+    if (s_image.crc_known && dev->crc_reported &&
+        dev->device_crc32 != s_image.crc32) {
+      dev_fail(dev, "CRC32 differs from the image", now);
+      return;
+    }
+    dev_phase(dev, PHASE_BOOT, now);
+    dev->state = DEV_BOOT;
+    dev->deadline = now + BOOT_TIMEOUT_MS;
+  } else if (dev->state == DEV_BOOT &&
+             strstr(dev->line, "Starting application") != NULL) {
+    dev_phase(dev, PHASE_BOOT, now);
+    dev->state = DEV_PASS;
+    epoll_ctl(s_epoll, EPOLL_CTL_DEL, dev->fd, NULL);
+  }
+}
+
+/**
+ * @brief Sort one received byte into protocol and log text
+ * @note  Same rules as sbupload: ACK, NAK and CAN never appear in log text,
+ *        a 'C' only counts as a request when it starts a line and nothing
+ *        printable follows within C_QUIET_MS.
+ */
+static void dev_rx(device_t *dev, uint8_t c, double now) {
+  if (dev->c_at != 0) {
+    dev->c_at = 0;
+    if (c >= 0x20) {
+      dev->line[dev->line_len++] = YMODEM_C;
+    } else {
+      dev_protocol(dev, YMODEM_C, now);
+    }
+  }
+  /* Nothing before the entry slot belongs to this session */
+  if (dev->state == DEV_IDLE || dev->state == DEV_PASS ||
+      dev->state == DEV_FAIL) {
+    return;
+  }
+  if (c == YMODEM_C && dev->line_len == 0 && dev_wants_c(dev)) {
+    dev->c_at = now;
+  } else if (c == '\n') {
+    dev_log_line(dev, now);
+  } else if (c == YMODEM_ACK || c == YMODEM_NAK || c == YMODEM_CAN) {
+    dev_protocol(dev, c, now);
+  } else if ((c >= 0x20 && c < 0x7F) || c == '\t') {
+    if (dev->line_len < sizeof(dev->line) - 1) {
+      dev->line[dev->line_len++] = (char)c;
+    }
+  }
+}
+
+static void dev_readable(device_t *dev, double now) {
+  uint8_t buf[512];
+
+  for (;;) {
+    ssize_t n = read(dev->fd, buf, sizeof(buf));
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    /* A raw tty with VMIN and VTIME at 0 reads 0 when drained */
+    if (n == 0 || (n < 0 && errno == EAGAIN)) {
+      return;
+    }
+    if (n < 0) {
+      dev_fail(dev, "port closed", now);
+      return;
+    }
+    for (ssize_t i = 0; i < n && dev->state != DEV_FAIL; i++) {
+      dev_rx(dev, buf[i], now);
+    }
+    if (dev->state == DEV_PASS || dev->state == DEV_FAIL) {
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Entry slot reached, ask the application for the bootloader
+ */
+static void dev_start(device_t *dev, double now) {
+  size_t len = strlen(s_opt.enter);
+
+  dev->phase = PHASE_ENTER;
+  dev->phase_start = now;
+  dev_send(dev, (const uint8_t *)s_opt.enter, len, DEV_ENTER,
+           (int)s_opt.timeout_s * 1000, now);
+}
+
+static void dev_timer(device_t *dev, double now) {
+  if (dev->c_at != 0 && now >= dev->c_at + C_QUIET_MS) {
+    dev->c_at = 0;
+    dev_protocol(dev, YMODEM_C, now);
+  }
+  if (dev->state == DEV_PASS || dev->state == DEV_FAIL ||
+      now < dev->deadline) {
+    return;
+  }
+  switch (dev->state) {
+  case DEV_IDLE:
+    dev_start(dev, now);
+    break;
+  case DEV_ENTER:
+    dev_fail(dev, "no transfer request", now);
+    break;
+  case DEV_HEADER:
+  case DEV_DATA:
+    dev_resend(dev, now);
+    break;
+  case DEV_ERASE:
+    dev_fail(dev, "image not accepted", now);
+    break;
+  case DEV_EOT_C:
+    /* No second request, send the final EOT anyway */
+    dev_protocol(dev, YMODEM_C, now);
+    break;
+  case DEV_EOT:
+  case DEV_EOT_FINAL:
+    dev_fail(dev, "end of transfer not acknowledged", now);
+    break;
+  case DEV_VERIFY:
+    dev_fail(dev, "no verification result", now);
+    break;
+  case DEV_BOOT:
+    dev_fail(dev, "application was not started", now);
+    break;
+  default:
+    break;
+  }
+}
+
+/**
+ * @brief Earliest deadline among the running devices
+ * @return Milliseconds to wait, -1 when nothing is running
+ */
+static int next_timeout(const device_t *devs, size_t count, double now) {
+  double next = -1;
+
+  for (size_t i = 0; i < count; i++) {
+    const device_t *dev = &devs[i];
+    double t;
+
+    if (dev->state == DEV_PASS || dev->state == DEV_FAIL) {
+      continue;
+    }
+    t = dev->c_at != 0 && dev->c_at + C_QUIET_MS < dev->deadline
+            ? dev->c_at + C_QUIET_MS
+            : dev->deadline;
+    if (next < 0 || t < next) {
+      next = t;
+    }
+  }
+  if (next < 0) {
+    return -1;
+  }
+  return next > now ? (int)(next - now) + 1 : 0;
+}
+
+static bool load_image(const char *path) {
+  FILE *f = fopen(path, "rb");
+  const char *name = strrchr(path, '/');
+  uint8_t *data;
+  long length;
+
+  if (f == NULL) {
+    fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  length = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  data = malloc(length > 0 ? (size_t)length : 1);
+  if (data == NULL || fread(data, 1, (size_t)length, f) != (size_t)length) {
+    fprintf(stderr, "Error: cannot read %s\n", path);
+    free(data);
+    fclose(f);
+    return false;
+  }
+  fclose(f);
+  if (length == 0 ||
+      length > BOOT_LAYOUT_APP_MAX(s_opt.bootloader_size) + 1024) {
+    fprintf(stderr, "Error: image must be 1..%u bytes\n",
+            BOOT_LAYOUT_APP_MAX(s_opt.bootloader_size));
+    free(data);
+    return false;
+  }
+
+  s_image.data = data;
+  s_image.size = (size_t)length;
+  s_image.name = name != NULL ? name + 1 : path;
+  s_image.crc_known = true;
+  if (s_image.size >= FIRMWARE_SPARSE_SIZE &&
+      load_le32(data) == FIRMWARE_SPARSE_MAGIC) {
+    s_image.crc32 = load_le32(data + 8);
+  } else if (s_image.size >= FIRMWARE_ENCRYPTION_SIZE &&
+             load_le32(data) == FIRMWARE_ENCRYPTION_MAGIC) {
+    s_image.crc_known = false; /* only the device sees the plaintext */
+  } else {
+    s_image.crc32 = crc32_update(0xFFFFFFFF, data, (uint32_t)s_image.size);
+  }
+  return true;
+}
+
+static double dev_total_ms(const device_t *dev) {
+  double total = 0;
+
+  for (int i = 0; i < PHASE_COUNT; i++) {
+    total += dev->phase_ms[i];
+  }
+  return total;
+}
+
+static void print_report(const device_t *devs, size_t count, double wall_ms) {
+  unsigned passed = 0;
+
+  printf("\n%-20s %-6s %9s %9s %7s %7s %-10s %s\n", "port", "result",
+         "total ms", "data ms", "B/s", "retries", "crc32", "error");
+  for (size_t i = 0; i < count; i++) {
+    const device_t *dev = &devs[i];
+    double data_ms = dev->phase_ms[PHASE_DATA];
+    char crc[12] = "-";
+
+    if (dev->crc_reported) {
+      snprintf(crc, sizeof(crc), "0x%08X", (unsigned)dev->device_crc32);
+    }
+    passed += dev->state == DEV_PASS;
+    printf("%-20s %-6s %9.1f %9.1f %7.0f %7u %-10s %s\n", dev->port,
+           dev->state == DEV_PASS ? "PASS" : "FAIL", dev_total_ms(dev),
+           data_ms,
+           dev->state == DEV_PASS && data_ms > 0
+               ? s_image.size * 1000.0 / data_ms
+               : 0,
+           dev->retries, crc, dev->error);
+  }
+  printf("\n%u passed, %zu failed in %.1f ms, %.0f bytes/s overall\n",
+         passed, count - passed, wall_ms,
+         wall_ms > 0 ? passed * s_image.size * 1000.0 / wall_ms : 0);
+}
+
+/**
+ * @brief Machine-readable copy of the report, one CSV row per device
+ */
+static bool write_report(const char *path, const device_t *devs,
+                         size_t count) {
+  FILE *f = fopen(path, "w");
+
+  if (f == NULL) {
+    fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  fprintf(f, "port,result");
+  for (int i = 0; i < PHASE_COUNT; i++) {
+    fprintf(f, ",%s_ms", phase_names[i]);
+  }
+  fprintf(f, ",total_ms,retries,crc32,error\n");
+  for (size_t i = 0; i < count; i++) {
+    const device_t *dev = &devs[i];
+
+    fprintf(f, "%s,%s", dev->port, dev->state == DEV_PASS ? "PASS" : "FAIL");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+      fprintf(f, ",%.1f", dev->phase_ms[p]);
+    }
+    fprintf(f, ",%.1f,%u,", dev_total_ms(dev), dev->retries);
+    if (dev->crc_reported) {
+      fprintf(f, "0x%08X", (unsigned)dev->device_crc32);
+    }
+    fprintf(f, ",%s\n", dev->error);
+  }
+  fclose(f);
+  return true;
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [options] <image.bin> <port>...\n"
+         "\n"
+         "Options:\n"
+         "  -b, --baud RATE     Serial baud rate (default: 115200)\n"
+         "  -e, --enter STRING  Sent to the running application to enter the\n"
+         "                      bootloader (default: \"B\"), \"\" to skip\n"
+         "  -t, --timeout SEC   Wait for the bootloader (default: 10)\n"
+         "  -s, --stagger MS    Delay between entry requests (default: 50)\n"
+         "  -B, --bootloader-size SIZE\n"
+         "                      Flash the bootloader reserves, as merge.py -b\n"
+         "                      (default: 0x%X)\n"
+         "  -r, --report FILE   Also write the report as CSV\n"
+         "  -v, --verbose       Echo every device log line\n"
+         "  -h, --help          Show this help\n"
+         "\n"
+         "Example:\n"
+         "  %s -r report.csv example_app/build/app.bin /dev/ttyUSB*\n",
+         prog, BOOTLOADER_SIZE, prog);
+}
+
+int main(int argc, char **argv) {
+  static const struct option long_options[] = {
+      {"baud", required_argument, NULL, 'b'},
+      {"enter", required_argument, NULL, 'e'},
+      {"timeout", required_argument, NULL, 't'},
+      {"stagger", required_argument, NULL, 's'},
+      {"bootloader-size", required_argument, NULL, 'B'},
+      {"report", required_argument, NULL, 'r'},
+      {"verbose", no_argument, NULL, 'v'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0}};
+  struct epoll_event events[64];
+  device_t *devs;
+  size_t count;
+  speed_t speed;
+  double start;
+  int c;
+
+  while ((c = getopt_long(argc, argv, "b:e:t:s:B:r:vh", long_options, NULL)) !=
+         -1) {
+    switch (c) {
+    case 'b':
+      s_opt.baudrate = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'e':
+      s_opt.enter = optarg;
+      break;
+    case 't':
+      s_opt.timeout_s = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      s_opt.stagger_ms = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'B':
+      s_opt.bootloader_size = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'r':
+      s_opt.report = optarg;
+      break;
+    case 'v':
+      s_opt.verbose = true;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+  speed = baud_to_speed(s_opt.baudrate);
+  if (speed == 0) {
+    fprintf(stderr, "Error: unsupported baud rate %u\n", s_opt.baudrate);
+    return 1;
+  }
+  if (!BOOT_LAYOUT_SIZE_VALID(s_opt.bootloader_size)) {
+    fprintf(stderr, "Error: invalid bootloader size 0x%X\n",
+            s_opt.bootloader_size);
+    return 1;
+  }
+  if (!load_image(argv[optind])) {
+    return 1;
+  }
+
+  count = (size_t)(argc - optind - 1);
+  devs = calloc(count, sizeof(*devs));
+  s_epoll = epoll_create1(0);
+  if (devs == NULL || s_epoll < 0) {
+    fprintf(stderr, "Error: %s\n", strerror(errno));
+    return 1;
+  }
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  printf("Image:     %s, %zu bytes\n", s_image.name, s_image.size);
+  printf("Devices:   %zu, entry every %u ms\n", count, s_opt.stagger_ms);
+
+  start = now_ms();
+  for (size_t i = 0; i < count; i++) {
+    device_t *dev = &devs[i];
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = dev};
+
+    dev->port = argv[optind + 1 + i];
+    dev->start_at = start + (double)i * s_opt.stagger_ms;
+    dev->deadline = dev->start_at;
+    dev->fd = port_open(dev->port, speed);
+    if (dev->fd < 0) {
+      dev_fail(dev, strerror(errno), start);
+    } else if (epoll_ctl(s_epoll, EPOLL_CTL_ADD, dev->fd, &ev) != 0) {
+      dev_fail(dev, strerror(errno), start);
+    }
+  }
+
+  for (;;) {
+    double now = now_ms();
+    int timeout = next_timeout(devs, count, now);
+    int n;
+
+    if (timeout < 0) {
+      break;
+    }
+    n = epoll_wait(s_epoll, events, 64, timeout);
+    if (n < 0 && errno != EINTR) {
+      fprintf(stderr, "Error: epoll: %s\n", strerror(errno));
+      return 1;
+    }
+    now = now_ms();
+    for (int i = 0; i < n; i++) {
+      device_t *dev = events[i].data.ptr;
+
+      if (dev->state == DEV_FAIL || dev->state == DEV_PASS) {
+        continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        dev_readable(dev, now);
+      }
+      if ((events[i].events & EPOLLHUP) && dev->state != DEV_FAIL &&
+          dev->state != DEV_PASS) {
+        dev_fail(dev, "port closed", now);
+        continue;
+      }
+      if ((events[i].events & EPOLLOUT) && dev->state != DEV_FAIL) {
+        dev_flush(dev, now);
+      }
+    }
+    for (size_t i = 0; i < count; i++) {
+      dev_timer(&devs[i], now);
+    }
+  }
+
+  print_report(devs, count, now_ms() - start);
+  if (s_opt.report != NULL && !write_report(s_opt.report, devs, count)) {
+    return 1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (devs[i].fd >= 0) {
+      close(devs[i].fd);
+    }
+    if (devs[i].state != DEV_PASS) {
+      return 1;
+    }
+  }
+  return 0;
+}
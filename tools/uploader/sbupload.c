@@ -0,0 +1,1256 @@
+/*
+ * Host uploader for the SimpleBoot bootloader. Build with `make uploader`,
+ * run with `make upload PORT=/dev/ttyUSB0`.
+ *
+ * Drives the whole update over one serial port: asks the running
+ * application to reset into the bootloader, runs the Y-modem transfer with
+ * 1KB (or 128 byte) packets, keeps BOOTLOADER_LOG text apart from protocol
+ * bytes and follows the device log until the new image is verified and
+ * started. Every phase is timed so slow links and slow flash show up in the
+ * report.
+ *
+ * Works on anything termios can open, including a pty.
+ */
+#include "boot_command.h"
+#include "boot_layout.h"
+#include "common.h"
+#include "sha256.h"
+#include "ymodem.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Keep in sync with Inc/bootloader.h */
+#define FIRMWARE_SIGNATURE_MAGIC 0x4E474953  // SIGN
+#define FIRMWARE_SIGNATURE_SIZE 80           // sizeof(firmware_signature_t)
+#define FIRMWARE_ENCRYPTION_MAGIC 0x52434E45 // ENCR
+#define FIRMWARE_ENCRYPTION_SIZE 16          // sizeof(firmware_encryption_t)
+#define FIRMWARE_SPARSE_MAGIC 0x53525053     // SPRS
+#define FIRMWARE_SPARSE_SIZE 16              // sizeof(firmware_sparse_t)
+
+#define PACKET_TIMEOUT_MS 5000  /* flash programming plus decryption */
+#define ERASE_TIMEOUT_MS 5000   /* whole application area */
+#define VERIFY_TIMEOUT_MS 30000 /* SHA-256 and signature check */
+#define C_QUIET_MS 20 /* silence that tells a 'C' request from log text */
+#define MAX_RETRIES 10
+#define COMMAND_REPLY_MS 1000 /* binary command answers, erase excluded */
+#define META_OFFSET 0x40      /* metadata below the application start */
+#define META_WRITE_SIZE 48    /* firmware_info_t up to the verified mark */
+#define APPLICATION_META_MAGIC 0x424F4F54 // BOOT
+#define GOLDEN_NAME "golden.bin" // BOOT_STAGING_GOLDEN_NAME
+
+typedef enum {
+  PHASE_ENTER = 0, /* entry request until the first 'C' */
+  PHASE_HEADER,    /* header packet until its ACK */
+  PHASE_ERASE,     /* header ACK until the device asks for data */
+  PHASE_DATA,
+  PHASE_FINISH, /* EOT handshake */
+  PHASE_VERIFY, /* until the device reports the verification result */
+  PHASE_BOOT,   /* until the device starts the application */
+  PHASE_COUNT
+} phase_t;
+
+static const char *const phase_names[PHASE_COUNT] = {
+    "enter", "header", "erase", "data", "finish", "verify", "boot"};
+
+typedef struct {
+  int fd;
+  bool quiet;
+  unsigned latency_ms; /* host turnaround before every packet */
+  uint8_t rx[256];
+  size_t rx_len;
+  size_t rx_pos;
+  char line[256];
+  size_t line_len;
+  /* What the device log said so far */
+  bool verified;
+  bool failed;
+  bool started;
+} link_t;
+
+/* What to do once the bootloader waits */
+typedef enum {
+  ACTION_UPLOAD = 0, /* Y-modem update */
+  ACTION_INFO,       /* binary commands from here on */
+  ACTION_CHECK,
+  ACTION_REWORK,
+  ACTION_READ,
+  ACTION_RUN
+} action_t;
+
+typedef struct {
+  const char *port;
+  const char *image; /* output file for ACTION_READ */
+  action_t action;
+  unsigned baudrate;
+  const char *enter;
+  unsigned timeout_s;
+  unsigned packet_size;
+  unsigned bootloader_size; /* the application starts right after it */
+  bool timing;
+  bool stats;
+  bool quiet;
+  bool golden; /* store in the golden slot of the staging flash */
+} options_t;
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static speed_t baud_to_speed(unsigned baudrate) {
+  switch (baudrate) {
+  case 9600:
+    return B9600;
+  case 19200:
+    return B19200;
+  case 38400:
+    return B38400;
+  case 57600:
+    return B57600;
+  case 115200:
+    return B115200;
+  case 230400:
+    return B230400;
+#ifdef B460800
+  case 460800:
+    return B460800;
+#endif
+#ifdef B921600
+  case 921600:
+    return B921600;
+#endif
+#ifdef B1000000
+  case 1000000:
+    return B1000000;
+#endif
+#ifdef B2000000
+  case 2000000:
+    return B2000000;
+#endif
+  default:
+    return 0;
+  }
+}
+
+/**
+ * @brief Open the serial port raw, 8N1, no flow control
+ * @return File descriptor, -1 on error
+ */
+static int link_open(const char *port, unsigned baudrate) {
+  struct termios tio;
+  speed_t speed = baud_to_speed(baudrate);
+  int fd;
+
+  if (speed == 0) {
+    fprintf(stderr, "Error: unsupported baud rate %u\n", baudrate);
+    return -1;
+  }
+  fd = open(port, O_RDWR | O_NOCTTY);
+  if (fd < 0) {
+    fprintf(stderr, "Error: %s: %s\n", port, strerror(errno));
+    return -1;
+  }
+  if (tcgetattr(fd, &tio) != 0) {
+    fprintf(stderr, "Error: %s: %s\n", port, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  cfmakeraw(&tio);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cflag &= ~(CSTOPB | PARENB);
+#ifdef CRTSCTS
+  tio.c_cflag &= ~CRTSCTS;
+#endif
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+  if (tcsetattr(fd, TCSANOW, &tio) != 0) {
+    fprintf(stderr, "Error: %s: %s\n", port, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  tcflush(fd, TCIOFLUSH);
+  return fd;
+}
+
+static bool link_write(link_t *link, const uint8_t *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(link->fd, data, size);
+
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      fprintf(stderr, "Error: write: %s\n", strerror(errno));
+      return false;
+    }
+    data += n;
+    size -= (size_t)n;
+  }
+  return true;
+}
+
+/**
+ * @brief Read one byte
+ * @param timeout_ms: How long to wait, 0 only takes what is buffered
+ * @return The byte, -1 on timeout
+ */
+static int link_getc(link_t *link, int timeout_ms) {
+  struct pollfd pfd = {.fd = link->fd, .events = POLLIN};
+  ssize_t n;
+
+  if (link->rx_pos < link->rx_len) {
+    return link->rx[link->rx_pos++];
+  }
+  if (poll(&pfd, 1, timeout_ms) <= 0) {
+    return -1;
+  }
+  n = read(link->fd, link->rx, sizeof(link->rx));
+  if (n <= 0) {
+    return -1;
+  }
+  link->rx_len = (size_t)n;
+  link->rx_pos = 1;
+  return link->rx[0];
+}
+
+/**
+ * @brief A complete device log line, echoed and checked for the update result
+ */
+static void link_log_line(link_t *link) {
+  link->line[link->line_len] = '\0';
+  if (link->line_len == 0) {
+    return;
+  }
+  if (!link->quiet) {
+    printf("  | %s\n", link->line);
+  }
+  if (strstr(link->line, "verification successful") != NULL) {
+    link->verified = true;
+  } else if (strstr(link->line, "failed") != NULL) {
+    link->failed = true;
+  } else if (strstr(link->line, "Starting application") != NULL) {
+    link->started = true;
+  }
+  link->line_len = 0;
+}
+
+/**
+ * @brief Wait for one of the protocol bytes in accept, log text is filtered
+ * @note  ACK, NAK and CAN never appear in log text. A 'C' only counts as a
+ *        request when it starts a line and nothing follows it for
+ *        C_QUIET_MS, otherwise it is the first letter of a log line.
+ * @param accept: Protocol bytes to return, others are dropped. '\n' returns
+ *        after every log line.
+ * @param timeout_ms: Overall timeout
+ * @return The protocol byte, -1 on timeout
+ */
+static int link_wait(link_t *link, const char *accept, int timeout_ms) {
+  double deadline = now_ms() + timeout_ms;
+
+  for (;;) {
+    int left = (int)(deadline - now_ms());
+    int c = link_getc(link, left > 0 ? left : 0);
+
+    if (c < 0) {
+      return -1;
+    }
+    if (c == YMODEM_C && link->line_len == 0 && strchr(accept, c) != NULL) {
+      int next = link_getc(link, C_QUIET_MS);
+
+      if (next < 0 || next < 0x20) {
+        if (next >= 0) {
+          link->rx_pos--; /* still buffered, hand it out next time */
+        }
+        return c;
+      }
+      link->line[link->line_len++] = (char)c;
+      c = next;
+    }
+    if (c == '\n') {
+      link_log_line(link);
+      if (strchr(accept, c) != NULL) {
+        return c;
+      }
+    } else if (c == YMODEM_ACK || c == YMODEM_NAK || c == YMODEM_CAN) {
+      if (strchr(accept, c) != NULL) {
+        return c;
+      }
+    } else if ((c >= 0x20 && c < 0x7F) || c == '\t') {
+      if (link->line_len < sizeof(link->line) - 1) {
+        link->line[link->line_len++] = (char)c;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Follow the device log until a flag is set
+ * @return true if the flag was set before the timeout
+ */
+static bool link_wait_log(link_t *link, const bool *flag, int timeout_ms) {
+  double deadline = now_ms() + timeout_ms;
+
+  while (!*flag && !link->failed) {
+    int left = (int)(deadline - now_ms());
+
+    if (left <= 0 || link_wait(link, "\n", left) < 0) {
+      break;
+    }
+  }
+  return *flag;
+}
+
+/**
+ * @brief Send a packet until it is acknowledged
+ * @param header: YMODEM_SOH or YMODEM_STX
+ * @param seq: Packet number
+ * @param data: Payload, padded with CTRLZ to the packet size
+ * @param size: Payload size
+ * @param retries: Incremented for every resend
+ * @return true once the device sent ACK
+ */
+static bool send_packet(link_t *link, uint8_t header, uint8_t seq,
+                        const uint8_t *data, size_t size, unsigned *retries) {
+  uint8_t packet[YMODEM_PACKET_HEADER_SIZE + YMODEM_PACKET_SIZE_1024 +
+                 YMODEM_PACKET_TRAILER_SIZE];
+  size_t payload = header == YMODEM_STX ? YMODEM_PACKET_SIZE_1024
+                                        : YMODEM_PACKET_SIZE_128;
+  uint16_t crc;
+
+  packet[0] = header;
+  packet[1] = seq;
+  packet[2] = (uint8_t)~seq;
+  memset(&packet[3], YMODEM_CTRLZ, payload);
+  memcpy(&packet[3], data, size);
+  crc = crc16_update(0, &packet[3], (uint16_t)payload);
+  packet[3 + payload] = (uint8_t)(crc >> 8);
+  packet[4 + payload] = (uint8_t)crc;
+
+  for (int attempt = 0; attempt < MAX_RETRIES; attempt++) {
+    int reply;
+
+    if (attempt > 0) {
+      (*retries)++;
+    }
+    if (link->latency_ms > 0) {
+      usleep(link->latency_ms * 1000);
+    }
+    if (!link_write(link, packet, payload + 5)) {
+      return false;
+    }
+    reply = link_wait(link, "\x06\x15\x18", PACKET_TIMEOUT_MS);
+    if (reply == YMODEM_ACK) {
+      return true;
+    }
+    if (reply == YMODEM_CAN) {
+      fprintf(stderr, "Error: device cancelled packet %u\n", seq);
+      return false;
+    }
+  }
+  fprintf(stderr, "Error: packet %u not acknowledged\n", seq);
+  return false;
+}
+
+static uint8_t *read_image(const char *path, size_t *size) {
+  FILE *f = fopen(path, "rb");
+  uint8_t *data;
+  long length;
+
+  if (f == NULL) {
+    fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  length = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  data = malloc(length > 0 ? (size_t)length : 1);
+  if (data == NULL || fread(data, 1, (size_t)length, f) != (size_t)length) {
+    fprintf(stderr, "Error: cannot read %s\n", path);
+    free(data);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+  *size = (size_t)length;
+  return data;
+}
+
+static uint32_t load_le32(const uint8_t *p) {
+  return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static uint8_t *store_le32(uint8_t *p, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    *p++ = (uint8_t)(value >> (i * 8));
+  }
+  return p;
+}
+
+/**
+ * @brief Print what the bootloader will record for this image
+ * @return false if it cannot fit into the application area
+ */
+static bool describe_image(const options_t *opt, const uint8_t *image,
+                           size_t size) {
+  size_t app_size = size;
+  bool encrypted = size >= FIRMWARE_ENCRYPTION_SIZE &&
+                   load_le32(image) == FIRMWARE_ENCRYPTION_MAGIC;
+  bool sparse = size >= FIRMWARE_SPARSE_SIZE &&
+                load_le32(image) == FIRMWARE_SPARSE_MAGIC;
+  bool is_signed = false;
+
+  if (encrypted) {
+    app_size -= FIRMWARE_ENCRYPTION_SIZE;
+  } else if (size >= FIRMWARE_SIGNATURE_SIZE &&
+             load_le32(image + size - FIRMWARE_SIGNATURE_SIZE) ==
+                 FIRMWARE_SIGNATURE_MAGIC) {
+    /* The block is encrypted along with the image, only visible in clear */
+    is_signed = true;
+  }
+
+  printf("Image:     %s\n", opt->image);
+  printf("Size:      %zu bytes%s%s\n", size, encrypted ? ", encrypted" : "",
+         is_signed ? ", signed" : "");
+  if (sparse) {
+    /* What ends up in flash, holes included */
+    app_size = load_le32(image + 4);
+    printf("Sparse:    %u segments, %zu byte image\n", load_le32(image + 12),
+           app_size);
+    printf("CRC32:     0x%08X\n", load_le32(image + 8));
+  } else if (!encrypted) {
+    printf("CRC32:     0x%08X\n",
+           (unsigned)crc32_update(0xFFFFFFFF, image, (uint32_t)size));
+  }
+  if (size == 0 || app_size > BOOT_LAYOUT_APP_MAX(opt->bootloader_size)) {
+    fprintf(stderr, "Error: image must be 1..%u bytes\n",
+            BOOT_LAYOUT_APP_MAX(opt->bootloader_size));
+    return false;
+  }
+  return true;
+}
+
+static void report(const double *phase_ms, size_t size, unsigned retries) {
+  double total = 0;
+
+  printf("\nPhase        ms\n");
+  for (int i = 0; i < PHASE_COUNT; i++) {
+    printf("%-8s %9.1f\n", phase_names[i], phase_ms[i]);
+    total += phase_ms[i];
+  }
+  printf("%-8s %9.1f\n", "total", total);
+  if (phase_ms[PHASE_DATA] > 0) {
+    printf("\nData:      %.0f bytes/s\n",
+           size * 1000.0 / phase_ms[PHASE_DATA]);
+  }
+  printf("Overall:   %.0f bytes/s (header to verified)\n",
+         size * 1000.0 /
+             (total - phase_ms[PHASE_ENTER] - phase_ms[PHASE_BOOT]));
+  printf("Retries:   %u\n", retries);
+}
+
+/**
+ * @brief Enter the bootloader and wait until it asks for a transfer
+ * @note  Also asks for the timing table and the statistics when wanted
+ * @return true once the device waits for a transfer
+ */
+static bool enter_bootloader(const options_t *opt, link_t *link) {
+  if (opt->enter[0] != '\0') {
+    printf("Requesting bootloader entry...\n");
+    link_write(link, (const uint8_t *)opt->enter, strlen(opt->enter));
+  }
+  printf("Waiting for the bootloader...\n");
+  if (link_wait(link, "C", (int)opt->timeout_s * 1000) != YMODEM_C) {
+    fprintf(stderr, "Error: no transfer request from the bootloader\n");
+    return false;
+  }
+
+  if (opt->timing) {
+    /* The device answers with its boot timing table and asks again */
+    uint8_t command = 'T';
+
+    link_write(link, &command, 1);
+    if (link_wait(link, "C", 3000) != YMODEM_C) {
+      fprintf(stderr, "Error: no transfer request after the timing report\n");
+      return false;
+    }
+  }
+  if (opt->stats) {
+    /* Counters of the earlier sessions, kept across resets */
+    uint8_t command = 'S';
+
+    link_write(link, &command, 1);
+    if (link_wait(link, "C", 3000) != YMODEM_C) {
+      fprintf(stderr, "Error: no transfer request after the statistics\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Run one update
+ * @return 0 once the device started the new image
+ */
+static int upload(const options_t *opt, link_t *link, const uint8_t *image,
+                  size_t size) {
+  double phase_ms[PHASE_COUNT] = {0};
+  uint8_t header[YMODEM_PACKET_SIZE_128] = {0};
+  const char *name = strrchr(opt->image, '/');
+  unsigned retries = 0;
+  uint8_t seq = 1;
+  double t;
+  int reply;
+
+  t = now_ms();
+  if (!enter_bootloader(opt, link)) {
+    return 1;
+  }
+  phase_ms[PHASE_ENTER] = now_ms() - t;
+
+  /* Header: file name and decimal size. Failures logged before this are
+   * left over from an earlier attempt. */
+  t = now_ms();
+  link->failed = false;
+  name = name != NULL ? name + 1 : opt->image;
+  if (opt->golden) {
+    name = GOLDEN_NAME;
+  }
+  snprintf((char *)header, sizeof(header) - 12, "%s", name);
+  snprintf((char *)header + strlen((char *)header) + 1, 12, "%u",
+           (unsigned)size);
+  if (!send_packet(link, YMODEM_SOH, 0, header, sizeof(header), &retries)) {
+    return 1;
+  }
+  phase_ms[PHASE_HEADER] = now_ms() - t;
+
+  /* The device erases and then asks for the data, older versions only NAK
+   * once their receive timeout runs out */
+  t = now_ms();
+  reply = link_wait(link, "C\x15\x18", ERASE_TIMEOUT_MS);
+  if (reply < 0 || reply == YMODEM_CAN || link->failed) {
+    fprintf(stderr, "Error: device did not accept the image\n");
+    return 1;
+  }
+  phase_ms[PHASE_ERASE] = now_ms() - t;
+
+  /* Data, full packets and a short one for a small tail */
+  printf("Sending %zu bytes...\n", size);
+  t = now_ms();
+  for (size_t offset = 0; offset < size; seq++) {
+    size_t left = size - offset;
+    size_t packet = left > YMODEM_PACKET_SIZE_128 ? opt->packet_size
+                                                  : YMODEM_PACKET_SIZE_128;
+    uint8_t type = packet == YMODEM_PACKET_SIZE_1024 ? YMODEM_STX : YMODEM_SOH;
+    size_t chunk = left > packet ? packet : left;
+
+    if (!send_packet(link, type, seq, image + offset, chunk, &retries)) {
+      return 1;
+    }
+    offset += chunk;
+  }
+  phase_ms[PHASE_DATA] = now_ms() - t;
+
+  /* EOT: this bootloader ACKs the first one and asks again, the classic
+   * receiver NAKs it */
+  t = now_ms();
+  link_write(link, (const uint8_t[]){YMODEM_EOT}, 1);
+  reply = link_wait(link, "\x06\x15", PACKET_TIMEOUT_MS);
+  if (reply == YMODEM_ACK) {
+    link_wait(link, "C", 1000);
+  }
+  link_write(link, (const uint8_t[]){YMODEM_EOT}, 1);
+  if (reply < 0 || link_wait(link, "\x06", PACKET_TIMEOUT_MS) != YMODEM_ACK) {
+    fprintf(stderr, "Error: end of transfer not acknowledged\n");
+    return 1;
+  }
+  phase_ms[PHASE_FINISH] = now_ms() - t;
+
+  /* Follow the log through verification and the jump */
+  t = now_ms();
+  if (!link_wait_log(link, &link->verified, VERIFY_TIMEOUT_MS)) {
+    fprintf(stderr, "Error: %s\n", link->failed ? "verification failed"
+                                                : "no verification result");
+    return 1;
+  }
+  phase_ms[PHASE_VERIFY] = now_ms() - t;
+
+  t = now_ms();
+  if (!link_wait_log(link, &link->started, 5000)) {
+    fprintf(stderr, "Error: application was not started\n");
+    return 1;
+  }
+  phase_ms[PHASE_BOOT] = now_ms() - t;
+
+  printf("Update complete\n");
+  report(phase_ms, size, retries);
+  return 0;
+}
+
+/* What GET_INFO reports, see Inc/boot_command.h */
+typedef struct {
+  uint8_t protocol;
+  uint8_t ops[16];
+  unsigned op_count;
+  uint32_t flash_size;
+  uint32_t page_size;
+  uint32_t app_start;
+  uint32_t app_max_size;
+  uint8_t entry_reason;
+  uint32_t meta_magic;
+  uint32_t meta_version;
+  uint32_t meta_size;
+  uint32_t meta_crc32;
+  bool verified;
+  char version[32];
+} device_info_t;
+
+static uint32_t load_be(const uint8_t *p, int size) {
+  uint32_t value = 0;
+
+  while (size-- > 0) {
+    value = value << 8 | *p++;
+  }
+  return value;
+}
+
+static uint8_t *store_be(uint8_t *p, uint32_t value, int size) {
+  while (size-- > 0) {
+    *p++ = (uint8_t)(value >> (size * 8));
+  }
+  return p;
+}
+
+/**
+ * @brief Read exactly size bytes of a command reply
+ * @return false on timeout
+ */
+static bool command_read(link_t *link, uint8_t *data, size_t size,
+                         int timeout_ms) {
+  for (size_t i = 0; i < size; i++) {
+    int c = link_getc(link, timeout_ms);
+
+    if (c < 0) {
+      return false;
+    }
+    data[i] = (uint8_t)c;
+  }
+  return true;
+}
+
+/**
+ * @brief Wait for ACK or NACK
+ * @return true on ACK
+ */
+static bool command_ack(link_t *link, int timeout_ms) {
+  uint8_t reply;
+
+  return command_read(link, &reply, 1, timeout_ms) &&
+         reply == BOOT_COMMAND_ACK;
+}
+
+/**
+ * @brief Send a block followed by the XOR of its bytes
+ * @return true once the device acknowledged it
+ */
+static bool command_block(link_t *link, const uint8_t *data, size_t size,
+                          int timeout_ms) {
+  uint8_t sum = 0;
+
+  for (size_t i = 0; i < size; i++) {
+    sum ^= data[i];
+  }
+  return link_write(link, data, size) && link_write(link, &sum, 1) &&
+         command_ack(link, timeout_ms);
+}
+
+/**
+ * @brief Send an opcode and, unless GET_INFO, its address
+ * @return true once both were acknowledged
+ */
+static bool command_begin(link_t *link, uint8_t op, uint32_t address) {
+  uint8_t frame[4] = {op, (uint8_t)~op};
+
+  if (!link_write(link, frame, 2) || !command_ack(link, COMMAND_REPLY_MS)) {
+    return false;
+  }
+  if (op == BOOT_COMMAND_GET_INFO) {
+    return true;
+  }
+  store_be(frame, address, 4);
+  return command_block(link, frame, 4, COMMAND_REPLY_MS);
+}
+
+/**
+ * @brief Switch the waiting bootloader to binary commands
+ * @note  'C' requests sent before the sync are skipped
+ */
+static bool command_sync(link_t *link) {
+  double deadline = now_ms() + COMMAND_REPLY_MS;
+  uint8_t sync = BOOT_COMMAND_SYNC;
+
+  link_write(link, &sync, 1);
+  while (now_ms() < deadline) {
+    int c = link_getc(link, (int)(deadline - now_ms()) + 1);
+
+    if (c == BOOT_COMMAND_ACK) {
+      return true;
+    }
+  }
+  fprintf(stderr, "Error: no command session, bootloader too old?\n");
+  return false;
+}
+
+static bool command_get_info(link_t *link, device_info_t *info) {
+  uint8_t data[256];
+  uint8_t count;
+  const uint8_t *p = data;
+  size_t version;
+
+  if (!command_begin(link, BOOT_COMMAND_GET_INFO, 0) ||
+      !command_read(link, &count, 1, COMMAND_REPLY_MS) ||
+      !command_read(link, data, count + 1U, COMMAND_REPLY_MS) ||
+      !command_ack(link, COMMAND_REPLY_MS)) {
+    return false;
+  }
+  memset(info, 0, sizeof(*info));
+  info->protocol = *p++;
+  info->op_count = *p++;
+  if (info->op_count > sizeof(info->ops) ||
+      count + 1U < 2 + info->op_count + 32) {
+    return false;
+  }
+  memcpy(info->ops, p, info->op_count);
+  p += info->op_count;
+  info->flash_size = load_be(p, 4);
+  info->page_size = load_be(p + 4, 2);
+  info->app_start = load_be(p + 6, 4);
+  info->app_max_size = load_be(p + 10, 4);
+  info->entry_reason = p[14];
+  info->meta_magic = load_be(p + 15, 4);
+  info->meta_version = load_be(p + 19, 4);
+  info->meta_size = load_be(p + 23, 4);
+  info->meta_crc32 = load_be(p + 27, 4);
+  info->verified = p[31] != 0;
+  p += 32;
+  version = (size_t)(data + count + 1 - p);
+  if (version >= sizeof(info->version)) {
+    version = sizeof(info->version) - 1;
+  }
+  memcpy(info->version, p, version);
+  return true;
+}
+
+static bool command_crc(link_t *link, uint32_t address, uint32_t size,
+                        uint32_t *crc) {
+  uint8_t arg[4];
+  uint8_t reply[5];
+
+  store_be(arg, size, 4);
+  if (!command_begin(link, BOOT_COMMAND_CRC, address) ||
+      !command_block(link, arg, 4, COMMAND_REPLY_MS) ||
+      !command_read(link, reply, 5, COMMAND_REPLY_MS) ||
+      (reply[0] ^ reply[1] ^ reply[2] ^ reply[3]) != reply[4]) {
+    return false;
+  }
+  *crc = load_be(reply, 4);
+  return true;
+}
+
+static bool command_read_memory(const options_t *opt, link_t *link,
+                                uint32_t address, uint8_t *data,
+                                uint32_t size) {
+  while (size > 0) {
+    uint32_t chunk = size < BOOT_COMMAND_READ_MAX ? size
+                                                  : BOOT_COMMAND_READ_MAX;
+    /* Twice the wire time of the chunk */
+    int timeout_ms = (int)(chunk * 20000ULL / opt->baudrate) +
+                     COMMAND_REPLY_MS;
+    uint8_t arg[2];
+
+    store_be(arg, chunk - 1, 2);
+    if (!command_begin(link, BOOT_COMMAND_READ, address) ||
+        !command_block(link, arg, 2, COMMAND_REPLY_MS) ||
+        !command_read(link, data, chunk, timeout_ms)) {
+      return false;
+    }
+    address += chunk;
+    data += chunk;
+    size -= chunk;
+  }
+  return true;
+}
+
+static bool command_erase(link_t *link, uint32_t address, uint32_t pages) {
+  uint8_t arg[2];
+
+  store_be(arg, pages - 1, 2);
+  return command_begin(link, BOOT_COMMAND_ERASE, address) &&
+         command_block(link, arg, 2, ERASE_TIMEOUT_MS);
+}
+
+/**
+ * @brief Program a range in BOOT_COMMAND_WRITE_MAX steps
+ * @param erased: The range is erased flash, chunks that are all 0xFF are
+ *                left out. RAM gets every byte.
+ */
+static bool command_write(link_t *link, uint32_t address, const uint8_t *data,
+                          size_t size, bool erased) {
+  uint8_t frame[1 + BOOT_COMMAND_WRITE_MAX];
+
+  for (size_t offset = 0; offset < size; offset += BOOT_COMMAND_WRITE_MAX) {
+    size_t chunk = size - offset < BOOT_COMMAND_WRITE_MAX
+                       ? size - offset
+                       : BOOT_COMMAND_WRITE_MAX;
+    size_t blank = 0;
+
+    while (blank < chunk && data[offset + blank] == 0xFF) {
+      blank++;
+    }
+    if (erased && blank == chunk) {
+      continue;
+    }
+    frame[0] = (uint8_t)(chunk - 1);
+    memcpy(&frame[1], data + offset, chunk);
+    if (!command_begin(link, BOOT_COMMAND_WRITE, address + offset) ||
+        !command_block(link, frame, chunk + 1, PACKET_TIMEOUT_MS)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool command_go(link_t *link, uint32_t address) {
+  return command_begin(link, BOOT_COMMAND_GO, address);
+}
+
+/**
+ * @brief Start the RAM image written to BOOT_COMMAND_RAM_ADDR
+ * @note  The device checks size and CRC32 against what it holds
+ */
+static bool command_run(link_t *link, const uint8_t *image, size_t size) {
+  uint8_t arg[8];
+
+  store_be(arg, (uint32_t)size, 4);
+  store_be(&arg[4], crc32_update(0xFFFFFFFF, image, (uint32_t)size), 4);
+  return command_begin(link, BOOT_COMMAND_RUN, BOOT_COMMAND_RAM_ADDR) &&
+         command_block(link, arg, sizeof(arg), COMMAND_REPLY_MS);
+}
+
+static void print_info(const device_info_t *info) {
+  printf("Bootloader: %s, protocol %u.%u\n", info->version,
+         info->protocol >> 4, info->protocol & 0xF);
+  printf("Commands:  ");
+  for (unsigned i = 0; i < info->op_count; i++) {
+    printf(" %02X", info->ops[i]);
+  }
+  printf("\nFlash:      %u KB, %u byte pages\n", info->flash_size / 1024,
+         info->page_size);
+  printf("App area:   0x%08X, %u bytes\n", info->app_start,
+         info->app_max_size);
+  printf("Entry:      %u\n", info->entry_reason);
+  if (info->meta_magic != APPLICATION_META_MAGIC) {
+    printf("Image:      none\n");
+    return;
+  }
+  printf("Image:      v%u, %u bytes, CRC32 0x%08X%s\n", info->meta_version,
+         info->meta_size, info->meta_crc32,
+         info->verified ? ", verified" : "");
+}
+
+static bool has_op(const device_info_t *info, uint8_t op) {
+  return memchr(info->ops, op, info->op_count) != NULL;
+}
+
+/**
+ * @brief Program only the pages that differ, then new metadata
+ * @note  Pages are compared by the device's CRC32, so an unchanged page
+ *        costs a few bytes on the wire. The device erases the metadata page
+ *        before the first change, the image boots again once it is written.
+ * @return true if the image in flash matches afterwards
+ */
+static bool rework(link_t *link, const device_info_t *info,
+                   const uint8_t *image, size_t size) {
+  uint32_t page_size = info->page_size;
+  size_t padded = (size + page_size - 1) / page_size * page_size;
+  uint32_t image_crc = crc32_update(0xFFFFFFFF, image, (uint32_t)size);
+  uint8_t *flat = malloc(padded);
+  uint8_t meta[META_WRITE_SIZE];
+  unsigned changed = 0;
+  sha256_ctx_t hash;
+  uint32_t crc;
+  uint8_t *p;
+  bool ok = false;
+
+  if (flat == NULL) {
+    return false;
+  }
+  memset(flat, 0xFF, padded);
+  memcpy(flat, image, size);
+
+  for (size_t offset = 0; offset < padded; offset += page_size) {
+    uint32_t address = info->app_start + (uint32_t)offset;
+
+    if (!command_crc(link, address, page_size, &crc)) {
+      fprintf(stderr, "Error: CRC of page 0x%08X failed\n", address);
+      goto out;
+    }
+    if (crc == crc32_update(0xFFFFFFFF, flat + offset, page_size)) {
+      continue;
+    }
+    changed++;
+    if (!command_erase(link, address, 1) ||
+        !command_write(link, address, flat + offset, page_size, true)) {
+      fprintf(stderr, "Error: rewriting page 0x%08X failed\n", address);
+      goto out;
+    }
+  }
+  printf("Rewrote %u of %zu pages\n", changed, padded / page_size);
+
+  /* Metadata as the bootloader writes it after an update */
+  if (changed > 0 || info->meta_magic != APPLICATION_META_MAGIC ||
+      info->meta_size != size || info->meta_crc32 != image_crc) {
+    p = store_le32(meta, APPLICATION_META_MAGIC);
+    p = store_le32(p, info->meta_magic == APPLICATION_META_MAGIC
+                          ? info->meta_version
+                          : 0);
+    p = store_le32(p, (uint32_t)size);
+    p = store_le32(p, image_crc);
+    sha256_init(&hash);
+    sha256_update(&hash, image, (uint32_t)size);
+    sha256_final(&hash, p);
+    if (!command_erase(link, info->app_start - page_size, 1) ||
+        !command_write(link, info->app_start - META_OFFSET, meta,
+                       sizeof(meta), true)) {
+      fprintf(stderr, "Error: writing the metadata failed\n");
+      goto out;
+    }
+  }
+
+  if (!command_crc(link, info->app_start, (uint32_t)size, &crc) ||
+      crc != image_crc) {
+    fprintf(stderr, "Error: image CRC32 mismatch after rework\n");
+    goto out;
+  }
+  ok = true;
+out:
+  free(flat);
+  return ok;
+}
+
+/**
+ * @brief Run a binary command session instead of a Y-modem transfer
+ * @return 0 on success
+ */
+static int commands(const options_t *opt, link_t *link, const uint8_t *image,
+                    size_t size) {
+  double t = now_ms();
+  device_info_t info;
+  uint32_t crc;
+  uint8_t *data;
+  FILE *f;
+  bool go;
+  int ret = 1;
+
+  if (!enter_bootloader(opt, link) || !command_sync(link) ||
+      !command_get_info(link, &info)) {
+    fprintf(stderr, "Error: GET_INFO failed\n");
+    return 1;
+  }
+  /* Queries hand a device taken out of its application back to it */
+  go = opt->enter[0] != '\0' && info.meta_magic == APPLICATION_META_MAGIC;
+
+  switch (opt->action) {
+  case ACTION_INFO:
+    print_info(&info);
+    ret = 0;
+    break;
+
+  case ACTION_CHECK:
+    if (!has_op(&info, BOOT_COMMAND_CRC) ||
+        !command_crc(link, info.app_start, (uint32_t)size, &crc)) {
+      fprintf(stderr, "Error: CRC command failed\n");
+      break;
+    }
+    if (crc != crc32_update(0xFFFFFFFF, image, (uint32_t)size)) {
+      printf("Image differs from the device (CRC32 0x%08X)\n", crc);
+      break;
+    }
+    printf("Image matches the device\n");
+    ret = 0;
+    break;
+
+  case ACTION_REWORK:
+    if (!has_op(&info, BOOT_COMMAND_WRITE)) {
+      fprintf(stderr, "Error: bootloader does not accept writes\n");
+      break;
+    }
+    if (size > info.app_max_size) {
+      fprintf(stderr, "Error: image too large\n");
+      break;
+    }
+    if (rework(link, &info, image, size)) {
+      go = true;
+      ret = 0;
+    }
+    break;
+
+  case ACTION_READ:
+    size = info.meta_magic == APPLICATION_META_MAGIC &&
+                   info.meta_size <= info.app_max_size
+               ? info.meta_size
+               : info.app_max_size;
+    data = malloc(size > 0 ? size : 1);
+    if (data == NULL || !has_op(&info, BOOT_COMMAND_READ) ||
+        !command_read_memory(opt, link, info.app_start, data,
+                             (uint32_t)size)) {
+      fprintf(stderr, "Error: read failed\n");
+      free(data);
+      break;
+    }
+    f = fopen(opt->image, "wb");
+    if (f == NULL || fwrite(data, 1, size, f) != size) {
+      fprintf(stderr, "Error: %s: %s\n", opt->image, strerror(errno));
+    } else {
+      printf("Read %zu bytes into %s\n", size, opt->image);
+      ret = 0;
+    }
+    if (f != NULL) {
+      fclose(f);
+    }
+    free(data);
+    break;
+
+  case ACTION_RUN:
+    if (!has_op(&info, BOOT_COMMAND_RUN)) {
+      fprintf(stderr, "Error: bootloader does not run RAM images\n");
+      break;
+    }
+    if (size > BOOT_COMMAND_RAM_SIZE) {
+      fprintf(stderr, "Error: RAM image must fit in %d bytes\n",
+              BOOT_COMMAND_RAM_SIZE);
+      break;
+    }
+    if (!command_write(link, BOOT_COMMAND_RAM_ADDR, image, size, false) ||
+        !command_run(link, image, size)) {
+      fprintf(stderr, "Error: device did not start the RAM image\n");
+      break;
+    }
+    printf("Session:    %.1f ms\n", now_ms() - t);
+    printf("RAM image started\n");
+    return 0;
+
+  default:
+    break;
+  }
+  printf("Session:    %.1f ms\n", now_ms() - t);
+
+  if (ret == 0 && go) {
+    if (!command_go(link, info.app_start)) {
+      fprintf(stderr, "Error: device did not start the application\n");
+      return 1;
+    }
+    if (!link_wait_log(link, &link->started, 5000)) {
+      fprintf(stderr, "Error: application was not started\n");
+      return 1;
+    }
+    printf("Application started\n");
+  }
+  return ret;
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [options] <port> <image.bin>\n"
+         "       %s -I | -R FILE [options] <port>\n"
+         "\n"
+         "Binary commands instead of a Y-modem update:\n"
+         "  -I, --info          Show bootloader and image information\n"
+         "  -c, --check         Compare the image with the device by CRC32\n"
+         "  -w, --rework        Rewrite only the pages that differ\n"
+         "  -R, --read FILE     Read the application back into FILE\n"
+         "  -X, --run           Load the image into RAM at 0x20002000 and\n"
+         "                      run it, flash is left alone\n"
+         "\n"
+         "Options:\n"
+         "  -b, --baud RATE     Serial baud rate (default: 115200)\n"
+         "  -e, --enter STRING  Sent to the running application to enter the\n"
+         "                      bootloader (default: \"B\"), \"\" to skip\n"
+         "  -t, --timeout SEC   Wait for the bootloader (default: 10)\n"
+         "  -p, --packet SIZE   Data packet size, 128 or 1024 (default: 1024)\n"
+         "  -B, --bootloader-size SIZE\n"
+         "                      Flash the bootloader reserves, as merge.py -b\n"
+         "                      (default: 0x%X)\n"
+         "  -L, --latency MS    Host turnaround before every packet\n"
+         "  -G, --golden        Keep the image as the recovery image in the\n"
+         "                      staging flash too\n"
+         "  -T, --timing        Print the bootloader's boot timing table\n"
+         "  -S, --stats         Print the update statistics of earlier\n"
+         "                      sessions\n"
+         "  -q, --quiet         Do not echo the device log\n"
+         "  -h, --help          Show this help\n"
+         "\n"
+         "Examples:\n"
+         "  %s /dev/ttyUSB0 example_app/build/app.bin\n"
+         "  %s -e \"\" -b 921600 /dev/ttyUSB0 app_signed.bin\n"
+         "  %s -w /dev/ttyUSB0 example_app/build/app.bin\n",
+         prog, prog, BOOTLOADER_SIZE, prog, prog, prog);
+}
+
+int main(int argc, char **argv) {
+  static const struct option long_options[] = {
+      {"baud", required_argument, NULL, 'b'},
+      {"enter", required_argument, NULL, 'e'},
+      {"timeout", required_argument, NULL, 't'},
+      {"packet", required_argument, NULL, 'p'},
+      {"bootloader-size", required_argument, NULL, 'B'},
+      {"latency", required_argument, NULL, 'L'},
+      {"golden", no_argument, NULL, 'G'},
+      {"timing", no_argument, NULL, 'T'},
+      {"stats", no_argument, NULL, 'S'},
+      {"info", no_argument, NULL, 'I'},
+      {"check", no_argument, NULL, 'c'},
+      {"rework", no_argument, NULL, 'w'},
+      {"read", required_argument, NULL, 'R'},
+      {"run", no_argument, NULL, 'X'},
+      {"quiet", no_argument, NULL, 'q'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0}};
+  options_t opt = {.baudrate = 115200,
+                   .enter = "B",
+                   .timeout_s = 10,
+                   .packet_size = YMODEM_PACKET_SIZE_1024,
+                   .bootloader_size = BOOTLOADER_SIZE};
+  link_t link = {0};
+  uint8_t *image = NULL;
+  size_t size = 0;
+  bool needs_image;
+  int c;
+  int ret;
+
+  while ((c = getopt_long(argc, argv, "b:e:t:p:B:L:GTSIcwR:Xqh", long_options,
+                          NULL)) != -1) {
+    switch (c) {
+    case 'b':
+      opt.baudrate = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'e':
+      opt.enter = optarg;
+      break;
+    case 't':
+      opt.timeout_s = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'p':
+      opt.packet_size = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'B':
+      opt.bootloader_size = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'L':
+      link.latency_ms = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'G':
+      opt.golden = true;
+      break;
+    case 'T':
+      opt.timing = true;
+      break;
+    case 'S':
+      opt.stats = true;
+      break;
+    case 'I':
+      opt.action = ACTION_INFO;
+      break;
+    case 'c':
+      opt.action = ACTION_CHECK;
+      break;
+    case 'w':
+      opt.action = ACTION_REWORK;
+      break;
+    case 'R':
+      opt.action = ACTION_READ;
+      opt.image = optarg;
+      break;
+    case 'X':
+      opt.action = ACTION_RUN;
+      break;
+    case 'q':
+      opt.quiet = true;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  /* Information and read back need no image */
+  needs_image = opt.action != ACTION_INFO && opt.action != ACTION_READ;
+  if (argc - optind != (needs_image ? 2 : 1)) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (!BOOT_LAYOUT_SIZE_VALID(opt.bootloader_size)) {
+    fprintf(stderr, "Error: invalid bootloader size 0x%X\n",
+            opt.bootloader_size);
+    return 1;
+  }
+  if (opt.packet_size != YMODEM_PACKET_SIZE_128 &&
+      opt.packet_size != YMODEM_PACKET_SIZE_1024) {
+    fprintf(stderr, "Error: packet size must be 128 or 1024\n");
+    return 1;
+  }
+  opt.port = argv[optind];
+  if (needs_image) {
+    opt.image = argv[optind + 1];
+    image = read_image(opt.image, &size);
+    if (image == NULL || !describe_image(&opt, image, size)) {
+      free(image);
+      return 1;
+    }
+    /* Compared and written as it lies in flash */
+    if (opt.action != ACTION_UPLOAD && size >= sizeof(uint32_t) &&
+        (load_le32(image) == FIRMWARE_ENCRYPTION_MAGIC ||
+         load_le32(image) == FIRMWARE_SPARSE_MAGIC)) {
+      fprintf(stderr, "Error: -c, -w and -X need a flat, unencrypted "
+                      "image\n");
+      free(image);
+      return 1;
+    }
+  }
+
+  /* Keep our messages and the device log in order */
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  link.fd = link_open(opt.port, opt.baudrate);
+  link.quiet = opt.quiet;
+  if (link.fd < 0) {
+    free(image);
+    return 1;
+  }
+
+  if (opt.action != ACTION_UPLOAD) {
+    ret = commands(&opt, &link, image, size);
+  } else {
+    ret = upload(&opt, &link, image, size);
+    if (ret != 0) {
+      /* Two CANs stop a receiver that is still waiting for packets */
+      link_write(&link, (const uint8_t[]){YMODEM_CAN, YMODEM_CAN}, 2);
+    }
+  }
+
+  close(link.fd);
+  free(image);
+  return ret;
+}